@@ -0,0 +1,704 @@
+// bench/loadgen.c
+//
+// End-to-end load generator for myServer. Simulates N users x M devices
+// speaking the real protocol and reports per-operation throughput and
+// latency percentiles as JSON on stdout.
+//
+// For every user, device 0 is the "writer" and runs the configured operation
+// mix; the remaining devices behave like idle clients and only consume the
+// pushes the server propagates to them, which is where fan-out delay is
+// measured (writer finished sending -> follower finished receiving).
+//
+// Uso: myLoadgen [opções] <host> <port>
+//   -u <n>     usuários simulados (padrão 4)
+//   -d <n>     dispositivos por usuário, 1..2 (padrão 2)
+//   -n <n>     operações por usuário (padrão 200)
+//   -s <bytes> tamanho dos arquivos enviados (padrão 16384)
+//   -f <n>     arquivos distintos por usuário (padrão 16)
+//   -m <mix>   pesos, ex: upload=40,download=30,delete=10,list=15,propagate=5
+//              (batch=<peso> envia LOADGEN_BATCH_FILES arquivos num único lote)
+//   -p <pref>  prefixo dos nomes de usuário (padrão "bench")
+//   -r <seed>  semente do gerador pseudoaleatório (padrão 1)
+//   -w <ms>    tempo máximo de espera por propagações ao final (padrão 3000)
+//   -R         downloads e listagens vão para a réplica de leitura oferecida
+//              pelo primário (volta ao primário se ela recusar)
+//   -z         oferece compressão de pacotes no handshake, como o cliente
+//   -t         envia texto (palavras repetidas) em vez de letras aleatórias,
+//              para medir a compressão com conteúdo compressível
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <poll.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include "../common/packet.h"
+#include "../common/batch.h"
+
+#define LOADGEN_MAX_DEVICES 2   // Server limit (MAX_SESSIONS_PER_USER)
+#define LOADGEN_MAX_FILES   1024
+#define LOADGEN_RECV_TIMEOUT_S 10
+#define LOADGEN_MAX_REDIRECTS  4   // Cluster mode: handshake redirects followed per device
+#define LOADGEN_BATCH_FILES    8   // Files per "batch" operation
+
+typedef enum {
+    OP_UPLOAD,
+    OP_DOWNLOAD,
+    OP_DELETE,
+    OP_LIST,
+    OP_PROPAGATE,
+    OP_BATCH,
+    OP_FANOUT_UPLOAD,  // Measured on followers, not part of the mix
+    OP_FANOUT_DELETE,
+    OP_COUNT
+} bench_op_t;
+
+#define MIX_OP_COUNT (OP_BATCH + 1)
+
+static const char *op_names[OP_COUNT] = {
+    "upload", "download", "delete", "list", "propagate", "batch", "fanout_upload", "fanout_delete"
+};
+
+typedef struct {
+    uint64_t *v;
+    size_t    n, cap;
+    uint64_t  errors;
+    uint64_t  bytes;
+} sample_vec_t;
+
+typedef struct {
+    const char *host;
+    const char *port;
+    int   users;
+    int   devices;
+    int   ops_per_user;
+    long  file_size;
+    int   files_per_user;
+    int   mix[MIX_OP_COUNT];
+    const char *user_prefix;
+    unsigned int seed;
+    int   drain_ms;
+    int   read_offload;
+    int   compress;      // Offer wire compression (-z)
+    int   text_content;  // Compressible upload contents (-t)
+} loadgen_config_t;
+
+typedef struct {
+    int  index;
+    char name[64];
+    pthread_mutex_t mu;
+    pthread_cond_t  cv;
+    uint64_t done_ns[LOADGEN_MAX_FILES];   // When the writer finished the last upload/delete
+    int      delivered[LOADGEN_MAX_FILES]; // Followers that received the current version
+    int      exists[LOADGEN_MAX_FILES];    // Writer's view of the server state
+    int      followers;
+} user_ctx_t;
+
+typedef struct {
+    user_ctx_t  *user;
+    int          device;
+    sample_vec_t samples[OP_COUNT];
+    int          aborted;
+    int          read_fallbacks; // Reads the replica refused or failed, redone on the primary
+} device_ctx_t;
+
+static loadgen_config_t cfg = {
+    .users = 4, .devices = 2, .ops_per_user = 200, .file_size = 16384,
+    .files_per_user = 16, .mix = { 40, 30, 10, 15, 5 }, .user_prefix = "bench",
+    .seed = 1, .drain_ms = 3000
+};
+
+static pthread_barrier_t start_barrier;
+static volatile int followers_stop = 0;
+static char *upload_buffer;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void sample_add(sample_vec_t *s, uint64_t ns) {
+    if (s->n == s->cap) {
+        size_t new_cap = s->cap ? s->cap * 2 : 256;
+        uint64_t *grown = realloc(s->v, new_cap * sizeof(uint64_t));
+        if (!grown) { s->errors++; return; }
+        s->v = grown;
+        s->cap = new_cap;
+    }
+    s->v[s->n++] = ns;
+}
+
+static int open_socket(const char *host, const char *port) {
+    struct addrinfo hints = { .ai_family = AF_INET, .ai_socktype = SOCK_STREAM }, *res, *p;
+    int sock = -1;
+    if (getaddrinfo(host, port, &hints, &res) != 0) return -1;
+    for (p = res; p; p = p->ai_next) {
+        if ((sock = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0) continue;
+        if (connect(sock, p->ai_addr, p->ai_addrlen) == 0) break;
+        close(sock);
+        sock = -1;
+    }
+    freeaddrinfo(res);
+    if (sock < 0) return -1;
+
+    struct timeval tv = { .tv_sec = LOADGEN_RECV_TIMEOUT_S, .tv_usec = 0 };
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    packet_set_nodelay(sock);
+    return sock;
+}
+
+// Turns compression on for 'sock' if the handshake ACK accepted the offer.
+static void apply_compression(int sock, const packet_t *ack) {
+    const char *line = strstr(ack->payload, PACKET_COMPRESS_OFFER);
+    int accepted = line && (line == ack->payload || line[-1] == '\n');
+    packet_set_compression(sock, cfg.compress && accepted);
+}
+
+// Runs the device handshake. If the ACK names a read replica ("reader="
+// line), its address is copied to 'reader'.
+static int connect_device(const char *username, char *reader, size_t reader_len) {
+    char host[256], port[16];
+    snprintf(host, sizeof(host), "%s", cfg.host);
+    snprintf(port, sizeof(port), "%s", cfg.port);
+    if (reader_len > 0) reader[0] = '\0';
+
+    for (int hops = 0; hops <= LOADGEN_MAX_REDIRECTS; hops++) {
+        int sock = open_socket(host, port);
+        if (sock < 0) return -1;
+
+        packet_t hs = { .type = PKT_GET_SYNC_DIR, .seq_num = 1 };
+        snprintf(hs.payload, MAX_PAYLOAD, "%s", username);
+        hs.payload_size = (uint32_t)strlen(hs.payload) + 1;
+        if (cfg.compress) packet_offer_compression(&hs);
+        packet_t ack;
+        if (send_packet(sock, &hs) != 0 || recv_packet(sock, &ack) != 0) {
+            close(sock);
+            return -1;
+        }
+        if (ack.type == PKT_ACK) {
+            ack.payload[ack.payload_size < MAX_PAYLOAD ? ack.payload_size : MAX_PAYLOAD - 1] = '\0';
+            apply_compression(sock, &ack);
+            const char *line = strstr(ack.payload, "reader=");
+            if (line && (line == ack.payload || line[-1] == '\n') && reader_len > 0) {
+                snprintf(reader, reader_len, "%.*s", (int)strcspn(line + 7, "\n"), line + 7);
+            }
+            return sock;
+        }
+        close(sock);
+        // Cluster mode: follow the redirect to the node that owns this user
+        ack.payload[MAX_PAYLOAD - 1] = '\0';
+        if (ack.type != PKT_REDIRECT || parse_host_port(ack.payload, host, sizeof(host), port, sizeof(port)) != 0) {
+            return -1;
+        }
+    }
+    return -1;
+}
+
+// Read-only session on the replica a primary offered (-R).
+static int connect_reader(const char *username, const char *addr) {
+    char host[256], port[16];
+    if (parse_host_port(addr, host, sizeof(host), port, sizeof(port)) != 0) return -1;
+    int sock = open_socket(host, port);
+    if (sock < 0) return -1;
+    packet_t hs = { .type = PKT_READ_SESSION, .seq_num = 1 };
+    snprintf(hs.payload, MAX_PAYLOAD, "%s", username);
+    hs.payload_size = (uint32_t)strlen(hs.payload) + 1;
+    if (cfg.compress) packet_offer_compression(&hs);
+    packet_t ack;
+    if (send_packet(sock, &hs) != 0 || recv_packet(sock, &ack) != 0 || ack.type != PKT_ACK) {
+        close(sock);
+        return -1;
+    }
+    ack.payload[ack.payload_size < MAX_PAYLOAD ? ack.payload_size : MAX_PAYLOAD - 1] = '\0';
+    apply_compression(sock, &ack);
+    return sock;
+}
+
+static int send_and_wait_ack(int sock, packet_t *p) {
+    packet_t a;
+    if (send_packet(sock, p) != 0 || recv_packet(sock, &a) != 0) return -1;
+    return (a.type == PKT_ACK) ? 0 : 1;
+}
+
+static void set_filename(packet_t *p, int slot) {
+    snprintf(p->payload, MAX_PAYLOAD, "f%04d.bin", slot);
+    p->payload_size = (uint32_t)strlen(p->payload) + 1;
+}
+
+// Returns 0 on success, 1 on protocol-level refusal, -1 on transport error.
+static int do_upload(int sock, int slot, uint64_t *bytes) {
+    packet_t rq = { .type = PKT_UPLOAD_REQ, .seq_num = 1 };
+    set_filename(&rq, slot);
+    // Declared size, as myClient sends it
+    rq.payload_size += (uint32_t)snprintf(rq.payload + rq.payload_size, MAX_PAYLOAD - rq.payload_size, "%ld", cfg.file_size) + 1;
+    int rc = send_and_wait_ack(sock, &rq);
+    if (rc != 0) return rc;
+
+    uint32_t seq = 2;
+    for (long off = 0; off < cfg.file_size; off += MAX_PAYLOAD) {
+        long n = cfg.file_size - off < MAX_PAYLOAD ? cfg.file_size - off : MAX_PAYLOAD;
+        packet_t dp = { .type = PKT_UPLOAD_DATA, .seq_num = seq++, .payload_size = (uint32_t)n };
+        memcpy(dp.payload, upload_buffer + off, (size_t)n);
+        if ((rc = send_and_wait_ack(sock, &dp)) != 0) return rc;
+        *bytes += (uint64_t)n;
+    }
+    packet_t endp = { .type = PKT_UPLOAD_DATA, .seq_num = seq, .payload_size = 0 };
+    return send_packet(sock, &endp) == 0 ? 0 : -1;
+}
+
+// Uploads slots first..first+n-1 (mod files_per_user) as one PKT_BATCH_UPLOAD.
+// Files larger than a batch allows are cut to BATCH_MAX_FILE_SIZE.
+static int do_batch(int sock, int first, int n, uint64_t *bytes) {
+    packet_t rq = { .type = PKT_BATCH_UPLOAD, .seq_num = 1 };
+    rq.payload_size = (uint32_t)snprintf(rq.payload, MAX_PAYLOAD, "%d", n) + 1;
+    int rc = send_and_wait_ack(sock, &rq);
+    if (rc != 0) return rc;
+
+    long size = cfg.file_size < BATCH_MAX_FILE_SIZE ? cfg.file_size : BATCH_MAX_FILE_SIZE;
+    batch_writer_t w;
+    batch_writer_init(&w, sock, 2);
+    for (int i = 0; i < n; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "f%04d.bin", (first + i) % cfg.files_per_user);
+        if (batch_add_file(&w, name, (uint64_t)size) != 0 || batch_write(&w, upload_buffer, (size_t)size) != 0) return -1;
+        *bytes += (uint64_t)size;
+    }
+    uint32_t end_seq;
+    packet_t reply;
+    if (batch_finish(&w, &end_seq) != 0 || recv_packet(sock, &reply) != 0) return -1;
+    return (reply.type == PKT_ACK && reply.seq_num == end_seq) ? 0 : 1;
+}
+
+static int do_download(int sock, int slot, uint64_t *bytes) {
+    packet_t rq = { .type = PKT_DOWNLOAD_REQ, .seq_num = 1 };
+    set_filename(&rq, slot);
+    int rc = send_and_wait_ack(sock, &rq);
+    if (rc != 0) return rc;
+
+    packet_t dp;
+    for (;;) {
+        if (recv_packet(sock, &dp) != 0 || dp.type != PKT_DOWNLOAD_DATA) return -1;
+        if (dp.payload_size == 0) return 0;
+        *bytes += dp.payload_size;
+        packet_t ca = { .type = PKT_ACK, .seq_num = dp.seq_num, .payload_size = 0 };
+        if (send_packet(sock, &ca) != 0) return -1;
+    }
+}
+
+static int do_delete(int sock, int slot) {
+    packet_t rq = { .type = PKT_DELETE_REQ, .seq_num = 1 };
+    set_filename(&rq, slot);
+    return send_and_wait_ack(sock, &rq);
+}
+
+static int do_list(int sock, uint64_t *bytes) {
+    packet_t rq = { .type = PKT_LIST_SERVER_REQ, .seq_num = 1, .payload_size = 0 };
+    packet_t res;
+    if (send_packet(sock, &rq) != 0 || recv_packet(sock, &res) != 0) return -1;
+    if (res.type != PKT_LIST_SERVER_RES) return 1;
+    *bytes += res.payload_size;
+    return 0;
+}
+
+static bench_op_t pick_op(unsigned int *rng) {
+    int total = 0;
+    for (int i = 0; i < MIX_OP_COUNT; i++) total += cfg.mix[i];
+    int r = (int)(rand_r(rng) % (unsigned int)total);
+    for (int i = 0; i < MIX_OP_COUNT; i++) {
+        if (r < cfg.mix[i]) return (bench_op_t)i;
+        r -= cfg.mix[i];
+    }
+    return OP_UPLOAD;
+}
+
+static int pick_slot(user_ctx_t *u, unsigned int *rng, int want_existing) {
+    int start = (int)(rand_r(rng) % (unsigned int)cfg.files_per_user);
+    for (int i = 0; i < cfg.files_per_user; i++) {
+        int slot = (start + i) % cfg.files_per_user;
+        if (!want_existing || u->exists[slot]) return slot;
+    }
+    return -1;
+}
+
+static void mark_written(user_ctx_t *u, int slot, int exists) {
+    pthread_mutex_lock(&u->mu);
+    u->done_ns[slot] = now_ns();
+    u->delivered[slot] = 0;
+    u->exists[slot] = exists;
+    pthread_mutex_unlock(&u->mu);
+}
+
+static void *writer_thread(void *arg) {
+    device_ctx_t *dev = (device_ctx_t *)arg;
+    user_ctx_t *u = dev->user;
+    unsigned int rng = cfg.seed * 7919u + (unsigned int)u->index;
+
+    char reader[256];
+    int sock = connect_device(u->name, reader, sizeof(reader));
+    int read_sock = -1;
+    if (sock >= 0 && cfg.read_offload && reader[0] != '\0') read_sock = connect_reader(u->name, reader);
+    pthread_barrier_wait(&start_barrier);
+    if (sock < 0) {
+        fprintf(stderr, "[loadgen] Falha ao conectar escritor de '%s'.\n", u->name);
+        dev->aborted = 1;
+        return NULL;
+    }
+
+    for (int i = 0; i < cfg.ops_per_user; i++) {
+        bench_op_t op = pick_op(&rng);
+        int slot = -1;
+        if (op == OP_DOWNLOAD || op == OP_DELETE) {
+            slot = pick_slot(u, &rng, 1);
+            if (slot < 0) op = OP_UPLOAD; // Nothing on the server yet
+        }
+        if (slot < 0) slot = pick_slot(u, &rng, 0);
+
+        sample_vec_t *s = &dev->samples[op];
+        uint64_t t0 = now_ns();
+        int rc = 0;
+        switch (op) {
+            case OP_UPLOAD:
+                rc = do_upload(sock, slot, &s->bytes);
+                if (rc == 0) mark_written(u, slot, 1);
+                break;
+            case OP_DOWNLOAD:
+                if (read_sock >= 0) {
+                    if ((rc = do_download(read_sock, slot, &s->bytes)) == 0) break;
+                    dev->read_fallbacks++;
+                    if (rc < 0) { close(read_sock); read_sock = -1; }
+                }
+                rc = do_download(sock, slot, &s->bytes);
+                break;
+            case OP_DELETE:
+                rc = do_delete(sock, slot);
+                if (rc == 0) mark_written(u, slot, 0);
+                break;
+            case OP_LIST:
+                if (read_sock >= 0) {
+                    if ((rc = do_list(read_sock, &s->bytes)) == 0) break;
+                    dev->read_fallbacks++;
+                    if (rc < 0) { close(read_sock); read_sock = -1; }
+                }
+                rc = do_list(sock, &s->bytes);
+                break;
+            case OP_BATCH: {
+                int n = cfg.files_per_user < LOADGEN_BATCH_FILES ? cfg.files_per_user : LOADGEN_BATCH_FILES;
+                rc = do_batch(sock, slot, n, &s->bytes);
+                for (int k = 0; rc == 0 && k < n; k++) mark_written(u, (slot + k) % cfg.files_per_user, 1);
+                break;
+            }
+            case OP_PROPAGATE: {
+                // Upload and block until every follower has received it
+                rc = do_upload(sock, slot, &s->bytes);
+                if (rc != 0) break;
+                mark_written(u, slot, 1);
+                struct timespec deadline;
+                clock_gettime(CLOCK_REALTIME, &deadline);
+                deadline.tv_sec += LOADGEN_RECV_TIMEOUT_S;
+                pthread_mutex_lock(&u->mu);
+                while (u->delivered[slot] < u->followers && rc == 0) {
+                    if (pthread_cond_timedwait(&u->cv, &u->mu, &deadline) == ETIMEDOUT) rc = 1;
+                }
+                pthread_mutex_unlock(&u->mu);
+                break;
+            }
+            default:
+                break;
+        }
+        if (rc == 0) {
+            sample_add(s, now_ns() - t0);
+        } else {
+            s->errors++;
+            if (rc < 0) {
+                fprintf(stderr, "[loadgen] Erro de transporte em '%s' (%s). Encerrando escritor.\n", u->name, op_names[op]);
+                dev->aborted = 1;
+                break;
+            }
+        }
+    }
+    close(sock);
+    if (read_sock >= 0) close(read_sock);
+    return NULL;
+}
+
+static int slot_from_name(const char *name) {
+    int slot;
+    if (sscanf(name, "f%d.bin", &slot) != 1 || slot < 0 || slot >= LOADGEN_MAX_FILES) return -1;
+    return slot;
+}
+
+static void record_fanout(device_ctx_t *dev, bench_op_t op, int slot) {
+    user_ctx_t *u = dev->user;
+    pthread_mutex_lock(&u->mu);
+    uint64_t t = now_ns();
+    if (slot >= 0 && u->done_ns[slot] != 0) {
+        sample_add(&dev->samples[op], t - u->done_ns[slot]);
+        u->delivered[slot]++;
+        pthread_cond_broadcast(&u->cv);
+    }
+    pthread_mutex_unlock(&u->mu);
+}
+
+static void *follower_thread(void *arg) {
+    device_ctx_t *dev = (device_ctx_t *)arg;
+    user_ctx_t *u = dev->user;
+
+    char reader[1];
+    int sock = connect_device(u->name, reader, 0);
+    pthread_barrier_wait(&start_barrier);
+    if (sock < 0) {
+        fprintf(stderr, "[loadgen] Falha ao conectar seguidor %d de '%s'.\n", dev->device, u->name);
+        dev->aborted = 1;
+        return NULL;
+    }
+
+    packet_t pkt;
+    while (!followers_stop) {
+        struct pollfd pfd = { .fd = sock, .events = POLLIN };
+        int ready = poll(&pfd, 1, 200);
+        if (ready < 0 && errno == EINTR) continue;
+        if (ready <= 0) continue;
+        if (recv_packet(sock, &pkt) != 0) break;
+
+        pkt.payload[MAX_PAYLOAD - 1] = '\0';
+        int slot = slot_from_name(pkt.payload);
+        packet_t ack = { .type = PKT_ACK, .seq_num = pkt.seq_num, .payload_size = 0 };
+
+        if (pkt.type == PKT_UPLOAD_REQ) {
+            if (send_packet(sock, &ack) != 0) break;
+            packet_t dp;
+            int ok = 1;
+            for (;;) {
+                if (recv_packet(sock, &dp) != 0 || dp.type != PKT_UPLOAD_DATA) { ok = 0; break; }
+                if (dp.payload_size == 0) break;
+                dev->samples[OP_FANOUT_UPLOAD].bytes += dp.payload_size;
+                ack.seq_num = dp.seq_num;
+                if (send_packet(sock, &ack) != 0) { ok = 0; break; }
+            }
+            if (!ok) { dev->samples[OP_FANOUT_UPLOAD].errors++; break; }
+            record_fanout(dev, OP_FANOUT_UPLOAD, slot);
+        } else if (pkt.type == PKT_DELETE_REQ) {
+            if (send_packet(sock, &ack) != 0) break;
+            record_fanout(dev, OP_FANOUT_DELETE, slot);
+        } else if (pkt.type == PKT_BATCH_UPLOAD) {
+            if (send_packet(sock, &ack) != 0) break;
+            batch_reader_t reader;
+            batch_reader_init(&reader, sock);
+            char name[NAME_MAX + 1], buf[MAX_PAYLOAD];
+            uint64_t size;
+            int rc;
+            long n;
+            while ((rc = batch_next_file(&reader, name, sizeof(name), &size)) == 1) {
+                while ((n = batch_read(&reader, buf, sizeof(buf))) > 0) dev->samples[OP_FANOUT_UPLOAD].bytes += (uint64_t)n;
+                if (n < 0) { rc = -1; break; }
+                record_fanout(dev, OP_FANOUT_UPLOAD, slot_from_name(name));
+            }
+            if (rc != 0) { dev->samples[OP_FANOUT_UPLOAD].errors++; break; }
+            ack.seq_num = batch_end_seq(&reader);
+            if (send_packet(sock, &ack) != 0) break;
+        }
+    }
+    close(sock);
+    return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile_us(const sample_vec_t *s, double q) {
+    if (s->n == 0) return 0.0;
+    size_t idx = (size_t)(q * (double)s->n);
+    if (idx >= s->n) idx = s->n - 1;
+    return (double)s->v[idx] / 1000.0;
+}
+
+static int parse_mix(const char *spec) {
+    int mix[MIX_OP_COUNT] = { 0 };
+    char *copy = strdup(spec), *save = NULL;
+    if (!copy) return -1;
+    for (char *tok = strtok_r(copy, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        char *eq = strchr(tok, '=');
+        if (!eq) { free(copy); return -1; }
+        *eq = '\0';
+        int found = 0;
+        for (int i = 0; i < MIX_OP_COUNT; i++) {
+            if (strcmp(tok, op_names[i]) == 0) { mix[i] = atoi(eq + 1); found = 1; }
+        }
+        if (!found) { free(copy); return -1; }
+    }
+    free(copy);
+    int total = 0;
+    for (int i = 0; i < MIX_OP_COUNT; i++) total += mix[i] > 0 ? mix[i] : 0;
+    if (total <= 0) return -1;
+    for (int i = 0; i < MIX_OP_COUNT; i++) cfg.mix[i] = mix[i] > 0 ? mix[i] : 0;
+    return 0;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Uso: %s [-u usuários] [-d dispositivos] [-n ops] [-s bytes] [-f arquivos]\n"
+                    "          [-m upload=40,download=30,delete=10,list=15,propagate=5,batch=0]\n"
+                    "          [-p prefixo] [-r semente] [-w espera_ms] [-R] [-z] [-t] <host> <port>\n", prog);
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "u:d:n:s:f:m:p:r:w:Rzt")) != -1) {
+        switch (opt) {
+            case 'u': cfg.users = atoi(optarg); break;
+            case 'd': cfg.devices = atoi(optarg); break;
+            case 'n': cfg.ops_per_user = atoi(optarg); break;
+            case 's': cfg.file_size = atol(optarg); break;
+            case 'f': cfg.files_per_user = atoi(optarg); break;
+            case 'm':
+                if (parse_mix(optarg) != 0) { fprintf(stderr, "Mix inválido: %s\n", optarg); return 1; }
+                break;
+            case 'p': cfg.user_prefix = optarg; break;
+            case 'r': cfg.seed = (unsigned int)strtoul(optarg, NULL, 10); break;
+            case 'w': cfg.drain_ms = atoi(optarg); break;
+            case 'R': cfg.read_offload = 1; break;
+            case 'z': cfg.compress = 1; break;
+            case 't': cfg.text_content = 1; break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+    if (argc - optind != 2) { usage(argv[0]); return 1; }
+    cfg.host = argv[optind];
+    cfg.port = argv[optind + 1];
+
+    if (cfg.users <= 0 || cfg.devices < 1 || cfg.devices > LOADGEN_MAX_DEVICES ||
+        cfg.files_per_user <= 0 || cfg.files_per_user > LOADGEN_MAX_FILES || cfg.file_size < 0) {
+        fprintf(stderr, "Parâmetros inválidos (dispositivos: 1..%d, arquivos: 1..%d).\n",
+                LOADGEN_MAX_DEVICES, LOADGEN_MAX_FILES);
+        return 1;
+    }
+
+    upload_buffer = malloc((size_t)cfg.file_size + 1);
+    if (!upload_buffer) { perror("malloc"); return 1; }
+    unsigned int fill_rng = cfg.seed;
+    if (cfg.text_content) {
+        static const char *words[] = { "sync ", "arquivo ", "servidor ", "cliente ", "dados ", "log ",
+                                       "upload ", "versão ", "erro ", "ok\n", "{\"id\": ", "}, " };
+        long i = 0;
+        while (i < cfg.file_size) {
+            const char *w = words[rand_r(&fill_rng) % (sizeof(words) / sizeof(words[0]))];
+            for (; *w && i < cfg.file_size; w++) upload_buffer[i++] = *w;
+        }
+    } else {
+        for (long i = 0; i < cfg.file_size; i++) upload_buffer[i] = (char)('a' + rand_r(&fill_rng) % 26);
+    }
+
+    int n_devices = cfg.users * cfg.devices;
+    user_ctx_t *users = calloc((size_t)cfg.users, sizeof(user_ctx_t));
+    device_ctx_t *devices = calloc((size_t)n_devices, sizeof(device_ctx_t));
+    pthread_t *tids = calloc((size_t)n_devices, sizeof(pthread_t));
+    if (!users || !devices || !tids) { perror("calloc"); return 1; }
+
+    pthread_barrier_init(&start_barrier, NULL, (unsigned int)n_devices + 1);
+    for (int u = 0; u < cfg.users; u++) {
+        users[u].index = u;
+        snprintf(users[u].name, sizeof(users[u].name), "%s%d", cfg.user_prefix, u);
+        pthread_mutex_init(&users[u].mu, NULL);
+        pthread_cond_init(&users[u].cv, NULL);
+        users[u].followers = cfg.devices - 1;
+        for (int d = 0; d < cfg.devices; d++) {
+            device_ctx_t *dev = &devices[u * cfg.devices + d];
+            dev->user = &users[u];
+            dev->device = d;
+            pthread_create(&tids[u * cfg.devices + d], NULL, d == 0 ? writer_thread : follower_thread, dev);
+        }
+    }
+
+    pthread_barrier_wait(&start_barrier);
+    uint64_t t_start = now_ns();
+    for (int u = 0; u < cfg.users; u++) pthread_join(tids[u * cfg.devices], NULL);
+    uint64_t t_end = now_ns();
+
+    // Give followers time to receive the last propagations, then stop them.
+    uint64_t drain_deadline = now_ns() + (uint64_t)cfg.drain_ms * 1000000ull;
+    for (int u = 0; u < cfg.users; u++) {
+        pthread_mutex_lock(&users[u].mu);
+        for (;;) {
+            int pending = 0;
+            for (int f = 0; f < cfg.files_per_user; f++) {
+                if (users[u].done_ns[f] != 0 && users[u].delivered[f] < users[u].followers) pending = 1;
+            }
+            if (!pending || now_ns() >= drain_deadline) break;
+            pthread_mutex_unlock(&users[u].mu);
+            usleep(10000);
+            pthread_mutex_lock(&users[u].mu);
+        }
+        pthread_mutex_unlock(&users[u].mu);
+    }
+    followers_stop = 1;
+    for (int u = 0; u < cfg.users; u++) {
+        for (int d = 1; d < cfg.devices; d++) pthread_join(tids[u * cfg.devices + d], NULL);
+    }
+
+    // Merge per-device samples
+    sample_vec_t total[OP_COUNT];
+    memset(total, 0, sizeof(total));
+    int aborted = 0, read_fallbacks = 0;
+    for (int i = 0; i < n_devices; i++) {
+        aborted += devices[i].aborted;
+        read_fallbacks += devices[i].read_fallbacks;
+        for (int op = 0; op < OP_COUNT; op++) {
+            sample_vec_t *src = &devices[i].samples[op];
+            for (size_t k = 0; k < src->n; k++) sample_add(&total[op], src->v[k]);
+            total[op].errors += src->errors;
+            total[op].bytes += src->bytes;
+            free(src->v);
+        }
+    }
+
+    double wall_s = (double)(t_end - t_start) / 1e9;
+    printf("{\n");
+    printf("  \"config\": {\"host\": \"%s\", \"port\": %s, \"users\": %d, \"devices\": %d, \"ops_per_user\": %d, "
+           "\"file_size\": %ld, \"files_per_user\": %d, \"seed\": %u, \"read_offload\": %s, \"compress\": %s, "
+           "\"text_content\": %s, \"mix\": {",
+           cfg.host, cfg.port, cfg.users, cfg.devices, cfg.ops_per_user, cfg.file_size, cfg.files_per_user, cfg.seed,
+           cfg.read_offload ? "true" : "false", cfg.compress ? "true" : "false", cfg.text_content ? "true" : "false");
+    for (int i = 0; i < MIX_OP_COUNT; i++) printf("%s\"%s\": %d", i ? ", " : "", op_names[i], cfg.mix[i]);
+    printf("}},\n");
+    packet_stats_t ps;
+    packet_get_stats(&ps);
+    printf("  \"duration_s\": %.6f,\n  \"aborted_devices\": %d,\n  \"read_fallbacks\": %d,\n",
+           wall_s, aborted, read_fallbacks);
+    printf("  \"wire\": {\"bytes_sent\": %llu, \"bytes_received\": %llu, \"compressed_sent\": %llu, "
+           "\"compressed_received\": %llu, \"saved_sent\": %llu, \"saved_received\": %llu, \"bypassed\": %llu},\n",
+           (unsigned long long)ps.bytes_sent, (unsigned long long)ps.bytes_received,
+           (unsigned long long)ps.compressed_sent, (unsigned long long)ps.compressed_received,
+           (unsigned long long)ps.compress_saved_sent, (unsigned long long)ps.compress_saved_received,
+           (unsigned long long)ps.compress_bypassed);
+    printf("  \"ops\": {\n");
+    for (int op = 0; op < OP_COUNT; op++) {
+        sample_vec_t *s = &total[op];
+        qsort(s->v, s->n, sizeof(uint64_t), cmp_u64);
+        double mean_us = 0.0;
+        for (size_t k = 0; k < s->n; k++) mean_us += (double)s->v[k] / 1000.0;
+        if (s->n) mean_us /= (double)s->n;
+        printf("    \"%s\": {\"count\": %zu, \"errors\": %llu, \"ops_per_s\": %.2f, \"bytes\": %llu, \"mb_per_s\": %.3f, "
+               "\"mean_us\": %.1f, \"p50_us\": %.1f, \"p99_us\": %.1f, \"p999_us\": %.1f, \"max_us\": %.1f}%s\n",
+               op_names[op], s->n, (unsigned long long)s->errors, wall_s > 0 ? (double)s->n / wall_s : 0.0,
+               (unsigned long long)s->bytes, wall_s > 0 ? (double)s->bytes / wall_s / 1e6 : 0.0, mean_us,
+               percentile_us(s, 0.50), percentile_us(s, 0.99), percentile_us(s, 0.999),
+               s->n ? (double)s->v[s->n - 1] / 1000.0 : 0.0, op + 1 < OP_COUNT ? "," : "");
+        free(s->v);
+    }
+    printf("  }\n}\n");
+
+    pthread_barrier_destroy(&start_barrier);
+    free(upload_buffer);
+    free(tids);
+    free(devices);
+    free(users);
+    return aborted ? 2 : 0;
+}
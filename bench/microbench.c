@@ -0,0 +1,393 @@
+// bench/microbench.c
+//
+// Micro-benchmarks for the per-packet and per-chunk paths shared by client
+// and server: send_packet/recv_packet, send_and_wait_ack_server, mkdir_p and
+// the fread/memcpy/send and recv/fwrite loops used by the request handler.
+// Sockets are AF_UNIX socketpairs and files live on tmpfs (/dev/shm), so the
+// numbers reflect CPU and syscall cost rather than network or disk latency.
+//
+// Columns:
+//   ns/op        wall time per operation
+//   syscalls/op  read/write syscalls of the whole process (/proc/self/io,
+//                includes the peer thread) plus mkdir calls (linker-wrapped)
+//   bytes/op     bytes moved by those syscalls plus user-space copies the
+//                code under test performs (struct copies and memcpy)
+//
+// Uso: myMicrobench [-t ms_por_caso] [-d diretório_tmpfs]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include "../common/packet.h"
+#include "../server/server_utils.h"
+
+#define CHUNK_SIZE MAX_PAYLOAD
+
+typedef struct {
+    unsigned long long syscr, syscw, rchar, wchar;
+} io_counters_t;
+
+static unsigned long long mkdir_calls = 0;
+static int bench_ms = 300;
+
+// mkdir is not visible in /proc/self/io; the Makefile links this binary with
+// -Wl,--wrap=mkdir so every call made by mkdir_p goes through here.
+int __real_mkdir(const char *path, mode_t mode);
+int __wrap_mkdir(const char *path, mode_t mode) {
+    __atomic_add_fetch(&mkdir_calls, 1, __ATOMIC_RELAXED);
+    return __real_mkdir(path, mode);
+}
+
+static void read_io_counters(io_counters_t *c) {
+    memset(c, 0, sizeof(*c));
+    FILE *f = fopen("/proc/self/io", "r");
+    if (!f) return;
+    char key[32];
+    unsigned long long value;
+    while (fscanf(f, "%31[^:]: %llu\n", key, &value) == 2) {
+        if (strcmp(key, "syscr") == 0) c->syscr = value;
+        else if (strcmp(key, "syscw") == 0) c->syscw = value;
+        else if (strcmp(key, "rchar") == 0) c->rchar = value;
+        else if (strcmp(key, "wchar") == 0) c->wchar = value;
+    }
+    fclose(f);
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+typedef struct {
+    const char *name;
+    const char *variant;
+    uint64_t    ops;
+    uint64_t    elapsed_ns;
+    io_counters_t io_before, io_after;
+    unsigned long long mkdir_before, mkdir_after;
+    double      user_copy_bytes_per_op;
+} bench_result_t;
+
+static void result_begin(bench_result_t *r) {
+    r->mkdir_before = __atomic_load_n(&mkdir_calls, __ATOMIC_RELAXED);
+    read_io_counters(&r->io_before);
+    r->elapsed_ns = now_ns();
+}
+
+static void result_end(bench_result_t *r) {
+    r->elapsed_ns = now_ns() - r->elapsed_ns;
+    read_io_counters(&r->io_after);
+    r->mkdir_after = __atomic_load_n(&mkdir_calls, __ATOMIC_RELAXED);
+    // The fopen/fscanf of /proc/self/io itself costs a few reads; negligible
+    // next to the iteration counts used here.
+}
+
+static void result_print(const bench_result_t *r) {
+    double ops = r->ops ? (double)r->ops : 1.0;
+    double syscalls = (double)(r->io_after.syscr - r->io_before.syscr) +
+                      (double)(r->io_after.syscw - r->io_before.syscw) +
+                      (double)(r->mkdir_after - r->mkdir_before);
+    double kernel_bytes = (double)(r->io_after.rchar - r->io_before.rchar) +
+                          (double)(r->io_after.wchar - r->io_before.wchar);
+    printf("%-22s %-18s %12llu %12.1f %12.2f %14.1f\n",
+           r->name, r->variant, (unsigned long long)r->ops, (double)r->elapsed_ns / ops,
+           syscalls / ops, kernel_bytes / ops + r->user_copy_bytes_per_op);
+    fflush(stdout);
+}
+
+static int time_left(uint64_t start) {
+    return now_ns() - start < (uint64_t)bench_ms * 1000000ull;
+}
+
+// ---------------------------------------------------------------------------
+// send_packet/recv_packet over a socketpair, single thread
+// ---------------------------------------------------------------------------
+static void bench_packet_codec(uint32_t payload_size, const char *variant) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) { perror("socketpair"); return; }
+    packet_t out = { .type = PKT_UPLOAD_DATA, .seq_num = 1, .payload_size = payload_size };
+    memset(out.payload, 'x', payload_size);
+    packet_t in;
+
+    bench_result_t r = { .name = "packet_send_recv", .variant = variant };
+    // send_packet copies the whole struct to convert the header to network order
+    r.user_copy_bytes_per_op = sizeof(packet_t);
+    result_begin(&r);
+    uint64_t start = now_ns();
+    while (time_left(start)) {
+        for (int i = 0; i < 256; i++) {
+            out.seq_num++;
+            if (send_packet(sv[0], &out) != 0 || recv_packet(sv[1], &in) != 0) {
+                fprintf(stderr, "packet_send_recv: erro de E/S\n");
+                goto done;
+            }
+        }
+        r.ops += 256;
+    }
+done:
+    result_end(&r);
+    result_print(&r);
+    close(sv[0]);
+    close(sv[1]);
+}
+
+// ---------------------------------------------------------------------------
+// send_and_wait_ack_server: stop-and-wait chunk with a peer thread ACKing
+// ---------------------------------------------------------------------------
+static void *ack_responder_thread(void *arg) {
+    int fd = *(int *)arg;
+    packet_t in;
+    while (recv_packet(fd, &in) == 0) {
+        packet_t ack = { .type = PKT_ACK, .seq_num = in.seq_num, .payload_size = 0 };
+        if (send_packet(fd, &ack) != 0) break;
+    }
+    return NULL;
+}
+
+static void bench_ack_roundtrip(uint32_t chunk, const char *variant) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) { perror("socketpair"); return; }
+    pthread_t tid;
+    pthread_create(&tid, NULL, ack_responder_thread, &sv[1]);
+
+    packet_t out = { .type = PKT_UPLOAD_DATA, .seq_num = 1, .payload_size = chunk };
+    memset(out.payload, 'x', chunk);
+
+    bench_result_t r = { .name = "chunk_send_wait_ack", .variant = variant };
+    // Two packets cross the socket per op, each copied once by send_packet
+    r.user_copy_bytes_per_op = 2.0 * sizeof(packet_t);
+    result_begin(&r);
+    uint64_t start = now_ns();
+    while (time_left(start)) {
+        for (int i = 0; i < 64; i++) {
+            out.seq_num++;
+            if (send_and_wait_ack_server(sv[0], &out) != 0) {
+                fprintf(stderr, "chunk_send_wait_ack: erro\n");
+                goto done;
+            }
+        }
+        r.ops += 64;
+    }
+done:
+    result_end(&r);
+    result_print(&r);
+    shutdown(sv[0], SHUT_RDWR);
+    pthread_join(tid, NULL);
+    close(sv[0]);
+    close(sv[1]);
+}
+
+// ---------------------------------------------------------------------------
+// mkdir_p on an existing tree (steady-state cost paid on every session)
+// ---------------------------------------------------------------------------
+static void bench_mkdir_p(const char *base, int depth, const char *variant) {
+    char path[512];
+    int len = snprintf(path, sizeof(path), "%s/mk", base);
+    for (int i = 0; i < depth - 1 && len < (int)sizeof(path) - 8; i++) {
+        len += snprintf(path + len, sizeof(path) - (size_t)len, "/d%d", i);
+    }
+    mkdir_p(path, 0755);
+
+    bench_result_t r = { .name = "mkdir_p_existing", .variant = variant };
+    r.user_copy_bytes_per_op = (double)strlen(path) + 1; // snprintf into the local buffer
+    result_begin(&r);
+    uint64_t start = now_ns();
+    while (time_left(start)) {
+        for (int i = 0; i < 256; i++) mkdir_p(path, 0755);
+        r.ops += 256;
+    }
+    result_end(&r);
+    result_print(&r);
+}
+
+// ---------------------------------------------------------------------------
+// Server download loop: fread -> memcpy into packet -> send_and_wait_ack
+// ---------------------------------------------------------------------------
+static int write_test_file(const char *path, size_t size) {
+    FILE *f = fopen(path, "wb");
+    if (!f) return -1;
+    char buf[CHUNK_SIZE];
+    memset(buf, 'y', sizeof(buf));
+    for (size_t off = 0; off < size; off += sizeof(buf)) {
+        size_t n = size - off < sizeof(buf) ? size - off : sizeof(buf);
+        fwrite(buf, 1, n, f);
+    }
+    fclose(f);
+    return 0;
+}
+
+static void bench_file_send_loop(const char *base, size_t file_size, size_t chunk, const char *variant) {
+    char path[512];
+    snprintf(path, sizeof(path), "%s/send_%zu.bin", base, file_size);
+    if (write_test_file(path, file_size) != 0) { perror("write_test_file"); return; }
+
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) { perror("socketpair"); return; }
+    pthread_t tid;
+    pthread_create(&tid, NULL, ack_responder_thread, &sv[1]);
+
+    size_t chunks = (file_size + chunk - 1) / chunk;
+    bench_result_t r = { .name = "file_fread_send", .variant = variant };
+    // Per file: stdio buffer -> buf, buf -> packet payload, plus send_packet's struct copy per chunk/ACK
+    r.user_copy_bytes_per_op = 2.0 * (double)file_size + (double)(chunks + 1) * 2.0 * sizeof(packet_t);
+    result_begin(&r);
+    uint64_t start = now_ns();
+    char buf[CHUNK_SIZE];
+    while (time_left(start)) {
+        FILE *f = fopen(path, "rb");
+        if (!f) break;
+        uint32_t seq = 1;
+        size_t n_read;
+        packet_t pkt;
+        while ((n_read = fread(buf, 1, chunk, f)) > 0) {
+            pkt.type = PKT_DOWNLOAD_DATA;
+            pkt.seq_num = seq++;
+            pkt.payload_size = (uint32_t)n_read;
+            memcpy(pkt.payload, buf, n_read);
+            if (send_and_wait_ack_server(sv[0], &pkt) != 0) break;
+        }
+        fclose(f);
+        pkt.type = PKT_DOWNLOAD_DATA;
+        pkt.seq_num = seq;
+        pkt.payload_size = 0;
+        send_and_wait_ack_server(sv[0], &pkt); // Responder ACKs everything, keeps the pipe in sync
+        r.ops++;
+    }
+    result_end(&r);
+    result_print(&r);
+    shutdown(sv[0], SHUT_RDWR);
+    pthread_join(tid, NULL);
+    close(sv[0]);
+    close(sv[1]);
+    unlink(path);
+}
+
+// ---------------------------------------------------------------------------
+// Server upload loop: recv_packet -> fwrite -> ACK, fed by a sender thread
+// ---------------------------------------------------------------------------
+typedef struct {
+    int    fd;
+    size_t file_size;
+    size_t chunk;
+    volatile int stop;
+} upload_feeder_args_t;
+
+static void *upload_feeder_thread(void *arg) {
+    upload_feeder_args_t *a = (upload_feeder_args_t *)arg;
+    packet_t pkt = { .type = PKT_UPLOAD_DATA };
+    memset(pkt.payload, 'z', sizeof(pkt.payload));
+    while (!a->stop) {
+        uint32_t seq = 2;
+        for (size_t off = 0; off < a->file_size; off += a->chunk) {
+            pkt.seq_num = seq++;
+            pkt.payload_size = (uint32_t)(a->file_size - off < a->chunk ? a->file_size - off : a->chunk);
+            if (send_and_wait_ack_server(a->fd, &pkt) != 0) return NULL;
+        }
+        pkt.seq_num = seq;
+        pkt.payload_size = 0;
+        if (send_packet(a->fd, &pkt) != 0) return NULL;
+    }
+    return NULL;
+}
+
+static void bench_file_recv_loop(const char *base, size_t file_size, size_t chunk, const char *variant) {
+    char path[512];
+    snprintf(path, sizeof(path), "%s/recv_%zu.bin", base, file_size);
+
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) { perror("socketpair"); return; }
+    upload_feeder_args_t args = { .fd = sv[0], .file_size = file_size, .chunk = chunk, .stop = 0 };
+    pthread_t tid;
+    pthread_create(&tid, NULL, upload_feeder_thread, &args);
+
+    size_t chunks = (file_size + chunk - 1) / chunk;
+    bench_result_t r = { .name = "file_recv_fwrite", .variant = variant };
+    // fwrite copies into the stdio buffer; send_packet copies the struct per chunk and per ACK
+    r.user_copy_bytes_per_op = (double)file_size + (double)(chunks * 2 + 1) * sizeof(packet_t);
+    result_begin(&r);
+    uint64_t start = now_ns();
+    packet_t pkt;
+    while (time_left(start)) {
+        FILE *f = fopen(path, "wb");
+        if (!f) break;
+        int ok = 1;
+        while ((ok = (recv_packet(sv[1], &pkt) == 0)) && pkt.payload_size > 0) {
+            fwrite(pkt.payload, 1, pkt.payload_size, f);
+            packet_t ack = { .type = PKT_ACK, .seq_num = pkt.seq_num, .payload_size = 0 };
+            send_packet(sv[1], &ack);
+        }
+        fclose(f);
+        if (!ok) break;
+        r.ops++;
+    }
+    result_end(&r);
+    result_print(&r);
+    args.stop = 1;
+    shutdown(sv[1], SHUT_RDWR);
+    pthread_join(tid, NULL);
+    close(sv[0]);
+    close(sv[1]);
+    unlink(path);
+}
+
+int main(int argc, char *argv[]) {
+    const char *tmpfs_root = "/dev/shm";
+    int opt;
+    while ((opt = getopt(argc, argv, "t:d:")) != -1) {
+        switch (opt) {
+            case 't': bench_ms = atoi(optarg); break;
+            case 'd': tmpfs_root = optarg; break;
+            default:
+                fprintf(stderr, "Uso: %s [-t ms_por_caso] [-d diretório_tmpfs]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (bench_ms <= 0) bench_ms = 300;
+    signal(SIGPIPE, SIG_IGN); // Peers are torn down with shutdown() between cases
+
+    char base[256];
+    snprintf(base, sizeof(base), "%s/sisop2-microbench-%d", tmpfs_root, (int)getpid());
+    if (mkdir(base, 0755) != 0 && errno != EEXIST) {
+        perror("mkdir base");
+        return 1;
+    }
+
+    printf("# sizeof(packet_t)=%zu CHUNK_SIZE=%d tmpfs=%s ms_per_case=%d\n",
+           sizeof(packet_t), CHUNK_SIZE, base, bench_ms);
+    printf("%-22s %-18s %12s %12s %12s %14s\n", "benchmark", "variant", "ops", "ns/op", "syscalls/op", "bytes/op");
+
+    bench_packet_codec(0, "payload=0");
+    bench_packet_codec(64, "payload=64");
+    bench_packet_codec(1024, "payload=1024");
+    bench_packet_codec(MAX_PAYLOAD, "payload=4096");
+
+    bench_ack_roundtrip(64, "chunk=64");
+    bench_ack_roundtrip(1024, "chunk=1024");
+    bench_ack_roundtrip(MAX_PAYLOAD, "chunk=4096");
+
+    bench_mkdir_p(base, 1, "depth=1");
+    bench_mkdir_p(base, 4, "depth=4");
+    bench_mkdir_p(base, 8, "depth=8");
+
+    bench_file_send_loop(base, 4096, 1024, "4KiB/chunk=1024");
+    bench_file_send_loop(base, 4096, CHUNK_SIZE, "4KiB/chunk=4096");
+    bench_file_send_loop(base, 1 << 20, 1024, "1MiB/chunk=1024");
+    bench_file_send_loop(base, 1 << 20, CHUNK_SIZE, "1MiB/chunk=4096");
+
+    bench_file_recv_loop(base, 4096, CHUNK_SIZE, "4KiB/chunk=4096");
+    bench_file_recv_loop(base, 1 << 20, 1024, "1MiB/chunk=1024");
+    bench_file_recv_loop(base, 1 << 20, CHUNK_SIZE, "1MiB/chunk=4096");
+
+    char cmd[512];
+    snprintf(cmd, sizeof(cmd), "rm -rf '%s'", base);
+    if (system(cmd) != 0) fprintf(stderr, "Aviso: não foi possível remover %s\n", base);
+    return 0;
+}
@@ -0,0 +1,380 @@
+// bench/netem.c
+//
+// TCP proxy that sits between myClient/myLoadgen and myServer and impairs
+// the link the way a WAN would: propagation delay, jitter, a bandwidth cap
+// and connection resets. Everything runs in user space on one box, so it
+// needs no root and no tc/netem.
+//
+// Each direction of each connection is modelled as a serial link. A byte
+// that arrives at time t leaves at
+//     max(t, link_free) + size/bandwidth + rtt/2 + jitter
+// and is never delivered before a byte that arrived earlier (TCP keeps
+// order, so jitter cannot reorder data). Jitter and reset points are
+// derived from the seed, the connection number and the byte offset, never
+// from read() boundaries, so the same workload sees the same impairments on
+// every run.
+//
+// Uso: myNetem [opções] <porta_local> <host_servidor> <porta_servidor>
+//   -t <ms>      RTT adicionado (metade em cada sentido, padrão 0)
+//   -j <ms>      jitter máximo por segmento, uniforme em [0, j] (padrão 0)
+//   -b <kbit/s>  limite de banda por sentido (padrão 0 = ilimitado)
+//   -x <bytes>   reseta cada conexão após ~N bytes do cliente para o
+//                servidor (uniforme em [N/2, 3N/2], padrão 0 = nunca)
+//   -s <bytes>   tamanho do segmento usado para jitter e agendamento (padrão 1448)
+//   -r <seed>    semente (padrão 1)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define NETEM_MAX_SEGMENT 65536
+#define NETEM_MAX_QUEUED  (4u << 20) // Bytes in flight per direction before the reader stops reading
+
+typedef struct {
+    const char  *server_host;
+    const char  *server_port;
+    int          listen_port;
+    uint64_t     rtt_us;
+    uint64_t     jitter_us;
+    uint64_t     bandwidth_bps; // Bits per second, 0 = unlimited
+    uint64_t     reset_bytes;
+    size_t       segment;
+    uint64_t     seed;
+} netem_config_t;
+
+static netem_config_t cfg = {
+    .segment = 1448,
+    .seed = 1
+};
+
+typedef struct segment {
+    struct segment *next;
+    uint64_t        deliver_at_us;
+    size_t          len;
+    char            data[];
+} segment_t;
+
+typedef struct conn conn_t;
+
+// One direction of a proxied connection: a reader thread timestamps the
+// data it receives and queues it, a writer thread releases it on schedule.
+typedef struct {
+    conn_t         *conn;
+    int             from_fd, to_fd;
+    int             upstream;       // 1 = client -> server
+    uint64_t        offset;         // Bytes read so far in this direction
+    uint64_t        link_free_us;   // When the modelled link finishes the previous segment
+    uint64_t        last_deliver_us;
+    segment_t      *head, *tail;
+    size_t          queued;
+    int             eof;
+    pthread_mutex_t mutex;
+    pthread_cond_t  cond;
+} direction_t;
+
+struct conn {
+    unsigned        id;
+    int             client_fd, server_fd;
+    uint64_t        reset_at;       // Upstream byte offset that triggers a reset, 0 = never
+    _Atomic int     closing;
+    _Atomic int     refs;
+    direction_t     dir[2];
+};
+
+static _Atomic unsigned next_conn_id;
+static _Atomic uint64_t total_bytes[2];
+static _Atomic uint64_t total_resets;
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000ull + (uint64_t)ts.tv_nsec / 1000ull;
+}
+
+static void sleep_until_us(uint64_t when) {
+    uint64_t now = now_us();
+    if (when <= now) return;
+    struct timespec ts = { .tv_sec = (time_t)((when - now) / 1000000ull),
+                           .tv_nsec = (long)((when - now) % 1000000ull) * 1000L };
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR) { }
+}
+
+// splitmix64: a stateless hash so impairments depend only on (seed, conn, offset)
+static uint64_t mix64(uint64_t x) {
+    x += 0x9e3779b97f4a7c15ull;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+}
+
+static uint64_t draw(unsigned conn_id, int upstream, uint64_t index, uint64_t bound) {
+    if (bound == 0) return 0;
+    uint64_t h = mix64(cfg.seed ^ mix64(((uint64_t)conn_id << 1 | (uint64_t)upstream) ^ mix64(index)));
+    return h % (bound + 1);
+}
+
+static void conn_release(conn_t *c) {
+    if (atomic_fetch_sub(&c->refs, 1) != 1) return;
+    close(c->client_fd);
+    close(c->server_fd);
+    for (int d = 0; d < 2; d++) {
+        segment_t *s = c->dir[d].head;
+        while (s) { segment_t *n = s->next; free(s); s = n; }
+        pthread_mutex_destroy(&c->dir[d].mutex);
+        pthread_cond_destroy(&c->dir[d].cond);
+    }
+    free(c);
+}
+
+// Aborts both sides with RST, as a middlebox or a flaky NAT would.
+static void conn_reset(conn_t *c) {
+    if (atomic_exchange(&c->closing, 1)) return;
+    atomic_fetch_add(&total_resets, 1);
+    struct linger lg = { .l_onoff = 1, .l_linger = 0 };
+    setsockopt(c->client_fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+    setsockopt(c->server_fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+    shutdown(c->client_fd, SHUT_RDWR);
+    shutdown(c->server_fd, SHUT_RDWR);
+    for (int d = 0; d < 2; d++) {
+        pthread_mutex_lock(&c->dir[d].mutex);
+        c->dir[d].eof = 1;
+        pthread_cond_broadcast(&c->dir[d].cond);
+        pthread_mutex_unlock(&c->dir[d].mutex);
+    }
+    fprintf(stderr, "[netem] conexão %u resetada\n", c->id);
+}
+
+static void enqueue(direction_t *d, const char *data, size_t len, uint64_t arrival_us) {
+    conn_t *c = d->conn;
+    uint64_t start = arrival_us > d->link_free_us ? arrival_us : d->link_free_us;
+    uint64_t tx_us = cfg.bandwidth_bps ? (uint64_t)len * 8ull * 1000000ull / cfg.bandwidth_bps : 0;
+    d->link_free_us = start + tx_us;
+
+    uint64_t jitter = draw(c->id, d->upstream, d->offset / cfg.segment, cfg.jitter_us);
+    uint64_t deliver = d->link_free_us + cfg.rtt_us / 2 + jitter;
+    if (deliver < d->last_deliver_us) deliver = d->last_deliver_us; // Keep byte order
+    d->last_deliver_us = deliver;
+    d->offset += len;
+
+    segment_t *s = malloc(sizeof(segment_t) + len);
+    if (!s) return;
+    s->next = NULL;
+    s->deliver_at_us = deliver;
+    s->len = len;
+    memcpy(s->data, data, len);
+
+    pthread_mutex_lock(&d->mutex);
+    while (d->queued >= NETEM_MAX_QUEUED && !d->eof) pthread_cond_wait(&d->cond, &d->mutex);
+    if (d->tail) d->tail->next = s; else d->head = s;
+    d->tail = s;
+    d->queued += len;
+    pthread_cond_broadcast(&d->cond);
+    pthread_mutex_unlock(&d->mutex);
+}
+
+static void *reader_thread(void *arg) {
+    direction_t *d = (direction_t *)arg;
+    conn_t *c = d->conn;
+    char buf[NETEM_MAX_SEGMENT];
+
+    while (!atomic_load(&c->closing)) {
+        // Never read past the reset point so the cut lands on the same byte every run
+        size_t want = cfg.segment - (size_t)(d->offset % cfg.segment);
+        if (d->upstream && c->reset_at && c->reset_at - d->offset < want) want = (size_t)(c->reset_at - d->offset);
+        if (want == 0) { conn_reset(c); break; }
+
+        ssize_t n = read(d->from_fd, buf, want);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        atomic_fetch_add_explicit(&total_bytes[d->upstream], (uint64_t)n, memory_order_relaxed);
+        enqueue(d, buf, (size_t)n, now_us());
+    }
+
+    pthread_mutex_lock(&d->mutex);
+    d->eof = 1;
+    pthread_cond_broadcast(&d->cond);
+    pthread_mutex_unlock(&d->mutex);
+    conn_release(c);
+    return NULL;
+}
+
+static void *writer_thread(void *arg) {
+    direction_t *d = (direction_t *)arg;
+    conn_t *c = d->conn;
+
+    for (;;) {
+        pthread_mutex_lock(&d->mutex);
+        while (!d->head && !d->eof) pthread_cond_wait(&d->cond, &d->mutex);
+        segment_t *s = d->head;
+        if (!s) { pthread_mutex_unlock(&d->mutex); break; } // EOF and drained
+        pthread_mutex_unlock(&d->mutex);
+
+        sleep_until_us(s->deliver_at_us);
+        if (atomic_load(&c->closing)) break;
+
+        size_t off = 0;
+        while (off < s->len) {
+            ssize_t w = write(d->to_fd, s->data + off, s->len - off);
+            if (w < 0 && errno == EINTR) continue;
+            if (w <= 0) break;
+            off += (size_t)w;
+        }
+
+        pthread_mutex_lock(&d->mutex);
+        d->head = s->next;
+        if (!d->head) d->tail = NULL;
+        d->queued -= s->len;
+        pthread_cond_broadcast(&d->cond);
+        pthread_mutex_unlock(&d->mutex);
+        int short_write = off < s->len;
+        free(s);
+        if (short_write) { conn_reset(c); break; }
+    }
+
+    // Half-close so the peer sees EOF only after every delayed byte arrived
+    if (!atomic_load(&c->closing)) shutdown(d->to_fd, SHUT_WR);
+    conn_release(c);
+    return NULL;
+}
+
+static int connect_server(void) {
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM }, *res, *p;
+    int rv = getaddrinfo(cfg.server_host, cfg.server_port, &hints, &res);
+    if (rv != 0) {
+        fprintf(stderr, "[netem] getaddrinfo: %s\n", gai_strerror(rv));
+        return -1;
+    }
+    int fd = -1;
+    for (p = res; p; p = p->ai_next) {
+        fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+        if (fd < 0) continue;
+        if (connect(fd, p->ai_addr, p->ai_addrlen) == 0) break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+static void start_conn(int client_fd) {
+    int server_fd = connect_server();
+    if (server_fd < 0) {
+        fprintf(stderr, "[netem] falha ao conectar a %s:%s\n", cfg.server_host, cfg.server_port);
+        close(client_fd);
+        return;
+    }
+    // The proxy does its own pacing; Nagle on top would add unmodelled delay
+    int one = 1;
+    setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    setsockopt(server_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    conn_t *c = calloc(1, sizeof(conn_t));
+    if (!c) { close(client_fd); close(server_fd); return; }
+    c->id = atomic_fetch_add(&next_conn_id, 1);
+    c->client_fd = client_fd;
+    c->server_fd = server_fd;
+    if (cfg.reset_bytes) {
+        c->reset_at = cfg.reset_bytes / 2 + draw(c->id, 1, UINT64_MAX, cfg.reset_bytes);
+    }
+    atomic_store(&c->refs, 4);
+    for (int i = 0; i < 2; i++) {
+        direction_t *d = &c->dir[i];
+        d->conn = c;
+        d->upstream = (i == 0);
+        d->from_fd = d->upstream ? client_fd : server_fd;
+        d->to_fd = d->upstream ? server_fd : client_fd;
+        pthread_mutex_init(&d->mutex, NULL);
+        pthread_cond_init(&d->cond, NULL);
+    }
+    for (int i = 0; i < 2; i++) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, reader_thread, &c->dir[i]) == 0) pthread_detach(tid);
+        else conn_release(c);
+        if (pthread_create(&tid, NULL, writer_thread, &c->dir[i]) == 0) pthread_detach(tid);
+        else conn_release(c);
+    }
+}
+
+static void print_totals(int sig) {
+    (void)sig;
+    char line[256];
+    int n = snprintf(line, sizeof(line),
+                     "[netem] conexões: %u, bytes cliente->servidor: %llu, servidor->cliente: %llu, resets: %llu\n",
+                     atomic_load(&next_conn_id),
+                     (unsigned long long)atomic_load(&total_bytes[1]),
+                     (unsigned long long)atomic_load(&total_bytes[0]),
+                     (unsigned long long)atomic_load(&total_resets));
+    if (n > 0) { ssize_t w = write(STDERR_FILENO, line, (size_t)n); (void)w; }
+    _exit(0);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Uso: %s [-t rtt_ms] [-j jitter_ms] [-b kbit/s] [-x bytes_reset] [-s segmento] [-r seed]\n"
+            "          <porta_local> <host_servidor> <porta_servidor>\n", prog);
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "t:j:b:x:s:r:h")) != -1) {
+        switch (opt) {
+            case 't': cfg.rtt_us = (uint64_t)(atof(optarg) * 1000.0); break;
+            case 'j': cfg.jitter_us = (uint64_t)(atof(optarg) * 1000.0); break;
+            case 'b': cfg.bandwidth_bps = strtoull(optarg, NULL, 10) * 1000ull; break;
+            case 'x': cfg.reset_bytes = strtoull(optarg, NULL, 10); break;
+            case 's': cfg.segment = (size_t)strtoul(optarg, NULL, 10); break;
+            case 'r': cfg.seed = strtoull(optarg, NULL, 10); break;
+            default:  usage(argv[0]); return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (argc - optind != 3 || cfg.segment == 0 || cfg.segment > NETEM_MAX_SEGMENT) {
+        usage(argv[0]);
+        return 1;
+    }
+    cfg.listen_port = atoi(argv[optind]);
+    cfg.server_host = argv[optind + 1];
+    cfg.server_port = argv[optind + 2];
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, print_totals);
+    signal(SIGTERM, print_totals);
+
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_fd < 0) { perror("socket"); return 1; }
+    int one = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+        .sin_port = htons(cfg.listen_port)
+    };
+    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listen_fd, 64) < 0) {
+        perror("bind/listen");
+        return 1;
+    }
+    fprintf(stderr, "[netem] 127.0.0.1:%d -> %s:%s (rtt %.1f ms, jitter %.1f ms, banda %llu kbit/s, reset %llu bytes, seed %llu)\n",
+            cfg.listen_port, cfg.server_host, cfg.server_port,
+            cfg.rtt_us / 1000.0, cfg.jitter_us / 1000.0,
+            (unsigned long long)(cfg.bandwidth_bps / 1000ull),
+            (unsigned long long)cfg.reset_bytes, (unsigned long long)cfg.seed);
+
+    while (1) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno != EINTR) perror("accept");
+            continue;
+        }
+        start_conn(fd);
+    }
+}
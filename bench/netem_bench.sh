@@ -0,0 +1,64 @@
+#!/usr/bin/env bash
+# Runs the load generator through myNetem under a set of link profiles and
+# keeps one JSON report per profile, so protocol changes (pipelining, chunk
+# size, resume) can be compared on one box with reproducible impairments.
+#
+# Uso: bench/netem_bench.sh [perfil ...]
+#   perfis: loopback lan wan mobile flaky (padrão: todos)
+# Variáveis: PORT (servidor, padrão 23400), NETEM_PORT (padrão 23401),
+#            OUT (diretório dos relatórios, padrão bench/results),
+#            LOADGEN_ARGS (padrão "-u 4 -d 1 -n 100 -r 1")
+set -euo pipefail
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+PORT=${PORT:-23400}
+NETEM_PORT=${NETEM_PORT:-23401}
+OUT=${OUT:-$ROOT/bench/results}
+LOADGEN_ARGS=${LOADGEN_ARGS:-"-u 4 -d 1 -n 100 -r 1"}
+
+# name -> myNetem options (same seed everywhere so runs are comparable)
+declare -A PROFILES=(
+  [loopback]=""
+  [lan]="-t 1 -j 0.2 -b 1000000"
+  [wan]="-t 60 -j 10 -b 20000"
+  [mobile]="-t 150 -j 40 -b 2000"
+  [flaky]="-t 60 -j 10 -b 20000 -x 2000000"
+)
+ORDER=(loopback lan wan mobile flaky)
+if [ $# -gt 0 ]; then ORDER=("$@"); fi
+
+make -C "$ROOT" all bench > /dev/null
+mkdir -p "$OUT"
+WORK=$(mktemp -d)
+SPID=""; NPID=""
+cleanup() {
+  [ -n "$NPID" ] && kill "$NPID" 2> /dev/null || true
+  [ -n "$SPID" ] && kill "$SPID" 2> /dev/null || true
+  rm -rf "$WORK"
+}
+trap cleanup EXIT
+
+for profile in "${ORDER[@]}"; do
+  if [ -z "${PROFILES[$profile]+x}" ]; then
+    echo "Perfil desconhecido: $profile" >&2
+    exit 1
+  fi
+
+  # Fresh server and storage for every profile
+  rm -rf "$WORK/storage"
+  (cd "$WORK" && exec "$ROOT/myServer" "$PORT" > "$WORK/server.log" 2>&1) &
+  SPID=$!
+  "$ROOT/myNetem" -r 1 ${PROFILES[$profile]} "$NETEM_PORT" 127.0.0.1 "$PORT" 2> "$OUT/$profile.netem.log" &
+  NPID=$!
+  sleep 0.5
+
+  echo "[$profile] myNetem ${PROFILES[$profile]:-(sem impairment)}"
+  # shellcheck disable=SC2086
+  "$ROOT/myLoadgen" $LOADGEN_ARGS 127.0.0.1 "$NETEM_PORT" > "$OUT/$profile.json" || true
+  grep -E '"(duration_s|aborted_devices)"' "$OUT/$profile.json" | sed 's/^/    /'
+
+  kill "$NPID" 2> /dev/null || true; wait "$NPID" 2> /dev/null || true; NPID=""
+  kill "$SPID" 2> /dev/null || true; wait "$SPID" 2> /dev/null || true; SPID=""
+done
+
+echo "Relatórios em $OUT"
@@ -11,10 +11,16 @@
 #include <sys/socket.h> 
 #include <netdb.h>      
 #include <errno.h>
+#include <signal.h>
 
 #include "../common/packet.h"
+#include "../common/log.h"
+#include "../common/trace.h"
 #include "client_actions.h" 
 #include "client_sync.h"    
+#include "client_conn.h"
+#include "client_journal.h"
+#include "client_hydrate.h"
 
 char initial_cwd[PATH_MAX];
 pthread_mutex_t socket_mutex = PTHREAD_MUTEX_INITIALIZER;
@@ -31,6 +37,8 @@ void cleanup_sync_dir_and_exit(int sock, const char* p_initial_cwd, const char*
             fprintf(stderr, "Erro crítico: Não foi possível retornar ao diretório inicial para limpar %s.\n", p_sync_dir_path);
         }
     }
+    trace_shutdown();
+    log_shutdown();
     exit(status);
 }
 
@@ -43,6 +51,12 @@ int main(int argc, char *argv[]) {
     const char *user = argv[1];
     const char *host = argv[2];
     const char *port_str = argv[3];
+    // Background threads log asynchronously to stderr; the REPL keeps using stdout.
+    log_init(STDERR_FILENO, LOG_LEVEL_INFO);
+    signal(SIGPIPE, SIG_IGN); // Lost connections surface as send errors and trigger a reconnect
+    char trace_name[64];
+    snprintf(trace_name, sizeof(trace_name), "client-%s", user);
+    trace_init(trace_name);
 
     initial_cwd[0] = '\0'; // Inicializa para o caso de getcwd falhar
     if (!getcwd(initial_cwd, sizeof(initial_cwd))) {
@@ -51,7 +65,11 @@ int main(int argc, char *argv[]) {
     }
 
     char sync_dir_path[PATH_MAX];
-    snprintf(sync_dir_path, PATH_MAX, "%s/sync_dir_%s", initial_cwd, user);
+    int n = snprintf(sync_dir_path, PATH_MAX, "%s/sync_dir_%s", initial_cwd, user);
+    if (n < 0 || n >= PATH_MAX) {
+        fprintf(stderr, "Caminho do diretório de sincronização longo demais.\n");
+        return 1; // Não há sync_dir para limpar aqui ainda
+    }
 
     printf("Limpando diretório de sincronização anterior (se existir): %s\n", sync_dir_path);
     fflush(stdout);
@@ -74,73 +92,31 @@ int main(int argc, char *argv[]) {
     printf("Diretório de trabalho atual: %s\n", sync_dir_path);
 
 
-    struct addrinfo hints, *servinfo, *p_servaddr;
-    int rv_getaddr;
-    int sock = -1;
-
-    memset(&hints, 0, sizeof hints);
-    hints.ai_family = AF_INET;
-    hints.ai_socktype = SOCK_STREAM;
-
-    if ((rv_getaddr = getaddrinfo(host, port_str, &hints, &servinfo)) != 0) {
-        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv_getaddr));
-        cleanup_sync_dir_and_exit(sock, initial_cwd, sync_dir_path, 1);
+    char journal_path[PATH_MAX];
+    n = snprintf(journal_path, PATH_MAX, "%s/.sync_journal_%s", initial_cwd, user);
+    if (n < 0 || n >= PATH_MAX) {
+        fprintf(stderr, "Caminho do journal longo demais.\n");
+        cleanup_sync_dir_and_exit(-1, initial_cwd, sync_dir_path, 1);
     }
+    journal_init(journal_path);
 
-    for(p_servaddr = servinfo; p_servaddr != NULL; p_servaddr = p_servaddr->ai_next) {
-        if ((sock = socket(p_servaddr->ai_family, p_servaddr->ai_socktype, p_servaddr->ai_protocol)) == -1) {
-            continue;
-        }
-        if (connect(sock, p_servaddr->ai_addr, p_servaddr->ai_addrlen) == -1) {
-            close(sock);
-            sock = -1;
-            continue;
-        }
-        break;
-    }
-
-    if (p_servaddr == NULL || sock == -1) {
-        fprintf(stderr, "Cliente: falha ao conectar a %s:%s após tentar todos os endereços.\n", host, port_str);
-        freeaddrinfo(servinfo);
-        cleanup_sync_dir_and_exit(sock, initial_cwd, sync_dir_path, 2);
-    }
-    freeaddrinfo(servinfo);
-
-    packet_t init_pkt = { .type = PKT_GET_SYNC_DIR, .seq_num = 1 };
-    strncpy(init_pkt.payload, user, MAX_PAYLOAD - 1);
-    init_pkt.payload[MAX_PAYLOAD - 1] = '\0';
-    init_pkt.payload_size = (uint32_t)strlen(init_pkt.payload) + 1;
-
-    pthread_mutex_lock(&socket_mutex);
-    int init_send_ok = (send_packet(sock, &init_pkt) == 0);
-    packet_t ack_pkt;
-    int init_recv_ok = 0;
-    if (init_send_ok) {
-        init_recv_ok = (recv_packet(sock, &ack_pkt) == 0);
-    }
-    pthread_mutex_unlock(&socket_mutex);
-
-    if (!init_send_ok) {
-        fprintf(stderr, "Erro ao enviar informações de usuário para o servidor.\n");
-        cleanup_sync_dir_and_exit(sock, initial_cwd, sync_dir_path, 1);
-    }
-    if (!init_recv_ok || (ack_pkt.type != PKT_ACK && ack_pkt.type != PKT_NACK)) {
-        fprintf(stderr, "Erro ao receber confirmação do servidor ou resposta inesperada.\n");
-        cleanup_sync_dir_and_exit(sock, initial_cwd, sync_dir_path, 1);
-    }
-
-    if (ack_pkt.type == PKT_NACK) {
-        fprintf(stderr, "Servidor recusou a conexão (PKT_NACK). Motivo: %s\n", ack_pkt.payload_size > 0 ? ack_pkt.payload : "Não especificado");
-        cleanup_sync_dir_and_exit(sock, initial_cwd, sync_dir_path, 1);
+    client_conn_configure(user, host, port_str);
+    int sock = client_conn_connect();
+    if (sock < 0) {
+        cleanup_sync_dir_and_exit(-1, initial_cwd, sync_dir_path, sock == -2 ? 1 : 2);
     }
     printf("Conectado ao servidor como '%s'.\n", user);
     fflush(stdout);
 
     printf("Iniciando sincronização inicial com o servidor...\n");
     fflush(stdout);
+    hydrate_init();
     if (perform_initial_sync(sock) != 0) { 
         fprintf(stderr, "Falha durante a sincronização inicial. Alguns arquivos podem estar desatualizados.\n");
         fflush(stderr);
+    } else if (hydrate_enabled()) {
+        printf("Sincronização inicial concluída; o conteúdo dos arquivos é baixado em segundo plano.\n");
+        fflush(stdout);
     } else {
         printf("Sincronização inicial concluída.\n");
         fflush(stdout);
@@ -172,6 +148,7 @@ int main(int argc, char *argv[]) {
         free(sock_ptr_inotify); free(sock_ptr_listener); 
         cleanup_sync_dir_and_exit(sock, initial_cwd, sync_dir_path, 1);
     }
+    hydrate_start(); // With the inotify thread up, its installs are expected
     
     printf("Sessão iniciada para '%s'. Diretório de sincronização: '%s'\n", user, sync_dir_path);
     printf("Monitoramento de arquivos e escuta de atualizações do servidor ativos.\n");
@@ -206,6 +183,15 @@ int main(int argc, char *argv[]) {
             if (strlen(arg) == 0) arg = NULL; // Considera argumento vazio como NULL após trim
         }
 
+        sock = client_conn_sock();
+        int needs_server = strcmp(cmd, "upload") == 0 || strcmp(cmd, "download") == 0 ||
+                           strcmp(cmd, "delete") == 0 || strcmp(cmd, "list_server") == 0;
+        if (needs_server && !client_conn_is_online()) {
+            printf("Sem conexão com o servidor no momento (reconexão em andamento). Tente novamente em instantes.\n");
+            fflush(stdout);
+            continue;
+        }
+
         if (strcmp(cmd, "upload") == 0) {
             if (arg) { // Verifica se arg não é NULL e não é vazio (já tratado acima)
                 char *upload_msg = upload_file_action(arg, sock); 
@@ -236,7 +222,10 @@ int main(int argc, char *argv[]) {
 
     printf("\nEncerrando cliente...\n");
     fflush(stdout);
-    
+
+    // Stops the listener from treating the shutdown below as a lost connection.
+    client_conn_request_shutdown();
+    sock = client_conn_sock();
     if (sock != -1) {
         printf("Desligando o socket...\n"); fflush(stdout);
         if (shutdown(sock, SHUT_RDWR) != 0) {
@@ -244,6 +233,8 @@ int main(int argc, char *argv[]) {
         }
     }
 
+    hydrate_stop(); // A transfer in progress fails with the socket shut down
+
     // É importante que o listener_tid seja encerrado antes de tentar fechar o socket,
     // ou que o close(sock) sinalize o listener para terminar.
     // A ordem atual é shutdown, close, depois join.
@@ -285,6 +276,8 @@ int main(int argc, char *argv[]) {
     sock_ptr_listener = NULL;
 
     pthread_mutex_destroy(&socket_mutex); 
+    trace_shutdown();
+    log_shutdown(); // Every logging thread has finished
 
     printf("Limpando diretório de sincronização: %s\n", sync_dir_path);
     fflush(stdout);
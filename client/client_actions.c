@@ -1,4 +1,11 @@
 #include "client_actions.h"
+#include "client_conn.h"
+#include "client_sync.h"
+#include "client_hydrate.h"
+#include "../common/log.h"
+#include "../common/trace.h"
+#include "../common/batch.h"
+#include "../common/sha256.h"
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h> 
@@ -42,16 +49,16 @@ int remove_directory_recursively(const char *path) {
                     } else {
                         r2 = remove(buf);
                         if (r2 != 0) {
-                            fprintf(stderr, "Erro ao remover arquivo %s: %s\n", buf, strerror(errno));
+                            LOG_ERROR("Erro ao remover arquivo %s: %s\n", buf, strerror(errno));
                         }
                     }
                 } else {
-                     fprintf(stderr, "Erro ao obter stat de %s: %s\n", buf, strerror(errno));
+                     LOG_ERROR("Erro ao obter stat de %s: %s\n", buf, strerror(errno));
                      r2 = -1; 
                 }
                 free(buf);
             } else {
-                fprintf(stderr, "Erro ao alocar memória para buffer de caminho.\n");
+                LOG_ERROR("Erro ao alocar memória para buffer de caminho.\n");
                 r2 = -1; 
             }
             r = r2; 
@@ -67,7 +74,7 @@ int remove_directory_recursively(const char *path) {
     if (r == 0) { 
         if (rmdir(path) != 0) {
             if (errno != ENOENT) { 
-                 fprintf(stderr, "Erro ao remover diretório %s: %s\n", path, strerror(errno));
+                 LOG_ERROR("Erro ao remover diretório %s: %s\n", path, strerror(errno));
                  r = -1;
             } else {
                 r = 0; // Não é erro se já não existe
@@ -77,37 +84,123 @@ int remove_directory_recursively(const char *path) {
     return r; 
 }
 
-int send_and_wait_ack_client(int s, packet_t *p) {
+int make_parent_dirs(const char *path) {
+    char dir[PATH_MAX];
+    if (snprintf(dir, sizeof(dir), "%s", path) >= (int)sizeof(dir)) return -1;
+    for (char *slash = strchr(dir + 1, '/'); slash; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        if (mkdir(dir, 0755) != 0 && errno != EEXIST) return -1;
+        *slash = '/';
+    }
+    return 0;
+}
+
+int sync_temp_path(const char *path, const char *suffix, char *out, size_t len) {
+    const char *base = strrchr(path, '/');
+    base = base ? base + 1 : path;
+    int n = snprintf(out, len, "%.*s.%s.%s", (int)(base - path), path, base, suffix);
+    return (n < 0 || (size_t)n >= len) ? -1 : 0;
+}
+
+int sync_path_join(const char *dir, const char *name, char *out, size_t len) {
+    int n = snprintf(out, len, "%s/%s", dir, name);
+    if (n < 0 || (size_t)n >= len) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    return 0;
+}
+
+void prune_empty_parents(const char *path, const char *root) {
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s", path);
+    size_t root_len = strlen(root);
+    char *slash;
+    while ((slash = strrchr(dir, '/')) != NULL && (size_t)(slash - dir) > root_len) {
+        *slash = '\0';
+        if (rmdir(dir) != 0) break; // Not empty, or not ours to remove
+    }
+}
+
+const char *sync_relative_name(const char *path) {
+    char cwd[PATH_MAX];
+    size_t len;
+    if (getcwd(cwd, sizeof(cwd)) && strncmp(path, cwd, len = strlen(cwd)) == 0 && path[len] == '/' && path[len + 1] != '\0') {
+        return path + len + 1;
+    }
+    const char *base = strrchr(path, '/');
+    return base ? base + 1 : path;
+}
+
+// Receives the reply to a request. The server may have started a push just
+// as the request went out; its first packet then arrives here instead. It is
+// dropped: the server, having read our request in place of the push's ACK,
+// serves the request first and sends the push again afterwards.
+static int recv_reply(int sock, packet_t *reply) {
+    int rc;
+    while ((rc = recv_packet(sock, reply)) == 0 &&
+           (reply->type == PKT_UPLOAD_REQ || reply->type == PKT_DELETE_REQ || reply->type == PKT_BATCH_UPLOAD ||
+            reply->type == PKT_RENAME_REQ)) {
+        LOG_DEBUG("Push do servidor (tipo %d) cruzou com um pedido; descartado.\n", reply->type);
+    }
+    return rc;
+}
+
+// Sends 'p' and waits for its ACK, which is copied to 'reply' when not NULL.
+static int send_and_wait_reply(int s, packet_t *p, packet_t *reply) {
     int result = -1;
-    printf("DEBUG_SWAC: Tentando lock para enviar tipo %d...\n", p->type); fflush(stdout);
+    LOG_DEBUG("DEBUG_SWAC: Tentando lock para enviar tipo %d...\n", p->type);
+    trace_span_t lock_span = trace_begin("client.socket_lock_wait", TRACE_FLOW_NONE);
     pthread_mutex_lock(&socket_mutex); 
-    printf("DEBUG_SWAC: Lock adquirido. Enviando tipo %d...\n", p->type); fflush(stdout);
+    trace_end(&lock_span, NULL);
+    LOG_DEBUG("DEBUG_SWAC: Lock adquirido. Enviando tipo %d...\n", p->type);
+    trace_span_t rtt_span = trace_begin("client.ack_rtt", TRACE_FLOW_NONE);
 
     if (send_packet(s, p) != 0) {
-        fprintf(stderr, "\n[send_and_wait_ack_client] Erro ao enviar pacote tipo %d.\n", p->type);
-        fflush(stderr);
+        LOG_ERROR("\n[send_and_wait_ack_client] Erro ao enviar pacote tipo %d.\n", p->type);
+        client_conn_mark_offline();
     } else {
-        printf("DEBUG_SWAC: Pacote tipo %d enviado. Esperando ACK...\n", p->type); fflush(stdout);
+        LOG_DEBUG("DEBUG_SWAC: Pacote tipo %d enviado. Esperando ACK...\n", p->type);
         packet_t a;
-        if (recv_packet(s, &a) != 0) {
-            printf("DEBUG_SWAC: recv_packet falhou ou conexão fechada esperando ACK para tipo %d.\n", p->type); fflush(stdout);
+        if (recv_reply(s, &a) != 0) {
+            LOG_DEBUG("DEBUG_SWAC: recv_packet falhou ou conexão fechada esperando ACK para tipo %d.\n", p->type);
+            client_conn_mark_offline();
         } else {
-            printf("DEBUG_SWAC: Pacote recebido tipo %d (esperando ACK %d) para request tipo %d.\n", a.type, PKT_ACK, p->type); fflush(stdout);
+            LOG_DEBUG("DEBUG_SWAC: Pacote recebido tipo %d (esperando ACK %d) para request tipo %d.\n", a.type, PKT_ACK, p->type);
             if (a.type == PKT_ACK) {
                 result = 0;
+                if (reply) *reply = a;
             } else {
-                fprintf(stderr, "\n[send_and_wait_ack_client] Resposta inesperada tipo %d para request tipo %d.\n", a.type, p->type);
-                fflush(stderr);
+                LOG_ERROR("\n[send_and_wait_ack_client] Resposta inesperada tipo %d para request tipo %d.\n", a.type, p->type);
             }
         }
     }
 
+    trace_end(&rtt_span, NULL);
     pthread_mutex_unlock(&socket_mutex); 
-    printf("DEBUG_SWAC: Mutex liberado. Retornando %d.\n", result); fflush(stdout);
+    LOG_DEBUG("DEBUG_SWAC: Mutex liberado. Retornando %d.\n", result);
     return result;
 }
 
-char* upload_file_action(const char *full_path_arg, int sock) {
+int send_and_wait_ack_client(int s, packet_t *p) {
+    return send_and_wait_reply(s, p, NULL);
+}
+
+// Hashes the contents of 'fp' into hex. Returns 0 or -1 on a read error.
+static int hash_file(FILE *fp, char hex[SHA256_HEX_LEN + 1]) {
+    sha256_ctx_t ctx;
+    sha256_init(&ctx);
+    char buf[CHUNK_SIZE];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) sha256_update(&ctx, buf, n);
+    if (ferror(fp)) return -1;
+    uint8_t digest[SHA256_DIGEST_LEN];
+    sha256_final(&ctx, digest);
+    sha256_to_hex(digest, hex);
+    return 0;
+}
+
+static char* upload_file(const char *full_path_arg, int sock) {
     //printf("\nDEBUG: upload_file_action iniciado para '%s'.\n", full_path_arg ? full_path_arg : "NULL"); fflush(stdout);
     char *msg = (char*) malloc(CLIENT_MSG_SIZE);
     if (!msg) { return strdup("Erro: Falha ao alocar memória para mensagem."); }
@@ -119,17 +212,21 @@ char* upload_file_action(const char *full_path_arg, int sock) {
         return msg;
     }
 
+    struct stat local_st;
     FILE *fp_check = fopen(full_path_arg, "rb");
-    if (fp_check == NULL) {
+    if (fp_check == NULL || fstat(fileno(fp_check), &local_st) != 0) {
+        if (fp_check) fclose(fp_check);
         snprintf(msg, CLIENT_MSG_SIZE, "Erro ao tentar abrir o arquivo local '%s' para upload (verifique o caminho e permissões).\n", full_path_arg);
         //printf("DEBUG: upload_file_action saindo, fopen falhou para '%s'. Error: %s\n", full_path_arg, strerror(errno)); fflush(stdout);
         return msg;
     }
+    // Large files declare their contents, which the server may already hold
+    char hex[SHA256_HEX_LEN + 1] = "";
+    if (local_st.st_size >= UPLOAD_HASH_MIN_SIZE && hash_file(fp_check, hex) != 0) hex[0] = '\0';
     fclose(fp_check);
 
-    char *base_filename = strrchr(full_path_arg, '/');
-    if (base_filename == NULL) base_filename = (char*)full_path_arg;
-    else base_filename++;
+    // Files under the sync dir keep their place in the tree
+    const char *base_filename = sync_relative_name(full_path_arg);
 
     if (strlen(base_filename) == 0) { 
         snprintf(msg, CLIENT_MSG_SIZE, "Erro: Nome do arquivo base resultante é vazio.\n");
@@ -147,8 +244,23 @@ char* upload_file_action(const char *full_path_arg, int sock) {
     strncpy(rq.payload, base_filename, MAX_PAYLOAD -1);
     rq.payload[MAX_PAYLOAD-1] = '\0';
     rq.payload_size = (uint32_t)strlen(rq.payload) + 1;
+    // The size lets the server preallocate the file
+    int size_len = snprintf(rq.payload + rq.payload_size, MAX_PAYLOAD - rq.payload_size, "%lld", (long long)local_st.st_size);
+    if (size_len > 0 && rq.payload_size + (uint32_t)size_len < MAX_PAYLOAD) {
+        rq.payload_size += (uint32_t)size_len + 1;
+        if (hex[0] != '\0' && rq.payload_size + SHA256_HEX_LEN < MAX_PAYLOAD) {
+            memcpy(rq.payload + rq.payload_size, hex, SHA256_HEX_LEN + 1);
+            rq.payload_size += SHA256_HEX_LEN + 1;
+        }
+    }
 
-    if (send_and_wait_ack_client(sock, &rq) == 0) { 
+    packet_t reply;
+    if (send_and_wait_reply(sock, &rq, &reply) == 0) { 
+        if (reply.payload_size == sizeof(UPLOAD_DEDUPE_REPLY) && memcmp(reply.payload, UPLOAD_DEDUPE_REPLY, sizeof(UPLOAD_DEDUPE_REPLY)) == 0) {
+            LOG_DEBUG("Servidor já tinha o conteúdo de '%s'; nada a enviar.\n", base_filename);
+            free(msg);
+            return (char*)UPLOAD_SUCCESS_MSG;
+        }
         //printf("DEBUG: upload_file_action: PKT_UPLOAD_REQ ACKed. Abrindo arquivo para enviar dados.\n"); fflush(stdout);
         FILE *fp = fopen(full_path_arg, "rb"); 
         if (fp == NULL) { 
@@ -190,6 +302,7 @@ char* upload_file_action(const char *full_path_arg, int sock) {
         pthread_mutex_unlock(&socket_mutex);
 
         if (!send_final_ok) {
+             client_conn_mark_offline();
              snprintf(msg, CLIENT_MSG_SIZE, "Erro: Falha ao enviar pacote final de upload para '%s'.\n", base_filename);
              //printf("DEBUG: upload_file_action terminando com erro ao enviar pacote final.\n"); fflush(stdout);
              return msg;
@@ -205,8 +318,111 @@ char* upload_file_action(const char *full_path_arg, int sock) {
     return msg;
 }
 
-char* delete_file_action(const char *filename, int sock) {
-    printf("DEBUG_DELETE: Iniciando delete_file_action para '%s'\n", filename ? filename : "NULL"); fflush(stdout);
+// Each local change starts a new trace; the id travels with every packet of
+// the transfer (see send_packet) so the server and the other devices can
+// attach their spans to it.
+char* upload_file_action(const char *full_path_arg, int sock) {
+    trace_set_current(trace_new_id());
+    trace_span_t span = trace_begin("client.upload", TRACE_FLOW_START);
+    char *msg = upload_file(full_path_arg, sock);
+    client_conn_note_write();
+    trace_end(&span, full_path_arg);
+    trace_set_current(0);
+    return msg;
+}
+
+// Sends 'n' small files as one PKT_BATCH_UPLOAD (see common/batch.h). The
+// socket stays locked for the whole exchange: the listener must not read the
+// reply. Returns the number of files the server stored, or -1 if the
+// connection failed.
+static int upload_batch(const char **full_paths, const long long *sizes, int n, int sock) {
+    packet_t rq = { .type = PKT_BATCH_UPLOAD, .seq_num = 1 };
+    snprintf(rq.payload, MAX_PAYLOAD, "%d", n);
+    rq.payload_size = (uint32_t)strlen(rq.payload) + 1;
+
+    pthread_mutex_lock(&socket_mutex);
+    packet_t reply;
+    int rc = -1;
+    if (send_packet(sock, &rq) != 0 || recv_reply(sock, &reply) != 0) goto out;
+    if (reply.type != PKT_ACK) {
+        rc = 0;
+        goto out;
+    }
+
+    batch_writer_t w;
+    batch_writer_init(&w, sock, 2);
+    char buf[CHUNK_SIZE];
+    for (int i = 0; i < n; i++) {
+        if (batch_add_file(&w, sync_relative_name(full_paths[i]), (uint64_t)sizes[i]) != 0) goto out;
+        FILE *fp = fopen(full_paths[i], "rb");
+        long long left = sizes[i];
+        size_t n_read;
+        while (fp && left > 0 && (n_read = fread(buf, 1, left < CHUNK_SIZE ? (size_t)left : CHUNK_SIZE, fp)) > 0) {
+            if (batch_write(&w, buf, n_read) != 0) break;
+            left -= (long long)n_read;
+        }
+        if (fp) fclose(fp);
+        if (left > 0) {
+            // Shrunk or gone since it was listed; the next change event resends it
+            LOG_WARN("Arquivo '%s' mudou durante o envio em lote.\n", full_paths[i]);
+            memset(buf, 0, sizeof(buf));
+            while (left > 0 && batch_write(&w, buf, left < CHUNK_SIZE ? (size_t)left : CHUNK_SIZE) == 0) {
+                left -= left < CHUNK_SIZE ? left : CHUNK_SIZE;
+            }
+        }
+    }
+    uint32_t end_seq;
+    if (batch_finish(&w, &end_seq) != 0 || recv_packet(sock, &reply) != 0) goto out;
+    reply.payload[MAX_PAYLOAD - 1] = '\0';
+    rc = (reply.type == PKT_ACK && reply.seq_num == end_seq) ? atoi(reply.payload) : 0;
+
+out:
+    pthread_mutex_unlock(&socket_mutex);
+    if (rc < 0) client_conn_mark_offline();
+    return rc;
+}
+
+int upload_files_action(const char **full_paths, int n, int sock) {
+    const char *batch[BATCH_MAX_FILES];
+    long long sizes[BATCH_MAX_FILES];
+    int in_batch = 0, stored = 0;
+    for (int i = 0; i <= n; i++) {
+        struct stat st;
+        int small = (i < n && stat(full_paths[i], &st) == 0 && S_ISREG(st.st_mode) && st.st_size <= BATCH_MAX_FILE_SIZE);
+        if (small) {
+            batch[in_batch] = full_paths[i];
+            sizes[in_batch++] = (long long)st.st_size;
+        }
+        if (in_batch > 0 && (in_batch == BATCH_MAX_FILES || i == n)) {
+            if (in_batch == 1) {
+                char *msg = upload_file_action(batch[0], sock);
+                if (msg == UPLOAD_SUCCESS_MSG) stored++;
+                else free(msg);
+            } else {
+                trace_set_current(trace_new_id());
+                trace_span_t span = trace_begin("client.batch_upload", TRACE_FLOW_START);
+                int rc = upload_batch(batch, sizes, in_batch, sock);
+                client_conn_note_write();
+                trace_end(&span, NULL);
+                trace_set_current(0);
+                if (rc < 0) return -1;
+                LOG_DEBUG("Lote de %d arquivo(s) enviado; %d gravado(s) pelo servidor.\n", in_batch, rc);
+                stored += rc;
+            }
+            in_batch = 0;
+        }
+        if (i < n && !small) {
+            char *msg = upload_file_action(full_paths[i], sock);
+            if (msg == UPLOAD_SUCCESS_MSG) stored++;
+            else free(msg);
+        }
+        if (!client_conn_is_online()) return -1;
+    }
+    return stored;
+}
+
+static char* delete_file(const char *filename, int sock) {
+    LOG_DEBUG("DEBUG_DELETE: Iniciando delete_file_action para '%s'\n", filename ? filename : "NULL");
     if (!filename || strlen(filename) == 0) return strdup("Erro: Nome do arquivo para exclusão não especificado.\n");
     
     packet_t rq = { .type = PKT_DELETE_REQ, .seq_num = 1 };
@@ -214,12 +430,12 @@ char* delete_file_action(const char *filename, int sock) {
     rq.payload[MAX_PAYLOAD-1] = '\0';
     rq.payload_size = (uint32_t)strlen(rq.payload) + 1;
 
-    printf("DEBUG_DELETE: Chamando send_and_wait_ack_client...\n"); fflush(stdout);
+    LOG_DEBUG("DEBUG_DELETE: Chamando send_and_wait_ack_client...\n");
     if (send_and_wait_ack_client(sock, &rq) == 0) { 
-        printf("DEBUG_DELETE: send_and_wait_ack_client retornou sucesso.\n"); fflush(stdout);
+        LOG_DEBUG("DEBUG_DELETE: send_and_wait_ack_client retornou sucesso.\n");
         return strdup("Solicitação de deleção enviada e confirmada pelo servidor.");
     } else {
-        printf("DEBUG_DELETE: send_and_wait_ack_client retornou erro.\n"); fflush(stdout);
+        LOG_DEBUG("DEBUG_DELETE: send_and_wait_ack_client retornou erro.\n");
         char* msg = (char*)malloc(CLIENT_MSG_SIZE);
         if(msg) snprintf(msg, CLIENT_MSG_SIZE, "Erro: Falha na operação de delete para '%s'.\n", filename);
         else return strdup("Erro na operação de delete e ao alocar msg.");
@@ -227,38 +443,82 @@ char* delete_file_action(const char *filename, int sock) {
     }
 }
 
-void download_file_action(const char *filename, int sock, const char* initial_cwd) {
-    if (!filename || strlen(filename) == 0) { printf("Uso: download <filename.ext>\n"); fflush(stdout); return; }
+char* delete_file_action(const char *filename, int sock) {
+    trace_set_current(trace_new_id());
+    trace_span_t span = trace_begin("client.delete", TRACE_FLOW_START);
+    char *msg = delete_file(filename, sock);
+    client_conn_note_write();
+    trace_end(&span, filename);
+    trace_set_current(0);
+    return msg;
+}
 
+int rename_file_action(const char *from, const char *to, int sock) {
+    size_t from_len = strlen(from) + 1, to_len = strlen(to) + 1;
+    if (from_len + to_len > MAX_PAYLOAD) return -1;
+    packet_t rq = { .type = PKT_RENAME_REQ, .seq_num = 1 };
+    memcpy(rq.payload, from, from_len);
+    memcpy(rq.payload + from_len, to, to_len);
+    rq.payload_size = (uint32_t)(from_len + to_len);
+
+    trace_set_current(trace_new_id());
+    trace_span_t span = trace_begin("client.rename", TRACE_FLOW_START);
+    int rc = send_and_wait_ack_client(sock, &rq);
+    client_conn_note_write();
+    trace_end(&span, to);
+    trace_set_current(0);
+    return rc;
+}
+
+// Listing and downloads go over the read-only session to the replica the
+// primary offered, when there is one (see client_conn_reader_acquire), and a
+// request that fails there is repeated on the primary. The primary socket is
+// shared with the listener, so it is locked per packet; the replica session
+// belongs to the caller until it is released.
+typedef struct {
+    int sock;
+    int replica;
+    int held; // The caller holds socket_mutex for the whole request
+} read_channel_t;
+
+static void channel_lock(const read_channel_t *ch) {
+    if (!ch->replica && !ch->held) pthread_mutex_lock(&socket_mutex);
+}
+
+static void channel_unlock(const read_channel_t *ch) {
+    if (!ch->replica && !ch->held) pthread_mutex_unlock(&socket_mutex);
+}
+
+// Requests 'filename' and writes it to 'path'. Returns the number of bytes
+// received, -1 if the server refused the request (r_ack_type tells how) and
+// -2 if the transfer failed (the partial file is removed).
+static long fetch_file(const read_channel_t *ch, const char *filename, const char *path, int *r_ack_type) {
     packet_t rq = { .type = PKT_DOWNLOAD_REQ, .seq_num = 1 };
     strncpy(rq.payload, filename, MAX_PAYLOAD -1);
     rq.payload[MAX_PAYLOAD-1] = '\0';
     rq.payload_size = (uint32_t)strlen(rq.payload) + 1;
 
-    packet_t r_ack; int initial_req_ok = 0;
-    pthread_mutex_lock(&socket_mutex);
-    if (send_packet(sock, &rq) == 0) {
-        if (recv_packet(sock, &r_ack) == 0 && r_ack.type == PKT_ACK) {
-            initial_req_ok = 1;
-        } else {
-             printf("Erro: Servidor não confirmou o pedido de download para '%s' ou falha na resposta (tipo %d).\n", filename, r_ack.type);
-             if(r_ack.type == PKT_NACK) printf("Servidor respondeu com NACK (arquivo pode não existir ou erro no servidor).\n");
-        }
-    } else printf("Erro ao enviar requisição de download para '%s'.\n", filename);
-    pthread_mutex_unlock(&socket_mutex);
-    fflush(stdout); 
-    if (!initial_req_ok) return;
+    packet_t r_ack = { .type = PKT_NACK }; int initial_req_ok = 0;
+    channel_lock(ch);
+    if (send_packet(ch->sock, &rq) == 0) {
+        if (recv_reply(ch->sock, &r_ack) == 0 && r_ack.type == PKT_ACK) initial_req_ok = 1;
+    } else r_ack.type = -1;
+    channel_unlock(ch);
+    if (r_ack_type) *r_ack_type = r_ack.type;
+    if (!initial_req_ok) return -1;
 
-    char download_path[PATH_MAX];
-    snprintf(download_path, PATH_MAX, "%s/%s", initial_cwd, filename);
-    FILE *fp = fopen(download_path, "wb");
-    if (!fp) { printf("Erro ao abrir o arquivo '%s' (em %s) para escrita.\n", filename, initial_cwd); fflush(stdout); return; }
-    printf("Baixando '%s' para '%s'...\n", filename, download_path); fflush(stdout);
+    FILE *fp = fopen(path, "wb");
+    if (!fp && errno == ENOENT && make_parent_dirs(path) == 0) fp = fopen(path, "wb");
+    if (!fp) {
+        LOG_ERROR("Erro ao abrir o arquivo '%s' para escrita.\n", path);
+        return -2;
+    }
 
-    int download_successful = 0; packet_t dp; dp.payload_size = 1; 
-    while (dp.payload_size != 0) { 
-        int error_in_loop = 0; pthread_mutex_lock(&socket_mutex);
-        if (recv_packet(sock, &dp) != 0) { error_in_loop = 1;
+    int download_successful = 0; packet_t dp; dp.payload_size = 1;
+    long bytes_downloaded = 0;
+    while (dp.payload_size != 0) {
+        int error_in_loop = 0; channel_lock(ch);
+        if (recv_packet(ch->sock, &dp) != 0) { error_in_loop = 1;
         } else {
             if (dp.type != PKT_DOWNLOAD_DATA) { error_in_loop = 1;
             } else {
@@ -266,72 +526,175 @@ void download_file_action(const char *filename, int sock, const char* initial_cw
                 else {
                     if (fwrite(dp.payload, 1, dp.payload_size, fp) != dp.payload_size) error_in_loop = 1;
                     else {
+                        bytes_downloaded += dp.payload_size;
                         packet_t ca = { .type = PKT_ACK, .seq_num = dp.seq_num, .payload_size = 0 };
-                        if (send_packet(sock, &ca) != 0) error_in_loop = 1;
+                        if (send_packet(ch->sock, &ca) != 0) error_in_loop = 1;
                     }
                 }
             }
         }
-        pthread_mutex_unlock(&socket_mutex);
-        if (error_in_loop || dp.payload_size == 0) break; 
-    } 
+        channel_unlock(ch);
+        if (error_in_loop || dp.payload_size == 0) break;
+    }
     fclose(fp);
-    if(download_successful) printf("Download de '%s' concluído.\n", filename);
-    else { printf("Download de '%s' falhou ou foi incompleto.\n", filename); remove(download_path); }
-    fflush(stdout);
+    if (!download_successful) {
+        remove(path);
+        return -2;
+    }
+    return bytes_downloaded;
 }
 
-void list_server_files_action(int sock) {
-    //printf("\nDEBUG: Dentro de list_server_files_action(). Tentando mutex...\n"); fflush(stdout);
-    packet_t rq = { .type = PKT_LIST_SERVER_REQ, .seq_num = 1, .payload_size = 0 };
-    packet_t res; int success = 0;
+static long fetch_file_replica(const char *filename, const char *path, int *r_ack_type) {
+    read_channel_t ch = { .sock = client_conn_reader_acquire(), .replica = 1 };
+    if (ch.sock < 0) return -1;
+    long got = fetch_file(&ch, filename, path, r_ack_type);
+    client_conn_reader_release(got < 0);
+    if (got < 0) LOG_DEBUG("Download de '%s' falhou na réplica; repetindo no primário.\n", filename);
+    return got;
+}
+
+static long fetch_file_offloaded(int sock, const char *filename, const char *path, int *r_ack_type) {
+    long got = fetch_file_replica(filename, path, r_ack_type);
+    if (got >= 0) return got;
+    read_channel_t ch = { .sock = sock, .replica = 0 };
+    return fetch_file(&ch, filename, path, r_ack_type);
+}
 
+long download_whole_file(int sock, const char *filename, const char *path, int *r_ack_type) {
+    long got = fetch_file_replica(filename, path, r_ack_type);
+    if (got >= 0) return got;
+    read_channel_t bg = { .sock = client_conn_background_acquire(), .replica = 1 };
+    if (bg.sock >= 0) {
+        got = fetch_file(&bg, filename, path, r_ack_type);
+        client_conn_background_release(got == -2);
+        if (got != -2) return got; // The primary's answer, refusals included
+    }
+    read_channel_t ch = { .sock = sock, .replica = 0, .held = 1 };
     pthread_mutex_lock(&socket_mutex);
-    //printf("DEBUG: Mutex adquirido em list_server_files_action(). Enviando request...\n"); fflush(stdout);
-    if (send_packet(sock, &rq) == 0) {
-        //printf("DEBUG: Request enviado. Esperando resposta...\n"); fflush(stdout);
-        if (recv_packet(sock, &res) == 0 && res.type == PKT_LIST_SERVER_RES) {
-            //printf("DEBUG: Resposta recebida. Tipo: %d, Tamanho: %u\n", res.type, res.payload_size); fflush(stdout);
+    got = fetch_file(&ch, filename, path, r_ack_type);
+    pthread_mutex_unlock(&socket_mutex);
+    return got;
+}
+
+// Streams the listing (see LIST_STREAM_REQUEST) into a NUL-terminated
+// buffer the caller frees. The primary socket stays locked for the whole
+// stream. Returns 0 or -1.
+static int fetch_list(const read_channel_t *ch, char **list, size_t *len) {
+    packet_t rq = { .type = PKT_LIST_SERVER_REQ, .seq_num = 1, .payload_size = sizeof(LIST_STREAM_REQUEST) };
+    memcpy(rq.payload, LIST_STREAM_REQUEST, sizeof(LIST_STREAM_REQUEST));
+    size_t used = 0, cap = CHUNK_SIZE + 1;
+    char *buf = malloc(cap);
+    int success = 0;
+    if (!buf) return -1;
+    channel_lock(ch);
+    packet_t res;
+    int rc = send_packet(ch->sock, &rq) == 0 ? recv_reply(ch->sock, &res) : -1;
+    while (rc == 0 && res.type == PKT_LIST_SERVER_RES) {
+        if (res.payload_size == 0) { // End of the stream
             success = 1;
-        } else {
-            //if (res.type != PKT_LIST_SERVER_RES && res.type != 0) { 
-            //     printf("DEBUG: Erro ao receber resposta ou tipo inesperado (recebido tipo %d, esperado %d).\n", res.type, PKT_LIST_SERVER_RES); fflush(stdout);
-            //} else { 
-            //     printf("DEBUG: Falha no recv_packet ao esperar resposta para list_server.\n"); fflush(stdout);
-            //}
+            break;
         }
-    } else {
-        //printf("DEBUG: Erro ao enviar request PKT_LIST_SERVER_REQ.\n"); fflush(stdout);
+        if (used + res.payload_size + 1 > cap) {
+            char *grown = realloc(buf, cap * 2);
+            if (!grown) break;
+            buf = grown;
+            cap *= 2;
+        }
+        memcpy(buf + used, res.payload, res.payload_size);
+        used += res.payload_size;
+        rc = recv_packet(ch->sock, &res);
     }
-    pthread_mutex_unlock(&socket_mutex);
-    //printf("DEBUG: Mutex liberado em list_server_files_action().\n"); fflush(stdout);
+    channel_unlock(ch);
+    if (!success) {
+        free(buf);
+        return -1;
+    }
+    buf[used] = '\0';
+    *list = buf;
+    *len = used;
+    return 0;
+}
+
+static int fetch_list_offloaded(int sock, char **list, size_t *len) {
+    read_channel_t ch = { .sock = client_conn_reader_acquire(), .replica = 1 };
+    if (ch.sock >= 0) {
+        int rc = fetch_list(&ch, list, len);
+        client_conn_reader_release(rc != 0);
+        if (rc == 0) return 0;
+        LOG_DEBUG("Listagem falhou na réplica; repetindo no primário.\n");
+    }
+    ch.sock = sock;
+    ch.replica = 0;
+    return fetch_list(&ch, list, len);
+}
+
+void download_file_action(const char *filename, int sock, const char* initial_cwd) {
+    if (!filename || strlen(filename) == 0) { printf("Uso: download <filename.ext>\n"); fflush(stdout); return; }
+
+    // Into the starting directory itself, whatever directory it is under here
+    hydrate_prioritize(filename); // Wanted now: the sync dir's copy too
+    const char *base = strrchr(filename, '/');
+    char download_path[PATH_MAX];
+    if (sync_path_join(initial_cwd, base ? base + 1 : filename, download_path, PATH_MAX) != 0) {
+        printf("Caminho de destino longo demais para '%s'.\n", filename); fflush(stdout);
+        return;
+    }
+    printf("Baixando '%s' para '%s'...\n", filename, download_path); fflush(stdout);
+
+    int r_ack_type = PKT_NACK;
+    long got = fetch_file_offloaded(sock, filename, download_path, &r_ack_type);
+    if (got == -1) {
+        if (r_ack_type == -1) printf("Erro ao enviar requisição de download para '%s'.\n", filename);
+        else {
+            printf("Erro: Servidor não confirmou o pedido de download para '%s' ou falha na resposta (tipo %d).\n", filename, r_ack_type);
+            if (r_ack_type == PKT_NACK) printf("Servidor respondeu com NACK (arquivo pode não existir ou erro no servidor).\n");
+        }
+    } else if (got >= 0) printf("Download de '%s' concluído.\n", filename);
+    else printf("Download de '%s' falhou ou foi incompleto.\n", filename);
+    fflush(stdout);
+}
 
-    if (success) {
-        if (res.payload_size > 0) {
-            printf("Arquivos no servidor:\n"); fwrite(res.payload, 1, res.payload_size, stdout);
+void list_server_files_action(int sock) {
+    char *list;
+    size_t len;
+    if (fetch_list_offloaded(sock, &list, &len) == 0) {
+        if (len > 0) {
+            printf("Arquivos no servidor:\n"); fwrite(list, 1, len, stdout);
         } else printf("Nenhum arquivo no diretório do servidor ou diretório vazio.\n");
+        free(list);
     } else printf("Erro ao obter la lista de arquivos do servidor.\n");
     fflush(stdout);
 }
 
-void list_client_files_action(void) {
-    DIR *d = opendir(".");
+// Lists the files under 'dir' (relative to the sync dir, "." for its root).
+static void list_client_dir(const char *dir) {
+    DIR *d = opendir(dir);
     if (!d) { perror("Erro ao abrir o diretório sync_dir local"); return; }
-    printf("Arquivos no diretório sync_dir local:\n");
     struct dirent *e; struct stat st;
     while ((e = readdir(d))) {
         if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0) continue;
-        if (stat(e->d_name, &st) == 0) {
-            printf("%s\t%ld bytes\t mtime: %ld atime: %ld ctime: %ld\n",
-                   e->d_name, (long)st.st_size, (long)st.st_mtime, (long)st.st_atime, (long)st.st_ctime);
-        } else printf("%s\t (não foi possível obter informações)\n", e->d_name);
+        char path[PATH_MAX];
+        if (strcmp(dir, ".") == 0) snprintf(path, sizeof(path), "%s", e->d_name);
+        else if (sync_path_join(dir, e->d_name, path, sizeof(path)) != 0) continue;
+        if (lstat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+            list_client_dir(path);
+        } else if (stat(path, &st) == 0) {
+            printf("%s\t%ld bytes\t mtime: %ld atime: %ld ctime: %ld%s\n",
+                   path, (long)st.st_size, (long)st.st_mtime, (long)st.st_atime, (long)st.st_ctime,
+                   hydrate_is_placeholder(path) ? "\t(conteúdo ainda não baixado)" : "");
+        } else printf("%s\t (não foi possível obter informações)\n", path);
     }
     closedir(d);
+}
+
+void list_client_files_action(void) {
+    printf("Arquivos no diretório sync_dir local:\n");
+    list_client_dir(".");
     fflush(stdout);
 }
 
 int download_file_to_sync_dir(const char *filename, long expected_size_server, int sock) {
-    printf("Sincronizando arquivo do servidor: '%s'\n", filename); fflush(stdout);
+    LOG_DEBUG("Sincronizando arquivo do servidor: '%s'\n", filename);
 
     struct stat st;
     long local_size = -1;
@@ -340,156 +703,92 @@ int download_file_to_sync_dir(const char *filename, long expected_size_server, i
     }
 
     if (local_size == expected_size_server && expected_size_server != 0) { // Don't skip 0-byte files if server has 0-byte and local doesn't exist
-        printf("Arquivo '%s' local já está sincronizado (tamanho: %ld bytes).\n", filename, local_size);
-        fflush(stdout);
+        LOG_DEBUG("Arquivo '%s' local já está sincronizado (tamanho: %ld bytes).\n", filename, local_size);
         return 0; 
     }
     if (local_size == -1 && expected_size_server == 0) { // Server has 0-byte, local doesn't exist -> download 0-byte
-         printf("Arquivo '%s' (0 bytes) ausente localmente. Baixando.\n", filename);
+         LOG_DEBUG("Arquivo '%s' (0 bytes) ausente localmente. Baixando.\n", filename);
     } else {
-        printf("Baixando '%s' do servidor (Servidor: %ld bytes, Local: %ld bytes).\n", filename, expected_size_server, local_size);
+        LOG_DEBUG("Baixando '%s' do servidor (Servidor: %ld bytes, Local: %ld bytes).\n", filename, expected_size_server, local_size);
     }
     fflush(stdout);
 
-    packet_t rq = { .type = PKT_DOWNLOAD_REQ, .seq_num = 1 };
-    strncpy(rq.payload, filename, MAX_PAYLOAD -1);
-    rq.payload[MAX_PAYLOAD-1] = '\0';
-    rq.payload_size = (uint32_t)strlen(rq.payload) + 1;
-
-    packet_t r_ack; int initial_req_ok = 0;
-    pthread_mutex_lock(&socket_mutex);
-    if (send_packet(sock, &rq) == 0) {
-        if (recv_packet(sock, &r_ack) == 0 && r_ack.type == PKT_ACK) {
-            initial_req_ok = 1;
-        } else {
-             fprintf(stderr, "Erro: Servidor não confirmou pedido de download para '%s' (sync) ou falha (tipo %d).\n", filename, r_ack.type);
-             if(r_ack.type == PKT_NACK) fprintf(stderr, "Servidor respondeu com NACK (sync).\n");
-             fflush(stderr);
+    // Renamed into place once complete, as a change the inotify thread must not send back
+    char tmp_path[PATH_MAX];
+    if (sync_temp_path(filename, "sync", tmp_path, sizeof(tmp_path)) != 0) return -1;
+    int r_ack_type = PKT_NACK;
+    long bytes_downloaded = fetch_file_offloaded(sock, filename, tmp_path, &r_ack_type);
+    if (bytes_downloaded == -1) {
+        if (r_ack_type == -1) LOG_ERROR("Erro ao enviar requisição de download para '%s' (sync).\n", filename);
+        else {
+            LOG_ERROR("Erro: Servidor não confirmou pedido de download para '%s' (sync) ou falha (tipo %d).\n", filename, r_ack_type);
+            if (r_ack_type == PKT_NACK) LOG_ERROR("Servidor respondeu com NACK (sync).\n");
         }
-    } else {
-        fprintf(stderr, "Erro ao enviar requisição de download para '%s' (sync).\n", filename);
-        fflush(stderr);
-    }
-    pthread_mutex_unlock(&socket_mutex);
-
-    if (!initial_req_ok) return -1;
-
-    FILE *fp = fopen(filename, "wb"); 
-    if (!fp) {
-        fprintf(stderr, "Erro ao abrir o arquivo local '%s' para escrita (sync).\n", filename);
-        fflush(stderr);
         return -1;
     }
 
-    int download_successful = 0; packet_t dp; dp.payload_size = 1; 
-    long bytes_downloaded = 0;
-    while (dp.payload_size != 0) { 
-        int error_in_loop = 0; pthread_mutex_lock(&socket_mutex);
-        if (recv_packet(sock, &dp) != 0) { error_in_loop = 1;
-        } else {
-            if (dp.type != PKT_DOWNLOAD_DATA) { error_in_loop = 1;
-            } else {
-                if (dp.payload_size == 0) download_successful = 1;
-                else {
-                    if (fwrite(dp.payload, 1, dp.payload_size, fp) != dp.payload_size) error_in_loop = 1;
-                    else {
-                        bytes_downloaded += dp.payload_size;
-                        packet_t ca = { .type = PKT_ACK, .seq_num = dp.seq_num, .payload_size = 0 };
-                        if (send_packet(sock, &ca) != 0) error_in_loop = 1;
-                    }
-                }
-            }
-        }
-        pthread_mutex_unlock(&socket_mutex);
-        if (error_in_loop || dp.payload_size == 0) break; 
-    } 
-    fclose(fp);
-
-    if(download_successful && bytes_downloaded == expected_size_server) {
-         printf("Arquivo '%s' sincronizado com sucesso (%ld bytes).\n", filename, bytes_downloaded);
-         fflush(stdout);
+    if (bytes_downloaded == expected_size_server && sync_install(tmp_path, filename) == 0) {
+         LOG_DEBUG("Arquivo '%s' sincronizado com sucesso (%ld bytes).\n", filename, bytes_downloaded);
          return 0;
     } else {
-         fprintf(stderr, "Sincronização de '%s' falhou ou incompleta (baixado %ld de %ld bytes).\n", filename, bytes_downloaded, expected_size_server);
-         fflush(stderr);
-         remove(filename); 
+         LOG_ERROR("Sincronização de '%s' falhou ou incompleta (baixado %ld de %ld bytes).\n", filename, bytes_downloaded > 0 ? bytes_downloaded : 0, expected_size_server);
+         if (bytes_downloaded >= 0) remove(tmp_path);
          return -1;
     }
 }
 
 int perform_initial_sync(int sock) {
-    printf("Iniciando Sincronização Inicial...\n"); fflush(stdout);
-    packet_t rq_list = { .type = PKT_LIST_SERVER_REQ, .seq_num = 1, .payload_size = 0 };
-    packet_t res_list;
-    int success_listing = 0;
-
-    pthread_mutex_lock(&socket_mutex);
-    if (send_packet(sock, &rq_list) == 0) {
-        if (recv_packet(sock, &res_list) == 0 && res_list.type == PKT_LIST_SERVER_RES) {
-            success_listing = 1;
-        } else {
-            fprintf(stderr, "Falha ao receber lista de arquivos do servidor para sync inicial.\n");
-            fflush(stderr);
-        }
-    } else {
-        fprintf(stderr, "Falha ao enviar pedido de lista de arquivos para sync inicial.\n");
-        fflush(stderr);
-    }
-    pthread_mutex_unlock(&socket_mutex);
-
-    if (!success_listing) {
-        fprintf(stderr, "Não foi possível obter a lista de arquivos do servidor. Sincronização inicial abortada.\n");
-        fflush(stderr);
+    LOG_INFO("Iniciando Sincronização Inicial...\n");
+    char *payload_copy;
+    size_t list_len;
+    if (fetch_list_offloaded(sock, &payload_copy, &list_len) != 0) {
+        LOG_ERROR("Não foi possível obter a lista de arquivos do servidor. Sincronização inicial abortada.\n");
         return -1;
     }
 
-    if (res_list.payload_size == 0) {
-        printf("Servidor não possui arquivos para este usuário. Nada a sincronizar.\n");
-        fflush(stdout);
+    if (list_len == 0) {
+        LOG_INFO("Servidor não possui arquivos para este usuário. Nada a sincronizar.\n");
+        free(payload_copy);
         return 0;
     }
 
-    char *payload_copy = malloc(res_list.payload_size + 1);
-    if (!payload_copy) {
-        fprintf(stderr, "Falha ao alocar memória para payload_copy em initial_sync.\n");
-        return -1;
-    }
-    memcpy(payload_copy, res_list.payload, res_list.payload_size);
-    payload_copy[res_list.payload_size] = '\0'; 
-
     char *line_saveptr;
     char *line = strtok_r(payload_copy, "\n", &line_saveptr);
-    int overall_sync_status = 0; 
+    int overall_sync_status = 0, queued = 0;
 
     while (line != NULL) {
-        char filename[MAX_PAYLOAD / 2]; 
+        char filename[PATH_MAX]; 
         long size_on_server;
         long mtime_server, atime_server, ctime_server; 
 
-        int items_parsed = sscanf(line, "%[^\t]\t%ld bytes\tmtime:%ld\tatime:%ld\tctime:%ld",
+        int items_parsed = sscanf(line, "%4095[^\t]\t%ld bytes\tmtime:%ld\tatime:%ld\tctime:%ld",
                                   filename, &size_on_server, &mtime_server, &atime_server, &ctime_server);
 
         if (items_parsed == 5) {
             //printf("Verificando arquivo do servidor: '%s', tamanho: %ld\n", filename, size_on_server);
             //fflush(stdout);
-            if (download_file_to_sync_dir(filename, size_on_server, sock) != 0) {
+            // Lazily, a missing file only gets its placeholder here
+            int lazy = hydrate_enabled() && size_on_server > 0 ? hydrate_add(filename, size_on_server, (time_t)mtime_server) : 0;
+            if (lazy > 0) {
+                queued++;
+            } else if (lazy < 0 || download_file_to_sync_dir(filename, size_on_server, sock) != 0) {
                 //fprintf(stderr, "Falha ao sincronizar o arquivo: %s\n", filename);
                 //fflush(stderr);
                 overall_sync_status = -1; 
             }
         } else {
-            fprintf(stderr, "Erro ao parsear linha da lista do servidor: %s\n", line);
-            fflush(stderr);
+            LOG_ERROR("Erro ao parsear linha da lista do servidor: %s\n", line);
             overall_sync_status = -1;
         }
         line = strtok_r(NULL, "\n", &line_saveptr);
     }
     free(payload_copy);
+    if (queued > 0) LOG_INFO("%d arquivo(s) na fila para download em segundo plano.\n", queued);
 
     if (overall_sync_status == 0) {
-        printf("Sincronização inicial de arquivos concluída.\n");
+        LOG_INFO("Sincronização inicial de arquivos concluída.\n");
     } else {
-        printf("Sincronização inicial de arquivos concluída com uma ou mais falhas.\n");
+        LOG_INFO("Sincronização inicial de arquivos concluída com uma ou mais falhas.\n");
     }
     fflush(stdout);
     return overall_sync_status;
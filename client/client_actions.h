@@ -11,11 +11,44 @@ extern pthread_mutex_t socket_mutex;
 
 int send_and_wait_ack_client(int s, packet_t *p); 
 char* upload_file_action(const char *full_path_arg, int sock);
+// Uploads several files: the small ones travel in batches (PKT_BATCH_UPLOAD),
+// the others one by one. Returns how many the server stored, or -1 if the
+// connection was lost.
+int upload_files_action(const char **full_paths, int n, int sock);
 char* delete_file_action(const char *filename, int sock);
+// Asks the server to rename a file it holds. Returns 0 once it did, -1 if it
+// refused (it lacks the old file) or the connection failed.
+int rename_file_action(const char *from, const char *to, int sock);
 void download_file_action(const char *filename, int sock, const char* initial_cwd); 
 void list_server_files_action(int sock);
 void list_client_files_action(void);
 
+// The name a local file has on the server: its path relative to the sync
+// dir (the working directory) when it is under it, its base name otherwise.
+// Points into 'path'.
+const char *sync_relative_name(const char *path);
+// Creates the missing directories leading to 'path'. Returns 0 or -1.
+int make_parent_dirs(const char *path);
+// Removes the directories leading to 'path' that are left empty, stopping
+// at 'root' (not removed), which must be a prefix of 'path'.
+void prune_empty_parents(const char *path, const char *root);
+// Writes to 'out' a hidden name next to 'path' ("dir/.name.<suffix>") for
+// a file written there before it is renamed into place: the inotify thread
+// ignores hidden names. Returns 0, or -1 if it does not fit.
+int sync_temp_path(const char *path, const char *suffix, char *out, size_t len);
+// Writes "<dir>/<name>" to 'out'. Returns 0, or -1 (ENAMETOOLONG) if it
+// does not fit.
+int sync_path_join(const char *dir, const char *name, char *out, size_t len);
+
+// Downloads 'filename' into 'path' for a background transfer, over the
+// replica or the primary's background session (client_conn.h). Without
+// either it falls back to the primary socket and, unlike the requests above,
+// which lock it per packet, keeps it locked for the whole file, so the
+// listener never reads the file's data as a push. Returns the bytes
+// received, -1 if the server refused the request (r_ack_type tells how) and
+// -2 if the transfer failed.
+long download_whole_file(int sock, const char *filename, const char *path, int *r_ack_type);
+
 int download_file_to_sync_dir(const char *filename, long expected_size, int sock); 
 int perform_initial_sync(int sock);
 int remove_directory_recursively(const char *path);
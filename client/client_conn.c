@@ -0,0 +1,431 @@
+#include "client_conn.h"
+#include "client_actions.h" // For socket_mutex
+#include "../common/log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+static char conn_user[MAX_PAYLOAD];
+static char conn_host[256];   // Node currently serving this user (may come from a redirect)
+static char conn_port[16];
+static char seed_host[256];   // Address given on the command line
+static char seed_port[16];
+// Replica group members learned from the handshake ACK ("host:port")
+static char replica_addrs[CLIENT_MAX_REPLICAS][sizeof(conn_host) + sizeof(conn_port)];
+static int  replica_count = 0;
+static int  replica_next = 0;
+
+// Read offload: replica the primary offered for listing and downloads. The
+// connection is opened on first use; reader_mutex is held for a whole read.
+static pthread_mutex_t reader_mutex = PTHREAD_MUTEX_INITIALIZER;
+static char     reader_addr[sizeof(replica_addrs[0])]; // "" = reads go to the primary
+static int      reader_sock = -1;
+static uint64_t reader_retry_ns = 0; // Replica refused or failed; not retried before this
+
+// Background transfers: a read-only session of their own on the primary.
+// Only the hydration thread uses it; conn_state_mutex guards the descriptor
+// against client_conn_request_shutdown.
+static int      background_sock = -1;
+static char     background_addr[sizeof(replica_addrs[0])]; // Node it was opened on
+static uint64_t background_retry_ns = 0;
+
+static pthread_mutex_t conn_state_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int conn_sock = -1;
+static int conn_online = 0;
+static int conn_shutdown = 0;
+static uint64_t last_write_ns = 0;
+
+static uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+void client_conn_configure(const char *user, const char *host, const char *port) {
+    snprintf(conn_user, sizeof(conn_user), "%s", user);
+    snprintf(conn_host, sizeof(conn_host), "%s", host);
+    snprintf(conn_port, sizeof(conn_port), "%s", port);
+    snprintf(seed_host, sizeof(seed_host), "%s", host);
+    snprintf(seed_port, sizeof(seed_port), "%s", port);
+}
+
+static int open_tcp_connection(const char *host, const char *port) {
+    struct addrinfo hints, *servinfo, *p_servaddr;
+    int sock = -1;
+
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+
+    int rv_getaddr = getaddrinfo(host, port, &hints, &servinfo);
+    if (rv_getaddr != 0) {
+        LOG_ERROR("getaddrinfo: %s\n", gai_strerror(rv_getaddr));
+        return -1;
+    }
+
+    for (p_servaddr = servinfo; p_servaddr != NULL; p_servaddr = p_servaddr->ai_next) {
+        if ((sock = socket(p_servaddr->ai_family, p_servaddr->ai_socktype, p_servaddr->ai_protocol)) == -1) {
+            continue;
+        }
+        if (connect(sock, p_servaddr->ai_addr, p_servaddr->ai_addrlen) == -1) {
+            close(sock);
+            sock = -1;
+            continue;
+        }
+        break;
+    }
+    freeaddrinfo(servinfo);
+    if (sock >= 0) packet_set_nodelay(sock);
+    return sock;
+}
+
+// Stores the comma-separated member list sent by a replica group leader.
+static void remember_replicas(const char *list) {
+    int count = 0;
+    const char *p = list;
+    while (*p && *p != '\n' && count < CLIENT_MAX_REPLICAS) {
+        size_t len = strcspn(p, ",\n");
+        if (len > 0 && len < sizeof(replica_addrs[0])) {
+            memcpy(replica_addrs[count], p, len);
+            replica_addrs[count][len] = '\0';
+            count++;
+        }
+        p += len;
+        if (*p == ',') p++;
+    }
+    replica_count = count;
+    replica_next = 0;
+}
+
+// Switches reads to the replica named in a handshake ACK ("" for none).
+static void remember_reader(const char *addr, size_t len) {
+    pthread_mutex_lock(&reader_mutex);
+    if (len >= sizeof(reader_addr)) len = 0;
+    if (strncmp(reader_addr, addr, len) != 0 || reader_addr[len] != '\0') {
+        if (reader_sock >= 0) {
+            packet_set_compression(reader_sock, 0);
+            close(reader_sock);
+        }
+        reader_sock = -1;
+        reader_retry_ns = 0;
+        memcpy(reader_addr, addr, len);
+        reader_addr[len] = '\0';
+    }
+    pthread_mutex_unlock(&reader_mutex);
+}
+
+// Whether a handshake ACK accepted our compression offer.
+static int ack_accepts_compression(const char *payload) {
+    size_t offer_len = strlen(PACKET_COMPRESS_OFFER);
+    for (const char *line = payload; *line; ) {
+        size_t len = strcspn(line, "\n");
+        if (len == offer_len && strncmp(line, PACKET_COMPRESS_OFFER, len) == 0) return 1;
+        line += len;
+        if (*line == '\n') line++;
+    }
+    return 0;
+}
+
+// Parses the "key=value" lines of a handshake ACK.
+static void parse_handshake_ack(const char *payload) {
+    const char *reader = "";
+    size_t reader_len = 0;
+    for (const char *line = payload; *line; ) {
+        size_t len = strcspn(line, "\n");
+        if (strncmp(line, "replicas=", 9) == 0) {
+            remember_replicas(line + 9);
+        } else if (strncmp(line, "reader=", 7) == 0) {
+            reader = line + 7;
+            reader_len = len - 7;
+        }
+        line += len;
+        if (*line == '\n') line++;
+    }
+    remember_reader(reader, reader_len);
+}
+
+// Points conn_host/conn_port at the next known replica. Returns 0 if there is none.
+static int next_replica(void) {
+    while (replica_count > 0) {
+        const char *addr = replica_addrs[replica_next];
+        replica_next = (replica_next + 1) % replica_count;
+        char host[sizeof(conn_host)], port[sizeof(conn_port)];
+        if (parse_host_port(addr, host, sizeof(host), port, sizeof(port)) != 0) continue;
+        if (strcmp(host, conn_host) == 0 && strcmp(port, conn_port) == 0 && replica_count > 1) continue;
+        snprintf(conn_host, sizeof(conn_host), "%s", host);
+        snprintf(conn_port, sizeof(conn_port), "%s", port);
+        return 1;
+    }
+    return 0;
+}
+
+// One connection attempt to conn_host:conn_port. Returns the socket, -1 on
+// network error, -2 on PKT_NACK and -3 after a redirect (conn_host/conn_port
+// then point at the node to try next).
+static int connect_once(void) {
+    int sock = open_tcp_connection(conn_host, conn_port);
+    if (sock < 0) {
+        LOG_ERROR("Cliente: falha ao conectar a %s:%s após tentar todos os endereços.\n", conn_host, conn_port);
+        return -1;
+    }
+
+    packet_t init_pkt = { .type = PKT_GET_SYNC_DIR, .seq_num = 1 };
+    strncpy(init_pkt.payload, conn_user, MAX_PAYLOAD - 1);
+    init_pkt.payload[MAX_PAYLOAD - 1] = '\0';
+    init_pkt.payload_size = (uint32_t)strlen(init_pkt.payload) + 1;
+    packet_offer_compression(&init_pkt);
+
+    packet_t ack_pkt;
+    if (send_packet(sock, &init_pkt) != 0) {
+        LOG_ERROR("Erro ao enviar informações de usuário para o servidor.\n");
+        close(sock);
+        return -1;
+    }
+    if (recv_packet(sock, &ack_pkt) != 0 ||
+        (ack_pkt.type != PKT_ACK && ack_pkt.type != PKT_NACK && ack_pkt.type != PKT_REDIRECT)) {
+        LOG_ERROR("Erro ao receber confirmação do servidor ou resposta inesperada.\n");
+        close(sock);
+        return -1;
+    }
+    if (ack_pkt.type == PKT_NACK) {
+        ack_pkt.payload[MAX_PAYLOAD - 1] = '\0';
+        LOG_ERROR("Servidor recusou a conexão (PKT_NACK). Motivo: %s\n", ack_pkt.payload_size > 0 ? ack_pkt.payload : "Não especificado");
+        close(sock);
+        return -2;
+    }
+    if (ack_pkt.type == PKT_REDIRECT) {
+        ack_pkt.payload[MAX_PAYLOAD - 1] = '\0';
+        close(sock);
+        char host[sizeof(conn_host)], port[sizeof(conn_port)];
+        if (parse_host_port(ack_pkt.payload, host, sizeof(host), port, sizeof(port)) != 0) {
+            LOG_ERROR("Redirecionamento inválido recebido do servidor: '%s'\n", ack_pkt.payload);
+            return -1;
+        }
+        LOG_INFO("Usuário '%s' é atendido por %s:%s; redirecionando.\n", conn_user, host, port);
+        snprintf(conn_host, sizeof(conn_host), "%s", host);
+        snprintf(conn_port, sizeof(conn_port), "%s", port);
+        return -3;
+    }
+
+    ack_pkt.payload[ack_pkt.payload_size < MAX_PAYLOAD ? ack_pkt.payload_size : MAX_PAYLOAD - 1] = '\0';
+    parse_handshake_ack(ack_pkt.payload);
+    packet_set_compression(sock, ack_accepts_compression(ack_pkt.payload));
+    client_conn_set_sock(sock);
+    return sock;
+}
+
+int client_conn_connect(void) {
+    int replicas_tried = 0;
+    for (int hops = 0; hops <= CLIENT_MAX_REDIRECTS; hops++) {
+        int rc = connect_once();
+        if (rc == -3) continue;
+        if (rc == -1 && replicas_tried < replica_count && next_replica()) {
+            // The leader may have failed over; any member will point us at the new one
+            replicas_tried++;
+            hops--;
+            LOG_INFO("Tentando a réplica %s:%s.\n", conn_host, conn_port);
+            continue;
+        }
+        if (rc == -1 && replica_count == 0 &&
+            (strcmp(conn_host, seed_host) != 0 || strcmp(conn_port, seed_port) != 0)) {
+            // The node we were redirected to is gone; ask the seed again next time
+            snprintf(conn_host, sizeof(conn_host), "%s", seed_host);
+            snprintf(conn_port, sizeof(conn_port), "%s", seed_port);
+        }
+        return rc;
+    }
+    LOG_ERROR("Muitos redirecionamentos ao conectar como '%s'.\n", conn_user);
+    return -1;
+}
+
+int client_conn_sock(void) {
+    pthread_mutex_lock(&conn_state_mutex);
+    int sock = conn_sock;
+    pthread_mutex_unlock(&conn_state_mutex);
+    return sock;
+}
+
+void client_conn_set_sock(int sock) {
+    pthread_mutex_lock(&conn_state_mutex);
+    conn_sock = sock;
+    conn_online = (sock >= 0);
+    pthread_mutex_unlock(&conn_state_mutex);
+}
+
+int client_conn_is_online(void) {
+    pthread_mutex_lock(&conn_state_mutex);
+    int online = conn_online;
+    pthread_mutex_unlock(&conn_state_mutex);
+    return online;
+}
+
+void client_conn_mark_offline(void) {
+    pthread_mutex_lock(&conn_state_mutex);
+    conn_online = 0;
+    pthread_mutex_unlock(&conn_state_mutex);
+}
+
+void client_conn_request_shutdown(void) {
+    pthread_mutex_lock(&conn_state_mutex);
+    conn_shutdown = 1;
+    if (background_sock >= 0) shutdown(background_sock, SHUT_RDWR); // Ends a transfer in progress
+    pthread_mutex_unlock(&conn_state_mutex);
+}
+
+int client_conn_shutting_down(void) {
+    pthread_mutex_lock(&conn_state_mutex);
+    int s = conn_shutdown;
+    pthread_mutex_unlock(&conn_state_mutex);
+    return s;
+}
+
+// Sleeps in short slices so a shutdown request interrupts the backoff quickly.
+static void backoff_sleep(int ms) {
+    while (ms > 0 && !client_conn_shutting_down()) {
+        int slice = ms < 100 ? ms : 100;
+        struct timespec ts = { .tv_sec = 0, .tv_nsec = (long)slice * 1000000L };
+        nanosleep(&ts, NULL);
+        ms -= slice;
+    }
+}
+
+int client_conn_reconnect(void) {
+    client_conn_mark_offline();
+
+    // Hold socket_mutex while swapping sockets so no thread is mid-exchange
+    // on the old descriptor when it gets closed.
+    pthread_mutex_lock(&socket_mutex);
+    int old_sock = client_conn_sock();
+    if (old_sock >= 0) {
+        packet_set_compression(old_sock, 0);
+        close(old_sock);
+    }
+    client_conn_set_sock(-1);
+    pthread_mutex_unlock(&socket_mutex);
+
+    int delay_ms = RECONNECT_BACKOFF_INITIAL_MS;
+    while (!client_conn_shutting_down()) {
+        LOG_INFO("\n[Reconexão] Tentando reconectar a %s:%s em %d ms...\n", conn_host, conn_port, delay_ms);
+        backoff_sleep(delay_ms);
+        if (client_conn_shutting_down()) break;
+
+        pthread_mutex_lock(&socket_mutex);
+        int sock = client_conn_connect();
+        pthread_mutex_unlock(&socket_mutex);
+        if (sock >= 0) {
+            LOG_INFO("\n[Reconexão] Reconectado ao servidor como '%s'.\n", conn_user);
+            return sock;
+        }
+
+        delay_ms *= 2;
+        if (delay_ms > RECONNECT_BACKOFF_MAX_MS) delay_ms = RECONNECT_BACKOFF_MAX_MS;
+    }
+    return -1;
+}
+
+// Opens a read-only session for this user on 'addr' ("host:port").
+static int open_read_session(const char *addr) {
+    char host[sizeof(conn_host)], port[sizeof(conn_port)];
+    if (parse_host_port(addr, host, sizeof(host), port, sizeof(port)) != 0) return -1;
+    int sock = open_tcp_connection(host, port);
+    if (sock < 0) return -1;
+
+    packet_t init_pkt = { .type = PKT_READ_SESSION, .seq_num = 1 };
+    snprintf(init_pkt.payload, MAX_PAYLOAD, "%s", conn_user);
+    init_pkt.payload_size = (uint32_t)strlen(init_pkt.payload) + 1;
+    packet_offer_compression(&init_pkt);
+    packet_t ack_pkt;
+    if (send_packet(sock, &init_pkt) != 0 || recv_packet(sock, &ack_pkt) != 0 || ack_pkt.type != PKT_ACK) {
+        close(sock);
+        return -1;
+    }
+    ack_pkt.payload[ack_pkt.payload_size < MAX_PAYLOAD ? ack_pkt.payload_size : MAX_PAYLOAD - 1] = '\0';
+    packet_set_compression(sock, ack_accepts_compression(ack_pkt.payload));
+    return sock;
+}
+
+// Opens the read-only session on reader_addr. Called with reader_mutex held.
+static int open_reader(void) {
+    int sock = open_read_session(reader_addr);
+    if (sock >= 0) LOG_INFO("Leituras de '%s' servidas pela réplica %s.\n", conn_user, reader_addr);
+    return sock;
+}
+
+int client_conn_reader_acquire(void) {
+    pthread_mutex_lock(&conn_state_mutex);
+    uint64_t written = last_write_ns;
+    pthread_mutex_unlock(&conn_state_mutex);
+    uint64_t now = monotonic_ns();
+    if (written != 0 && now - written < (uint64_t)CLIENT_READ_FENCE_MS * 1000000ull) return -1;
+
+    pthread_mutex_lock(&reader_mutex);
+    if (reader_sock < 0 && reader_addr[0] != '\0' && now >= reader_retry_ns) {
+        reader_sock = open_reader();
+        if (reader_sock < 0) reader_retry_ns = now + (uint64_t)CLIENT_READER_RETRY_MS * 1000000ull;
+    }
+    if (reader_sock < 0) {
+        pthread_mutex_unlock(&reader_mutex);
+        return -1;
+    }
+    return reader_sock;
+}
+
+void client_conn_reader_release(int failed) {
+    if (failed && reader_sock >= 0) {
+        // Stale or gone; the primary serves reads until the retry pause ends
+        packet_set_compression(reader_sock, 0);
+        close(reader_sock);
+        reader_sock = -1;
+        reader_retry_ns = monotonic_ns() + (uint64_t)CLIENT_READER_RETRY_MS * 1000000ull;
+    }
+    pthread_mutex_unlock(&reader_mutex);
+}
+
+static void close_background(void) {
+    pthread_mutex_lock(&conn_state_mutex);
+    int sock = background_sock;
+    background_sock = -1;
+    pthread_mutex_unlock(&conn_state_mutex);
+    packet_set_compression(sock, 0);
+    close(sock);
+}
+
+int client_conn_background_acquire(void) {
+    char addr[sizeof(background_addr)];
+    pthread_mutex_lock(&socket_mutex); // conn_host changes on redirects, under this lock
+    snprintf(addr, sizeof(addr), "%s:%s", conn_host, conn_port);
+    pthread_mutex_unlock(&socket_mutex);
+    if (background_sock >= 0 && strcmp(addr, background_addr) != 0) close_background(); // Primary moved
+
+    uint64_t now = monotonic_ns();
+    if (background_sock < 0 && now >= background_retry_ns && !client_conn_shutting_down()) {
+        int sock = open_read_session(addr);
+        if (sock >= 0) {
+            memcpy(background_addr, addr, sizeof(addr));
+            pthread_mutex_lock(&conn_state_mutex);
+            background_sock = sock;
+            if (conn_shutdown) shutdown(sock, SHUT_RDWR);
+            pthread_mutex_unlock(&conn_state_mutex);
+        } else {
+            // Reads not served there (e.g. -R 0); transfers share the primary socket meanwhile
+            background_retry_ns = now + (uint64_t)CLIENT_READER_RETRY_MS * 1000000ull;
+        }
+    }
+    return background_sock;
+}
+
+void client_conn_background_release(int failed) {
+    if (failed && background_sock >= 0) close_background();
+}
+
+void client_conn_note_write(void) {
+    pthread_mutex_lock(&conn_state_mutex);
+    last_write_ns = monotonic_ns();
+    pthread_mutex_unlock(&conn_state_mutex);
+}
@@ -0,0 +1,63 @@
+#ifndef CLIENT_CONN_H
+#define CLIENT_CONN_H
+
+#include "../common/packet.h"
+
+#define RECONNECT_BACKOFF_INITIAL_MS 500
+#define RECONNECT_BACKOFF_MAX_MS     30000
+#define CLIENT_MAX_REDIRECTS         4
+#define CLIENT_MAX_REPLICAS          8
+#define CLIENT_READ_FENCE_MS         2000 // Reads stay on the primary this long after a write
+#define CLIENT_READER_RETRY_MS       5000 // Pause before retrying a replica that failed a read
+
+// Remembers user/host/port so the connection can be re-established later.
+void client_conn_configure(const char *user, const char *host, const char *port);
+
+// Opens a TCP connection to the configured server and runs the PKT_GET_SYNC_DIR
+// handshake, following PKT_REDIRECT answers from cluster nodes and replica
+// followers. A replica group leader lists its members in the handshake ACK
+// ("replicas=" line); when the current node cannot be reached, the others are
+// tried in turn before giving up. The handshake also offers wire compression
+// (packet.h) and enables it on the socket when the server accepts. Returns
+// the socket on success, -1 on network error and -2 if the server rejected
+// the session (PKT_NACK).
+int client_conn_connect(void);
+
+// Current socket (may be stale if the connection was lost).
+int client_conn_sock(void);
+void client_conn_set_sock(int sock);
+
+// Connection state. Transport errors mark the connection offline; the
+// listener thread is responsible for bringing it back.
+int  client_conn_is_online(void);
+void client_conn_mark_offline(void);
+
+// Reconnects with exponential backoff until it succeeds or shutdown is
+// requested. Re-runs the handshake. Returns the new socket or -1 on shutdown.
+int client_conn_reconnect(void);
+
+// Read offload. A primary may name a replica in its handshake ACK ("reader="
+// line); listing and downloads then go over a separate read-only session to
+// it. acquire returns that session's socket, held exclusively until release,
+// or -1 when reads must use the primary: no replica offered, the replica
+// failed recently, or this client wrote within CLIENT_READ_FENCE_MS (which
+// must not be shorter than the server's staleness bound, so a client always
+// reads its own writes). release(1) drops a session that failed a request.
+int  client_conn_reader_acquire(void);
+void client_conn_reader_release(int failed);
+// Background transfers (see client_hydrate.h) go over a read-only session of
+// their own on the primary, so a long download never holds up the requests
+// and pushes on the main socket. Only one thread may use it. acquire opens it
+// if needed and returns -1 when the primary does not serve one (it is then
+// retried after CLIENT_READER_RETRY_MS); release(1) drops a session that
+// failed a transfer.
+int  client_conn_background_acquire(void);
+void client_conn_background_release(int failed);
+// Records that an upload or delete just completed (starts the read fence).
+void client_conn_note_write(void);
+
+// Signals that the client is exiting; stops any reconnect loop.
+void client_conn_request_shutdown(void);
+int  client_conn_shutting_down(void);
+
+#endif // CLIENT_CONN_H
@@ -0,0 +1,347 @@
+#include "client_hydrate.h"
+#include "client_actions.h"
+#include "client_conn.h"
+#include "client_sync.h"
+#include "../common/log.h"
+#include "../common/packet.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+// A queued file. The hash table finds it by name; the heap orders the ones
+// still waiting.
+typedef struct hydrate_entry {
+    struct hydrate_entry *next;
+    char     *name;
+    long long size;    // The server's copy
+    time_t    mtime;
+    uint64_t  boost;   // When it was asked for, 0 if never: the latest first
+    long      heap_at; // -1 while being fetched
+    int       dropped; // Left the queue while being fetched
+    dev_t     dev;     // The placeholder
+    ino_t     ino;
+    struct timespec stamp;
+} hydrate_entry_t;
+
+static int lazy = 1;
+static hydrate_entry_t *table[HYDRATE_BUCKETS];
+static hydrate_entry_t **heap;
+static long heap_count, heap_cap;
+static hydrate_entry_t *in_flight;
+static uint64_t boost_seq;
+static int stopping, started;
+static pthread_t hydrate_tid;
+static pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_changed = PTHREAD_COND_INITIALIZER;
+
+void hydrate_init(void) {
+    const char *v = getenv("SYNC_HYDRATE");
+    lazy = (v && strcmp(v, "lazy") == 0);
+}
+
+int hydrate_enabled(void) {
+    return lazy;
+}
+
+static hydrate_entry_t **slot_of(const char *name) {
+    unsigned h = 2166136261u;
+    for (const char *c = name; *c; c++) h = (h ^ (unsigned char)*c) * 16777619u;
+    hydrate_entry_t **e = &table[h % HYDRATE_BUCKETS];
+    while (*e && strcmp((*e)->name, name) != 0) e = &(*e)->next;
+    return e;
+}
+
+static void unchain_locked(hydrate_entry_t *e) {
+    hydrate_entry_t **slot = slot_of(e->name);
+    if (*slot == e) *slot = e->next;
+}
+
+static int before(const hydrate_entry_t *a, const hydrate_entry_t *b) {
+    if (a->boost != b->boost) return a->boost > b->boost;
+    time_t slot_a = a->mtime / HYDRATE_RECENCY_SLOT, slot_b = b->mtime / HYDRATE_RECENCY_SLOT;
+    if (slot_a != slot_b) return slot_a > slot_b;
+    if (a->size != b->size) return a->size < b->size;
+    return a->mtime > b->mtime;
+}
+
+static void heap_swap(long i, long j) {
+    hydrate_entry_t *t = heap[i];
+    heap[i] = heap[j];
+    heap[j] = t;
+    heap[i]->heap_at = i;
+    heap[j]->heap_at = j;
+}
+
+static void heap_fix(long i) {
+    while (i > 0 && before(heap[i], heap[(i - 1) / 2])) {
+        heap_swap(i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+    for (;;) {
+        long first = i, l = 2 * i + 1, r = 2 * i + 2;
+        if (l < heap_count && before(heap[l], heap[first])) first = l;
+        if (r < heap_count && before(heap[r], heap[first])) first = r;
+        if (first == i) return;
+        heap_swap(i, first);
+        i = first;
+    }
+}
+
+static int heap_push(hydrate_entry_t *e) {
+    if (heap_count == heap_cap) {
+        long cap = heap_cap ? heap_cap * 2 : 1024;
+        hydrate_entry_t **grown = realloc(heap, (size_t)cap * sizeof(*grown));
+        if (!grown) return -1;
+        heap = grown;
+        heap_cap = cap;
+    }
+    e->heap_at = heap_count;
+    heap[heap_count++] = e;
+    heap_fix(e->heap_at);
+    return 0;
+}
+
+static void heap_remove(hydrate_entry_t *e) {
+    long i = e->heap_at;
+    e->heap_at = -1;
+    if (i < 0) return;
+    if (i != --heap_count) {
+        heap[i] = heap[heap_count];
+        heap[i]->heap_at = i;
+        heap_fix(i);
+    }
+}
+
+static void free_entry(hydrate_entry_t *e) {
+    free(e->name);
+    free(e);
+}
+
+// Takes 'e' off the queue; the thread frees the one it is fetching.
+static void drop_locked(hydrate_entry_t *e) {
+    unchain_locked(e);
+    if (e == in_flight) {
+        e->dropped = 1;
+        return;
+    }
+    heap_remove(e);
+    free_entry(e);
+}
+
+static int untouched(const hydrate_entry_t *e) {
+    struct stat st;
+    return lstat(e->name, &st) == 0 && S_ISREG(st.st_mode) && st.st_size == 0 && st.st_dev == e->dev &&
+           st.st_ino == e->ino && st.st_mtim.tv_sec == e->stamp.tv_sec && st.st_mtim.tv_nsec == e->stamp.tv_nsec;
+}
+
+int hydrate_add(const char *name, long long size, time_t mtime) {
+    if (!lazy) return 0;
+    pthread_mutex_lock(&queue_mutex);
+    hydrate_entry_t *e = *slot_of(name);
+    if (e) {
+        e->size = size;
+        e->mtime = mtime;
+        if (e->heap_at >= 0) heap_fix(e->heap_at);
+        pthread_mutex_unlock(&queue_mutex);
+        return 1;
+    }
+    pthread_mutex_unlock(&queue_mutex);
+    struct stat st;
+    if (lstat(name, &st) == 0 || errno != ENOENT) return 0;
+
+    // Made under a hidden name and renamed into place queued already, so the
+    // inotify thread never sees it as a new empty file
+    char tmp_path[PATH_MAX];
+    if (sync_temp_path(name, "placeholder", tmp_path, sizeof(tmp_path)) != 0) return -1;
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0 && errno == ENOENT && make_parent_dirs(tmp_path) == 0) {
+        fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    }
+    if (fd < 0) {
+        LOG_ERROR("Erro ao criar o arquivo provisório de '%s': %s\n", name, strerror(errno));
+        return -1;
+    }
+    struct timespec times[2] = { { .tv_sec = mtime }, { .tv_sec = mtime } };
+    int ok = futimens(fd, times) == 0 && fstat(fd, &st) == 0;
+    close(fd);
+    if (ok && !(e = calloc(1, sizeof(*e)))) ok = 0;
+    if (ok && !(e->name = strdup(name))) ok = 0;
+    if (!ok) {
+        free(e);
+        unlink(tmp_path);
+        return -1;
+    }
+    e->size = size;
+    e->mtime = mtime;
+    e->dev = st.st_dev;
+    e->ino = st.st_ino;
+    e->stamp = st.st_mtim;
+
+    pthread_mutex_lock(&queue_mutex);
+    hydrate_entry_t **slot = slot_of(name);
+    int rc = -1;
+    if (!*slot && heap_push(e) == 0) {
+        *slot = e;
+        if (rename(tmp_path, name) == 0) {
+            pthread_cond_signal(&queue_changed);
+            rc = 1;
+        } else {
+            LOG_ERROR("Erro ao criar o arquivo provisório de '%s': %s\n", name, strerror(errno));
+            unchain_locked(e);
+            heap_remove(e);
+        }
+    }
+    pthread_mutex_unlock(&queue_mutex);
+    if (rc < 0) {
+        free_entry(e);
+        unlink(tmp_path);
+    }
+    return rc;
+}
+
+void hydrate_prioritize(const char *name) {
+    if (!lazy) return;
+    pthread_mutex_lock(&queue_mutex);
+    hydrate_entry_t *e = *slot_of(name);
+    if (e && e->heap_at >= 0) {
+        e->boost = ++boost_seq;
+        heap_fix(e->heap_at);
+        LOG_DEBUG("'%s' passou para o início da fila de downloads.\n", name);
+    }
+    pthread_mutex_unlock(&queue_mutex);
+}
+
+int hydrate_is_placeholder(const char *name) {
+    if (!lazy) return 0;
+    pthread_mutex_lock(&queue_mutex);
+    hydrate_entry_t *e = *slot_of(name);
+    int placeholder = e && untouched(e);
+    if (e && !placeholder) drop_locked(e);
+    pthread_mutex_unlock(&queue_mutex);
+    return placeholder;
+}
+
+// Renames 'e', whose name starts with the directory or file 'from'.
+static void rename_entry_locked(hydrate_entry_t *e, const char *from, const char *to) {
+    size_t from_len = strlen(from);
+    size_t len = strlen(to) + strlen(e->name + from_len) + 1;
+    char *renamed = malloc(len);
+    if (!renamed) return;
+    snprintf(renamed, len, "%s%s", to, e->name + from_len);
+    unchain_locked(e);
+    free(e->name);
+    e->name = renamed;
+    hydrate_entry_t *replaced = *slot_of(renamed);
+    if (replaced) drop_locked(replaced); // Overwritten by the one moved here
+    e->next = NULL;
+    *slot_of(renamed) = e;
+}
+
+void hydrate_rename(const char *from, const char *to) {
+    if (!lazy) return;
+    pthread_mutex_lock(&queue_mutex);
+    // Collected first: renaming one may drop another, which reorders the heap
+    size_t from_len = strlen(from), count = 0;
+    hydrate_entry_t **moving = malloc((size_t)(heap_count + 1) * sizeof(*moving));
+    for (long i = 0; moving && i <= heap_count; i++) {
+        hydrate_entry_t *e = i < heap_count ? heap[i] : in_flight;
+        if (e && !e->dropped && strncmp(e->name, from, from_len) == 0 && (e->name[from_len] == '\0' || e->name[from_len] == '/')) {
+            moving[count++] = e;
+        }
+    }
+    for (size_t i = 0; i < count; i++) rename_entry_locked(moving[i], from, to);
+    free(moving);
+    pthread_mutex_unlock(&queue_mutex);
+}
+
+static void wait_locked(int ms) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += ms / 1000;
+    ts.tv_nsec += (long)(ms % 1000) * 1000000L;
+    if (ts.tv_nsec >= 1000000000L) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+    }
+    pthread_cond_timedwait(&queue_changed, &queue_mutex, &ts);
+}
+
+static void *hydrate_thread(void *arg) {
+    (void)arg;
+    long fetched = 0;
+    pthread_mutex_lock(&queue_mutex);
+    while (!stopping) {
+        if (heap_count == 0 || !client_conn_is_online()) {
+            if (heap_count == 0 && fetched > 0) {
+                LOG_INFO("\n[Hidratação] Conteúdo de %ld arquivo(s) baixado em segundo plano.\n", fetched);
+                fetched = 0;
+            }
+            wait_locked(200); // Reconnects are not signalled
+            continue;
+        }
+        hydrate_entry_t *e = heap[0];
+        heap_remove(e);
+        if (!untouched(e)) { // Written, replaced or deleted meanwhile
+            drop_locked(e);
+            continue;
+        }
+        in_flight = e;
+        char name[PATH_MAX], tmp_path[PATH_MAX];
+        snprintf(name, sizeof(name), "%s", e->name);
+        pthread_mutex_unlock(&queue_mutex);
+
+        int r_ack_type = PKT_NACK;
+        long got = -2;
+        if (sync_temp_path(name, "hydrate", tmp_path, sizeof(tmp_path)) == 0) {
+            got = download_whole_file(client_conn_sock(), name, tmp_path, &r_ack_type);
+        }
+
+        pthread_mutex_lock(&queue_mutex);
+        in_flight = NULL;
+        if (e->dropped) {
+            if (got >= 0) unlink(tmp_path);
+            free_entry(e);
+            continue;
+        }
+        if (got >= 0 || r_ack_type == PKT_NACK) {
+            // The placeholder may have been renamed meanwhile; e->name follows it
+            if (got >= 0 && untouched(e) && sync_install(tmp_path, e->name) == 0) fetched++;
+            else if (got >= 0) unlink(tmp_path);
+            else LOG_WARN("\n[Hidratação] Servidor recusou '%s'; o arquivo provisório fica vazio.\n", name);
+            unchain_locked(e);
+            free_entry(e);
+            continue;
+        }
+        // Lost the connection, or the transfer: it waits its turn again
+        if (heap_push(e) != 0) drop_locked(e);
+        wait_locked(HYDRATE_RETRY_MS);
+    }
+    pthread_mutex_unlock(&queue_mutex);
+    return NULL;
+}
+
+void hydrate_start(void) {
+    if (!lazy) return;
+    if (pthread_create(&hydrate_tid, NULL, hydrate_thread, NULL) != 0) {
+        LOG_ERROR("Falha ao iniciar os downloads em segundo plano: %s\n", strerror(errno));
+        return;
+    }
+    started = 1;
+}
+
+void hydrate_stop(void) {
+    if (!started) return;
+    pthread_mutex_lock(&queue_mutex);
+    stopping = 1;
+    pthread_cond_broadcast(&queue_changed);
+    pthread_mutex_unlock(&queue_mutex);
+    pthread_join(hydrate_tid, NULL);
+    started = 0;
+}
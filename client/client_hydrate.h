@@ -0,0 +1,47 @@
+#ifndef CLIENT_HYDRATE_H
+#define CLIENT_HYDRATE_H
+
+#include <time.h>
+
+// Lazy initial sync, with SYNC_HYDRATE=lazy in the environment (by default
+// every file is downloaded before the client starts). The initial sync then
+// creates each file missing locally as an empty placeholder, carrying the
+// server's mtime, and queues its contents; the REPL and the watchers start
+// right away while a background thread fetches the queue. Recently changed files come first and, among files changed in
+// the same HYDRATE_RECENCY_SLOT, the smaller ones, so most files are usable
+// soonest. A file asked for (the download command, or any program opening
+// its placeholder) jumps to the front.
+//
+// A placeholder is replaced only while untouched: once written to it is a
+// local file like any other, and an untouched one is never uploaded. Until
+// then other programs see it empty, which is why the mode is opt-in.
+
+#define HYDRATE_RECENCY_SLOT (24 * 3600) // Seconds
+#define HYDRATE_BUCKETS      65536
+#define HYDRATE_RETRY_MS     1000        // Pause after a failed transfer
+
+// Reads SYNC_HYDRATE; call before the initial sync.
+void hydrate_init(void);
+int  hydrate_enabled(void);
+
+// Queues the contents of 'name' (relative to the sync dir), whose server
+// copy has 'size' bytes and 'mtime', creating its placeholder. A name
+// already queued gets the new size and mtime. Returns 1 if queued, 0 if
+// 'name' is a local file (nothing to queue) and -1 if the placeholder
+// could not be created.
+int  hydrate_add(const char *name, long long size, time_t mtime);
+
+// Starts the thread that fetches the queue, once the others run; stop
+// waits for it, after client_conn_request_shutdown.
+void hydrate_start(void);
+void hydrate_stop(void);
+
+// Moves 'name', if queued, to the front of the queue.
+void hydrate_prioritize(const char *name);
+// Returns 1 if 'name' is a placeholder still waiting for its contents. A
+// queued file found changed leaves the queue: the local file took over.
+int  hydrate_is_placeholder(const char *name);
+// Follows a rename of a file, or of a directory and the files under it.
+void hydrate_rename(const char *from, const char *to);
+
+#endif // CLIENT_HYDRATE_H
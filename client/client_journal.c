@@ -0,0 +1,180 @@
+#include "client_journal.h"
+#include "client_actions.h"
+#include "client_conn.h"
+#include "client_hydrate.h"
+#include "../common/log.h"
+#include "../common/batch.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <errno.h>
+#include <pthread.h>
+
+typedef struct {
+    char op;
+    char filename[PATH_MAX];
+} journal_entry_t;
+
+static pthread_mutex_t journal_mutex = PTHREAD_MUTEX_INITIALIZER;
+static char journal_path[PATH_MAX];
+static char replay_path[PATH_MAX + 8];
+
+void journal_init(const char *path) {
+    pthread_mutex_lock(&journal_mutex);
+    snprintf(journal_path, sizeof(journal_path), "%s", path);
+    snprintf(replay_path, sizeof(replay_path), "%s.replay", path);
+    unlink(journal_path);
+    unlink(replay_path);
+    pthread_mutex_unlock(&journal_mutex);
+}
+
+int journal_record(char op, const char *filename) {
+    if (!filename || filename[0] == '\0') return -1;
+    pthread_mutex_lock(&journal_mutex);
+    FILE *f = fopen(journal_path, "a");
+    if (!f) {
+        LOG_ERROR("[Journal] fopen: %s", strerror(errno));
+        pthread_mutex_unlock(&journal_mutex);
+        return -1;
+    }
+    fprintf(f, "%c\t%s\n", op, filename);
+    fflush(f);
+    fsync(fileno(f));
+    fclose(f);
+    pthread_mutex_unlock(&journal_mutex);
+    LOG_INFO("\n[Journal] Operação '%c' para '%s' registrada para reenvio após reconexão.\n", op, filename);
+    return 0;
+}
+
+// Appends the entries found in 'path' to the dynamic array. Missing file is not an error.
+static int load_entries(const char *path, journal_entry_t **entries, size_t *count, size_t *cap) {
+    FILE *f = fopen(path, "r");
+    if (!f) return (errno == ENOENT) ? 0 : -1;
+
+    char line[PATH_MAX + 4];
+    while (fgets(line, sizeof(line), f)) {
+        size_t len = strlen(line);
+        if (len > 0 && line[len - 1] == '\n') line[--len] = '\0';
+        if (len < 3 || line[1] != '\t') continue;
+        if (line[0] != JOURNAL_OP_UPLOAD && line[0] != JOURNAL_OP_DELETE) continue;
+
+        if (*count == *cap) {
+            size_t new_cap = *cap ? *cap * 2 : 64;
+            journal_entry_t *grown = realloc(*entries, new_cap * sizeof(journal_entry_t));
+            if (!grown) { fclose(f); return -1; }
+            *entries = grown;
+            *cap = new_cap;
+        }
+        (*entries)[*count].op = line[0];
+        snprintf((*entries)[*count].filename, PATH_MAX, "%s", line + 2);
+        (*count)++;
+    }
+    fclose(f);
+    return 0;
+}
+
+// Keeps only the last operation per filename, preserving the order of those last occurrences.
+static size_t coalesce_entries(journal_entry_t *entries, size_t count) {
+    size_t kept = 0;
+    for (size_t i = 0; i < count; i++) {
+        int superseded = 0;
+        for (size_t j = i + 1; j < count; j++) {
+            if (strcmp(entries[i].filename, entries[j].filename) == 0) { superseded = 1; break; }
+        }
+        if (!superseded) entries[kept++] = entries[i];
+    }
+    return kept;
+}
+
+// Atomically rewrites 'path' with the given entries (temp file + rename).
+static int write_entries(const char *path, const journal_entry_t *entries, size_t count) {
+    if (count == 0) {
+        return (unlink(path) == 0 || errno == ENOENT) ? 0 : -1;
+    }
+    char tmp_path[PATH_MAX + 16];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    FILE *f = fopen(tmp_path, "w");
+    if (!f) return -1;
+    for (size_t i = 0; i < count; i++) {
+        fprintf(f, "%c\t%s\n", entries[i].op, entries[i].filename);
+    }
+    fflush(f);
+    fsync(fileno(f));
+    fclose(f);
+    return rename(tmp_path, path);
+}
+
+int journal_replay(int sock, const char *sync_dir_abs_path) {
+    journal_entry_t *entries = NULL;
+    size_t count = 0, cap = 0;
+
+    // Move the live journal into the replay file so new offline changes
+    // recorded while replaying are not lost when the replay file is rewritten.
+    pthread_mutex_lock(&journal_mutex);
+    int load_ok = load_entries(replay_path, &entries, &count, &cap) == 0 &&
+                  load_entries(journal_path, &entries, &count, &cap) == 0;
+    if (load_ok) {
+        count = coalesce_entries(entries, count);
+        load_ok = write_entries(replay_path, entries, count) == 0;
+        if (load_ok) unlink(journal_path);
+    }
+    pthread_mutex_unlock(&journal_mutex);
+
+    if (!load_ok) {
+        LOG_ERROR("[Journal] Falha ao carregar o journal de operações pendentes.\n");
+        free(entries);
+        return -1;
+    }
+    if (count == 0) {
+        free(entries);
+        return 0;
+    }
+
+    LOG_INFO("\n[Journal] Reenviando %zu operação(ões) pendente(s)...\n", count);
+
+    size_t done = 0;
+    while (done < count && client_conn_is_online()) {
+        size_t batch_end = done + JOURNAL_REPLAY_BATCH;
+        if (batch_end > count) batch_end = count;
+
+        while (done < batch_end) {
+            journal_entry_t *e = &entries[done];
+            if (e->op == JOURNAL_OP_UPLOAD) {
+                // Consecutive uploads go out together (small files in batches)
+                static char paths_buf[BATCH_MAX_FILES][PATH_MAX];
+                const char *paths[BATCH_MAX_FILES];
+                size_t run_end = done;
+                int n_paths = 0;
+                while (run_end < batch_end && entries[run_end].op == JOURNAL_OP_UPLOAD && n_paths < BATCH_MAX_FILES) {
+                    // Removed locally since, or never fetched: nothing to send
+                    if (sync_path_join(sync_dir_abs_path, entries[run_end].filename, paths_buf[n_paths], PATH_MAX) == 0 &&
+                        access(paths_buf[n_paths], F_OK) == 0 && !hydrate_is_placeholder(entries[run_end].filename)) {
+                        paths[n_paths] = paths_buf[n_paths];
+                        n_paths++;
+                    }
+                    run_end++;
+                }
+                if (n_paths > 0 && upload_files_action(paths, n_paths, sock) < 0) break;
+                done = run_end;
+                continue;
+            } else {
+                char *msg = delete_file_action(e->filename, sock);
+                free(msg);
+            }
+            // A server-side rejection is final; only a lost connection keeps the entry.
+            if (!client_conn_is_online()) break;
+            done++;
+        }
+
+        pthread_mutex_lock(&journal_mutex);
+        write_entries(replay_path, entries + done, count - done);
+        pthread_mutex_unlock(&journal_mutex);
+    }
+
+    size_t remaining = count - done;
+    LOG_INFO("\n[Journal] Reenvio concluído: %zu enviada(s), %zu pendente(s).\n", done, remaining);
+    free(entries);
+    return (int)remaining;
+}
@@ -0,0 +1,25 @@
+#ifndef CLIENT_JOURNAL_H
+#define CLIENT_JOURNAL_H
+
+#define JOURNAL_OP_UPLOAD 'U'
+#define JOURNAL_OP_DELETE 'D'
+#define JOURNAL_REPLAY_BATCH 32
+
+// Offline change journal. Local changes that could not reach the server are
+// appended to a file (one "<op>\t<filename>" line each) and replayed after a
+// reconnect, so an outage does not require a full resync.
+
+// Sets the journal file path. Any previous journal content is discarded
+// since the sync_dir it refers to is recreated at startup.
+void journal_init(const char *journal_path);
+
+// Appends an operation and flushes it to disk. Returns 0 on success.
+int journal_record(char op, const char *filename);
+
+// Replays pending operations against the server in batches, keeping only the
+// newest operation per file. Stops early if the connection drops; unreplayed
+// entries stay in the journal. Returns the number of entries still pending,
+// or -1 on I/O error.
+int journal_replay(int sock, const char *sync_dir_abs_path);
+
+#endif // CLIENT_JOURNAL_H
@@ -1,5 +1,10 @@
 #include "client_sync.h"
 #include "client_actions.h" 
+#include "client_conn.h"
+#include "client_journal.h"
+#include "client_hydrate.h"
+#include "../common/log.h"
+#include "../common/trace.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -8,31 +13,135 @@
 #include <errno.h>      
 #include <pthread.h>
 #include <sys/select.h> 
+#include <poll.h>
 #include <sys/time.h>   
+#include <sys/stat.h>
+#include <time.h>
+#include <stdatomic.h>
 
 
 void inotify_cleanup_handler(void *arg) {
     int fd = *(int*)arg;
     if (fd >= 0) { 
-        printf("\n[Inotify Thread] Cleanup: Fechando inotify_fd %d\n", fd);
-        fflush(stdout);
+        LOG_DEBUG("\n[Inotify Thread] Cleanup: Fechando inotify_fd %d\n", fd);
         close(fd);
         // *(int*)arg = -1; // Opcional: invalida o fd na variável original se o ponteiro for para ela
     }
 }
 
+// Names are the server's; a pushed name must still be a path inside the
+// sync dir, with no hidden component (the client's own temporary files).
+static int valid_pushed_name(const char *name) {
+    for (const char *c = name;; c++) {
+        if (*c == '\0' || *c == '/' || *c == '.') return 0; // Empty or hidden component
+        c = strchr(c, '/');
+        if (!c) return 1;
+    }
+}
+
+// Expected states by name: the listener, the hydration thread and the
+// initial sync add them, the inotify thread takes them.
+typedef struct expect_entry {
+    struct expect_entry *next;
+    int       exists;
+    dev_t     dev;
+    ino_t     ino;
+    off_t     size;
+    struct timespec mtime;
+    char      name[];
+} expect_entry_t;
+
+static expect_entry_t *expect_table[EXPECT_BUCKETS];
+static pthread_mutex_t expect_mutex = PTHREAD_MUTEX_INITIALIZER;
+static atomic_int watching;
+
+static expect_entry_t **expect_slot(const char *name) {
+    unsigned h = 2166136261u;
+    for (const char *c = name; *c; c++) h = (h ^ (unsigned char)*c) * 16777619u;
+    expect_entry_t **e = &expect_table[h % EXPECT_BUCKETS];
+    while (*e && strcmp((*e)->name, name) != 0) e = &(*e)->next;
+    return e;
+}
+
+void sync_expect(const char *name, const struct stat *st) {
+    if (!atomic_load(&watching)) return;
+    pthread_mutex_lock(&expect_mutex);
+    expect_entry_t **slot = expect_slot(name), *e = *slot;
+    if (!e && (e = malloc(sizeof(*e) + strlen(name) + 1)) != NULL) {
+        strcpy(e->name, name);
+        e->next = NULL;
+        *slot = e;
+    }
+    if (e) {
+        e->exists = (st != NULL);
+        if (st) {
+            e->dev = st->st_dev;
+            e->ino = st->st_ino;
+            e->size = st->st_size;
+            e->mtime = st->st_mtim;
+        }
+    }
+    pthread_mutex_unlock(&expect_mutex);
+}
+
+void sync_expect_cancel(const char *name) {
+    pthread_mutex_lock(&expect_mutex);
+    expect_entry_t **slot = expect_slot(name), *e = *slot;
+    if (e) {
+        *slot = e->next;
+        free(e);
+    }
+    pthread_mutex_unlock(&expect_mutex);
+}
+
+// Returns 1 if 'name' is as last expected, which the change just seen then
+// was. The expectation is used up either way: a later change is the user's.
+static int expect_take(const char *name) {
+    pthread_mutex_lock(&expect_mutex);
+    expect_entry_t **slot = expect_slot(name), *e = *slot;
+    int match = 0;
+    if (e) {
+        struct stat st;
+        if (lstat(name, &st) != 0) match = !e->exists && errno == ENOENT;
+        else if (S_ISDIR(st.st_mode)) match = e->exists && st.st_dev == e->dev && st.st_ino == e->ino; // Moved: its ".." changed
+        else match = e->exists && st.st_dev == e->dev && st.st_ino == e->ino && st.st_size == e->size &&
+                     st.st_mtim.tv_sec == e->mtime.tv_sec && st.st_mtim.tv_nsec == e->mtime.tv_nsec;
+        *slot = e->next;
+        free(e);
+    }
+    pthread_mutex_unlock(&expect_mutex);
+    return match;
+}
+
+int sync_install(const char *tmp_path, const char *name) {
+    struct stat st;
+    if (lstat(tmp_path, &st) != 0) return -1;
+    sync_expect(name, &st); // A rename keeps what identifies the file
+    if (rename(tmp_path, name) != 0 && (errno != ENOENT || make_parent_dirs(name) != 0 || rename(tmp_path, name) != 0)) {
+        int saved = errno;
+        sync_expect_cancel(name);
+        errno = saved;
+        return -1;
+    }
+    return 0;
+}
+
 void handle_server_initiated_download(int sock, const char *filename, const char* sync_dir_abs_path) {
-    char path[PATH_MAX];
-    snprintf(path, sizeof(path), "%s/%s", sync_dir_abs_path, filename);
-    
-    FILE *f = fopen(path, "wb");
+    char path[PATH_MAX], tmp_path[PATH_MAX];
+    if (sync_path_join(sync_dir_abs_path, filename, path, sizeof(path)) != 0 ||
+        sync_temp_path(path, "push", tmp_path, sizeof(tmp_path)) != 0) {
+        LOG_ERROR("\n[Cliente Sync] Nome longo demais para '%s' (server-initiated).\n", filename);
+        return;
+    }
+
+    // Written under a hidden name and renamed once complete, like a batch
+    FILE *f = fopen(tmp_path, "wb");
+    if (!f && errno == ENOENT && make_parent_dirs(tmp_path) == 0) f = fopen(tmp_path, "wb"); // First file of a new directory
     if (!f) {
-        fprintf(stderr, "\n[Cliente Sync] Erro na abertura do arquivo '%s' para download (server-initiated).\n", path);
-        fflush(stderr);
+        LOG_ERROR("\n[Cliente Sync] Erro na abertura do arquivo '%s' para download (server-initiated).\n", tmp_path);
         return;
     }
-    printf("\n[Cliente Sync] Servidor iniciou atualização para: %s. Salvando em: %s\n", filename, path);
-    fflush(stdout);
+    LOG_DEBUG("\n[Cliente Sync] Servidor iniciou atualização para: %s. Salvando em: %s\n", filename, path);
 
     packet_t pkt;
     int error_occurred = 0;
@@ -41,13 +150,11 @@ void handle_server_initiated_download(int sock, const char *filename, const char
 
 
     while (pkt.payload_size != 0) { 
-        pthread_mutex_lock(&socket_mutex);
         if (recv_packet(sock, &pkt) != 0) {
             error_occurred = 1;
         } else {
             if (pkt.type != PKT_UPLOAD_DATA && pkt.type != PKT_DOWNLOAD_DATA) { 
-                fprintf(stderr, "\n[Cliente Sync] Recebido tipo de pacote inesperado (%d) para '%s'.\n", pkt.type, filename);
-                fflush(stderr);
+                LOG_ERROR("\n[Cliente Sync] Recebido tipo de pacote inesperado (%d) para '%s'.\n", pkt.type, filename);
                 error_occurred = 1;
             } else {
                 packet_t ca = { .type = PKT_ACK, .seq_num = pkt.seq_num, .payload_size = 0 };
@@ -57,65 +164,521 @@ void handle_server_initiated_download(int sock, const char *filename, const char
                     if (pkt.payload_size == 0) { 
                         download_completed_flag = 1;
                     } else {
-                        if (fwrite(pkt.payload, 1, pkt.payload_size, f) != pkt.payload_size) {
-                            fprintf(stderr, "\n[Cliente Sync] Erro ao escrever no arquivo '%s'.\n", path);
-                            fflush(stderr);
+                        trace_span_t write_span = trace_begin("storage.fwrite", TRACE_FLOW_NONE);
+                        size_t written = fwrite(pkt.payload, 1, pkt.payload_size, f);
+                        trace_end(&write_span, NULL);
+                        if (written != pkt.payload_size) {
+                            LOG_ERROR("\n[Cliente Sync] Erro ao escrever no arquivo '%s'.\n", path);
                             error_occurred = 1;
                         }
                     }
                 }
             }
         }
-        pthread_mutex_unlock(&socket_mutex);
         if (error_occurred || pkt.payload_size == 0) break;
     }
-    fclose(f);
-    if (download_completed_flag && !error_occurred) {
-        printf("\n[Cliente Sync] Arquivo '%s' atualizado com sucesso via servidor.\n", filename);
-        fflush(stdout);
+    if (fclose(f) != 0) error_occurred = 1;
+    if (download_completed_flag && !error_occurred && valid_pushed_name(filename) && sync_install(tmp_path, filename) == 0) {
+        LOG_INFO("\n[Cliente Sync] Arquivo '%s' atualizado com sucesso via servidor.\n", filename);
     } else {
         if (error_occurred && pkt.payload_size != 0) { 
-             printf("\n[Cliente Sync] Download do arquivo '%s' via servidor falhou ou incompleto.\n", filename);
-             fflush(stdout);
+             LOG_WARN("\n[Cliente Sync] Download do arquivo '%s' via servidor falhou ou incompleto.\n", filename);
+        } else if (download_completed_flag && !error_occurred) {
+             LOG_ERROR("\n[Cliente Sync] Erro ao mover '%s' para '%s': %s\n", tmp_path, path, strerror(errno));
+        }
+        remove(tmp_path);
+    }
+}
+
+void handle_server_initiated_batch(int sock, const packet_t *req, const char* sync_dir_abs_path) {
+    packet_t ack = { .type = PKT_ACK, .seq_num = req->seq_num, .payload_size = 0 };
+    if (send_packet(sock, &ack) != 0) return;
+
+    batch_reader_t reader;
+    batch_reader_init(&reader, sock);
+    char name[PATH_MAX];
+    uint64_t size;
+    int rc, stored = 0;
+    while ((rc = batch_next_file(&reader, name, sizeof(name), &size)) == 1) {
+        if (!valid_pushed_name(name)) continue;
+        // Written under a hidden name, which the inotify thread ignores, and
+        // renamed once complete: the file appears whole or not at all
+        char path[PATH_MAX], tmp_path[PATH_MAX];
+        FILE *f = NULL;
+        if (sync_path_join(sync_dir_abs_path, name, path, sizeof(path)) != 0 ||
+            sync_temp_path(path, "batch", tmp_path, sizeof(tmp_path)) != 0) {
+            LOG_ERROR("\n[Cliente Sync] Nome longo demais para '%s' (lote do servidor).\n", name);
+        } else {
+            f = fopen(tmp_path, "wb");
+            if (!f && errno == ENOENT && make_parent_dirs(tmp_path) == 0) f = fopen(tmp_path, "wb");
+            if (!f) LOG_ERROR("\n[Cliente Sync] Erro na abertura do arquivo '%s' (lote do servidor).\n", tmp_path);
+        }
+        char buf[MAX_PAYLOAD];
+        long n;
+        int write_ok = (f != NULL);
+        while ((n = batch_read(&reader, buf, sizeof(buf))) > 0) {
+            if (write_ok && fwrite(buf, 1, (size_t)n, f) != (size_t)n) write_ok = 0;
+        }
+        if (f && fclose(f) != 0) write_ok = 0;
+        if (n < 0 || !write_ok) {
+            if (f) remove(tmp_path);
+            if (n < 0) { // Cut short
+                rc = -1;
+                break;
+            }
+            if (f) LOG_ERROR("\n[Cliente Sync] Erro ao escrever no arquivo '%s'.\n", tmp_path);
+            continue;
+        }
+        if (sync_install(tmp_path, name) == 0) stored++;
+        else LOG_ERROR("\n[Cliente Sync] Erro ao mover '%s' para '%s': %s\n", tmp_path, path, strerror(errno));
+    }
+    if (rc == 0) {
+        packet_t done = { .type = PKT_ACK, .seq_num = batch_end_seq(&reader) };
+        snprintf(done.payload, MAX_PAYLOAD, "%d", stored);
+        done.payload_size = (uint32_t)strlen(done.payload) + 1;
+        send_packet(sock, &done);
+        LOG_INFO("\n[Cliente Sync] %d arquivo(s) atualizado(s) em lote via servidor.\n", stored);
+    } else {
+        LOG_WARN("\n[Cliente Sync] Lote de arquivos do servidor interrompido.\n");
+    }
+}
+
+// Uploads the changes collected from one read of inotify events; see
+// upload_files_action. While offline they go to the journal instead.
+static void flush_pending_uploads(char pending[][PATH_MAX], int *count) {
+    if (*count == 0) return;
+    const char *paths[BATCH_MAX_FILES];
+    for (int i = 0; i < *count; i++) paths[i] = pending[i];
+    if (client_conn_is_online()) {
+        LOG_DEBUG("\n[Inotify Thread] Enviando %d arquivo(s) criado(s)/modificado(s)...\n", *count);
+        if (upload_files_action(paths, *count, client_conn_sock()) < 0) {
+            LOG_ERROR("[Inotify Thread] Conexão perdida durante o envio de %d arquivo(s).\n", *count);
+        }
+    }
+    if (!client_conn_is_online()) {
+        for (int i = 0; i < *count; i++) journal_record(JOURNAL_OP_UPLOAD, sync_relative_name(pending[i]));
+    }
+    *count = 0;
+}
+
+static void queue_upload(const char *full_path, char pending[][PATH_MAX], int *count) {
+    // What the server sent, and placeholders still waiting for it, are not news to the server
+    const char *name = sync_relative_name(full_path);
+    if (expect_take(name) || hydrate_is_placeholder(name)) return;
+    for (int i = 0; i < *count; i++) {
+        if (strcmp(pending[i], full_path) == 0) return;
+    }
+    if (*count == BATCH_MAX_FILES) flush_pending_uploads(pending, count);
+    snprintf(pending[(*count)++], PATH_MAX, "%s", full_path);
+}
+
+// The sync dir is the working directory: paths relative to it work as they
+// are, and the absolute ones for uploads are built from this.
+static char sync_root[PATH_MAX];
+
+// Joins a path relative to the sync dir ("" for the dir itself) and a name.
+// Returns 0, or -1 (ENAMETOOLONG) if the name does not fit in 'len' bytes.
+static int join_rel(char *out, size_t len, const char *dir, const char *name) {
+    if (dir[0] != '\0') return sync_path_join(dir, name, out, len);
+    int n = snprintf(out, len, "%s", name);
+    if (n < 0 || (size_t)n >= len) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    return 0;
+}
+
+static int is_under(const char *rel, const char *dir) {
+    size_t n = strlen(dir);
+    return strncmp(rel, dir, n) == 0 && (rel[n] == '\0' || rel[n] == '/');
+}
+
+// Calls fn on every file under the directory 'rel', hidden entries aside.
+static void for_each_file(const char *rel, void (*fn)(const char *rel, const struct stat *st, void *arg), void *arg) {
+    DIR *d = opendir(rel[0] ? rel : ".");
+    if (!d) return;
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL) {
+        if (e->d_name[0] == '.') continue;
+        char child[PATH_MAX];
+        struct stat st;
+        if (join_rel(child, sizeof(child), rel, e->d_name) != 0) {
+            LOG_WARN("[Inotify Thread] Nome longo demais em '%s', ignorado: %s", rel, e->d_name);
+            continue;
+        }
+        if (lstat(child, &st) != 0) continue;
+        if (S_ISDIR(st.st_mode)) for_each_file(child, fn, arg);
+        else if (S_ISREG(st.st_mode)) fn(child, &st, arg);
+    }
+    closedir(d);
+}
+
+typedef struct {
+    char (*pending)[PATH_MAX];
+    int  *count;
+} upload_queue_t;
+
+static void queue_file(const char *rel, const struct stat *st, void *arg) {
+    (void)st;
+    upload_queue_t *q = arg;
+    char full_path[PATH_MAX];
+    if (sync_path_join(sync_root, rel, full_path, sizeof(full_path)) != 0) {
+        LOG_WARN("[Inotify Thread] Caminho longo demais, não enviado: %s", rel);
+        return;
+    }
+    queue_upload(full_path, q->pending, q->count);
+}
+
+// Watched directories by watch descriptor, which the kernel hands out in
+// increasing order: the path of each relative to the sync dir, "" for the
+// sync dir itself. Only the inotify thread uses them.
+static char **watch_dirs;
+static int watch_dirs_cap;
+
+static void watch_set(int wd, const char *rel) {
+    if (wd >= watch_dirs_cap) {
+        int cap = watch_dirs_cap ? watch_dirs_cap : 64;
+        while (cap <= wd) cap *= 2;
+        char **grown = realloc(watch_dirs, (size_t)cap * sizeof(*grown));
+        if (!grown) return;
+        memset(grown + watch_dirs_cap, 0, (size_t)(cap - watch_dirs_cap) * sizeof(*grown));
+        watch_dirs = grown;
+        watch_dirs_cap = cap;
+    }
+    free(watch_dirs[wd]);
+    watch_dirs[wd] = strdup(rel);
+}
+
+static const char *watch_dir(int wd) {
+    return wd >= 0 && wd < watch_dirs_cap ? watch_dirs[wd] : NULL;
+}
+
+static void watch_drop(int wd) {
+    if (wd < 0 || wd >= watch_dirs_cap) return;
+    free(watch_dirs[wd]);
+    watch_dirs[wd] = NULL;
+}
+
+// A watch follows its directory when it moves; only the name we keep changes.
+static void watch_move(const char *from, const char *to) {
+    size_t from_len = strlen(from);
+    for (int wd = 0; wd < watch_dirs_cap; wd++) {
+        if (!watch_dirs[wd] || !is_under(watch_dirs[wd], from)) continue;
+        char moved[PATH_MAX];
+        snprintf(moved, sizeof(moved), "%s%s", to, watch_dirs[wd] + from_len);
+        watch_set(wd, moved);
+    }
+}
+
+static void watch_remove_under(int fd, const char *dir) {
+    for (int wd = 0; wd < watch_dirs_cap; wd++) {
+        if (!watch_dirs[wd] || !is_under(watch_dirs[wd], dir)) continue;
+        inotify_rm_watch(fd, wd);
+        watch_drop(wd);
+    }
+}
+
+// Scanned directories and what their files looked like on the last scan.
+// A root's first scan only records its files unless it 'reports' (it
+// appeared after startup); later scans upload what is new or changed and
+// delete what is gone.
+typedef struct scan_entry {
+    struct scan_entry *next;
+    long long size;
+    time_t    mtime;
+    unsigned  gen; // Scan that last saw the file
+    char      rel[];
+} scan_entry_t;
+
+typedef struct {
+    char *rel;
+    int   report;
+} scan_root_t;
+
+static scan_entry_t *scan_table[SCAN_BUCKETS];
+static scan_root_t *scan_roots;
+static int scan_root_count, scan_root_cap;
+static unsigned scan_gen;
+
+static unsigned scan_hash(const char *s) {
+    unsigned h = 2166136261u;
+    while (*s) h = (h ^ (unsigned char)*s++) * 16777619u;
+    return h % SCAN_BUCKETS;
+}
+
+static void scan_root_add(const char *rel, int report) {
+    if (scan_root_count == scan_root_cap) {
+        int cap = scan_root_cap ? scan_root_cap * 2 : 16;
+        scan_root_t *grown = realloc(scan_roots, (size_t)cap * sizeof(*grown));
+        if (!grown) return;
+        scan_roots = grown;
+        scan_root_cap = cap;
+    }
+    if (scan_root_count == 0) {
+        LOG_WARN("\n[Inotify Thread] Limite de watches do inotify atingido; '%s' e outros diretórios serão verificados a cada %d ms.\n",
+                 rel, SCAN_INTERVAL_MS);
+    }
+    scan_roots[scan_root_count].rel = strdup(rel);
+    scan_roots[scan_root_count++].report = report;
+}
+
+// Forgets what the scans recorded under 'dir', which left the tree or was
+// renamed: neither should look like deletes to the next scan.
+static void scan_forget_under(const char *dir) {
+    for (int b = 0; b < SCAN_BUCKETS; b++) {
+        for (scan_entry_t **e = &scan_table[b]; *e;) {
+            if (!is_under((*e)->rel, dir)) {
+                e = &(*e)->next;
+                continue;
+            }
+            scan_entry_t *gone = *e;
+            *e = gone->next;
+            free(gone);
         }
-        // Somente remove se o download não foi completado E não houve outro erro E o arquivo existe
-        if(!download_completed_flag && !error_occurred && access(path, F_OK) == 0 ) { 
-            remove(path); 
+    }
+}
+
+// Moves the scan roots under 'from' to 'to', or drops them when 'to' is
+// NULL. Their next scan starts over, without reporting.
+static void scan_roots_move(const char *from, const char *to) {
+    if (scan_root_count == 0) return;
+    scan_forget_under(from);
+    size_t from_len = strlen(from);
+    for (int i = 0; i < scan_root_count;) {
+        scan_root_t *r = &scan_roots[i];
+        if (!is_under(r->rel, from)) {
+            i++;
+            continue;
+        }
+        if (!to) {
+            free(r->rel);
+            *r = scan_roots[--scan_root_count];
+            continue;
         }
+        char moved[PATH_MAX];
+        snprintf(moved, sizeof(moved), "%s%s", to, r->rel + from_len);
+        free(r->rel);
+        r->rel = strdup(moved);
+        r->report = 0;
+        i++;
+    }
+}
+
+typedef struct {
+    upload_queue_t queue;
+    int            report;
+} scan_ctx_t;
+
+static void scan_file(const char *rel, const struct stat *st, void *arg) {
+    scan_ctx_t *ctx = arg;
+    unsigned b = scan_hash(rel);
+    scan_entry_t *e = scan_table[b];
+    while (e && strcmp(e->rel, rel) != 0) e = e->next;
+    int changed = 1;
+    if (e) {
+        changed = e->size != (long long)st->st_size || e->mtime != st->st_mtime;
+    } else if ((e = malloc(sizeof(*e) + strlen(rel) + 1)) != NULL) {
+        strcpy(e->rel, rel);
+        e->next = scan_table[b];
+        scan_table[b] = e;
+    } else {
+        return;
+    }
+    e->size = (long long)st->st_size;
+    e->mtime = st->st_mtime;
+    e->gen = scan_gen;
+    if (changed && ctx->report) queue_file(rel, st, &ctx->queue);
+}
+
+static void sync_delete(const char *name, char pending[][PATH_MAX], int *count);
+
+// Scans every root, then deletes on the server the files no scan saw.
+static void scan_run(char pending[][PATH_MAX], int *count) {
+    scan_gen++;
+    for (int i = 0; i < scan_root_count;) {
+        scan_root_t *r = &scan_roots[i];
+        struct stat st;
+        if (lstat(r->rel, &st) != 0 || !S_ISDIR(st.st_mode)) { // Gone: the sweep below deletes its files
+            free(r->rel);
+            *r = scan_roots[--scan_root_count];
+            continue;
+        }
+        scan_ctx_t ctx = { .queue = { pending, count }, .report = r->report };
+        for_each_file(r->rel, scan_file, &ctx);
+        r->report = 1;
+        i++;
+    }
+    for (int b = 0; b < SCAN_BUCKETS; b++) {
+        for (scan_entry_t **e = &scan_table[b]; *e;) {
+            if ((*e)->gen == scan_gen) {
+                e = &(*e)->next;
+                continue;
+            }
+            scan_entry_t *gone = *e;
+            *e = gone->next;
+            sync_delete(gone->rel, pending, count);
+            free(gone);
+        }
+    }
+    flush_pending_uploads(pending, count);
+}
+
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DONT_FOLLOW)
+
+// Watches the directory 'rel' and every directory under it. One that
+// appears while the client runs ('announce') may already hold files, made
+// before its watch existed: they are queued for upload. Returns 0 if 'rel'
+// is watched or scanned.
+static int add_watch_tree(int fd, const char *rel, int announce, char pending[][PATH_MAX], int *count) {
+    // With contents to fetch, opening a placeholder asks for its contents
+    int wd = inotify_add_watch(fd, rel[0] ? rel : ".", WATCH_MASK | (hydrate_enabled() ? IN_OPEN : 0));
+    if (wd < 0) {
+        if (errno == ENOSPC || errno == ENOMEM) {
+            scan_root_add(rel, announce);
+            return 0;
+        }
+        if (errno != ENOENT) LOG_ERROR("[Inotify Thread] inotify_add_watch '%s': %s", rel, strerror(errno));
+        return -1;
+    }
+    watch_set(wd, rel);
+    DIR *d = opendir(rel[0] ? rel : ".");
+    if (!d) return 0;
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL) {
+        if (e->d_name[0] == '.') continue;
+        char child[PATH_MAX];
+        struct stat st;
+        if (join_rel(child, sizeof(child), rel, e->d_name) != 0) {
+            LOG_WARN("[Inotify Thread] Nome longo demais em '%s', ignorado: %s", rel, e->d_name);
+            continue;
+        }
+        if (lstat(child, &st) != 0) continue;
+        if (S_ISDIR(st.st_mode)) {
+            add_watch_tree(fd, child, announce, pending, count);
+        } else if (announce && S_ISREG(st.st_mode)) {
+            upload_queue_t q = { pending, count };
+            queue_file(child, &st, &q);
+        }
+    }
+    closedir(d);
+    return 0;
+}
+
+// Deletes 'name' on the server, after the uploads seen before it. A
+// directory goes with everything under it.
+static void sync_delete(const char *name, char pending[][PATH_MAX], int *count) {
+    if (expect_take(name)) return; // Deleted by the server
+    flush_pending_uploads(pending, count);
+    if (!client_conn_is_online()) {
+        journal_record(JOURNAL_OP_DELETE, name);
+    } else {
+        LOG_DEBUG("\n[Inotify Thread] Evento: Arquivo '%s' deletado. Solicitando deleção...\n", name);
+        char *delete_msg = delete_file_action(name, client_conn_sock());
+        if (delete_msg) { LOG_DEBUG("[Inotify Thread] Delete: %s\n", delete_msg); free(delete_msg); }
+        if (!client_conn_is_online()) journal_record(JOURNAL_OP_DELETE, name);
+    }
+}
+
+// Renames 'from' to 'to' on the server, which then moves its copy and asks
+// the other devices to move theirs: no contents travel. If the server lacks
+// the old file the new one is uploaded instead; the journal, which keeps one
+// operation per file, records a rename as the delete and the upload. A
+// directory that cannot be renamed is uploaded file by file and the old
+// one deleted.
+static void sync_rename(const char *from, const char *to, int is_dir, char pending[][PATH_MAX], int *count) {
+    flush_pending_uploads(pending, count);
+    if (client_conn_is_online()) {
+        LOG_DEBUG("\n[Inotify Thread] Evento: '%s' renomeado para '%s'. Solicitando renomeação...\n", from, to);
+        if (rename_file_action(from, to, client_conn_sock()) == 0) return;
+    }
+    if (is_dir) {
+        upload_queue_t q = { pending, count };
+        for_each_file(to, queue_file, &q);
+        sync_delete(from, pending, count);
+    } else if (client_conn_is_online()) {
+        upload_queue_t q = { pending, count };
+        queue_file(to, NULL, &q);
+        flush_pending_uploads(pending, count);
+    } else if (!hydrate_is_placeholder(to)) {
+        journal_record(JOURNAL_OP_DELETE, from);
+        journal_record(JOURNAL_OP_UPLOAD, to);
+    }
+}
+
+// 'rel' left the synced tree (or became hidden).
+static void sync_moved_out(int fd, const char *rel, int is_dir, char pending[][PATH_MAX], int *count) {
+    if (is_dir) {
+        watch_remove_under(fd, rel);
+        scan_roots_move(rel, NULL);
     }
+    sync_delete(rel, pending, count);
+}
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000u + (uint64_t)ts.tv_nsec / 1000000u;
 }
 
 void *notify_file_change_thread(void *parameter) {
-    int sock = *(int*)parameter; 
-    char sync_dir_abs_path[PATH_MAX];
-    if (!getcwd(sync_dir_abs_path, sizeof(sync_dir_abs_path))) {
-        perror("\n[Inotify Thread] Erro ao obter CWD para inotify");
+    (void)parameter; // The socket may change after a reconnect; see client_conn_sock()
+    if (!getcwd(sync_root, sizeof(sync_root))) {
+        LOG_ERROR("\n[Inotify Thread] Erro ao obter CWD para inotify: %s", strerror(errno));
         pthread_exit(NULL);
     }
-    printf("\n[Inotify Thread] Monitorando diretório: %s para mudanças...\n", sync_dir_abs_path);
-    fflush(stdout);
+    LOG_INFO("\n[Inotify Thread] Monitorando diretório: %s para mudanças...\n", sync_root);
 
     char buf[INOTIFY_BUF_LEN]; 
     int inotify_fd = inotify_init(); // Inicializa fd
     if (inotify_fd < 0) { 
-        perror("[Inotify Thread] inotify_init"); 
+        LOG_ERROR("[Inotify Thread] inotify_init: %s", strerror(errno)); 
         pthread_exit(NULL); 
     }
 
     pthread_cleanup_push(inotify_cleanup_handler, &inotify_fd); // Registra handler de cleanup
 
-    int wd = inotify_add_watch(inotify_fd, sync_dir_abs_path, IN_CREATE | IN_DELETE | IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM);
-    if (wd < 0) { 
-        perror("[Inotify Thread] inotify_add_watch"); 
-        // pthread_cleanup_pop(1); // <<--- REMOVIDO DAQUI
-        // inotify_fd = -1;       // <<--- REMOVIDO DAQUI (handler deve ser robusto ou fd não é alterado antes do pop)
+    // Uploads are collected over the whole read (a file usually shows up
+    // twice, created and then closed) and sent together; a delete or a
+    // rename first flushes the uploads seen before it to keep their order
+    static char pending[BATCH_MAX_FILES][PATH_MAX];
+    int pending_count = 0;
+
+    // Every directory of the tree gets a watch of its own. Expectations
+    // count from before the first watch, so none of the changes the watches
+    // report goes unexpected
+    atomic_store(&watching, 1);
+    if (add_watch_tree(inotify_fd, "", 0, pending, &pending_count) != 0) {
         pthread_exit(NULL); // pthread_exit executará os handlers de cleanup automaticamente
     }
+    uint64_t next_scan = now_ms();
+
+    // An IN_MOVED_FROM waiting for the IN_MOVED_TO with its cookie
+    static char move_from[PATH_MAX];
+    int move_is_dir = 0;
+    uint32_t move_cookie = 0;
+    move_from[0] = '\0';
 
     // Loop principal para monitorar eventos do inotify
     while (1) { 
         pthread_testcancel(); 
-        int n = read(inotify_fd, buf, INOTIFY_BUF_LEN); 
+        if (scan_root_count > 0 && now_ms() >= next_scan) {
+            scan_run(pending, &pending_count);
+            next_scan = now_ms() + SCAN_INTERVAL_MS;
+        }
+        int timeout = -1;
+        if (scan_root_count > 0) timeout = (int)(next_scan > now_ms() ? next_scan - now_ms() : 0);
+        if (move_from[0] != '\0' && (timeout < 0 || timeout > MOVE_PAIR_WAIT_MS)) timeout = MOVE_PAIR_WAIT_MS;
+        struct pollfd more = { .fd = inotify_fd, .events = POLLIN };
+        int ready = poll(&more, 1, timeout);
+        if (ready < 0 && errno == EINTR) continue;
+        if (ready == 0) {
+            if (move_from[0] != '\0') { // Moved out of the tree
+                sync_moved_out(inotify_fd, move_from, move_is_dir, pending, &pending_count);
+                move_from[0] = '\0';
+            }
+            continue;
+        }
+        int n = ready < 0 ? -1 : read(inotify_fd, buf, INOTIFY_BUF_LEN); 
         if (n <= 0) {
             if (n < 0) {
                 if (errno == EINTR) continue; // Se interrompido por sinal, tenta novamente
@@ -129,41 +692,96 @@ void *notify_file_change_thread(void *parameter) {
         while (p < buf + n) { // Loop interno para processar múltiplos eventos lidos de uma vez
             pthread_testcancel(); 
             struct inotify_event *event = (struct inotify_event*)p;
-            if (event->len > 0 && event->name[0] != '.') { // Se tem nome e não é arquivo oculto
-                char full_path[PATH_MAX];
-                snprintf(full_path, PATH_MAX, "%s/%s", sync_dir_abs_path, event->name);
-                if (event->mask & IN_CREATE || event->mask & IN_MOVED_TO || event->mask & IN_CLOSE_WRITE) {
-                    printf("\n[Inotify Thread] Evento: Arquivo '%s' criado/modificado. Enviando...\n", event->name); fflush(stdout);
-                    char *upload_msg = upload_file_action(full_path, sock); 
-                    if (upload_msg) {
-                        if (strcmp(upload_msg, "Arquivo enviado com sucesso.") != 0) {
-                           fprintf(stderr, "[Inotify Thread] Upload: %s\n", upload_msg); fflush(stderr); free(upload_msg);
-                        } else { printf("[Inotify Thread] Upload: %s\n", upload_msg); fflush(stdout); }
+            p += sizeof(struct inotify_event) + event->len;
+            if (event->mask & IN_Q_OVERFLOW) {
+                LOG_WARN("\n[Inotify Thread] Fila de eventos do inotify transbordou; mudanças podem ter sido perdidas.\n");
+                continue;
+            }
+            if (event->mask & IN_IGNORED) { // The directory is gone, or its watch was removed
+                watch_drop(event->wd);
+                continue;
+            }
+            const char *dir = watch_dir(event->wd);
+            if (event->len == 0 || dir == NULL) continue;
+            char rel[PATH_MAX];
+            if (join_rel(rel, sizeof(rel), dir, event->name) != 0) {
+                LOG_WARN("[Inotify Thread] Nome longo demais em '%s', evento ignorado: %s", dir, event->name);
+                continue;
+            }
+            int is_dir = (event->mask & IN_ISDIR) != 0;
+
+            if ((event->mask & IN_MOVED_TO) && move_from[0] != '\0' && event->cookie == move_cookie) {
+                if (event->name[0] == '.') {
+                    sync_moved_out(inotify_fd, move_from, move_is_dir, pending, &pending_count); // Hidden from now on
+                } else {
+                    if (move_is_dir) {
+                        watch_move(move_from, rel);
+                        scan_roots_move(move_from, rel);
+                    }
+                    int from_expected = expect_take(move_from), to_expected = expect_take(rel);
+                    if (!from_expected || !to_expected) {
+                        hydrate_rename(move_from, rel); // A placeholder keeps waiting under its new name
+                        sync_rename(move_from, rel, move_is_dir, pending, &pending_count);
+                    }
+                }
+                move_from[0] = '\0';
+            } else if (event->name[0] != '.') { // Se tem nome e não é arquivo oculto
+                if (event->mask & IN_OPEN) {
+                    if (!is_dir) hydrate_prioritize(rel);
+                } else if (is_dir && (event->mask & (IN_CREATE | IN_MOVED_TO))) {
+                    add_watch_tree(inotify_fd, rel, 1, pending, &pending_count);
+                } else if (event->mask & IN_CREATE || event->mask & IN_MOVED_TO || event->mask & IN_CLOSE_WRITE) {
+                    char full_path[PATH_MAX];
+                    if (sync_path_join(sync_root, rel, full_path, PATH_MAX) == 0) {
+                        queue_upload(full_path, pending, &pending_count);
+                    } else {
+                        LOG_WARN("[Inotify Thread] Caminho longo demais, não enviado: %s", rel);
                     }
-                } else if (event->mask & IN_DELETE || event->mask & IN_MOVED_FROM) {
-                    printf("\n[Inotify Thread] Evento: Arquivo '%s' deletado. Solicitando deleção...\n", event->name); fflush(stdout);
-                    char *delete_msg = delete_file_action(event->name, sock); 
-                     if (delete_msg) { printf("[Inotify Thread] Delete: %s\n", delete_msg); fflush(stdout); free(delete_msg); }
+                } else if (event->mask & IN_MOVED_FROM) {
+                    if (move_from[0] != '\0') sync_moved_out(inotify_fd, move_from, move_is_dir, pending, &pending_count); // Never paired
+                    snprintf(move_from, sizeof(move_from), "%s", rel);
+                    move_is_dir = is_dir;
+                    move_cookie = event->cookie;
+                } else if ((event->mask & IN_DELETE) && !is_dir) { // A directory's files went first
+                    sync_delete(rel, pending, &pending_count);
                 }
             }
-            p += sizeof(struct inotify_event) + event->len;
         } // Fim do loop interno (p < buf + n)
+        flush_pending_uploads(pending, &pending_count);
     } // Fim do loop while(1) principal
 
     pthread_cleanup_pop(1); // Remove e EXECUTA o handler de cleanup (para fechar inotify_fd)
     
-    printf("\n[Inotify Thread] Encerrando normalmente...\n"); fflush(stdout);
+    LOG_DEBUG("\n[Inotify Thread] Encerrando normalmente...\n");
     pthread_exit(NULL);
 } // Fim da função notify_file_change_thread
 
+// Called when the listener loses the connection. Reconnects with backoff,
+// replays the offline journal and pulls whatever changed on the server meanwhile.
+// Returns the new socket, or -1 if the client is shutting down.
+static int recover_connection(const char *sync_dir_abs_path) {
+    if (client_conn_shutting_down()) return -1;
+    LOG_INFO("\n[Listener Thread] Conexão com o servidor perdida. Alterações locais serão registradas no journal.\n");
+
+    int sock = client_conn_reconnect();
+    if (sock < 0) return -1;
+
+    journal_replay(sock, sync_dir_abs_path);
+    if (perform_initial_sync(sock) != 0) {
+        LOG_ERROR("\n[Listener Thread] Ressincronização após reconexão concluída com falhas.\n");
+    }
+    return sock;
+}
+
 void *server_updates_listener_thread(void *arg) {
-    int sock = *(int *)arg;
+    (void)arg; // The socket may change after a reconnect; see client_conn_sock()
+    int sock = client_conn_sock();
     char sync_dir_effective_path[PATH_MAX];
     if (!getcwd(sync_dir_effective_path, sizeof(sync_dir_effective_path))) {
-        perror("\n[Listener Thread] Falha ao obter CWD");
+        LOG_ERROR("\n[Listener Thread] Falha ao obter CWD: %s", strerror(errno));
         pthread_exit(NULL);
     }
-    printf("\n[Listener Thread] Escutando atualizações do servidor...\n"); fflush(stdout);
+    LOG_INFO("\n[Listener Thread] Escutando atualizações do servidor...\n");
     
     fd_set read_fds;
     struct timeval tv;
@@ -181,18 +799,28 @@ void *server_updates_listener_thread(void *arg) {
 
         if (activity < 0) {
             if (errno == EINTR) continue; 
-            break; 
+            if ((sock = recover_connection(sync_dir_effective_path)) < 0) break;
+            continue;
         }
 
         if (activity > 0 && FD_ISSET(sock, &read_fds)) {
             pthread_mutex_lock(&socket_mutex);
+            // A request may have taken the lock and read its reply after
+            // select returned; blocking in recv with the lock held would then
+            // stall every later request.
+            struct pollfd still_ready = { .fd = sock, .events = POLLIN };
+            if (poll(&still_ready, 1, 0) <= 0) {
+                pthread_mutex_unlock(&socket_mutex);
+                continue;
+            }
             int recv_status = recv_packet(sock, &pkt);
-            pthread_mutex_unlock(&socket_mutex); 
-
             if (recv_status != 0) {
-                break; 
+                pthread_mutex_unlock(&socket_mutex);
+                if ((sock = recover_connection(sync_dir_effective_path)) < 0) break;
+                continue;
             }
-            
+            // Kept until the push is answered and received: a request sent in
+            // between would reach the server where it expects the push's ACK
             char fn[MAX_PAYLOAD+1];
             if (pkt.payload_size > 0 && pkt.payload_size <= MAX_PAYLOAD) {
                 memcpy(fn, pkt.payload, pkt.payload_size);
@@ -208,47 +836,86 @@ void *server_updates_listener_thread(void *arg) {
                 fn[0] = '\0';
             }
             
-            if(pkt.type == PKT_UPLOAD_REQ){       
-                printf("\n[Listener Thread] Servidor requisitou UPLOAD para arquivo '%s' (propagação).\n", fn); fflush(stdout);
+            // Adopt the id of the change being pushed so the apply spans join its trace
+            trace_set_current(pkt.trace_id);
+            if (pkt.type == PKT_BATCH_UPLOAD) {
+                LOG_DEBUG("\n[Listener Thread] Servidor enviou um lote de arquivos (propagação).\n");
+                trace_span_t apply_span = trace_begin("client.apply_batch", TRACE_FLOW_END);
+                handle_server_initiated_batch(sock, &pkt, sync_dir_effective_path);
+                trace_end(&apply_span, NULL);
+            } else if(pkt.type == PKT_UPLOAD_REQ){       
+                LOG_DEBUG("\n[Listener Thread] Servidor requisitou UPLOAD para arquivo '%s' (propagação).\n", fn);
                 packet_t r_ack = { .type = PKT_ACK, .seq_num = pkt.seq_num, .payload_size = 0 };    
-                
-                pthread_mutex_lock(&socket_mutex);         
-                int ack_sent_ok = (send_packet(sock, &r_ack) == 0);
-                pthread_mutex_unlock(&socket_mutex);
-
-                if(!ack_sent_ok) {
-                    fprintf(stderr, "\n[Listener Thread] Falha ao enviar ACK para UPLOAD_REQ do servidor para '%s'.\n", fn); fflush(stderr);
-                    continue; 
+                if (send_packet(sock, &r_ack) != 0) {
+                    LOG_ERROR("\n[Listener Thread] Falha ao enviar ACK para UPLOAD_REQ do servidor para '%s'.\n", fn);
+                } else {
+                    trace_span_t apply_span = trace_begin("client.apply_update", TRACE_FLOW_END);
+                    handle_server_initiated_download(sock, fn, sync_dir_effective_path); 
+                    trace_end(&apply_span, fn);
                 }
-                handle_server_initiated_download(sock, fn, sync_dir_effective_path); 
             } else if (pkt.type == PKT_DELETE_REQ) {
-                printf("\n[Listener Thread] Servidor requisitou DELETE para arquivo '%s'.\n", fn); fflush(stdout);
+                LOG_DEBUG("\n[Listener Thread] Servidor requisitou DELETE para arquivo '%s'.\n", fn);
                 packet_t r_ack = { .type = PKT_ACK, .seq_num = pkt.seq_num, .payload_size = 0 };
-
-                pthread_mutex_lock(&socket_mutex);
-                int ack_sent_ok = (send_packet(sock, &r_ack) == 0);
-                pthread_mutex_unlock(&socket_mutex);
-
-                if(!ack_sent_ok) {
-                     fprintf(stderr, "\n[Listener Thread] Falha ao enviar ACK para DELETE_REQ do servidor para '%s'.\n", fn); fflush(stderr);
-                     continue; 
-                }
-                char local_file_to_delete[PATH_MAX];
-                snprintf(local_file_to_delete, PATH_MAX, "%s/%s", sync_dir_effective_path, fn);
-                if (remove(local_file_to_delete) == 0) {
-                   printf("\n[Listener Thread] Arquivo '%s' deletado localmente por instrução do servidor.\n", local_file_to_delete); fflush(stdout);
+                if (send_packet(sock, &r_ack) != 0) {
+                     LOG_ERROR("\n[Listener Thread] Falha ao enviar ACK para DELETE_REQ do servidor para '%s'.\n", fn);
                 } else {
-                   fprintf(stderr, "\n[Listener Thread] Erro ao deletar '%s' localmente: %s\n", local_file_to_delete, strerror(errno)); fflush(stderr);
+                    char local_file_to_delete[PATH_MAX];
+                    trace_span_t apply_span = trace_begin("client.apply_delete", TRACE_FLOW_END);
+                    int valid = valid_pushed_name(fn) &&
+                                sync_path_join(sync_dir_effective_path, fn, local_file_to_delete, PATH_MAX) == 0;
+                    if (valid) sync_expect(fn, NULL);
+                    int removed = valid && remove(local_file_to_delete) == 0;
+                    if (removed) prune_empty_parents(local_file_to_delete, sync_dir_effective_path);
+                    else if (valid) sync_expect_cancel(fn);
+                    trace_end(&apply_span, fn);
+                    if (removed) {
+                       LOG_DEBUG("\n[Listener Thread] Arquivo '%s' deletado localmente por instrução do servidor.\n", local_file_to_delete);
+                    } else {
+                       LOG_ERROR("\n[Listener Thread] Erro ao deletar '%s' localmente: %s\n", fn, strerror(errno));
+                    }
+                }
+            } else if (pkt.type == PKT_RENAME_REQ) {
+                size_t from_len = strnlen(pkt.payload, pkt.payload_size);
+                const char *to = from_len + 1 < pkt.payload_size ? pkt.payload + from_len + 1 : "";
+                LOG_DEBUG("\n[Listener Thread] Servidor requisitou RENAME de '%s' para '%s'.\n", fn, to);
+                char from_path[PATH_MAX], to_path[PATH_MAX];
+                trace_span_t apply_span = trace_begin("client.apply_rename", TRACE_FLOW_END);
+                struct stat from_st;
+                int valid = valid_pushed_name(fn) && valid_pushed_name(to) &&
+                            sync_path_join(sync_dir_effective_path, fn, from_path, PATH_MAX) == 0 &&
+                            sync_path_join(sync_dir_effective_path, to, to_path, PATH_MAX) == 0 &&
+                            lstat(from_path, &from_st) == 0;
+                if (valid) {
+                    sync_expect(fn, NULL);
+                    sync_expect(to, &from_st);
+                }
+                int renamed = valid && make_parent_dirs(to_path) == 0 && rename(from_path, to_path) == 0;
+                if (renamed) {
+                    prune_empty_parents(from_path, sync_dir_effective_path);
+                    hydrate_rename(fn, to);
+                } else if (valid) {
+                    int saved = errno;
+                    sync_expect_cancel(fn);
+                    sync_expect_cancel(to);
+                    errno = saved;
+                }
+                trace_end(&apply_span, to);
+                // Without the old file the server sends the new one whole instead
+                packet_t r_reply = { .type = renamed ? PKT_ACK : PKT_NACK, .seq_num = pkt.seq_num, .payload_size = 0 };
+                if (!renamed) LOG_DEBUG("\n[Listener Thread] '%s' não renomeado localmente: %s\n", fn, strerror(errno));
+                if (send_packet(sock, &r_reply) != 0) {
+                    LOG_ERROR("\n[Listener Thread] Falha ao responder RENAME_REQ do servidor para '%s'.\n", fn);
                 }
             } else if (pkt.type == PKT_SYNC_EVENT) {
-                printf("\n[Listener Thread] Recebido PKT_SYNC_EVENT, ignorando.\n"); fflush(stdout);
+                LOG_DEBUG("\n[Listener Thread] Recebido PKT_SYNC_EVENT, ignorando.\n");
             } else {
-                printf("\n[Listener Thread] Aviso: Recebido pacote tipo %d (seq: %u). Não é uma ação de servidor para este listener.\n", pkt.type, pkt.seq_num);
-                fflush(stdout);
+                LOG_WARN("\n[Listener Thread] Aviso: Recebido pacote tipo %d (seq: %u). Não é uma ação de servidor para este listener.\n", pkt.type, pkt.seq_num);
             }
+            pthread_mutex_unlock(&socket_mutex);
+            trace_set_current(0);
         }
         pthread_testcancel(); 
     }
-    printf("\n[Listener Thread] Thread de escuta terminando.\n"); fflush(stdout);
+    LOG_DEBUG("\n[Listener Thread] Thread de escuta terminando.\n");
     pthread_exit(NULL);
 }
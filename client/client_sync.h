@@ -2,16 +2,46 @@
 #define CLIENT_SYNC_H
 
 #include "../common/packet.h"
+#include "../common/batch.h"
 #include <limits.h> 
 #include <sys/inotify.h> 
 #include <pthread.h>
+#include <sys/stat.h>
 
-#define INOTIFY_BUF_LEN (10 * (sizeof(struct inotify_event) + NAME_MAX + 1))
+// Room for a create and a close event per file of a full batch, so a burst
+// of new files is read, and uploaded, in one go
+#define INOTIFY_BUF_LEN (2 * BATCH_MAX_FILES * (sizeof(struct inotify_event) + NAME_MAX + 1))
+
+// How long an IN_MOVED_FROM waits for its IN_MOVED_TO when they come in
+// separate reads; unpaired, the file or directory left the synced tree
+#define MOVE_PAIR_WAIT_MS 10
+
+// Directories that cannot get a watch of their own, once the per-user limit
+// (fs.inotify.max_user_watches) is reached, are scanned for changes instead,
+// this often
+#define SCAN_INTERVAL_MS 2000
+#define SCAN_BUCKETS     4096
+
+// Changes the client makes to apply the server's are expected: the inotify
+// thread sees them like any other and would send each one back
+#define EXPECT_BUCKETS 1024
 
 extern pthread_mutex_t socket_mutex; 
 
 void *notify_file_change_thread(void *parameter);
 void *server_updates_listener_thread(void *arg);
+// Both apply a push the listener read; call with socket_mutex held.
 void handle_server_initiated_download(int sock, const char *filename, const char* sync_dir_abs_path);
+void handle_server_initiated_batch(int sock, const packet_t *req, const char* sync_dir_abs_path);
+
+// Records what 'name' (relative to the sync dir) is about to look like,
+// NULL for gone, so the inotify thread takes the change for the server's
+// own. Call before making the change, and sync_expect_cancel if it fails.
+// Does nothing until the inotify thread runs.
+void sync_expect(const char *name, const struct stat *st);
+void sync_expect_cancel(const char *name);
+// Renames the complete temporary file 'tmp_path' to 'name' as an expected
+// change. Returns 0 or -1 (errno set).
+int  sync_install(const char *tmp_path, const char *name);
 
 #endif // CLIENT_SYNC_H
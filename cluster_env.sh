@@ -0,0 +1,70 @@
+#!/usr/bin/env bash
+# Local cluster harness: runs several myServer nodes on one box, each with its
+# own storage directory, sharing one membership file.
+#
+#   ./cluster_env.sh start [n]   starts nodes n1..nN (default 3)
+#   ./cluster_env.sh add         starts one more node and rebalances (SIGHUP)
+#   ./cluster_env.sh status      shows nodes and which users each one stores
+#   ./cluster_env.sh stop        stops every node
+#
+# Clients can point at any node: ./myClient alice 127.0.0.1 $BASE_PORT
+# Variables: CLUSTER_DIR (default /tmp/sync_cluster), BASE_PORT (default 24001)
+set -euo pipefail
+
+ROOT=$(cd "$(dirname "$0")" && pwd)
+CLUSTER_DIR=${CLUSTER_DIR:-/tmp/sync_cluster}
+BASE_PORT=${BASE_PORT:-24001}
+MEMBERS="$CLUSTER_DIR/cluster.conf"
+
+node_count() {
+  [ -f "$MEMBERS" ] && grep -c '^n' "$MEMBERS" || true
+}
+
+start_node() {
+  local i=$1 port=$((BASE_PORT + $1 - 1))
+  mkdir -p "$CLUSTER_DIR/n$i"
+  "$ROOT/myServer" -C "$MEMBERS" -i "n$i" -s "$CLUSTER_DIR/n$i/storage" "$port" \
+    > "$CLUSTER_DIR/n$i/server.log" 2>&1 &
+  echo $! > "$CLUSTER_DIR/n$i/pid"
+  echo "n$i: 127.0.0.1:$port (pid $!, log $CLUSTER_DIR/n$i/server.log)"
+}
+
+case "${1:-}" in
+  start)
+    n=${2:-3}
+    make -C "$ROOT" all > /dev/null
+    mkdir -p "$CLUSTER_DIR"
+    echo "# id host porta" > "$MEMBERS"
+    for i in $(seq 1 "$n"); do echo "n$i 127.0.0.1 $((BASE_PORT + i - 1))" >> "$MEMBERS"; done
+    for i in $(seq 1 "$n"); do start_node "$i"; done
+    ;;
+  add)
+    i=$(( $(node_count) + 1 ))
+    echo "n$i 127.0.0.1 $((BASE_PORT + i - 1))" >> "$MEMBERS"
+    start_node "$i"
+    sleep 0.5
+    # Existing nodes reload the file and move the users they no longer own
+    for pidfile in "$CLUSTER_DIR"/n*/pid; do
+      [ "$pidfile" = "$CLUSTER_DIR/n$i/pid" ] || kill -HUP "$(cat "$pidfile")"
+    done
+    ;;
+  status)
+    for dir in "$CLUSTER_DIR"/n*/; do
+      node=$(basename "$dir")
+      state="parado"
+      kill -0 "$(cat "$dir/pid")" 2> /dev/null && state="ativo"
+      users=$(ls "$dir/storage" 2> /dev/null | tr '\n' ' ')
+      echo "$node ($state): ${users:-(nenhum usuário)}"
+    done
+    ;;
+  stop)
+    for pidfile in "$CLUSTER_DIR"/n*/pid; do
+      kill "$(cat "$pidfile")" 2> /dev/null || true
+      rm -f "$pidfile"
+    done
+    ;;
+  *)
+    sed -n '2,10p' "$0"
+    exit 1
+    ;;
+esac
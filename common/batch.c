@@ -0,0 +1,119 @@
+#include "batch.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+void batch_writer_init(batch_writer_t *w, int sock, uint32_t first_seq) {
+    memset(w, 0, sizeof(*w));
+    w->sock = sock;
+    w->seq = first_seq;
+    w->pkt.type = PKT_BATCH_DATA;
+}
+
+static int flush_packet(batch_writer_t *w) {
+    if (w->error) return -1;
+    if (w->pkt.payload_size == 0) return 0;
+    w->pkt.seq_num = w->seq++;
+    if (send_packet(w->sock, &w->pkt) != 0) w->error = 1;
+    w->pkt.payload_size = 0;
+    return w->error ? -1 : 0;
+}
+
+int batch_add_file(batch_writer_t *w, const char *name, uint64_t size) {
+    char header[MAX_PAYLOAD];
+    int len = snprintf(header, sizeof(header), "%s%c%llu", name, '\0', (unsigned long long)size);
+    if (len < 0 || (size_t)len + 1 > sizeof(header)) return -1;
+    len++; // The size's terminator
+    if (w->pkt.payload_size + (uint32_t)len > MAX_PAYLOAD && flush_packet(w) != 0) return -1;
+    memcpy(w->pkt.payload + w->pkt.payload_size, header, (size_t)len);
+    w->pkt.payload_size += (uint32_t)len;
+    return w->error ? -1 : 0;
+}
+
+int batch_write(batch_writer_t *w, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0 && !w->error) {
+        if (w->pkt.payload_size == MAX_PAYLOAD && flush_packet(w) != 0) break;
+        size_t room = MAX_PAYLOAD - w->pkt.payload_size;
+        size_t n = len < room ? len : room;
+        memcpy(w->pkt.payload + w->pkt.payload_size, p, n);
+        w->pkt.payload_size += (uint32_t)n;
+        p += n;
+        len -= n;
+    }
+    return w->error ? -1 : 0;
+}
+
+int batch_finish(batch_writer_t *w, uint32_t *end_seq) {
+    if (flush_packet(w) != 0) return -1;
+    packet_t end = { .type = PKT_BATCH_DATA, .seq_num = w->seq, .payload_size = 0 };
+    if (end_seq) *end_seq = w->seq;
+    if (send_packet(w->sock, &end) != 0) w->error = 1;
+    return w->error ? -1 : 0;
+}
+
+void batch_reader_init(batch_reader_t *r, int sock) {
+    memset(r, 0, sizeof(*r));
+    r->sock = sock;
+}
+
+// Makes sure unread payload is available. Returns 1 if so, 0 at the end of
+// the batch and -1 on a broken stream.
+static int fill(batch_reader_t *r) {
+    if (r->ended) return 0;
+    if (r->offset < r->pkt.payload_size) return 1;
+    if (recv_packet(r->sock, &r->pkt) != 0 || r->pkt.type != PKT_BATCH_DATA || r->pkt.payload_size > MAX_PAYLOAD) {
+        return -1;
+    }
+    r->offset = 0;
+    if (r->pkt.payload_size == 0) {
+        r->ended = 1;
+        return 0;
+    }
+    return 1;
+}
+
+long batch_read(batch_reader_t *r, void *buf, size_t len) {
+    if (r->left == 0) return 0;
+    int rc = fill(r);
+    if (rc <= 0) return -1; // The batch may not end inside a file
+    size_t avail = r->pkt.payload_size - r->offset;
+    size_t n = len < avail ? len : avail;
+    if (n > r->left) n = (size_t)r->left;
+    memcpy(buf, r->pkt.payload + r->offset, n);
+    r->offset += n;
+    r->left -= n;
+    return (long)n;
+}
+
+int batch_next_file(batch_reader_t *r, char *name, size_t name_len, uint64_t *size) {
+    char skip[MAX_PAYLOAD];
+    long n;
+    while ((n = batch_read(r, skip, sizeof(skip))) > 0) {
+    }
+    if (n < 0) return -1;
+
+    int rc = fill(r);
+    if (rc <= 0) return rc;
+    const char *p = r->pkt.payload + r->offset;
+    size_t avail = r->pkt.payload_size - r->offset;
+    const char *name_end = memchr(p, '\0', avail);
+    if (!name_end) return -1;
+    const char *size_str = name_end + 1;
+    const char *size_end = memchr(size_str, '\0', avail - (size_t)(size_str - p));
+    if (!size_end || size_end == size_str) return -1;
+
+    char *parse_end;
+    unsigned long long declared = strtoull(size_str, &parse_end, 10);
+    if (parse_end != size_end) return -1;
+    if ((size_t)(name_end - p) >= name_len) return -1;
+    memcpy(name, p, (size_t)(name_end - p) + 1);
+    *size = declared;
+    r->left = declared;
+    r->offset += (size_t)(size_end - p) + 1;
+    return 1;
+}
+
+uint32_t batch_end_seq(const batch_reader_t *r) {
+    return r->pkt.seq_num;
+}
@@ -0,0 +1,60 @@
+#ifndef COMMON_BATCH_H
+#define COMMON_BATCH_H
+
+#include "packet.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// Batched transfer of small files (PKT_BATCH_UPLOAD).
+//
+// The sender asks with PKT_BATCH_UPLOAD, payload "<file count>\0", and waits
+// for its ACK. It then streams PKT_BATCH_DATA packets without waiting for
+// ACKs: their payloads, concatenated, hold one entry per file, the header
+// "name\0<size>\0" followed by 'size' bytes of contents. A header never
+// spans two packets; contents may. A 0-byte PKT_BATCH_DATA ends the batch
+// and is answered with a single ACK whose payload is the number of files
+// the receiver stored ("<n>\0"), or a NACK if it stored none.
+//
+// Only files of at most BATCH_MAX_FILE_SIZE bytes travel in batches, and at
+// most BATCH_MAX_FILES per batch; larger files use the regular transfer.
+
+#define BATCH_MAX_FILES     64
+#define BATCH_MAX_FILE_SIZE (64 * 1024)
+
+typedef struct {
+    int      sock;
+    uint32_t seq;
+    int      error;  // A send failed; everything after it is dropped
+    packet_t pkt;    // Packet being filled
+} batch_writer_t;
+
+// Data packets start at 'first_seq'.
+void batch_writer_init(batch_writer_t *w, int sock, uint32_t first_seq);
+// Starts the entry for a file of 'size' bytes; 'size' bytes of batch_write
+// must follow. Returns -1 if the connection failed.
+int  batch_add_file(batch_writer_t *w, const char *name, uint64_t size);
+int  batch_write(batch_writer_t *w, const void *buf, size_t len);
+// Flushes and sends the end packet; its sequence number is returned in
+// *end_seq so the caller can match the receiver's ACK.
+int  batch_finish(batch_writer_t *w, uint32_t *end_seq);
+
+typedef struct {
+    int      sock;
+    size_t   offset;  // Next unread byte of pkt's payload
+    uint64_t left;    // Contents of the current file still unread
+    int      ended;   // The 0-byte end packet arrived
+    packet_t pkt;
+} batch_reader_t;
+
+void batch_reader_init(batch_reader_t *r, int sock);
+// Reads the next header, skipping whatever is left of the current file.
+// Returns 1 with the entry's name and size, 0 at the end of the batch and
+// -1 if the stream broke or is malformed.
+int  batch_next_file(batch_reader_t *r, char *name, size_t name_len, uint64_t *size);
+// Reads up to 'len' bytes of the current file's contents. Returns the
+// number read, 0 once the file is complete, or -1 on a broken stream.
+long batch_read(batch_reader_t *r, void *buf, size_t len);
+// Sequence number of the end packet, valid once batch_next_file returned 0.
+uint32_t batch_end_seq(const batch_reader_t *r);
+
+#endif // COMMON_BATCH_H
@@ -0,0 +1,260 @@
+#include "log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+#define LOG_FLUSH_INTERVAL_MS 20
+#define LOG_FLUSH_BATCH       4096
+
+typedef struct {
+    uint64_t ts_ns;   // CLOCK_REALTIME, for human-readable timestamps
+    int      tid;
+    uint8_t  level;
+    uint16_t len;
+    char     msg[LOG_MSG_MAX];
+} log_record_t;
+
+typedef struct log_ring {
+    _Atomic uint64_t head;      // Next slot to write (producer only)
+    _Atomic uint64_t tail;      // Next slot to read (flusher only)
+    _Atomic int      in_use;    // Owned by a live thread
+    _Atomic uint64_t dropped;
+    int              tid;
+    struct log_ring *next;      // Rings are never freed, only reused
+    log_record_t     slots[LOG_RING_SLOTS];
+} log_ring_t;
+
+static _Atomic(log_ring_t *) rings_head = NULL;
+static __thread log_ring_t *tls_ring = NULL;
+static pthread_key_t ring_release_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+
+static _Atomic int log_min_level = LOG_LEVEL_INFO;
+static _Atomic int log_running = 0;
+static int log_fd = 2;
+static pthread_t flusher_tid;
+static pthread_mutex_t lifecycle_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *level_names[] = { "DEBUG", "INFO ", "WARN ", "ERROR" };
+
+static void release_ring(void *arg) {
+    log_ring_t *ring = (log_ring_t *)arg;
+    // Pending records stay in the ring and are drained by the flusher;
+    // the next thread that claims it keeps appending after them.
+    atomic_store_explicit(&ring->in_use, 0, memory_order_release);
+}
+
+static void make_ring_key(void) {
+    pthread_key_create(&ring_release_key, release_ring);
+}
+
+static log_ring_t *acquire_ring(void) {
+    if (tls_ring) return tls_ring;
+    pthread_once(&ring_key_once, make_ring_key);
+
+    log_ring_t *ring = NULL;
+    for (log_ring_t *r = atomic_load_explicit(&rings_head, memory_order_acquire); r; r = r->next) {
+        int expected = 0;
+        if (atomic_compare_exchange_strong(&r->in_use, &expected, 1)) { ring = r; break; }
+    }
+    if (!ring) {
+        ring = calloc(1, sizeof(log_ring_t));
+        if (!ring) return NULL;
+        atomic_store(&ring->in_use, 1);
+        log_ring_t *old_head = atomic_load(&rings_head);
+        do {
+            ring->next = old_head;
+        } while (!atomic_compare_exchange_weak(&rings_head, &old_head, ring));
+    }
+    ring->tid = (int)syscall(SYS_gettid);
+    tls_ring = ring;
+    pthread_setspecific(ring_release_key, ring);
+    return ring;
+}
+
+void log_set_level(log_level_t level) {
+    atomic_store_explicit(&log_min_level, (int)level, memory_order_relaxed);
+}
+
+int log_enabled(log_level_t level) {
+    return (int)level >= atomic_load_explicit(&log_min_level, memory_order_relaxed);
+}
+
+static uint64_t realtime_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+// Formats one record as a text line. Returns the number of bytes written to 'out'.
+static size_t format_line(char *out, size_t cap, const log_record_t *rec) {
+    time_t secs = (time_t)(rec->ts_ns / 1000000000ull);
+    struct tm tm_local;
+    localtime_r(&secs, &tm_local);
+    char when[32];
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &tm_local);
+    int n = snprintf(out, cap, "%s.%06u %s [%d] %.*s\n", when,
+                     (unsigned)((rec->ts_ns / 1000ull) % 1000000ull),
+                     level_names[rec->level < LOG_LEVEL_OFF ? rec->level : LOG_LEVEL_ERROR],
+                     rec->tid, (int)rec->len, rec->msg);
+    if (n < 0) return 0;
+    return (size_t)n < cap ? (size_t)n : cap - 1;
+}
+
+static void write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t w = write(fd, buf, len);
+        if (w <= 0) return;
+        buf += w;
+        len -= (size_t)w;
+    }
+}
+
+void log_write(log_level_t level, const char *fmt, ...) {
+    log_record_t tmp;
+    log_record_t *rec = &tmp;
+    log_ring_t *ring = atomic_load_explicit(&log_running, memory_order_acquire) ? acquire_ring() : NULL;
+    uint64_t head = 0;
+
+    if (ring) {
+        head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        if (head - tail >= LOG_RING_SLOTS) {
+            atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+            return;
+        }
+        rec = &ring->slots[head & (LOG_RING_SLOTS - 1)];
+    }
+
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(rec->msg, LOG_MSG_MAX, fmt, ap);
+    va_end(ap);
+    if (n < 0) n = 0;
+    size_t len = (size_t)n < LOG_MSG_MAX ? (size_t)n : LOG_MSG_MAX - 1;
+
+    // Messages inherited from printf often carry leading/trailing newlines
+    size_t start = 0;
+    while (start < len && rec->msg[start] == '\n') start++;
+    while (len > start && rec->msg[len - 1] == '\n') len--;
+    if (start > 0) memmove(rec->msg, rec->msg + start, len - start);
+    rec->len = (uint16_t)(len - start);
+    rec->level = (uint8_t)level;
+    rec->ts_ns = realtime_ns();
+
+    if (ring) {
+        rec->tid = ring->tid;
+        atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    } else {
+        // Logger not running (early startup or after shutdown): write synchronously
+        rec->tid = (int)syscall(SYS_gettid);
+        char line[LOG_MSG_MAX + 64];
+        write_all(log_fd, line, format_line(line, sizeof(line), rec));
+    }
+}
+
+static int cmp_record_ts(const void *a, const void *b) {
+    const log_record_t *x = *(const log_record_t * const *)a, *y = *(const log_record_t * const *)b;
+    return (x->ts_ns > y->ts_ns) - (x->ts_ns < y->ts_ns);
+}
+
+// Drains every ring once. Returns the number of records written.
+static size_t drain_rings(void) {
+    static log_record_t *batch[LOG_FLUSH_BATCH];
+    static log_ring_t   *batch_ring[LOG_FLUSH_BATCH];
+    static char          out[LOG_FLUSH_BATCH * 96];
+    size_t total = 0;
+
+    for (;;) {
+        size_t count = 0;
+        uint64_t dropped = 0;
+        for (log_ring_t *r = atomic_load_explicit(&rings_head, memory_order_acquire); r; r = r->next) {
+            uint64_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+            uint64_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+            for (; tail < head && count < LOG_FLUSH_BATCH; tail++) {
+                batch[count] = &r->slots[tail & (LOG_RING_SLOTS - 1)];
+                batch_ring[count] = r;
+                count++;
+            }
+            dropped += atomic_exchange_explicit(&r->dropped, 0, memory_order_relaxed);
+        }
+        if (count == 0 && dropped == 0) break;
+
+        qsort(batch, count, sizeof(batch[0]), cmp_record_ts);
+        size_t used = 0;
+        for (size_t i = 0; i < count; i++) {
+            char line[LOG_MSG_MAX + 64];
+            size_t n = format_line(line, sizeof(line), batch[i]);
+            if (used + n > sizeof(out)) {
+                write_all(log_fd, out, used);
+                used = 0;
+            }
+            memcpy(out + used, line, n);
+            used += n;
+        }
+        if (dropped > 0) {
+            int n = snprintf(out + used, sizeof(out) - used, "[log] %llu mensagem(ns) descartada(s) (buffer cheio)\n",
+                             (unsigned long long)dropped);
+            if (n > 0 && used + (size_t)n < sizeof(out)) used += (size_t)n;
+        }
+        write_all(log_fd, out, used);
+
+        // Release the slots only after they were formatted. Records were taken
+        // from each ring in order, so advancing every ring by its count is exact.
+        for (size_t i = 0; i < count; i++) {
+            atomic_fetch_add_explicit(&batch_ring[i]->tail, 1, memory_order_release);
+        }
+        total += count;
+        if (count < LOG_FLUSH_BATCH) break;
+    }
+    return total;
+}
+
+static void *flusher_thread(void *arg) {
+    (void)arg;
+    struct timespec interval = { .tv_sec = 0, .tv_nsec = LOG_FLUSH_INTERVAL_MS * 1000000L };
+    while (atomic_load_explicit(&log_running, memory_order_acquire)) {
+        if (drain_rings() == 0) nanosleep(&interval, NULL);
+    }
+    drain_rings(); // Final drain after shutdown was requested
+    return NULL;
+}
+
+static log_level_t level_from_env(log_level_t fallback) {
+    const char *v = getenv("SYNC_LOG_LEVEL");
+    if (!v) return fallback;
+    if (strcmp(v, "debug") == 0) return LOG_LEVEL_DEBUG;
+    if (strcmp(v, "info") == 0)  return LOG_LEVEL_INFO;
+    if (strcmp(v, "warn") == 0)  return LOG_LEVEL_WARN;
+    if (strcmp(v, "error") == 0) return LOG_LEVEL_ERROR;
+    if (strcmp(v, "off") == 0)   return LOG_LEVEL_OFF;
+    return fallback;
+}
+
+void log_init(int fd, log_level_t min_level) {
+    pthread_mutex_lock(&lifecycle_mutex);
+    log_fd = fd;
+    log_set_level(level_from_env(min_level));
+    if (!atomic_load(&log_running)) {
+        atomic_store(&log_running, 1);
+        if (pthread_create(&flusher_tid, NULL, flusher_thread, NULL) != 0) {
+            atomic_store(&log_running, 0); // Fall back to synchronous writes
+        }
+    }
+    pthread_mutex_unlock(&lifecycle_mutex);
+}
+
+void log_shutdown(void) {
+    pthread_mutex_lock(&lifecycle_mutex);
+    if (atomic_load(&log_running)) {
+        atomic_store(&log_running, 0);
+        pthread_join(flusher_tid, NULL);
+    }
+    pthread_mutex_unlock(&lifecycle_mutex);
+}
@@ -0,0 +1,60 @@
+#ifndef COMMON_LOG_H
+#define COMMON_LOG_H
+
+#include <stdatomic.h>
+
+// Asynchronous logger shared by client and server.
+//
+// Each thread writes fixed-size records into its own lock-free ring buffer
+// (single producer, single consumer); a background flusher drains all rings,
+// orders the batch by timestamp and writes it with one write() call. Callers
+// never block on I/O and never take a lock, so logging is safe while holding
+// socket_mutex or sessions_mutex. If a ring is full the record is dropped and
+// counted; the flusher reports the drop count.
+
+typedef enum {
+    LOG_LEVEL_DEBUG,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_WARN,
+    LOG_LEVEL_ERROR,
+    LOG_LEVEL_OFF
+} log_level_t;
+
+// Levels below LOG_COMPILE_LEVEL are removed at compile time (release builds
+// use LOG_LEVEL_INFO, see the Makefile).
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+#define LOG_RING_SLOTS 256   // Per thread, power of two
+#define LOG_MSG_MAX    232   // Longer messages are truncated
+
+// Starts the flusher thread writing to 'fd'. The runtime level can be
+// overridden with SYNC_LOG_LEVEL=debug|info|warn|error|off.
+void log_init(int fd, log_level_t min_level);
+// Drains every ring and stops the flusher. Safe to call more than once.
+void log_shutdown(void);
+void log_set_level(log_level_t level);
+int  log_enabled(log_level_t level);
+
+void log_write(log_level_t level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+#define LOG_AT(level, ...) \
+    do { if ((level) >= LOG_COMPILE_LEVEL && log_enabled(level)) log_write((level), __VA_ARGS__); } while (0)
+
+#define LOG_DEBUG(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define LOG_INFO(...)  LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG_WARN(...)  LOG_AT(LOG_LEVEL_WARN, __VA_ARGS__)
+#define LOG_ERROR(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+
+// Debug message emitted only once every 'n' executions of this call site,
+// for per-chunk paths.
+#define LOG_DEBUG_SAMPLED(n, ...) \
+    do { \
+        static _Atomic unsigned long log_sample_counter_; \
+        if (LOG_LEVEL_DEBUG >= LOG_COMPILE_LEVEL && log_enabled(LOG_LEVEL_DEBUG) && \
+            atomic_fetch_add_explicit(&log_sample_counter_, 1, memory_order_relaxed) % (n) == 0) \
+            log_write(LOG_LEVEL_DEBUG, __VA_ARGS__); \
+    } while (0)
+
+#endif // COMMON_LOG_H
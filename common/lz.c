@@ -0,0 +1,122 @@
+#include "lz.h"
+#include <stdint.h>
+#include <string.h>
+
+#define LZ_HASH_BITS 12
+#define LZ_SKIP_TRIGGER 5 // Misses before the scan starts skipping ahead
+
+static uint32_t read32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t hash4(uint32_t v) {
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// Writes a length that did not fit its nibble as 255-valued bytes plus a
+// remainder. Returns the new output position or NULL if out of room.
+static unsigned char *put_length(unsigned char *op, const unsigned char *oend, size_t n) {
+    while (n >= 255) {
+        if (op >= oend) return NULL;
+        *op++ = 255;
+        n -= 255;
+    }
+    if (op >= oend) return NULL;
+    *op++ = (unsigned char)n;
+    return op;
+}
+
+// Emits literals [lit, lit+lit_len) followed by a match (match_len 0: none).
+static unsigned char *put_sequence(unsigned char *op, const unsigned char *oend,
+                                   const unsigned char *lit, size_t lit_len,
+                                   size_t offset, size_t match_len) {
+    if (op >= oend) return NULL;
+    unsigned char *token = op++;
+    size_t ml = match_len ? match_len - LZ_MIN_MATCH : 0;
+    *token = (unsigned char)(((lit_len < 15 ? lit_len : 15) << 4) | (ml < 15 ? ml : 15));
+    if (lit_len >= 15 && !(op = put_length(op, oend, lit_len - 15))) return NULL;
+    if ((size_t)(oend - op) < lit_len) return NULL;
+    memcpy(op, lit, lit_len);
+    op += lit_len;
+    if (match_len == 0) return op;
+    if (oend - op < 2) return NULL;
+    *op++ = (unsigned char)(offset & 0xff);
+    *op++ = (unsigned char)(offset >> 8);
+    if (ml >= 15 && !(op = put_length(op, oend, ml - 15))) return NULL;
+    return op;
+}
+
+size_t lz_compress(const void *src, size_t len, void *dst, size_t cap) {
+    if (len > LZ_MAX_INPUT) return 0;
+    const unsigned char *in = src;
+    unsigned char *op = dst;
+    const unsigned char *oend = op + cap;
+    uint16_t table[1 << LZ_HASH_BITS]; // Position + 1 of the last 4 bytes with each hash
+    memset(table, 0, sizeof(table));
+
+    size_t ip = 0, anchor = 0;
+    unsigned misses = 0;
+    while (ip + LZ_MIN_MATCH <= len) {
+        uint32_t seq = read32(in + ip);
+        uint32_t h = hash4(seq);
+        size_t cand = table[h];
+        table[h] = (uint16_t)(ip + 1);
+        if (cand == 0 || read32(in + cand - 1) != seq) {
+            // Incompressible stretches are scanned with growing steps
+            ip += 1 + (misses++ >> LZ_SKIP_TRIGGER);
+            continue;
+        }
+        cand--;
+        misses = 0;
+        size_t match_len = LZ_MIN_MATCH;
+        while (ip + match_len < len && in[cand + match_len] == in[ip + match_len]) match_len++;
+        op = put_sequence(op, oend, in + anchor, ip - anchor, ip - cand, match_len);
+        if (!op) return 0;
+        ip += match_len;
+        anchor = ip;
+    }
+    op = put_sequence(op, oend, in + anchor, len - anchor, 0, 0);
+    return op ? (size_t)(op - (unsigned char *)dst) : 0;
+}
+
+// Reads the extra bytes of a length whose nibble was 15.
+static int get_length(const unsigned char **ip, const unsigned char *iend, size_t *n) {
+    unsigned char b;
+    do {
+        if (*ip >= iend) return -1;
+        b = *(*ip)++;
+        *n += b;
+    } while (b == 255);
+    return 0;
+}
+
+long lz_decompress(const void *src, size_t len, void *dst, size_t cap) {
+    const unsigned char *ip = src;
+    const unsigned char *iend = ip + len;
+    unsigned char *out = dst;
+    size_t op = 0;
+
+    while (ip < iend) {
+        unsigned char token = *ip++;
+        size_t lit_len = token >> 4;
+        if (lit_len == 15 && get_length(&ip, iend, &lit_len) != 0) return -1;
+        if ((size_t)(iend - ip) < lit_len || cap - op < lit_len) return -1;
+        memcpy(out + op, ip, lit_len);
+        ip += lit_len;
+        op += lit_len;
+        if (ip == iend) return (long)op; // The last sequence has no match
+
+        if (iend - ip < 2) return -1;
+        size_t offset = (size_t)ip[0] | ((size_t)ip[1] << 8);
+        ip += 2;
+        size_t match_len = token & 0x0f;
+        if (match_len == 15 && get_length(&ip, iend, &match_len) != 0) return -1;
+        match_len += LZ_MIN_MATCH;
+        if (offset == 0 || offset > op || cap - op < match_len) return -1;
+        // Byte by byte: the match may overlap the bytes it produces
+        for (size_t i = 0; i < match_len; i++, op++) out[op] = out[op - offset];
+    }
+    return len == 0 ? 0 : -1; // Input ended right after a match
+}
@@ -0,0 +1,25 @@
+#ifndef COMMON_LZ_H
+#define COMMON_LZ_H
+
+#include <stddef.h>
+
+// Small LZ77 block codec for packet payloads, in the LZ4 block layout: a
+// run of sequences, each a token byte (literal count in the high nibble,
+// match length - LZ_MIN_MATCH in the low one, 15 meaning "more length bytes
+// follow"), the literals, then a 2-byte little-endian back offset and the
+// extra match length bytes. The last sequence has literals only. There is
+// no entropy stage: it trades ratio for speed, which is what a per-chunk
+// codec on the send path needs.
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_INPUT 65535 // Offsets are 16 bits
+
+// Compresses 'len' bytes of 'src' into 'dst'. Returns the compressed size,
+// or 0 if it would not fit in 'cap' bytes (pass cap < len to keep only
+// results that actually shrink) or 'len' exceeds LZ_MAX_INPUT.
+size_t lz_compress(const void *src, size_t len, void *dst, size_t cap);
+// Decompresses into at most 'cap' bytes. Returns the decompressed size, or
+// -1 if the input is malformed or does not fit.
+long   lz_decompress(const void *src, size_t len, void *dst, size_t cap);
+
+#endif // COMMON_LZ_H
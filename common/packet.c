@@ -1,25 +1,104 @@
 #include "packet.h"
+#include "trace.h"
+#include "lz.h"
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
 #include <errno.h>
 #include <stdio.h>
 #include <string.h> // For memcpy if not included elsewhere
+#include <stdatomic.h>
+
+static _Atomic uint64_t stat_packets_sent;
+static _Atomic uint64_t stat_packets_received;
+static _Atomic uint64_t stat_bytes_sent;
+static _Atomic uint64_t stat_bytes_received;
+static _Atomic uint64_t stat_compressed_sent;
+static _Atomic uint64_t stat_compressed_received;
+static _Atomic uint64_t stat_saved_sent;
+static _Atomic uint64_t stat_saved_received;
+static _Atomic uint64_t stat_compress_bypassed;
+
+// Per-socket compression state, indexed by descriptor
+typedef struct {
+    _Atomic unsigned char enabled;
+    _Atomic unsigned char misses;  // Payloads in a row that did not shrink
+    _Atomic unsigned char backoff; // Packets left to send before trying again
+} compress_state_t;
+
+static compress_state_t compress_states[PACKET_MAX_FDS];
+
+// Whether this packet should go through the compressor at all.
+static int compression_worth_trying(int sockfd, uint32_t payload_size) {
+    if (payload_size < PACKET_COMPRESS_MIN || sockfd < 0 || sockfd >= PACKET_MAX_FDS) return 0;
+    compress_state_t *cs = &compress_states[sockfd];
+    if (!atomic_load_explicit(&cs->enabled, memory_order_relaxed)) return 0;
+    unsigned char backoff = atomic_load_explicit(&cs->backoff, memory_order_relaxed);
+    if (backoff > 0) {
+        atomic_store_explicit(&cs->backoff, backoff - 1, memory_order_relaxed);
+        return 0;
+    }
+    return 1;
+}
+
+static void note_compression_result(int sockfd, int shrank) {
+    compress_state_t *cs = &compress_states[sockfd];
+    if (shrank) {
+        atomic_store_explicit(&cs->misses, 0, memory_order_relaxed);
+        return;
+    }
+    atomic_fetch_add_explicit(&stat_compress_bypassed, 1, memory_order_relaxed);
+    unsigned char misses = atomic_load_explicit(&cs->misses, memory_order_relaxed) + 1;
+    if (misses >= PACKET_COMPRESS_MISSES) {
+        misses = 0;
+        atomic_store_explicit(&cs->backoff, PACKET_COMPRESS_BACKOFF, memory_order_relaxed);
+    }
+    atomic_store_explicit(&cs->misses, misses, memory_order_relaxed);
+}
 
 int send_packet(int sockfd, const packet_t *pkt) {
-    packet_t netpkt = *pkt;
+    if (pkt->payload_size > MAX_PAYLOAD) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    packet_t netpkt;
+    uint32_t type = (uint32_t)pkt->type;
+    uint32_t wire_size = pkt->payload_size;
+    size_t compressed = 0;
+    if (compression_worth_trying(sockfd, wire_size)) {
+        compressed = lz_compress(pkt->payload, wire_size, netpkt.payload, wire_size - wire_size / PACKET_COMPRESS_GAIN);
+        note_compression_result(sockfd, compressed > 0);
+    }
+    if (compressed > 0) {
+        atomic_fetch_add_explicit(&stat_compressed_sent, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&stat_saved_sent, wire_size - compressed, memory_order_relaxed);
+        type |= PKT_FLAG_COMPRESSED;
+        wire_size = (uint32_t)compressed;
+    } else {
+        memcpy(netpkt.payload, pkt->payload, wire_size);
+    }
+    netpkt.type         = (packet_type_t)type;
     netpkt.seq_num      = htonl(pkt->seq_num);
-    netpkt.payload_size = htonl(pkt->payload_size);
-    ssize_t sent = write(sockfd, &netpkt, sizeof(packet_t)); // Ensure to send entire packet_t size
-    return (sent == sizeof(packet_t)) ? 0 : -1;
+    netpkt.payload_size = htonl(wire_size);
+    netpkt.trace_id     = htonl(trace_current());
+    size_t len = PACKET_HEADER_SIZE + wire_size; // Only the used part of the payload
+    ssize_t sent = write(sockfd, &netpkt, len);
+    if (sent > 0) {
+        atomic_fetch_add_explicit(&stat_bytes_sent, (uint64_t)sent, memory_order_relaxed);
+        atomic_fetch_add_explicit(&stat_packets_sent, 1, memory_order_relaxed);
+    }
+    return (sent == (ssize_t)len) ? 0 : -1;
 }
 
-int recv_packet(int sockfd, packet_t *pkt) {
-    char *buffer = (char *)pkt; // Ponteiro para o início da estrutura do pacote
-    size_t bytes_to_receive = sizeof(packet_t); // Ensure to receive entire packet_t size
-    ssize_t bytes_received_total = 0;
+// Reads exactly 'len' bytes. Returns 0, or -1 on error or end of stream.
+static int read_full(int sockfd, void *buf, size_t len) {
+    char *buffer = buf;
+    size_t bytes_received_total = 0;
 
-    while (bytes_received_total < bytes_to_receive) {
-        ssize_t bytes_received_now = read(sockfd, buffer + bytes_received_total, bytes_to_receive - bytes_received_total);
+    while (bytes_received_total < len) {
+        ssize_t bytes_received_now = read(sockfd, buffer + bytes_received_total, len - bytes_received_total);
 
         if (bytes_received_now == -1) {
             if (errno == EINTR) { // Chamada interrompida por um sinal, tente novamente
@@ -31,14 +110,101 @@ int recv_packet(int sockfd, packet_t *pkt) {
 
         if (bytes_received_now == 0) {
             // Conexão fechada pelo peer antes de todos os dados serem recebidos
-            // fprintf(stderr, "recv_packet: Conexão fechada. Esperado %zu bytes, recebido %zd no total.\n", bytes_to_receive, bytes_received_total);
             return -1; // Conexão fechada
         }
-        bytes_received_total += bytes_received_now;
+        bytes_received_total += (size_t)bytes_received_now;
+    }
+    return 0;
+}
+
+int recv_packet(int sockfd, packet_t *pkt) {
+    if (read_full(sockfd, pkt, PACKET_HEADER_SIZE) != 0) return -1;
+    uint32_t type      = (uint32_t)pkt->type;
+    uint32_t wire_size = ntohl(pkt->payload_size);
+    if (wire_size > MAX_PAYLOAD) {
+        errno = EMSGSIZE;
+        return -1;
     }
 
-    // Se chegou aqui, todos os bytes foram recebidos
+    char compressed[MAX_PAYLOAD];
+    int is_compressed = (type & PKT_FLAG_COMPRESSED) != 0;
+    if (read_full(sockfd, is_compressed ? compressed : pkt->payload, wire_size) != 0) return -1;
+    atomic_fetch_add_explicit(&stat_bytes_received, PACKET_HEADER_SIZE + wire_size, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stat_packets_received, 1, memory_order_relaxed);
+
+    pkt->type         = (packet_type_t)(type & ~PKT_FLAG_COMPRESSED);
     pkt->seq_num      = ntohl(pkt->seq_num);
-    pkt->payload_size = ntohl(pkt->payload_size);
+    pkt->payload_size = wire_size;
+    pkt->trace_id     = ntohl(pkt->trace_id);
+    if (is_compressed) {
+        long n = lz_decompress(compressed, wire_size, pkt->payload, MAX_PAYLOAD);
+        if (n < 0) {
+            errno = EBADMSG; // The stream cannot be trusted past this point
+            return -1;
+        }
+        pkt->payload_size = (uint32_t)n;
+        atomic_fetch_add_explicit(&stat_compressed_received, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&stat_saved_received, (uint64_t)n - wire_size, memory_order_relaxed);
+    }
+    if (pkt->payload_size < MAX_PAYLOAD) pkt->payload[pkt->payload_size] = '\0';
+    return 0;
+}
+
+void packet_get_stats(packet_stats_t *out) {
+    out->packets_sent     = atomic_load_explicit(&stat_packets_sent, memory_order_relaxed);
+    out->packets_received = atomic_load_explicit(&stat_packets_received, memory_order_relaxed);
+    out->bytes_sent       = atomic_load_explicit(&stat_bytes_sent, memory_order_relaxed);
+    out->bytes_received   = atomic_load_explicit(&stat_bytes_received, memory_order_relaxed);
+    out->compressed_sent         = atomic_load_explicit(&stat_compressed_sent, memory_order_relaxed);
+    out->compressed_received     = atomic_load_explicit(&stat_compressed_received, memory_order_relaxed);
+    out->compress_saved_sent     = atomic_load_explicit(&stat_saved_sent, memory_order_relaxed);
+    out->compress_saved_received = atomic_load_explicit(&stat_saved_received, memory_order_relaxed);
+    out->compress_bypassed       = atomic_load_explicit(&stat_compress_bypassed, memory_order_relaxed);
+}
+
+void packet_set_nodelay(int sockfd) {
+    int one = 1;
+    setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+void packet_set_compression(int sockfd, int enabled) {
+    if (sockfd < 0 || sockfd >= PACKET_MAX_FDS) return;
+    compress_state_t *cs = &compress_states[sockfd];
+    atomic_store_explicit(&cs->misses, 0, memory_order_relaxed);
+    atomic_store_explicit(&cs->backoff, 0, memory_order_relaxed);
+    atomic_store_explicit(&cs->enabled, enabled ? 1 : 0, memory_order_relaxed);
+}
+
+void packet_offer_compression(packet_t *handshake) {
+    size_t len = strnlen(handshake->payload, MAX_PAYLOAD) + 1;
+    size_t offer_len = strlen(PACKET_COMPRESS_OFFER "\n");
+    if (len + offer_len > MAX_PAYLOAD) return; // No room: the session simply stays uncompressed
+    memcpy(handshake->payload + len, PACKET_COMPRESS_OFFER "\n", offer_len);
+    handshake->payload_size = (uint32_t)(len + offer_len);
+}
+
+int packet_wants_compression(const packet_t *handshake) {
+    size_t size = handshake->payload_size < MAX_PAYLOAD ? handshake->payload_size : MAX_PAYLOAD;
+    const char *p = memchr(handshake->payload, '\0', size);
+    if (!p) return 0;
+    const char *end = handshake->payload + size;
+    size_t offer_len = strlen(PACKET_COMPRESS_OFFER);
+    for (p++; p < end; ) { // "key=value" lines after the user name
+        const char *nl = memchr(p, '\n', (size_t)(end - p));
+        size_t n = nl ? (size_t)(nl - p) : (size_t)(end - p);
+        if (n == offer_len && memcmp(p, PACKET_COMPRESS_OFFER, n) == 0) return 1;
+        p += n + 1;
+    }
+    return 0;
+}
+
+int parse_host_port(const char *addr, char *host, size_t host_len, char *port, size_t port_len) {
+    const char *colon = strrchr(addr, ':');
+    if (!colon || colon == addr || colon[1] == '\0') return -1;
+    size_t hlen = (size_t)(colon - addr);
+    if (hlen >= host_len || strlen(colon + 1) >= port_len) return -1;
+    memcpy(host, addr, hlen);
+    host[hlen] = '\0';
+    strcpy(port, colon + 1);
     return 0;
 }
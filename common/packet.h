@@ -2,34 +2,116 @@
 #define COMMON_PACKET_H
 
 #include <stdint.h>
+#include <stddef.h>
 
 #define MAX_PAYLOAD 4096
 
+// File names in requests and pushes are paths relative to the user's sync
+// dir, with '/' between directories; directories are implied by the files
+// in them. A delete or rename whose name is a directory applies to every
+// file under it.
+#define LIST_STREAM_REQUEST "stream"
+
 typedef enum {
-    PKT_UPLOAD_REQ,
+    PKT_UPLOAD_REQ,    // payload "name\0", optionally followed by "<size>\0" (bytes about to be sent) and "<sha256 hex>\0"
     PKT_UPLOAD_DATA,
     PKT_DOWNLOAD_REQ,
     PKT_DOWNLOAD_DATA,
     PKT_DELETE_REQ,
-    PKT_LIST_SERVER_REQ,
+    PKT_LIST_SERVER_REQ, // Empty payload: one PKT_LIST_SERVER_RES; LIST_STREAM_REQUEST: as many as it takes, then an empty one
     PKT_LIST_SERVER_RES,
     PKT_LIST_CLIENT_REQ,
     PKT_SYNC_EVENT,
     PKT_GET_SYNC_DIR,  // ← novo
     PKT_ACK,
-    PKT_NACK
+    PKT_NACK,
+    PKT_REDIRECT,      // Handshake answer in cluster mode: payload "host:port" of the owning node
+    PKT_MIGRATE_USER,  // Node-to-node handshake that moves a user's files during rebalancing
+    PKT_REPL_HELLO,    // Primary -> backup handshake, payload "<epoch> <term>"; ACK payload "<epoch> <applied lsn>"
+    PKT_REPL_RECORD,   // seq_num = lsn (0 inside a snapshot); payload op char, "user\0file\0" (+ "new\0" for 'R')
+    PKT_REPL_DATA,     // File contents following an upload record; a 0-byte packet ends it
+    PKT_REPL_SNAPSHOT, // seq_num = base lsn; payload "begin" or "end"
+    PKT_HEARTBEAT,     // Replica group heartbeat, answered in kind: "<id> <term> <leader id|-> <lsn>"
+    PKT_READ_SESSION,  // Handshake for a read-only session (list/download) on a replica; payload username
+    PKT_REPL_KEEPALIVE, // Primary -> backup every REPL_KEEPALIVE_MS; seq_num = primary's head lsn
+    PKT_BATCH_UPLOAD,   // Many small files in one exchange, either direction; see common/batch.h
+    PKT_BATCH_DATA,
+    PKT_RENAME_REQ      // Either direction; payload "old\0new\0"
 } packet_type_t;
 
 typedef struct {
     packet_type_t type;
     uint32_t      seq_num;
     uint32_t      payload_size;
+    uint32_t      trace_id;     // Filled by send_packet from the sender's current trace id (0 = none)
     char          payload[MAX_PAYLOAD];
 } packet_t;
 
+// On the wire a packet is its 16-byte header followed by payload_size bytes
+// of payload; the unused tail of 'payload' is never sent. recv_packet puts a
+// NUL right after the payload (when it is shorter than MAX_PAYLOAD), so a
+// string payload sent without its terminator still reads as one.
+#define PACKET_HEADER_SIZE offsetof(packet_t, payload)
+
+// Wire compression. A client offers it by appending a "compress=lz" line
+// after the NUL that ends the user name in its handshake, and the server
+// accepts with a "compress=lz" line in the ACK; each side then enables it on
+// its socket. send_packet compresses every payload of at least
+// PACKET_COMPRESS_MIN bytes with the codec in lz.h and marks the packet with
+// PKT_FLAG_COMPRESSED in its type; a payload that does not shrink by at
+// least 1/PACKET_COMPRESS_GAIN of its size goes out as is. After
+// PACKET_COMPRESS_MISSES such payloads in a row the socket stops trying for
+// PACKET_COMPRESS_BACKOFF packets (already compressed media, for instance).
+// recv_packet undoes the compression on any socket, so the rest of the code
+// never sees the flag.
+#define PKT_FLAG_COMPRESSED     0x8000u
+#define PACKET_COMPRESS_MIN     256
+#define PACKET_COMPRESS_GAIN    32
+#define PACKET_COMPRESS_MISSES  4
+#define PACKET_COMPRESS_BACKOFF 64
+#define PACKET_MAX_FDS          65536 // Sockets above this never compress
+#define PACKET_COMPRESS_OFFER   "compress=lz"
+
+// Upload by content. A client declares the SHA-256 of a file of at least
+// UPLOAD_HASH_MIN_SIZE bytes after its size in the PKT_UPLOAD_REQ; a server
+// that already stores those contents makes the file from them and answers
+// with an ACK whose payload is UPLOAD_DEDUPE_REPLY, which ends the upload:
+// the client sends no data. Any other ACK asks for the contents as usual.
+#define UPLOAD_HASH_MIN_SIZE (64 * 1024) // Smaller files go in batches
+#define UPLOAD_DEDUPE_REPLY  "dedupe"
+
+// Process-wide wire counters, updated lock-free by send_packet/recv_packet
+typedef struct {
+    uint64_t packets_sent;
+    uint64_t packets_received;
+    uint64_t bytes_sent;
+    uint64_t bytes_received;
+    uint64_t compressed_sent;       // Packets sent compressed
+    uint64_t compressed_received;
+    uint64_t compress_saved_sent;   // Payload bytes compression kept off the wire
+    uint64_t compress_saved_received;
+    uint64_t compress_bypassed;     // Payloads tried that did not shrink enough
+} packet_stats_t;
+
 // Protótipos para envio/recepção
 int send_packet(int sockfd, const packet_t *pkt);
 int recv_packet(int sockfd, packet_t *pkt);
+void packet_get_stats(packet_stats_t *out);
+// Disables Nagle's algorithm on a connected socket. Every send is a whole
+// packet, so there are no small writes to coalesce, and pipelined transfers
+// (batches, replication) would otherwise stall on delayed ACKs.
+void packet_set_nodelay(int sockfd);
+// Turns wire compression on or off for a socket after the handshake
+// negotiated it. Clear it before closing the socket, since the descriptor
+// number will be reused.
+void packet_set_compression(int sockfd, int enabled);
+// Handshake helpers: the client appends its offer to a packet already
+// holding the NUL-terminated user name; the server checks for it.
+void packet_offer_compression(packet_t *handshake);
+int  packet_wants_compression(const packet_t *handshake);
+
+// Splits a "host:port" address (as carried by PKT_REDIRECT). Returns 0 on success.
+int parse_host_port(const char *addr, char *host, size_t host_len, char *port, size_t port_len);
 
 #endif // COMMON_PACKET_H
 
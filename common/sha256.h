@@ -0,0 +1,30 @@
+#ifndef COMMON_SHA256_H
+#define COMMON_SHA256_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// SHA-256 (FIPS 180-4), streamed. Used to name contents: a client hashes a
+// file before uploading it and the server looks the digest up among the
+// files it already stores.
+
+#define SHA256_DIGEST_LEN 32
+#define SHA256_HEX_LEN    (2 * SHA256_DIGEST_LEN) // Without a terminator
+
+typedef struct {
+    uint32_t state[8];
+    uint64_t length;    // Bytes hashed so far
+    uint8_t  block[64];
+    size_t   used;      // Bytes waiting in 'block'
+} sha256_ctx_t;
+
+void sha256_init(sha256_ctx_t *ctx);
+void sha256_update(sha256_ctx_t *ctx, const void *data, size_t len);
+void sha256_final(sha256_ctx_t *ctx, uint8_t digest[SHA256_DIGEST_LEN]);
+
+// Lowercase hex; 'hex' must hold SHA256_HEX_LEN + 1 bytes.
+void sha256_to_hex(const uint8_t digest[SHA256_DIGEST_LEN], char *hex);
+// Returns 0, or -1 if 'hex' is not exactly SHA256_HEX_LEN hex digits.
+int  sha256_from_hex(const char *hex, uint8_t digest[SHA256_DIGEST_LEN]);
+
+#endif // COMMON_SHA256_H
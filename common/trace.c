@@ -0,0 +1,166 @@
+#include "trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/syscall.h>
+
+#define TRACE_INITIAL_EVENTS 4096
+#define TRACE_MAX_EVENTS     (1u << 20) // ~100 MB; later events are dropped and counted
+#define TRACE_DETAIL_MAX     96
+
+typedef struct {
+    const char  *name;
+    uint64_t     start_us;
+    uint64_t     dur_us;
+    uint32_t     trace_id;
+    int          tid;
+    trace_flow_t flow;
+    char         detail[TRACE_DETAIL_MAX];
+} trace_event_t;
+
+static _Atomic int trace_on = 0;
+static char trace_path[PATH_MAX];
+static char trace_process[64];
+static _Atomic uint32_t next_id;
+
+static pthread_mutex_t events_mutex = PTHREAD_MUTEX_INITIALIZER;
+static trace_event_t *events = NULL;
+static size_t events_count = 0;
+static size_t events_cap = 0;
+static uint64_t events_dropped = 0;
+
+static __thread uint32_t current_id = 0;
+static __thread int cached_tid = 0;
+
+static uint64_t realtime_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000ull + (uint64_t)ts.tv_nsec / 1000ull;
+}
+
+void trace_init(const char *process_name) {
+    const char *prefix = getenv("SYNC_TRACE");
+    if (!prefix || !*prefix) return;
+    snprintf(trace_process, sizeof(trace_process), "%s", process_name);
+    snprintf(trace_path, sizeof(trace_path), "%s.%s.%d.json", prefix, process_name, (int)getpid());
+    // Ids from different processes must not collide when their traces are merged
+    atomic_store(&next_id, ((uint32_t)getpid() << 16) ^ (uint32_t)realtime_us());
+    atomic_store(&trace_on, 1);
+}
+
+int trace_enabled(void) {
+    return atomic_load_explicit(&trace_on, memory_order_relaxed);
+}
+
+uint32_t trace_new_id(void) {
+    uint32_t id;
+    do {
+        id = atomic_fetch_add_explicit(&next_id, 1, memory_order_relaxed);
+    } while (id == 0);
+    return id;
+}
+
+void trace_set_current(uint32_t trace_id) {
+    current_id = trace_id;
+}
+
+uint32_t trace_current(void) {
+    return current_id;
+}
+
+trace_span_t trace_begin(const char *name, trace_flow_t flow) {
+    trace_span_t span = { .name = name, .start_us = 0, .trace_id = current_id, .flow = flow };
+    if (trace_enabled()) span.start_us = realtime_us();
+    return span;
+}
+
+void trace_end(const trace_span_t *span, const char *detail) {
+    if (!trace_enabled() || span->start_us == 0) return;
+    uint64_t end_us = realtime_us();
+    if (cached_tid == 0) cached_tid = (int)syscall(SYS_gettid);
+
+    pthread_mutex_lock(&events_mutex);
+    if (events_count == events_cap) {
+        size_t new_cap = events_cap ? events_cap * 2 : TRACE_INITIAL_EVENTS;
+        trace_event_t *grown = new_cap <= TRACE_MAX_EVENTS ? realloc(events, new_cap * sizeof(trace_event_t)) : NULL;
+        if (!grown) {
+            events_dropped++;
+            pthread_mutex_unlock(&events_mutex);
+            return;
+        }
+        events = grown;
+        events_cap = new_cap;
+    }
+    trace_event_t *ev = &events[events_count++];
+    ev->name = span->name;
+    ev->start_us = span->start_us;
+    ev->dur_us = end_us - span->start_us;
+    ev->trace_id = span->trace_id;
+    ev->tid = cached_tid;
+    ev->flow = span->flow;
+    snprintf(ev->detail, sizeof(ev->detail), "%s", detail ? detail : "");
+    pthread_mutex_unlock(&events_mutex);
+}
+
+static void write_json_string(FILE *out, const char *s) {
+    fputc('"', out);
+    for (; *s; s++) {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\') fprintf(out, "\\%c", c);
+        else if (c < 0x20) fprintf(out, "\\u%04x", c);
+        else fputc(c, out);
+    }
+    fputc('"', out);
+}
+
+static void write_events(FILE *out) {
+    int pid = (int)getpid();
+    fputs("{\"traceEvents\":[\n", out);
+    fprintf(out, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":", pid);
+    write_json_string(out, trace_process);
+    fputs("}}", out);
+
+    for (size_t i = 0; i < events_count; i++) {
+        const trace_event_t *ev = &events[i];
+        fprintf(out, ",\n{\"name\":\"%s\",\"cat\":\"sync\",\"ph\":\"X\",\"ts\":%llu,\"dur\":%llu,"
+                     "\"pid\":%d,\"tid\":%d,\"args\":{\"trace_id\":\"%08x\",\"detail\":",
+                ev->name, (unsigned long long)ev->start_us, (unsigned long long)ev->dur_us,
+                pid, ev->tid, ev->trace_id);
+        write_json_string(out, ev->detail);
+        fputs("}}", out);
+
+        // Flow events bind to the span above (same thread, timestamp inside it)
+        if (ev->flow != TRACE_FLOW_NONE && ev->trace_id != 0) {
+            const char *ph = ev->flow == TRACE_FLOW_START ? "s" : ev->flow == TRACE_FLOW_STEP ? "t" : "f";
+            fprintf(out, ",\n{\"name\":\"transfer\",\"cat\":\"flow\",\"ph\":\"%s\",\"id\":%u,\"ts\":%llu,"
+                         "\"pid\":%d,\"tid\":%d%s}",
+                    ph, ev->trace_id, (unsigned long long)ev->start_us, pid, ev->tid,
+                    ev->flow == TRACE_FLOW_END ? ",\"bp\":\"e\"" : "");
+        }
+    }
+    fputs("\n],\"displayTimeUnit\":\"ms\"}\n", out);
+}
+
+void trace_shutdown(void) {
+    if (!atomic_exchange(&trace_on, 0)) return;
+
+    pthread_mutex_lock(&events_mutex);
+    FILE *out = fopen(trace_path, "w");
+    if (out) {
+        write_events(out);
+        fclose(out);
+        fprintf(stderr, "Trace gravado em %s (%zu spans, %llu descartados).\n",
+                trace_path, events_count, (unsigned long long)events_dropped);
+    } else {
+        perror("trace: fopen");
+    }
+    free(events);
+    events = NULL;
+    events_count = events_cap = 0;
+    pthread_mutex_unlock(&events_mutex);
+}
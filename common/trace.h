@@ -0,0 +1,51 @@
+#ifndef COMMON_TRACE_H
+#define COMMON_TRACE_H
+
+#include <stdint.h>
+
+// Opt-in span tracing exported in the Chrome trace-event JSON format
+// (load the file in chrome://tracing or https://ui.perfetto.dev).
+//
+// Enabled by setting SYNC_TRACE=<prefix> in the environment; each process
+// then writes <prefix>.<process>.<pid>.json when trace_shutdown() runs.
+// Timestamps are CLOCK_REALTIME microseconds so files from the client and
+// server processes line up; tools/trace_merge.py joins them into one file.
+//
+// Every thread has a "current" trace id. send_packet() stamps it on every
+// outgoing packet and the receiving side adopts the id of the request it is
+// serving, so one edit on device A keeps the same id through the server and
+// into the write on device B. Spans sharing an id are linked by flow arrows.
+//
+// When tracing is disabled every call below is a cheap no-op.
+
+typedef enum {
+    TRACE_FLOW_NONE,
+    TRACE_FLOW_START, // Origin of a transfer (the client that made the edit)
+    TRACE_FLOW_STEP,  // Intermediate hop (server handling / propagation)
+    TRACE_FLOW_END    // Change applied on the receiving device
+} trace_flow_t;
+
+typedef struct {
+    const char  *name;     // Must be a string literal
+    uint64_t     start_us;
+    uint32_t     trace_id;
+    trace_flow_t flow;
+} trace_span_t;
+
+// 'process_name' appears in the trace viewer and in the output file name.
+void trace_init(const char *process_name);
+// Writes the collected events to disk. Safe to call more than once.
+void trace_shutdown(void);
+int  trace_enabled(void);
+
+// Fresh non-zero id for a new client-originated operation.
+uint32_t trace_new_id(void);
+void     trace_set_current(uint32_t trace_id);
+uint32_t trace_current(void);
+
+// Starts a span tagged with the calling thread's current trace id.
+trace_span_t trace_begin(const char *name, trace_flow_t flow);
+// Records the span; 'detail' (may be NULL) is shown in its args, e.g. a file name.
+void trace_end(const trace_span_t *span, const char *detail);
+
+#endif // COMMON_TRACE_H
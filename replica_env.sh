@@ -0,0 +1,66 @@
+#!/usr/bin/env bash
+# Local replica group harness: runs several myServer members on one box, each
+# with its own storage directory, sharing one group file (-P).
+#
+#   ./replica_env.sh start [n]    starts members r1..rN (default 3)
+#   ./replica_env.sh crash <i>    kills member r<i> with SIGKILL
+#   ./replica_env.sh restart <i>  starts member r<i> again
+#   ./replica_env.sh status       shows which members run and who they follow
+#   ./replica_env.sh stop         stops every member
+#
+# Clients can point at any member: ./myClient alice 127.0.0.1 $BASE_PORT
+# Variables: GROUP_DIR (default /tmp/sync_group), BASE_PORT (default 24501),
+#            REPL_MODE (sync or async, default sync)
+set -euo pipefail
+
+ROOT=$(cd "$(dirname "$0")" && pwd)
+GROUP_DIR=${GROUP_DIR:-/tmp/sync_group}
+BASE_PORT=${BASE_PORT:-24501}
+REPL_MODE=${REPL_MODE:-sync}
+MEMBERS="$GROUP_DIR/group.conf"
+
+start_member() {
+  local i=$1 port=$((BASE_PORT + $1 - 1))
+  mkdir -p "$GROUP_DIR/r$i"
+  "$ROOT/myServer" -P "$MEMBERS" -i "r$i" -m "$REPL_MODE" -s "$GROUP_DIR/r$i/storage" "$port" \
+    >> "$GROUP_DIR/r$i/server.log" 2>&1 &
+  echo $! > "$GROUP_DIR/r$i/pid"
+  echo "r$i: 127.0.0.1:$port (pid $!, log $GROUP_DIR/r$i/server.log)"
+}
+
+case "${1:-}" in
+  start)
+    n=${2:-3}
+    make -C "$ROOT" all > /dev/null
+    mkdir -p "$GROUP_DIR"
+    echo "# id host porta" > "$MEMBERS"
+    for i in $(seq 1 "$n"); do echo "r$i 127.0.0.1 $((BASE_PORT + i - 1))" >> "$MEMBERS"; done
+    for i in $(seq 1 "$n"); do start_member "$i"; done
+    ;;
+  crash)
+    kill -KILL "$(cat "$GROUP_DIR/r${2:?membro}/pid")"
+    echo "r$2 derrubado"
+    ;;
+  restart)
+    start_member "${2:?membro}"
+    ;;
+  status)
+    for dir in "$GROUP_DIR"/r*/; do
+      member=$(basename "$dir")
+      state="parado"
+      kill -0 "$(cat "$dir/pid")" 2> /dev/null && state="ativo"
+      view=$(grep -h "\[Eleição\] \(Líder\|Este nó é o líder\|Este nó deixou\)" "$dir/server.log" 2> /dev/null \
+             | tail -n 1 | sed 's/.*\[Eleição\] //')
+      echo "$member ($state): ${view:-(sem líder)}"
+    done
+    ;;
+  stop)
+    for pidfile in "$GROUP_DIR"/r*/pid; do
+      kill "$(cat "$pidfile")" 2> /dev/null || true
+    done
+    ;;
+  *)
+    sed -n '2,13p' "$0"
+    exit 1
+    ;;
+esac
@@ -8,20 +8,113 @@
 #include <sys/socket.h> // For socket, bind, listen, accept
 #include <pthread.h>    // For pthread_create, pthread_detach
 #include <limits.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
 #include "../common/packet.h"
+#include "../common/log.h"
+#include "../common/trace.h"
 #include "server_utils.h"
 #include "server_session.h"
 #include "server_request_handler.h"
+#include "server_metrics.h"
+#include "server_cluster.h"
+#include "server_replication.h"
+#include "server_election.h"
+#include "server_push.h"
+#include "server_cache.h"
+#include "server_storage.h"
+#include "server_pack.h"
+#include "server_zfile.h"
+#include "server_dedupe.h"
 
 #define SERVER_DEFAULT_PORT 12345
-#define SERVER_BACKLOG      10
-#define STORAGE_BASE_DIR "storage"
+#define SERVER_BACKLOG      1024 // Default listen backlog; the kernel caps it at net.core.somaxconn
+#define SERVER_MAX_ACCEPTORS 64
+#define ACCEPT_ERROR_BACKOFF_US 10000
+
+static int wire_compression = 1; // Accept clients' compression offers (-Z turns it off)
 
 typedef struct {
     int client_conn_fd;
     // struct sockaddr_in client_addr; // If needed for logging client IP
 } client_handler_args_t;
 
+typedef struct {
+    int listen_fd;
+    int index; // Shown in the connection log line
+} acceptor_args_t;
+
+
+// Read-only session on a replica, opened on the "reader=" address a primary
+// handed out. Only listing and downloads are served, and each one only while
+// this copy is within the staleness bound; the client falls back to the
+// primary whenever it gets a NACK.
+static void serve_read_session(int conn_fd, const char *username, uint32_t seq, uint64_t handshake_start, int compress) {
+    char owner_addr[CLUSTER_ADDR_MAX], user_dir[PATH_MAX], user_base[PATH_MAX];
+    UserSession_t *user_session = NULL;
+    if (repl_reads_fresh() && cluster_owns_user(username, owner_addr, sizeof(owner_addr)) &&
+        path_join(user_base, sizeof(user_base), storage_base_dir(), username) == 0) {
+        lock_sessions();
+        user_session = get_or_create_user_session_locked(username);
+        unlock_sessions();
+    }
+    packet_t resp = { .type = user_session ? PKT_ACK : PKT_NACK, .seq_num = seq };
+    if (!user_session) {
+        snprintf(resp.payload, MAX_PAYLOAD, "Réplica indisponível para leituras.");
+        resp.payload_size = strlen(resp.payload) + 1;
+    }
+    if (user_session && compress) {
+        resp.payload_size = (uint32_t)snprintf(resp.payload, MAX_PAYLOAD, PACKET_COMPRESS_OFFER "\n") + 1;
+    }
+    int handshake_ok = (send_packet(conn_fd, &resp) == 0) && user_session;
+    metrics_observe_op(METRIC_OP_HANDSHAKE, metrics_now_ns() - handshake_start, handshake_ok);
+    if (!handshake_ok) return;
+    if (compress) packet_set_compression(conn_fd, 1);
+
+    user_sync_dir(username, user_dir, sizeof(user_dir));
+    mkdir_p(user_base, 0755);
+    mkdir_p(user_dir, 0755); // A user with no files yet lists as empty
+    LOG_INFO("[Leitura] Sessão somente leitura para '%s' (fd=%d).", username, conn_fd);
+
+    packet_t pkt;
+    while (recv_packet(conn_fd, &pkt) == 0) {
+        if ((pkt.type != PKT_DOWNLOAD_REQ && pkt.type != PKT_LIST_SERVER_REQ) || !repl_reads_fresh()) {
+            packet_t nack = { .type = PKT_NACK, .seq_num = pkt.seq_num };
+            if (send_packet(conn_fd, &nack) != 0) break;
+            continue;
+        }
+        handle_received_packet(conn_fd, &pkt, user_session, user_dir);
+    }
+    LOG_INFO("[Leitura] Sessão somente leitura de '%s' (fd=%d) encerrada.", username, conn_fd);
+}
+
+// Serves a device's requests and, between them, sends the pushes queued for
+// it. This thread is the only one using the socket, so a push's ACKs cannot
+// be taken by a request read and vice versa.
+static void serve_device(int conn_fd, UserSession_t *user_session, const char *user_dir, push_queue_t *push_queue) {
+    struct pollfd fds[2] = {
+        { .fd = conn_fd, .events = POLLIN },
+        { .fd = push_queue_wake_fd(push_queue), .events = POLLIN }
+    };
+    packet_t received_pkt;
+    int drained;
+    while ((drained = push_queue_drain(push_queue, conn_fd, user_dir, &received_pkt)) >= 0) {
+        if (drained == PUSH_CROSSED) { // The device's request goes first
+            handle_received_packet(conn_fd, &received_pkt, user_session, user_dir);
+            continue;
+        }
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            LOG_ERROR("poll failed on fd=%d: %s", conn_fd, strerror(errno));
+            break;
+        }
+        if (fds[0].revents != 0) {
+            if (recv_packet(conn_fd, &received_pkt) != 0) break;
+            handle_received_packet(conn_fd, &received_pkt, user_session, user_dir);
+        }
+    }
+}
 
 void *client_handler_thread(void *arg) {
     client_handler_args_t *handler_args = (client_handler_args_t*)arg;
@@ -30,118 +123,278 @@ void *client_handler_thread(void *arg) {
     // inet_ntop(AF_INET, &handler_args->client_addr.sin_addr, client_ip_str, INET_ADDRSTRLEN);
     free(handler_args); // Free the arguments structure
 
+    metrics_gauge_add(METRIC_GAUGE_ACTIVE_CONNECTIONS, 1);
     packet_t initial_pkt;
-    if (recv_packet(conn_fd, &initial_pkt) < 0 || initial_pkt.type != PKT_GET_SYNC_DIR) {
-        fprintf(stderr, "Falha ao receber pacote inicial ou tipo incorreto de fd=%d.\n", conn_fd);
+    if (recv_packet(conn_fd, &initial_pkt) < 0 ||
+        (initial_pkt.type != PKT_GET_SYNC_DIR && initial_pkt.type != PKT_MIGRATE_USER &&
+         initial_pkt.type != PKT_REPL_HELLO && initial_pkt.type != PKT_HEARTBEAT &&
+         initial_pkt.type != PKT_READ_SESSION)) {
+        LOG_ERROR("Falha ao receber pacote inicial ou tipo incorreto de fd=%d.\n", conn_fd);
+        close(conn_fd);
+        metrics_gauge_add(METRIC_GAUGE_ACTIVE_CONNECTIONS, -1);
+        return NULL;
+    }
+    uint64_t handshake_start = metrics_now_ns();
+
+    if (initial_pkt.type == PKT_REPL_HELLO) { // A primary streaming its changes to us
+        repl_serve_backup(conn_fd, &initial_pkt);
+        close(conn_fd);
+        metrics_gauge_add(METRIC_GAUGE_ACTIVE_CONNECTIONS, -1);
+        return NULL;
+    }
+    if (initial_pkt.type == PKT_HEARTBEAT) { // Another member of the replica group
+        election_serve_peer(conn_fd, &initial_pkt);
         close(conn_fd);
+        metrics_gauge_add(METRIC_GAUGE_ACTIVE_CONNECTIONS, -1);
         return NULL;
     }
 
+    // The name ends at the first NUL; handshake options may follow it
     char username[MAX_USER_LEN];
-    size_t ulen = initial_pkt.payload_size < (MAX_USER_LEN -1) ? initial_pkt.payload_size : (MAX_USER_LEN -1);
+    size_t ulen = strnlen(initial_pkt.payload, initial_pkt.payload_size < MAX_PAYLOAD ? initial_pkt.payload_size : MAX_PAYLOAD);
+    if (ulen > MAX_USER_LEN - 1) ulen = MAX_USER_LEN - 1;
     memcpy(username, initial_pkt.payload, ulen);
-    username[ulen > 0 ? ulen -1: 0] = '\0'; // Ensure null termination (if payload_size includes it)
-    if (initial_pkt.payload_size > 0 && initial_pkt.payload_size <= MAX_USER_LEN) { // If not null terminated
-         username[initial_pkt.payload_size] = '\0';
-    } else if (initial_pkt.payload_size == 0){
-         username[0] = '\0'; // Empty username
-    }
+    username[ulen] = '\0';
+    int compress = wire_compression && packet_wants_compression(&initial_pkt);
 
 
     if (strlen(username) == 0) {
-        fprintf(stderr, "Nome de usuário vazio recebido de fd=%d. Rejeitando.\n", conn_fd);
+        LOG_ERROR("Nome de usuário vazio recebido de fd=%d. Rejeitando.\n", conn_fd);
         packet_t nack_resp = { .type = PKT_NACK, .seq_num = initial_pkt.seq_num };
         snprintf(nack_resp.payload, MAX_PAYLOAD, "Nome de usuário não pode ser vazio.");
         nack_resp.payload_size = strlen(nack_resp.payload) +1;
         send_packet(conn_fd, &nack_resp);
         close(conn_fd);
+        metrics_observe_op(METRIC_OP_HANDSHAKE, metrics_now_ns() - handshake_start, 0);
+        metrics_gauge_add(METRIC_GAUGE_ACTIVE_CONNECTIONS, -1);
+        return NULL;
+    }
+
+    // Replication records carry the name, so a longer one could never reach a backup
+    if (ulen >= REPL_NAME_MAX) {
+        LOG_ERROR("Nome de usuário longo demais recebido de fd=%d. Rejeitando.\n", conn_fd);
+        packet_t nack_resp = { .type = PKT_NACK, .seq_num = initial_pkt.seq_num };
+        snprintf(nack_resp.payload, MAX_PAYLOAD, "Nome de usuário longo demais (máximo %d bytes).", REPL_NAME_MAX - 1);
+        nack_resp.payload_size = strlen(nack_resp.payload) +1;
+        send_packet(conn_fd, &nack_resp);
+        close(conn_fd);
+        metrics_observe_op(METRIC_OP_HANDSHAKE, metrics_now_ns() - handshake_start, 0);
+        metrics_gauge_add(METRIC_GAUGE_ACTIVE_CONNECTIONS, -1);
         return NULL;
     }
 
 
+    if (initial_pkt.type == PKT_READ_SESSION) {
+        serve_read_session(conn_fd, username, initial_pkt.seq_num, handshake_start, compress);
+        packet_set_compression(conn_fd, 0);
+        close(conn_fd);
+        metrics_gauge_add(METRIC_GAUGE_ACTIVE_CONNECTIONS, -1);
+        return NULL;
+    }
+
+    // Replica group: only the leader serves clients. Followers point them at
+    // it; during an election they hang up and the client retries.
+    char leader_addr[CLUSTER_ADDR_MAX];
+    if (election_enabled() && !election_is_leader(leader_addr, sizeof(leader_addr))) {
+        int redirect_ok = 0;
+        if (leader_addr[0] != '\0') {
+            packet_t resp = { .type = PKT_REDIRECT, .seq_num = initial_pkt.seq_num };
+            snprintf(resp.payload, MAX_PAYLOAD, "%s", leader_addr);
+            resp.payload_size = strlen(resp.payload) + 1;
+            redirect_ok = (send_packet(conn_fd, &resp) == 0);
+            LOG_INFO("Usuário '%s' (fd=%d) redirecionado ao líder %s.", username, conn_fd, leader_addr);
+        } else {
+            LOG_WARN("Eleição em andamento; recusando '%s' (fd=%d).", username, conn_fd);
+        }
+        close(conn_fd);
+        metrics_observe_op(METRIC_OP_HANDSHAKE, metrics_now_ns() - handshake_start, redirect_ok);
+        metrics_gauge_add(METRIC_GAUGE_ACTIVE_CONNECTIONS, -1);
+        return NULL;
+    }
+
+    // Writes here would never reach the primary, so a backup serves no clients
+    if (repl_is_backup()) {
+        LOG_WARN("Servidor em modo backup; recusando '%s' (fd=%d).", username, conn_fd);
+        packet_t nack_resp = { .type = PKT_NACK, .seq_num = initial_pkt.seq_num };
+        snprintf(nack_resp.payload, MAX_PAYLOAD, "Servidor em modo backup.");
+        nack_resp.payload_size = strlen(nack_resp.payload) +1;
+        send_packet(conn_fd, &nack_resp);
+        close(conn_fd);
+        metrics_observe_op(METRIC_OP_HANDSHAKE, metrics_now_ns() - handshake_start, 0);
+        metrics_gauge_add(METRIC_GAUGE_ACTIVE_CONNECTIONS, -1);
+        return NULL;
+    }
+
+    // Cluster mode: users owned by another node are sent there
+    char owner_addr[CLUSTER_ADDR_MAX];
+    if (!cluster_owns_user(username, owner_addr, sizeof(owner_addr))) {
+        LOG_INFO("Usuário '%s' (fd=%d) pertence a %s; redirecionando.", username, conn_fd, owner_addr);
+        packet_t resp = { .type = initial_pkt.type == PKT_MIGRATE_USER ? PKT_NACK : PKT_REDIRECT,
+                          .seq_num = initial_pkt.seq_num };
+        snprintf(resp.payload, MAX_PAYLOAD, "%s", owner_addr);
+        resp.payload_size = strlen(resp.payload) + 1;
+        int redirect_ok = (send_packet(conn_fd, &resp) == 0);
+        close(conn_fd);
+        metrics_observe_op(METRIC_OP_HANDSHAKE, metrics_now_ns() - handshake_start, redirect_ok);
+        metrics_gauge_add(METRIC_GAUGE_ACTIVE_CONNECTIONS, -1);
+        return NULL;
+    }
+
+    // A storage directory too long for PATH_MAX would store the user's files
+    // under a truncated path, possibly another user's
+    char user_base_for_mkdir[PATH_MAX]; // Path for user's own base before sync_dir
+    char user_storage_base_dir[PATH_MAX];
+    int base_len = snprintf(user_base_for_mkdir, sizeof(user_base_for_mkdir), "%s/%s", storage_base_dir(), username);
+    if (base_len < 0 || (size_t)base_len + sizeof("/sync_dir") > sizeof(user_base_for_mkdir)) {
+        LOG_ERROR("Caminho de armazenamento longo demais para '%s' (fd=%d).", username, conn_fd);
+        packet_t nack_resp = { .type = PKT_NACK, .seq_num = initial_pkt.seq_num };
+        snprintf(nack_resp.payload, MAX_PAYLOAD, "Caminho de armazenamento longo demais.");
+        nack_resp.payload_size = strlen(nack_resp.payload) +1;
+        send_packet(conn_fd, &nack_resp);
+        close(conn_fd);
+        metrics_observe_op(METRIC_OP_HANDSHAKE, metrics_now_ns() - handshake_start, 0);
+        metrics_gauge_add(METRIC_GAUGE_ACTIVE_CONNECTIONS, -1);
+        return NULL;
+    }
+    user_sync_dir(username, user_storage_base_dir, sizeof(user_storage_base_dir));
+
     lock_sessions();
     UserSession_t *user_session = get_or_create_user_session_locked(username);
     if (!user_session) { // Should not happen if calloc worked
         unlock_sessions();
-        fprintf(stderr, "Falha crítica ao obter/criar sessão para '%s'.\n", username);
+        LOG_ERROR("Falha crítica ao obter/criar sessão para '%s'.\n", username);
         packet_t nack_resp = { .type = PKT_NACK, .seq_num = initial_pkt.seq_num };
          snprintf(nack_resp.payload, MAX_PAYLOAD, "Erro interno do servidor (sessão).");
         nack_resp.payload_size = strlen(nack_resp.payload) +1;
         send_packet(conn_fd, &nack_resp);
         close(conn_fd);
+        metrics_observe_op(METRIC_OP_HANDSHAKE, metrics_now_ns() - handshake_start, 0);
+        metrics_gauge_add(METRIC_GAUGE_ACTIVE_CONNECTIONS, -1);
         return NULL;
     }
 
-    if (add_connection_to_session_locked(user_session, conn_fd) != 0) {
+    // A migrating peer uploads into the session without taking a device slot,
+    // so the files it moves are still pushed to the user's connected devices.
+    int is_migration = (initial_pkt.type == PKT_MIGRATE_USER);
+    push_queue_t *push_queue = NULL;
+    if (!is_migration && ((push_queue = push_queue_create()) == NULL ||
+                          add_connection_to_session_locked(user_session, conn_fd, push_queue) != 0)) {
         unlock_sessions();
-        fprintf(stderr, "Usuário '%s' (fd=%d) excedeu o limite de conexões (%d).\n", username, conn_fd, MAX_SESSIONS_PER_USER);
+        push_queue_destroy(push_queue);
+        LOG_ERROR("Usuário '%s' (fd=%d) excedeu o limite de conexões (%d).\n", username, conn_fd, MAX_SESSIONS_PER_USER);
         packet_t nack_resp = { .type = PKT_NACK, .seq_num = initial_pkt.seq_num };
         snprintf(nack_resp.payload, MAX_PAYLOAD, "Limite de conexões atingido.");
         nack_resp.payload_size = strlen(nack_resp.payload) +1;
         send_packet(conn_fd, &nack_resp);
         close(conn_fd);
+        metrics_observe_op(METRIC_OP_HANDSHAKE, metrics_now_ns() - handshake_start, 0);
+        metrics_gauge_add(METRIC_GAUGE_ACTIVE_CONNECTIONS, -1);
         return NULL;
     }
     unlock_sessions();
 
+    // The ACK may carry "key=value" lines: "replicas=" lists the replica group
+    // so the client can find it again after a failover, and "reader=" names
+    // a backup that serves this client's listing and downloads.
     packet_t ack_resp = { .type = PKT_ACK, .seq_num = initial_pkt.seq_num, .payload_size = 0 };
-    send_packet(conn_fd, &ack_resp);
+    size_t ack_len = 0;
+    if (election_enabled()) {
+        char members[MAX_PAYLOAD / 2];
+        election_member_list(members, sizeof(members));
+        ack_len += (size_t)snprintf(ack_resp.payload + ack_len, MAX_PAYLOAD - ack_len, "replicas=%s\n", members);
+    }
+    char reader_addr[CLUSTER_ADDR_MAX];
+    if (!is_migration && repl_pick_reader(reader_addr, sizeof(reader_addr)) == 0) {
+        ack_len += (size_t)snprintf(ack_resp.payload + ack_len, MAX_PAYLOAD - ack_len, "reader=%s\n", reader_addr);
+    }
+    if (compress && !is_migration) {
+        ack_len += (size_t)snprintf(ack_resp.payload + ack_len, MAX_PAYLOAD - ack_len, PACKET_COMPRESS_OFFER "\n");
+    }
+    if (ack_len > 0) ack_resp.payload_size = (uint32_t)ack_len + 1;
+    int handshake_ok = (send_packet(conn_fd, &ack_resp) == 0);
+    if (compress && !is_migration) packet_set_compression(conn_fd, 1);
+    metrics_observe_op(METRIC_OP_HANDSHAKE, metrics_now_ns() - handshake_start, handshake_ok);
     
-    lock_sessions();
-    printf("[+] Sessão iniciada para '%s' (fd=%d), total de conexões ativas para este usuário: %d\n",
-           username, conn_fd, user_session->active_connections_count);
-    unlock_sessions();
+    if (is_migration) {
+        LOG_INFO("[Cluster] Recebendo migração do usuário '%s' (fd=%d).", username, conn_fd);
+    } else {
+        lock_sessions();
+        LOG_INFO("[+] Sessão iniciada para '%s' (fd=%d), total de conexões ativas para este usuário: %d\n",
+               username, conn_fd, user_session->active_connections_count);
+        unlock_sessions();
+    }
 
 
-    char user_storage_base_dir[PATH_MAX];
-    snprintf(user_storage_base_dir, sizeof(user_storage_base_dir), "%s/%s/sync_dir", STORAGE_BASE_DIR, username);
-    mkdir_p(STORAGE_BASE_DIR, 0755); // Ensure base storage directory exists
-    char user_base_for_mkdir[PATH_MAX]; // Path for user's own base before sync_dir
-    snprintf(user_base_for_mkdir, sizeof(user_base_for_mkdir), "%s/%s", STORAGE_BASE_DIR, username);
+    mkdir_p(storage_base_dir(), 0755); // Ensure base storage directory exists
     mkdir_p(user_base_for_mkdir, 0755); // Ensure user's directory exists
     mkdir_p(user_storage_base_dir, 0755); // Ensure sync_dir for user exists
 
 
-    packet_t received_pkt;
-    while (recv_packet(conn_fd, &received_pkt) == 0) {
-        handle_received_packet(conn_fd, &received_pkt, user_session, user_storage_base_dir);
+    if (is_migration) {
+        packet_t received_pkt;
+        while (recv_packet(conn_fd, &received_pkt) == 0) {
+            handle_received_packet(conn_fd, &received_pkt, user_session, user_storage_base_dir);
+        }
+        LOG_INFO("[Cluster] Migração do usuário '%s' (fd=%d) encerrada.", username, conn_fd);
+        close(conn_fd);
+        metrics_gauge_add(METRIC_GAUGE_ACTIVE_CONNECTIONS, -1);
+        return NULL;
     }
 
+    serve_device(conn_fd, user_session, user_storage_base_dir, push_queue);
+
     // Client disconnected or error in recv_packet
-    printf("[-] Conexão com fd=%d (usuário '%s') encerrada ou perdida.\n", conn_fd, username);
+    LOG_INFO("[-] Conexão com fd=%d (usuário '%s') encerrada ou perdida.\n", conn_fd, username);
     lock_sessions();
     remove_connection_from_session_locked(user_session, conn_fd);
-    printf("[-] Sessão para '%s' (fd=%d) finalizada. Conexões restantes para este usuário: %d\n",
+    LOG_INFO("[-] Sessão para '%s' (fd=%d) finalizada. Conexões restantes para este usuário: %d\n",
            username, conn_fd, user_session->active_connections_count);
     unlock_sessions();
+    push_queue_destroy(push_queue); // Unreachable for push_change once out of the session
+    packet_set_compression(conn_fd, 0);
     close(conn_fd);
+    metrics_gauge_add(METRIC_GAUGE_ACTIVE_CONNECTIONS, -1);
     return NULL;
 }
 
 
-int main(int argc, char *argv[]) {
-    int port = SERVER_DEFAULT_PORT;
-    if (argc > 1) {
-        port = atoi(argv[1]);
-        if (port <= 0 || port > 65535) {
-            fprintf(stderr, "Porta inválida: %s. Usando porta padrão %d.\n", argv[1], SERVER_DEFAULT_PORT);
-            port = SERVER_DEFAULT_PORT;
-        }
+// Waits for SIGINT/SIGTERM so buffered log records and traces are flushed
+// before exiting. SIGHUP reloads the cluster membership file.
+static void *signal_thread(void *arg) {
+    sigset_t *set = (sigset_t *)arg;
+    int sig = 0;
+    while (sigwait(set, &sig) == 0 && sig == SIGHUP) {
+        LOG_INFO("SIGHUP recebido, recarregando a configuração do cluster.");
+        cluster_reload();
     }
+    LOG_INFO("Sinal %d recebido, encerrando servidor.", sig);
+    repl_set_active(0); // Records the replicated position so backups can resume
+    trace_shutdown();
+    log_shutdown();
+    exit(EXIT_SUCCESS);
+    return NULL;
+}
 
-    init_session_management(); // Initialize mutex for sessions
-    mkdir_p(STORAGE_BASE_DIR, 0755); // Create base storage directory at startup
-
+// Creates a listener on 'port'. With 'reuseport' several listeners share the
+// port and the kernel balances new connections between them. Returns -1 on error.
+static int open_listener(int port, int backlog, int reuseport) {
     int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (listen_fd < 0) { perror("socket creation failed"); exit(EXIT_FAILURE); }
+    if (listen_fd < 0) {
+        LOG_ERROR("socket creation failed: %s", strerror(errno));
+        return -1;
+    }
 
     // Allow address reuse
     int optval = 1;
     if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)) < 0) {
-        perror("setsockopt SO_REUSEADDR failed");
+        LOG_WARN("setsockopt SO_REUSEADDR failed: %s", strerror(errno));
         // Non-fatal, but good for development
     }
-
+    if (reuseport && setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval)) < 0) {
+        LOG_ERROR("setsockopt SO_REUSEPORT failed: %s", strerror(errno));
+        close(listen_fd);
+        return -1;
+    }
 
     struct sockaddr_in serv_addr = {
         .sin_family = AF_INET,
@@ -150,35 +403,44 @@ int main(int argc, char *argv[]) {
     };
 
     if (bind(listen_fd, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) < 0) {
-        perror("bind failed");
+        LOG_ERROR("bind failed: %s", strerror(errno));
         close(listen_fd);
-        exit(EXIT_FAILURE);
+        return -1;
     }
 
-    if (listen(listen_fd, SERVER_BACKLOG) < 0) {
-        perror("listen failed");
+    if (listen(listen_fd, backlog) < 0) {
+        LOG_ERROR("listen failed: %s", strerror(errno));
         close(listen_fd);
-        exit(EXIT_FAILURE);
+        return -1;
     }
-    printf("Servidor escutando na porta %d...\n", port);
+    return listen_fd;
+}
 
+// Accepts connections on 'listen_fd' forever, one handler thread per connection.
+static void accept_loop(int listen_fd, int acceptor_index) {
     while (1) {
         struct sockaddr_in client_addr;
         socklen_t client_len = sizeof(client_addr);
         int conn_fd = accept(listen_fd, (struct sockaddr*)&client_addr, &client_len);
 
         if (conn_fd < 0) {
-            perror("accept failed");
+            LOG_ERROR("accept failed: %s", strerror(errno));
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+                // Out of descriptors or memory: give handlers time to finish
+                // instead of spinning on the same error
+                usleep(ACCEPT_ERROR_BACKOFF_US);
+            }
             continue; // Continue to accept other connections
         }
         
+        packet_set_nodelay(conn_fd);
         char client_ip_str[INET_ADDRSTRLEN];
         inet_ntop(AF_INET, &client_addr.sin_addr, client_ip_str, INET_ADDRSTRLEN);
-        printf("Nova conexão de %s:%d (fd=%d)\n", client_ip_str, ntohs(client_addr.sin_port), conn_fd);
+        LOG_INFO("Nova conexão de %s:%d (fd=%d, aceitador %d)\n", client_ip_str, ntohs(client_addr.sin_port), conn_fd, acceptor_index);
 
         client_handler_args_t *thread_args = (client_handler_args_t*) malloc(sizeof(client_handler_args_t));
         if (!thread_args) {
-            perror("malloc for thread_args failed");
+            LOG_ERROR("malloc for thread_args failed: %s", strerror(errno));
             close(conn_fd);
             continue;
         }
@@ -186,15 +448,273 @@ int main(int argc, char *argv[]) {
         // thread_args->client_addr = client_addr; // If needed by thread
 
         pthread_t tid;
-        if (pthread_create(&tid, NULL, client_handler_thread, thread_args) != 0) {
-            perror("pthread_create failed");
+        int err = pthread_create(&tid, NULL, client_handler_thread, thread_args);
+        if (err != 0) {
+            LOG_ERROR("pthread_create failed: %s", strerror(err));
             free(thread_args);
             close(conn_fd);
         } else {
             pthread_detach(tid); // Detach thread as we are not joining it
         }
     }
+}
+
+static void *acceptor_thread(void *arg) {
+    acceptor_args_t acceptor = *(acceptor_args_t *)arg;
+    free(arg);
+    accept_loop(acceptor.listen_fd, acceptor.index);
+    return NULL;
+}
+
+static void print_usage(const char *prog) {
+    fprintf(stderr, "Uso: %s [-a porta_admin] [-s dir_storage] [-C arquivo_cluster -i id_no] [-r host:porta ...] [-m sync|async] [-P arquivo_grupo -i id_no] [-L ms] [-A n] [-B backlog] [-c MiB] [-D none|file|group] [-k KiB] [-z] [-Z] [-H off|user|global] [porta]\n"
+                    "  -a <porta>  expõe métricas (formato Prometheus) em http://127.0.0.1:<porta>/metrics\n"
+                    "  -s <dir>    diretório de armazenamento (padrão: storage)\n"
+                    "  -C <arq>    modo cluster: arquivo com uma linha \"<id> <host> <porta>\" por nó\n"
+                    "  -i <id>     id deste nó no arquivo do cluster ou do grupo\n"
+                    "  -r <h:p>    replica uploads e deleções para o backup em h:p (repetível, até %d)\n"
+                    "  -m <modo>   durabilidade da replicação: async (padrão) ou sync\n"
+                    "  -P <arq>    grupo de réplicas com eleição automática de líder; mesmo formato de -C\n"
+                    "  -L <ms>     atraso máximo de um backup para servir listagens e downloads (padrão %d; 0 desativa)\n"
+                    "  -A <n>      aceita conexões em n threads, cada uma com seu socket SO_REUSEPORT (padrão 1, até %d)\n"
+                    "  -B <n>      tamanho da fila de conexões pendentes de cada socket (padrão %d)\n"
+                    "  -c <MiB>    memória do cache de conteúdo para downloads e propagações (padrão %d; 0 desativa)\n"
+                    "  -D <modo>   durabilidade dos uploads: none (padrão), file (fsync por arquivo) ou group (fsync em grupo)\n"
+                    "  -k <KiB>    guarda arquivos de até KiB em um packfile por diretório (padrão 0: desativado)\n"
+                    "  -z          grava os arquivos comprimidos em blocos (os já comprimidos ficam como estão)\n"
+                    "  -Z          recusa a compressão de pacotes oferecida pelos clientes\n"
+                    "  -H <escopo> reaproveita conteúdo já armazenado em vez de recebê-lo de novo: off, user (padrão, só\n"
+                    "              arquivos do próprio usuário) ou global (entre usuários)\n",
+            prog, REPL_MAX_BACKUPS, REPL_READ_STALENESS_MS, SERVER_MAX_ACCEPTORS, SERVER_BACKLOG, CONTENT_CACHE_DEFAULT_MB);
+}
+
+int main(int argc, char *argv[]) {
+    int port = SERVER_DEFAULT_PORT;
+    int admin_port = 0; // 0 = admin socket disabled
+    const char *cluster_file = NULL;
+    const char *node_id = NULL;
+    const char *group_file = NULL;
+    int backup_count = 0;
+    int acceptor_count = 1;
+    int backlog = SERVER_BACKLOG;
+    int opt;
+    while ((opt = getopt(argc, argv, "a:s:C:i:r:m:P:L:A:B:c:D:k:zZH:h")) != -1) {
+        switch (opt) {
+            case 'a':
+                admin_port = atoi(optarg);
+                if (admin_port <= 0 || admin_port > 65535) {
+                    fprintf(stderr, "Porta de administração inválida: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 's':
+                set_storage_base_dir(optarg);
+                break;
+            case 'C':
+                cluster_file = optarg;
+                break;
+            case 'i':
+                node_id = optarg;
+                break;
+            case 'r':
+                if (repl_add_backup(optarg) != 0) {
+                    fprintf(stderr, "No máximo %d backups.\n", REPL_MAX_BACKUPS);
+                    return EXIT_FAILURE;
+                }
+                backup_count++;
+                break;
+            case 'P':
+                group_file = optarg;
+                break;
+            case 'L': {
+                char *end = NULL;
+                long ms = strtol(optarg, &end, 10);
+                if (!end || *end != '\0' || ms < 0 || ms > 3600000) {
+                    fprintf(stderr, "Atraso máximo de leitura inválido: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                repl_set_read_staleness((unsigned int)ms);
+                break;
+            }
+            case 'A':
+                acceptor_count = atoi(optarg);
+                if (acceptor_count < 1 || acceptor_count > SERVER_MAX_ACCEPTORS) {
+                    fprintf(stderr, "Número de aceitadores inválido: %s (1 a %d)\n", optarg, SERVER_MAX_ACCEPTORS);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'B':
+                backlog = atoi(optarg);
+                if (backlog < 1) {
+                    fprintf(stderr, "Backlog inválido: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'c': {
+                char *end = NULL;
+                long mb = strtol(optarg, &end, 10);
+                if (!end || *end != '\0' || mb < 0 || mb > 1024 * 1024) {
+                    fprintf(stderr, "Tamanho de cache inválido: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                content_cache_set_budget((size_t)mb * 1024 * 1024);
+                break;
+            }
+            case 'D': {
+                storage_sync_t policy;
+                if (storage_parse_sync_policy(optarg, &policy) != 0) {
+                    fprintf(stderr, "Modo de durabilidade inválido: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                storage_set_sync_policy(policy);
+                break;
+            }
+            case 'z':
+                zfile_set_enabled(1);
+                break;
+            case 'Z':
+                wire_compression = 0;
+                break;
+            case 'H': {
+                dedupe_scope_t scope;
+                if (dedupe_parse_scope(optarg, &scope) != 0) {
+                    fprintf(stderr, "Escopo de deduplicação inválido: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                dedupe_set_scope(scope);
+                break;
+            }
+            case 'k': {
+                char *end = NULL;
+                long kb = strtol(optarg, &end, 10);
+                if (!end || *end != '\0' || kb < 0 || kb > 1024 * 1024) {
+                    fprintf(stderr, "Limite de empacotamento inválido: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                pack_set_threshold((size_t)kb * 1024);
+                break;
+            }
+            case 'm':
+                if (strcmp(optarg, "sync") == 0) {
+                    repl_set_mode(REPL_MODE_SYNC);
+                } else if (strcmp(optarg, "async") == 0) {
+                    repl_set_mode(REPL_MODE_ASYNC);
+                } else {
+                    fprintf(stderr, "Modo de replicação inválido: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            default:
+                print_usage(argv[0]);
+                return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    if (optind < argc) {
+        port = atoi(argv[optind]);
+        if (port <= 0 || port > 65535) {
+            fprintf(stderr, "Porta inválida: %s. Usando porta padrão %d.\n", argv[optind], SERVER_DEFAULT_PORT);
+            port = SERVER_DEFAULT_PORT;
+        }
+    }
+    if (cluster_file && group_file) {
+        fprintf(stderr, "As opções -C e -P não podem ser combinadas.\n");
+        return EXIT_FAILURE;
+    }
+    if ((cluster_file != NULL || group_file != NULL) != (node_id != NULL)) {
+        fprintf(stderr, "A opção -i deve acompanhar -C ou -P.\n");
+        return EXIT_FAILURE;
+    }
+    if (group_file && backup_count > 0) {
+        fprintf(stderr, "Com -P os backups são os outros membros do grupo; não use -r.\n");
+        return EXIT_FAILURE;
+    }
+
+    // Signals are blocked before any thread is created so that only
+    // signal_thread receives them.
+    static sigset_t shutdown_signals;
+    sigemptyset(&shutdown_signals);
+    sigaddset(&shutdown_signals, SIGINT);
+    sigaddset(&shutdown_signals, SIGTERM);
+    sigaddset(&shutdown_signals, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &shutdown_signals, NULL);
+    signal(SIGPIPE, SIG_IGN); // A peer hanging up mid-transfer fails the write instead of killing the server
+    log_init(STDOUT_FILENO, LOG_LEVEL_INFO);
+    trace_init("server");
+    pthread_t sig_tid;
+    if (pthread_create(&sig_tid, NULL, signal_thread, &shutdown_signals) == 0) {
+        pthread_detach(sig_tid);
+    }
+
+    init_session_management(); // Initialize mutex for sessions
+    mkdir_p(storage_base_dir(), 0755); // Create base storage directory at startup
+    storage_prepare_trees();
+
+    if (cluster_file) {
+        if (cluster_load(cluster_file, node_id) != 0) {
+            log_shutdown();
+            return EXIT_FAILURE;
+        }
+        // Hand off users this node stopped owning while it was down
+        cluster_rebalance();
+    }
+    if (group_file && election_load(group_file, node_id) != 0) {
+        log_shutdown();
+        return EXIT_FAILURE;
+    }
+    repl_start();
+    if (group_file) {
+        election_start(); // Activates replication on whichever member leads
+    } else if (backup_count > 0) {
+        repl_set_active(1);
+    }
+
+    if (admin_port > 0) {
+        if (metrics_start_admin_server(admin_port) == 0) {
+            LOG_INFO("Métricas disponíveis em http://127.0.0.1:%d/metrics\n", admin_port);
+        } else {
+            LOG_WARN("Aviso: não foi possível iniciar o socket de administração na porta %d.\n", admin_port);
+        }
+    }
+
+    // With several acceptors each one gets its own SO_REUSEPORT listener and
+    // the kernel spreads incoming handshakes across them. All of them are
+    // bound here so that a busy port fails the startup, not a thread.
+    int listen_fds[SERVER_MAX_ACCEPTORS];
+    for (int i = 0; i < acceptor_count; i++) {
+        listen_fds[i] = open_listener(port, backlog, acceptor_count > 1);
+        if (listen_fds[i] < 0) {
+            log_shutdown();
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (acceptor_count > 1) {
+        LOG_INFO("Servidor escutando na porta %d com %d aceitadores (backlog %d)...\n", port, acceptor_count, backlog);
+    } else {
+        LOG_INFO("Servidor escutando na porta %d...\n", port);
+    }
+
+    for (int i = 1; i < acceptor_count; i++) {
+        acceptor_args_t *acceptor = malloc(sizeof(*acceptor));
+        pthread_t tid;
+        if (!acceptor) {
+            LOG_ERROR("malloc for acceptor failed: %s", strerror(errno));
+            close(listen_fds[i]);
+            continue;
+        }
+        acceptor->listen_fd = listen_fds[i];
+        acceptor->index = i;
+        int err = pthread_create(&tid, NULL, acceptor_thread, acceptor);
+        if (err != 0) {
+            // The kernel would keep queueing handshakes on this listener
+            LOG_ERROR("pthread_create failed for acceptor %d: %s", i, strerror(err));
+            close(listen_fds[i]);
+            free(acceptor);
+        } else {
+            pthread_detach(tid);
+        }
+    }
+    accept_loop(listen_fds[0], 0); // The main thread is acceptor 0
 
-    close(listen_fd); // Never reached in this loop
+    close(listen_fds[0]); // Never reached in this loop
     return 0;
 }
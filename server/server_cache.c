@@ -0,0 +1,386 @@
+#include "server_cache.h"
+#include "server_filelock.h"
+#include "server_pack.h"
+#include "server_storage.h"
+#include "server_zfile.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+
+typedef enum {
+    ENTRY_LOADING, // Its first reader is filling it; others wait on cache_loaded
+    ENTRY_READY,
+    ENTRY_FAILED
+} entry_state_t;
+
+struct cache_entry {
+    char           *path;
+    dev_t           dev;   // Version of the file the contents belong to
+    ino_t           ino;
+    off_t           size;
+    struct timespec mtime;
+    char           *data;
+    size_t          data_size;  // Contents in 'data': 'size' unless the file is compressed
+    entry_state_t   state;
+    int             refs;       // Readers holding the entry, its loader included
+    int             referenced; // CLOCK bit, set on every hit
+    int             in_table;   // Unlinked entries are freed by their last reader
+    struct cache_entry *hash_next;
+    struct cache_entry *clock_prev, *clock_next; // Ring of the entries in the table
+};
+
+// Everything below is protected by cache_mutex.
+static pthread_mutex_t     cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t      cache_loaded = PTHREAD_COND_INITIALIZER; // Broadcast when a load ends
+static struct cache_entry *buckets[CONTENT_CACHE_BUCKETS];
+static struct cache_entry *clock_hand = NULL;
+static size_t              entry_count = 0;
+static size_t              used_bytes = 0; // Every live entry, unlinked ones still being read included
+static size_t              budget_bytes = (size_t)CONTENT_CACHE_DEFAULT_MB * 1024 * 1024;
+
+static _Atomic uint64_t hits, misses, load_waits, evictions, bypasses;
+
+static size_t bucket_of(const char *path) {
+    uint32_t h = 2166136261u; // FNV-1a
+    for (const unsigned char *c = (const unsigned char *)path; *c; c++) {
+        h ^= *c;
+        h *= 16777619u;
+    }
+    return h % CONTENT_CACHE_BUCKETS;
+}
+
+static struct cache_entry *lookup_locked(const char *path) {
+    for (struct cache_entry *e = buckets[bucket_of(path)]; e; e = e->hash_next) {
+        if (strcmp(e->path, path) == 0) return e;
+    }
+    return NULL;
+}
+
+static int same_version(const struct cache_entry *e, const struct stat *st) {
+    return e->dev == st->st_dev && e->ino == st->st_ino && e->size == st->st_size &&
+           e->mtime.tv_sec == st->st_mtim.tv_sec && e->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+static void insert_locked(struct cache_entry *e) {
+    size_t b = bucket_of(e->path);
+    e->hash_next = buckets[b];
+    buckets[b] = e;
+    // Just behind the hand, so it is the last entry the hand reaches
+    if (!clock_hand) {
+        e->clock_prev = e->clock_next = e;
+        clock_hand = e;
+    } else {
+        e->clock_next = clock_hand;
+        e->clock_prev = clock_hand->clock_prev;
+        e->clock_prev->clock_next = e;
+        clock_hand->clock_prev = e;
+    }
+    e->in_table = 1;
+    entry_count++;
+}
+
+static void unlink_locked(struct cache_entry *e) {
+    if (!e->in_table) return;
+    for (struct cache_entry **pp = &buckets[bucket_of(e->path)]; *pp; pp = &(*pp)->hash_next) {
+        if (*pp == e) {
+            *pp = e->hash_next;
+            break;
+        }
+    }
+    if (e->clock_next == e) {
+        clock_hand = NULL;
+    } else {
+        e->clock_prev->clock_next = e->clock_next;
+        e->clock_next->clock_prev = e->clock_prev;
+        if (clock_hand == e) clock_hand = e->clock_next;
+    }
+    e->in_table = 0;
+    entry_count--;
+}
+
+static void free_entry_locked(struct cache_entry *e) {
+    used_bytes -= e->data_size;
+    free(e->data);
+    free(e->path);
+    free(e);
+}
+
+static void release_locked(struct cache_entry *e) {
+    if (--e->refs == 0 && !e->in_table) free_entry_locked(e);
+}
+
+// CLOCK: the hand clears the bit of recently used entries and evicts the
+// first idle entry whose bit is already clear. Returns -1 if readers hold
+// too much of the budget for 'need' more bytes to fit.
+static int make_room_locked(size_t need) {
+    size_t steps = 2 * entry_count;
+    while (used_bytes + need > budget_bytes) {
+        if (!clock_hand || steps-- == 0) return -1;
+        struct cache_entry *e = clock_hand;
+        clock_hand = e->clock_next;
+        if (e->refs > 0 || e->state != ENTRY_READY) continue;
+        if (e->referenced) {
+            e->referenced = 0;
+            continue;
+        }
+        unlink_locked(e);
+        free_entry_locked(e);
+        atomic_fetch_add_explicit(&evictions, 1, memory_order_relaxed);
+    }
+    return 0;
+}
+
+// Reads the whole file, provided it is still the version 'e' was keyed by,
+// and stores the size of its contents in *data_size. A compressed file is
+// decoded, unless its contents exceed 'max_size'.
+static int load_entry(struct cache_entry *e, size_t max_size, size_t *data_size) {
+    int fd = open(e->path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    struct stat st;
+    uint64_t raw_size;
+    int ok = (fstat(fd, &st) == 0 && same_version(e, &st));
+    if (ok && zfile_probe(fd, &raw_size)) {
+        zfile_reader_t *z = raw_size <= max_size ? zfile_open(fd) : NULL;
+        ok = z && (e->data = malloc(raw_size > 0 ? (size_t)raw_size : 1)) &&
+             zfile_pread(z, e->data, (size_t)raw_size, 0) == (long)raw_size;
+        zfile_close(z);
+        close(fd);
+        *data_size = (size_t)raw_size;
+        return (ok && e->data) ? 0 : -1;
+    }
+    if (ok) e->data = malloc(e->size > 0 ? (size_t)e->size : 1);
+    size_t done = 0;
+    while (ok && e->data && done < (size_t)e->size) {
+        ssize_t n = read(fd, e->data + done, (size_t)e->size - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) ok = 0;
+        else done += (size_t)n;
+    }
+    close(fd);
+    *data_size = (size_t)e->size;
+    return (ok && e->data) ? 0 : -1;
+}
+
+// Returns the entry for 'path' with a reference held, loading it first if
+// needed, or NULL if the caller has to read the file itself.
+static struct cache_entry *cache_acquire(const char *path, const struct stat *st, size_t max_entry) {
+    pthread_mutex_lock(&cache_mutex);
+    struct cache_entry *e = lookup_locked(path);
+    if (e && same_version(e, st)) {
+        e->refs++;
+        e->referenced = 1;
+        if (e->state == ENTRY_LOADING) {
+            atomic_fetch_add_explicit(&load_waits, 1, memory_order_relaxed);
+            while (e->state == ENTRY_LOADING) pthread_cond_wait(&cache_loaded, &cache_mutex);
+        }
+        if (e->state == ENTRY_READY) {
+            atomic_fetch_add_explicit(&hits, 1, memory_order_relaxed);
+            pthread_mutex_unlock(&cache_mutex);
+            return e;
+        }
+        release_locked(e);
+        pthread_mutex_unlock(&cache_mutex);
+        return NULL;
+    }
+    if (e) { // An older version of the file
+        unlink_locked(e);
+        if (e->refs == 0) free_entry_locked(e);
+        e = NULL;
+    }
+    atomic_fetch_add_explicit(&misses, 1, memory_order_relaxed);
+    if (make_room_locked((size_t)st->st_size) != 0 || !(e = calloc(1, sizeof(*e))) || !(e->path = strdup(path))) {
+        free(e);
+        atomic_fetch_add_explicit(&bypasses, 1, memory_order_relaxed);
+        pthread_mutex_unlock(&cache_mutex);
+        return NULL;
+    }
+    e->dev = st->st_dev;
+    e->ino = st->st_ino;
+    e->size = st->st_size;
+    e->mtime = st->st_mtim;
+    e->state = ENTRY_LOADING;
+    e->refs = 1;
+    e->data_size = (size_t)st->st_size; // Corrected once a compressed file is decoded
+    insert_locked(e);
+    used_bytes += e->data_size;
+    pthread_mutex_unlock(&cache_mutex);
+
+    size_t data_size = e->data_size;
+    int loaded = (load_entry(e, max_entry, &data_size) == 0);
+
+    pthread_mutex_lock(&cache_mutex);
+    if (loaded) {
+        // A compressed file takes more decoded than its size on disk, which
+        // is all that was reserved: the rest must fit too, or the entry only
+        // serves the readers that wait for it and is freed after them
+        if (data_size > e->data_size && make_room_locked(data_size - e->data_size) != 0) {
+            unlink_locked(e);
+            atomic_fetch_add_explicit(&bypasses, 1, memory_order_relaxed);
+        }
+        used_bytes += data_size - e->data_size; // Wraps back correctly when it shrinks
+        e->data_size = data_size;
+    }
+    e->state = loaded ? ENTRY_READY : ENTRY_FAILED;
+    pthread_cond_broadcast(&cache_loaded);
+    if (!loaded) {
+        unlink_locked(e);
+        release_locked(e);
+        e = NULL;
+    }
+    pthread_mutex_unlock(&cache_mutex);
+    return e;
+}
+
+void content_cache_set_budget(size_t bytes) {
+    pthread_mutex_lock(&cache_mutex);
+    budget_bytes = bytes;
+    pthread_mutex_unlock(&cache_mutex);
+}
+
+void content_cache_invalidate(const char *path) {
+    char disk_path[PATH_MAX];
+    if (storage_locate(path, disk_path, sizeof(disk_path)) != 0) return;
+    pthread_mutex_lock(&cache_mutex);
+    struct cache_entry *e = lookup_locked(disk_path);
+    if (e) {
+        unlink_locked(e);
+        if (e->refs == 0) free_entry_locked(e);
+    }
+    pthread_mutex_unlock(&cache_mutex);
+}
+
+int content_open(content_reader_t *r, const char *path) {
+    memset(r, 0, sizeof(*r));
+    pthread_mutex_lock(&cache_mutex);
+    size_t max_entry = budget_bytes / 8;
+    pthread_mutex_unlock(&cache_mutex);
+
+    // Held until the contents are pinned or the file is open, not while
+    // they are read out
+    char disk_path[PATH_MAX];
+    if (storage_locate(path, disk_path, sizeof(disk_path)) != 0) return -1;
+    file_lock_t *lock = file_lock_read(path);
+    struct stat st;
+    if (max_entry > 0 && stat(disk_path, &st) == 0 && S_ISREG(st.st_mode)) {
+        if ((size_t)st.st_size <= max_entry) {
+            r->entry = cache_acquire(disk_path, &st, max_entry);
+            if (r->entry) {
+                file_unlock(lock);
+                return 0;
+            }
+        } else {
+            atomic_fetch_add_explicit(&bypasses, 1, memory_order_relaxed);
+        }
+    }
+    r->f = fopen(disk_path, "rb"); // Stored files are looked up by where they live
+    int rc = r->f ? 0 : -1;
+    if (r->f && zfile_probe(fileno(r->f), NULL) && !(r->z = zfile_open(fileno(r->f)))) {
+        fclose(r->f);
+        r->f = NULL;
+        rc = -1;
+    }
+    if (!r->f && errno == ENOENT) rc = pack_read(path, &r->packed, &r->packed_size);
+    int saved = errno;
+    file_unlock(lock);
+    errno = saved;
+    return rc;
+}
+
+size_t content_read(content_reader_t *r, void *buf, size_t len) {
+    const char *data;
+    size_t size;
+    if (r->entry) {
+        data = r->entry->data;
+        size = r->entry->data_size;
+    } else if (r->z) {
+        long n = zfile_pread(r->z, buf, len, r->offset);
+        if (n < 0) {
+            r->error = 1;
+            return 0;
+        }
+        r->offset += (size_t)n;
+        return (size_t)n;
+    } else if (r->packed) {
+        data = r->packed;
+        size = r->packed_size;
+    } else {
+        return r->f ? fread(buf, 1, len, r->f) : 0;
+    }
+    size_t left = size - r->offset;
+    size_t n = len < left ? len : left;
+    memcpy(buf, data + r->offset, n);
+    r->offset += n;
+    return n;
+}
+
+int content_error(const content_reader_t *r) {
+    return r->error || (r->f && ferror(r->f));
+}
+
+long long content_size(const content_reader_t *r) {
+    if (r->entry) return (long long)r->entry->data_size;
+    if (r->z) return (long long)zfile_size(r->z);
+    if (r->packed) return (long long)r->packed_size;
+    struct stat st;
+    if (!r->f || fstat(fileno(r->f), &st) != 0) return -1;
+    return (long long)st.st_size;
+}
+
+void content_close(content_reader_t *r) {
+    if (r->entry) {
+        pthread_mutex_lock(&cache_mutex);
+        release_locked(r->entry);
+        pthread_mutex_unlock(&cache_mutex);
+        r->entry = NULL;
+    }
+    zfile_close(r->z);
+    r->z = NULL;
+    if (r->f) {
+        fclose(r->f);
+        r->f = NULL;
+    }
+    free(r->packed);
+    r->packed = NULL;
+}
+
+void content_cache_write_metrics(FILE *out) {
+    pthread_mutex_lock(&cache_mutex);
+    size_t bytes = used_bytes, budget = budget_bytes, entries = entry_count;
+    pthread_mutex_unlock(&cache_mutex);
+    fprintf(out, "# HELP sync_cache_hits_total File reads served from the content cache.\n"
+                 "# TYPE sync_cache_hits_total counter\n"
+                 "sync_cache_hits_total %llu\n"
+                 "# HELP sync_cache_misses_total File reads that had to load the file into the content cache.\n"
+                 "# TYPE sync_cache_misses_total counter\n"
+                 "sync_cache_misses_total %llu\n"
+                 "# HELP sync_cache_load_waits_total Hits that waited for another reader's load of the same file.\n"
+                 "# TYPE sync_cache_load_waits_total counter\n"
+                 "sync_cache_load_waits_total %llu\n"
+                 "# HELP sync_cache_evictions_total Entries evicted to stay within the cache budget.\n"
+                 "# TYPE sync_cache_evictions_total counter\n"
+                 "sync_cache_evictions_total %llu\n"
+                 "# HELP sync_cache_bypass_total File reads served from disk because the file is too large or the budget is held by readers.\n"
+                 "# TYPE sync_cache_bypass_total counter\n"
+                 "sync_cache_bypass_total %llu\n"
+                 "# HELP sync_cache_bytes Bytes held by the content cache.\n"
+                 "# TYPE sync_cache_bytes gauge\n"
+                 "sync_cache_bytes %zu\n"
+                 "# HELP sync_cache_entries Files held by the content cache.\n"
+                 "# TYPE sync_cache_entries gauge\n"
+                 "sync_cache_entries %zu\n"
+                 "# HELP sync_cache_budget_bytes Memory budget of the content cache.\n"
+                 "# TYPE sync_cache_budget_bytes gauge\n"
+                 "sync_cache_budget_bytes %zu\n",
+            (unsigned long long)atomic_load_explicit(&hits, memory_order_relaxed),
+            (unsigned long long)atomic_load_explicit(&misses, memory_order_relaxed),
+            (unsigned long long)atomic_load_explicit(&load_waits, memory_order_relaxed),
+            (unsigned long long)atomic_load_explicit(&evictions, memory_order_relaxed),
+            (unsigned long long)atomic_load_explicit(&bypasses, memory_order_relaxed),
+            bytes, entries, budget);
+}
@@ -0,0 +1,50 @@
+#ifndef SERVER_CACHE_H
+#define SERVER_CACHE_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+// Content cache for files that are read over and over: downloads, pushes to
+// a user's other devices and records shipped to every backup. Entries are
+// keyed by path and validated against the file's version (inode, size and
+// modification time) on every lookup, so a rewritten or replaced file is
+// read again. Concurrent readers of a file that is not cached share a single
+// read from disk. Files larger than an eighth of the budget are never
+// cached, and entries are evicted with the CLOCK algorithm when the budget
+// is exceeded. Readers fall back to the file itself whenever the cache
+// cannot hold it. Files stored in a packfile (see server_pack.h) are not
+// cached: they are small and copied out of the packfile with a single read.
+// Block-compressed files (see server_zfile.h) are cached decoded; read from
+// disk, they are decoded a block at a time.
+
+#define CONTENT_CACHE_DEFAULT_MB 64
+#define CONTENT_CACHE_BUCKETS    1024
+
+// Memory budget in bytes (0 disables the cache). Call before serving.
+void content_cache_set_budget(size_t bytes);
+// Drops the entry for 'path'; call after changing the file in place.
+void content_cache_invalidate(const char *path);
+// Prometheus lines with hits, misses, evictions and the bytes cached.
+void content_cache_write_metrics(FILE *out);
+
+// Sequential reader over a file's contents, from the cache when possible.
+typedef struct {
+    struct cache_entry *entry; // Pinned until content_close
+    FILE   *f;                 // Used when the file is not cached
+    struct zfile_reader *z;    // Decoder over 'f' when the file is compressed
+    char   *packed;            // Contents copied out of a packfile
+    size_t  packed_size;
+    size_t  offset;
+    int     error;
+} content_reader_t;
+
+// Returns -1 (errno set) if the file cannot be opened.
+int    content_open(content_reader_t *r, const char *path);
+// Same contract as fread(buf, 1, len, f).
+size_t content_read(content_reader_t *r, void *buf, size_t len);
+int    content_error(const content_reader_t *r);
+// Size of the contents being read, or -1 if it cannot be known.
+long long content_size(const content_reader_t *r);
+void   content_close(content_reader_t *r);
+
+#endif // SERVER_CACHE_H
@@ -0,0 +1,328 @@
+#define _XOPEN_SOURCE 700 // nftw
+#include "server_cluster.h"
+#include "server_session.h"
+#include "server_utils.h"
+#include "server_metrics.h"
+#include "server_storage.h"
+#include "server_cache.h"
+#include "server_pack.h"
+#include "../common/packet.h"
+#include "../common/log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <limits.h>
+#include <dirent.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+
+#define CHUNK_SIZE MAX_PAYLOAD
+
+typedef struct {
+    char id[64];
+    char host[256];
+    int  port;
+} cluster_node_t;
+
+typedef struct {
+    uint32_t hash;
+    int      node;
+} ring_point_t;
+
+static pthread_mutex_t cluster_mutex = PTHREAD_MUTEX_INITIALIZER;
+static char membership_path[PATH_MAX];
+static char self_node_id[64];
+static int  enabled = 0;
+static cluster_node_t nodes[CLUSTER_MAX_NODES];
+static int  node_count = 0;
+static int  self_index = -1;
+static ring_point_t ring[CLUSTER_MAX_NODES * CLUSTER_VNODES];
+static int  ring_size = 0;
+
+static pthread_mutex_t rebalance_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int rebalance_running = 0;
+static int rebalance_again = 0;
+
+static uint32_t fnv1a(const char *s) {
+    uint32_t h = 2166136261u;
+    for (; *s; s++) {
+        h ^= (unsigned char)*s;
+        h *= 16777619u;
+    }
+    // FNV alone barely mixes the last bytes, and keys such as "alice1"/"alice2"
+    // or "n1#7"/"n1#8" differ only there; the murmur3 finalizer spreads them.
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
+
+static int cmp_ring_point(const void *a, const void *b) {
+    const ring_point_t *x = a, *y = b;
+    if (x->hash != y->hash) return x->hash < y->hash ? -1 : 1;
+    return strcmp(nodes[x->node].id, nodes[y->node].id); // Same order on every node
+}
+
+// Parses the membership file into the static tables. Caller holds cluster_mutex.
+static int load_membership_locked(void) {
+    FILE *f = fopen(membership_path, "r");
+    if (!f) {
+        LOG_ERROR("[Cluster] Não foi possível abrir '%s': %s", membership_path, strerror(errno));
+        return -1;
+    }
+
+    cluster_node_t parsed[CLUSTER_MAX_NODES];
+    int count = 0, self = -1;
+    char line[512];
+    while (fgets(line, sizeof(line), f)) {
+        char *hash = strchr(line, '#');
+        if (hash) *hash = '\0';
+        cluster_node_t n;
+        if (sscanf(line, "%63s %255s %d", n.id, n.host, &n.port) != 3) continue;
+        if (count == CLUSTER_MAX_NODES) {
+            LOG_WARN("[Cluster] Mais de %d nós em '%s'; os excedentes foram ignorados.", CLUSTER_MAX_NODES, membership_path);
+            break;
+        }
+        if (strcmp(n.id, self_node_id) == 0) self = count;
+        parsed[count++] = n;
+    }
+    fclose(f);
+
+    if (self < 0) {
+        LOG_ERROR("[Cluster] O nó '%s' não aparece em '%s'.", self_node_id, membership_path);
+        return -1;
+    }
+
+    memcpy(nodes, parsed, sizeof(cluster_node_t) * (size_t)count);
+    node_count = count;
+    self_index = self;
+    ring_size = 0;
+    for (int i = 0; i < count; i++) {
+        for (int v = 0; v < CLUSTER_VNODES; v++) {
+            char key[96];
+            snprintf(key, sizeof(key), "%s#%d", nodes[i].id, v);
+            ring[ring_size].hash = fnv1a(key);
+            ring[ring_size].node = i;
+            ring_size++;
+        }
+    }
+    qsort(ring, (size_t)ring_size, sizeof(ring_point_t), cmp_ring_point);
+    LOG_INFO("[Cluster] %d nó(s) carregado(s) de '%s'; este nó é '%s' (%s:%d).",
+             count, membership_path, nodes[self].id, nodes[self].host, nodes[self].port);
+    return 0;
+}
+
+int cluster_load(const char *path, const char *self_id) {
+    pthread_mutex_lock(&cluster_mutex);
+    snprintf(membership_path, sizeof(membership_path), "%s", path);
+    snprintf(self_node_id, sizeof(self_node_id), "%s", self_id);
+    int rc = load_membership_locked();
+    enabled = (rc == 0);
+    pthread_mutex_unlock(&cluster_mutex);
+    return rc;
+}
+
+int cluster_enabled(void) {
+    pthread_mutex_lock(&cluster_mutex);
+    int e = enabled;
+    pthread_mutex_unlock(&cluster_mutex);
+    return e;
+}
+
+int cluster_owns_user(const char *username, char *owner_addr, size_t addr_len) {
+    pthread_mutex_lock(&cluster_mutex);
+    if (!enabled || ring_size == 0) {
+        pthread_mutex_unlock(&cluster_mutex);
+        return 1;
+    }
+    // First ring point clockwise from the user's hash
+    uint32_t h = fnv1a(username);
+    int lo = 0, hi = ring_size;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (ring[mid].hash < h) lo = mid + 1; else hi = mid;
+    }
+    int owner = ring[lo == ring_size ? 0 : lo].node;
+    int mine = (owner == self_index);
+    if (!mine && owner_addr) {
+        snprintf(owner_addr, addr_len, "%s:%d", nodes[owner].host, nodes[owner].port);
+    }
+    pthread_mutex_unlock(&cluster_mutex);
+    return mine;
+}
+
+// ---------------------------------------------------------------------------
+// Rebalancing
+// ---------------------------------------------------------------------------
+
+// Sends one file with the regular client upload exchange.
+static int migrate_file(int sock, const char *dir, const char *name) {
+    char path[PATH_MAX];
+    if (path_join(path, sizeof(path), dir, name) != 0) return -1;
+    content_reader_t f; // Packed files are read through it too
+    if (content_open(&f, path) != 0) return -1;
+
+    packet_t rq = { .type = PKT_UPLOAD_REQ, .seq_num = 1 };
+    snprintf(rq.payload, MAX_PAYLOAD, "%s", name);
+    rq.payload_size = (uint32_t)strlen(rq.payload) + 1;
+    int rc = send_and_wait_ack_server(sock, &rq);
+
+    uint32_t seq = 2;
+    size_t n_read;
+    packet_t dp = { .type = PKT_UPLOAD_DATA };
+    while (rc == 0 && (n_read = content_read(&f, dp.payload, CHUNK_SIZE)) > 0) {
+        dp.seq_num = seq++;
+        dp.payload_size = (uint32_t)n_read;
+        rc = send_and_wait_ack_server(sock, &dp);
+    }
+    if (rc == 0 && content_error(&f)) rc = -1;
+    content_close(&f);
+    if (rc == 0) {
+        packet_t endp = { .type = PKT_UPLOAD_DATA, .seq_num = seq, .payload_size = 0 };
+        rc = send_packet(sock, &endp);
+    }
+    return rc;
+}
+
+typedef struct {
+    int         sock;
+    const char *dir;
+    int         files;
+} migrate_ctx_t;
+
+static int migrate_entry(const char *name, const struct stat *st, void *arg) {
+    (void)st;
+    migrate_ctx_t *ctx = arg;
+    ctx->files++;
+    return migrate_file(ctx->sock, ctx->dir, name) != 0;
+}
+
+static int migrate_user(const char *username, const char *owner_addr) {
+    int sock = connect_to_addr(owner_addr);
+    if (sock < 0) return -1;
+
+    packet_t hs = { .type = PKT_MIGRATE_USER, .seq_num = 1 };
+    snprintf(hs.payload, MAX_PAYLOAD, "%s", username);
+    hs.payload_size = (uint32_t)strlen(hs.payload) + 1;
+    if (send_and_wait_ack_server(sock, &hs) != 0) {
+        close(sock);
+        return -1;
+    }
+
+    char dir[PATH_MAX];
+    user_sync_dir(username, dir, sizeof(dir));
+    migrate_ctx_t ctx = { .sock = sock, .dir = dir };
+    int rc = (storage_list_tree(dir, migrate_entry, &ctx) > 0) ? -1 : 0, files = ctx.files;
+
+    // The peer does not ACK the last data packet; a list round trip confirms
+    // it has processed every upload before the local copy goes away.
+    if (rc == 0) {
+        packet_t list_rq = { .type = PKT_LIST_SERVER_REQ, .seq_num = 1 };
+        packet_t list_res;
+        rc = (send_packet(sock, &list_rq) == 0 && recv_packet(sock, &list_res) == 0 &&
+              list_res.type == PKT_LIST_SERVER_RES) ? 0 : -1;
+    }
+    close(sock);
+    if (rc == 0) {
+        LOG_INFO("[Cluster] Usuário '%s' migrado para %s (%d arquivo(s)).", username, owner_addr, files);
+    }
+    return rc;
+}
+
+static int remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+    (void)st; (void)flag; (void)ftw;
+    return remove(path);
+}
+
+static void rebalance_pass(void) {
+    const char *base = storage_base_dir();
+    DIR *d = opendir(base);
+    if (!d) return;
+    int moved = 0, failed = 0;
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL) {
+        if (e->d_name[0] == '.') continue;
+        char owner[CLUSTER_ADDR_MAX];
+        if (cluster_owns_user(e->d_name, owner, sizeof(owner))) continue;
+
+        // New handshakes are already redirected; push the existing devices
+        // over too so nothing keeps writing here while the files move.
+        lock_sessions();
+        disconnect_user_locked(e->d_name);
+        unlock_sessions();
+
+        uint64_t start = metrics_now_ns();
+        int ok = (migrate_user(e->d_name, owner) == 0);
+        metrics_observe_op(METRIC_OP_MIGRATION, metrics_now_ns() - start, ok);
+        if (!ok) {
+            LOG_ERROR("[Cluster] Falha ao migrar '%s' para %s; nova tentativa no próximo rebalanceamento.", e->d_name, owner);
+            failed++;
+            continue;
+        }
+        char user_dir[PATH_MAX];
+        if (path_join(user_dir, sizeof(user_dir), base, e->d_name) != 0) { // Never remove a truncated path
+            LOG_ERROR("[Cluster] Caminho longo demais para remover a cópia local de '%s'.", e->d_name);
+            continue;
+        }
+        nftw(user_dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+        pack_forget_under(user_dir);
+        moved++;
+    }
+    closedir(d);
+    if (moved || failed) {
+        LOG_INFO("[Cluster] Rebalanceamento concluído: %d usuário(s) migrado(s), %d falha(s).", moved, failed);
+    }
+}
+
+static void *rebalance_thread(void *arg) {
+    (void)arg;
+    for (;;) {
+        rebalance_pass();
+        pthread_mutex_lock(&rebalance_mutex);
+        if (!rebalance_again) {
+            rebalance_running = 0;
+            pthread_mutex_unlock(&rebalance_mutex);
+            break;
+        }
+        rebalance_again = 0;
+        pthread_mutex_unlock(&rebalance_mutex);
+    }
+    return NULL;
+}
+
+void cluster_rebalance(void) {
+    if (!cluster_enabled()) return;
+    pthread_mutex_lock(&rebalance_mutex);
+    if (rebalance_running) {
+        rebalance_again = 1; // The running pass starts over when it finishes
+        pthread_mutex_unlock(&rebalance_mutex);
+        return;
+    }
+    rebalance_running = 1;
+    pthread_mutex_unlock(&rebalance_mutex);
+
+    pthread_t tid;
+    int err = pthread_create(&tid, NULL, rebalance_thread, NULL);
+    if (err != 0) {
+        LOG_ERROR("[Cluster] pthread_create para rebalanceamento falhou: %s", strerror(err));
+        pthread_mutex_lock(&rebalance_mutex);
+        rebalance_running = 0;
+        pthread_mutex_unlock(&rebalance_mutex);
+        return;
+    }
+    pthread_detach(tid);
+}
+
+int cluster_reload(void) {
+    pthread_mutex_lock(&cluster_mutex);
+    int rc = enabled ? load_membership_locked() : -1;
+    pthread_mutex_unlock(&cluster_mutex);
+    if (rc == 0) cluster_rebalance();
+    return rc;
+}
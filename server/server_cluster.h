@@ -0,0 +1,36 @@
+#ifndef SERVER_CLUSTER_H
+#define SERVER_CLUSTER_H
+
+#include <stddef.h>
+
+// Cluster mode: several myServer processes split the users between them with
+// a consistent-hash ring (CLUSTER_VNODES points per node, FNV-1a of the
+// username with a murmur3 finalizer). A node that is asked for a user it does not own answers the
+// handshake with PKT_REDIRECT to the owner.
+//
+// The membership file has one node per line: "<id> <host> <port>", '#'
+// starts a comment. Every node must be started with the same file and its
+// own id (-i). After the file is edited, SIGHUP makes a node reload it and
+// hand users it no longer owns to their new owner (see cluster_rebalance).
+
+#define CLUSTER_VNODES    64
+#define CLUSTER_MAX_NODES 64
+#define CLUSTER_ADDR_MAX  (256 + 8) // "host:port"
+
+// Loads the membership file. Returns 0 on success, -1 if the file cannot be
+// read or does not list 'self_id'.
+int cluster_load(const char *path, const char *self_id);
+int cluster_enabled(void);
+
+// Returns 1 if this node owns 'username' (always true outside cluster mode);
+// otherwise returns 0 and writes the owner's "host:port" to 'owner_addr'.
+int cluster_owns_user(const char *username, char *owner_addr, size_t addr_len);
+
+// Re-reads the membership file and starts a background pass that moves every
+// user this node no longer owns: its connected devices are disconnected (they
+// reconnect and get redirected), its files are uploaded to the new owner over
+// a PKT_MIGRATE_USER connection and then removed locally.
+int cluster_reload(void);
+void cluster_rebalance(void);
+
+#endif // SERVER_CLUSTER_H
@@ -0,0 +1,197 @@
+#include "server_dedupe.h"
+#include "server_storage.h"
+#include "../common/log.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+typedef struct dedupe_entry {
+    uint8_t  digest[SHA256_DIGEST_LEN];
+    uint64_t size;
+    char    *path;
+    dev_t    dev;
+    ino_t    ino;
+    off_t    stored_size; // On disk; differs from 'size' for compressed files
+    struct timespec mtime, ctime;
+    struct dedupe_entry *next;              // In its bucket
+    struct dedupe_entry *next_path;         // In its path's bucket
+    struct dedupe_entry *older, *newer;     // Insertion order, for eviction
+} dedupe_entry_t;
+
+static dedupe_scope_t scope = DEDUPE_USER;
+
+// Everything below is protected by index_mutex.
+static pthread_mutex_t index_mutex = PTHREAD_MUTEX_INITIALIZER;
+static dedupe_entry_t *buckets[DEDUPE_BUCKETS];
+static dedupe_entry_t *path_buckets[DEDUPE_BUCKETS];
+static dedupe_entry_t *oldest = NULL, *newest = NULL;
+static size_t          entry_count = 0;
+
+static _Atomic uint64_t hits_total, misses_total, stale_total, saved_bytes_total;
+
+void dedupe_set_scope(dedupe_scope_t s) {
+    scope = s;
+}
+
+int dedupe_parse_scope(const char *s, dedupe_scope_t *out) {
+    if (strcmp(s, "off") == 0) *out = DEDUPE_OFF;
+    else if (strcmp(s, "user") == 0) *out = DEDUPE_USER;
+    else if (strcmp(s, "global") == 0) *out = DEDUPE_GLOBAL;
+    else return -1;
+    return 0;
+}
+
+int dedupe_enabled(void) {
+    return scope != DEDUPE_OFF;
+}
+
+static dedupe_entry_t **bucket_of(const uint8_t digest[SHA256_DIGEST_LEN]) {
+    uint32_t h;
+    memcpy(&h, digest, sizeof(h)); // Already uniform
+    return &buckets[h % DEDUPE_BUCKETS];
+}
+
+static dedupe_entry_t **path_bucket_of(const char *path) {
+    uint32_t h = 2166136261u;
+    while (*path) h = (h ^ (unsigned char)*path++) * 16777619u;
+    return &path_buckets[h % DEDUPE_BUCKETS];
+}
+
+static void unlink_locked(dedupe_entry_t *e) {
+    for (dedupe_entry_t **pp = bucket_of(e->digest); *pp; pp = &(*pp)->next) {
+        if (*pp == e) {
+            *pp = e->next;
+            break;
+        }
+    }
+    for (dedupe_entry_t **pp = path_bucket_of(e->path); *pp; pp = &(*pp)->next_path) {
+        if (*pp == e) {
+            *pp = e->next_path;
+            break;
+        }
+    }
+    if (e->older) e->older->newer = e->newer; else oldest = e->newer;
+    if (e->newer) e->newer->older = e->older; else newest = e->older;
+    entry_count--;
+    free(e->path);
+    free(e);
+}
+
+static void forget_locked(const char *path) {
+    dedupe_entry_t *e = *path_bucket_of(path);
+    while (e) {
+        dedupe_entry_t *next = e->next_path;
+        if (strcmp(e->path, path) == 0) unlink_locked(e);
+        e = next;
+    }
+}
+
+void dedupe_forget(const char *path) {
+    if (!dedupe_enabled()) return;
+    pthread_mutex_lock(&index_mutex);
+    forget_locked(path);
+    pthread_mutex_unlock(&index_mutex);
+}
+
+void dedupe_remember(const char *path, const uint8_t digest[SHA256_DIGEST_LEN], uint64_t size, const struct stat *st) {
+    if (!dedupe_enabled()) return;
+    pthread_mutex_lock(&index_mutex);
+    forget_locked(path); // A path holds one file; re-added below as the newest
+    dedupe_entry_t **bucket = bucket_of(digest);
+    dedupe_entry_t *e = calloc(1, sizeof(*e));
+    if (!e || !(e->path = strdup(path))) {
+        free(e);
+        pthread_mutex_unlock(&index_mutex);
+        LOG_WARN("Sem memória para indexar o conteúdo de '%s'.", path);
+        return;
+    }
+    memcpy(e->digest, digest, SHA256_DIGEST_LEN);
+    e->size = size;
+    e->dev = st->st_dev;
+    e->ino = st->st_ino;
+    e->stored_size = st->st_size;
+    e->mtime = st->st_mtim;
+    e->ctime = st->st_ctim;
+    e->next = *bucket;
+    *bucket = e;
+    dedupe_entry_t **path_bucket = path_bucket_of(path);
+    e->next_path = *path_bucket;
+    *path_bucket = e;
+    e->older = newest;
+    if (newest) newest->newer = e; else oldest = e;
+    newest = e;
+    if (++entry_count > DEDUPE_MAX_ENTRIES) unlink_locked(oldest);
+    pthread_mutex_unlock(&index_mutex);
+}
+
+static int same_time(struct timespec a, struct timespec b) {
+    return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+}
+
+// Whether the file at the entry's path is still the one indexed: an inode
+// freed and reused for other contents of the same size differs in its times.
+static int unchanged(const dedupe_entry_t *e, const struct stat *now) {
+    return now->st_dev == e->dev && now->st_ino == e->ino && now->st_size == e->stored_size &&
+           same_time(now->st_mtim, e->mtime) && same_time(now->st_ctim, e->ctime);
+}
+
+static int visible_to(const dedupe_entry_t *e, const char *user_dir) {
+    if (scope == DEDUPE_GLOBAL) return 1;
+    size_t len = strlen(user_dir);
+    return strncmp(e->path, user_dir, len) == 0 && e->path[len] == '/';
+}
+
+int dedupe_lookup(const char *user_dir, const uint8_t digest[SHA256_DIGEST_LEN], uint64_t size,
+                  char *path, size_t path_len, struct stat *st) {
+    if (!dedupe_enabled()) return 0;
+    int found = 0;
+    pthread_mutex_lock(&index_mutex);
+    dedupe_entry_t *e = *bucket_of(digest);
+    while (e && !found) {
+        dedupe_entry_t *next = e->next;
+        if (e->size == size && memcmp(e->digest, digest, SHA256_DIGEST_LEN) == 0 && visible_to(e, user_dir)) {
+            struct stat now;
+            char disk_path[PATH_MAX];
+            if (storage_locate(e->path, disk_path, sizeof(disk_path)) != 0 || stat(disk_path, &now) != 0 || !unchanged(e, &now)) {
+                atomic_fetch_add_explicit(&stale_total, 1, memory_order_relaxed);
+                unlink_locked(e); // Replaced or deleted since
+            } else if (snprintf(path, path_len, "%s", e->path) < (int)path_len) {
+                *st = now;
+                found = 1;
+            }
+        }
+        e = next;
+    }
+    pthread_mutex_unlock(&index_mutex);
+    atomic_fetch_add_explicit(found ? &hits_total : &misses_total, 1, memory_order_relaxed);
+    return found;
+}
+
+void dedupe_note_saved(uint64_t size) {
+    atomic_fetch_add_explicit(&saved_bytes_total, size, memory_order_relaxed);
+}
+
+void dedupe_write_metrics(FILE *out) {
+    pthread_mutex_lock(&index_mutex);
+    size_t entries = entry_count;
+    pthread_mutex_unlock(&index_mutex);
+    fprintf(out, "# HELP sync_dedupe_lookups_total Uploads that declared a content digest, by whether a stored file had it.\n"
+                 "# TYPE sync_dedupe_lookups_total counter\n"
+                 "sync_dedupe_lookups_total{result=\"hit\"} %llu\n"
+                 "sync_dedupe_lookups_total{result=\"miss\"} %llu\n"
+                 "# HELP sync_dedupe_stale_total Index entries dropped because their file was replaced or deleted.\n"
+                 "# TYPE sync_dedupe_stale_total counter\n"
+                 "sync_dedupe_stale_total %llu\n"
+                 "# HELP sync_dedupe_saved_bytes_total Upload bytes not transferred because the server already held them.\n"
+                 "# TYPE sync_dedupe_saved_bytes_total counter\n"
+                 "sync_dedupe_saved_bytes_total %llu\n"
+                 "# HELP sync_dedupe_index_entries Stored files in the content index.\n"
+                 "# TYPE sync_dedupe_index_entries gauge\n"
+                 "sync_dedupe_index_entries %zu\n",
+            (unsigned long long)atomic_load_explicit(&hits_total, memory_order_relaxed),
+            (unsigned long long)atomic_load_explicit(&misses_total, memory_order_relaxed),
+            (unsigned long long)atomic_load_explicit(&stale_total, memory_order_relaxed),
+            (unsigned long long)atomic_load_explicit(&saved_bytes_total, memory_order_relaxed),
+            entries);
+}
@@ -0,0 +1,60 @@
+#ifndef SERVER_DEDUPE_H
+#define SERVER_DEDUPE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/stat.h>
+#include "../common/sha256.h"
+
+// Index of stored contents by SHA-256, for uploads the server can answer
+// without their bytes (-H). A client declares the digest of a large file in
+// its PKT_UPLOAD_REQ; if a stored file has those contents, the server
+// materializes the new file from it (see storage_clone) and the upload ends
+// with the request's ACK.
+//
+// Digests are computed by the server itself as it receives uploads of at
+// least UPLOAD_HASH_MIN_SIZE bytes, never taken from clients. Storage drops
+// a file's entry when it replaces, renames or deletes the file, and each
+// entry also remembers the stored file's inode and times, so a file changed
+// some other way (a user's tree migrated or wiped) no longer matches and its
+// entry is dropped when found. The index lives in
+// memory, holds at most DEDUPE_MAX_ENTRIES files (the oldest go first) and
+// starts empty on every run.
+//
+// With the 'user' scope (the default) a user only reuses their own files;
+// 'global' shares contents across users, which lets anyone who knows a
+// file's digest obtain it.
+
+#define DEDUPE_BUCKETS     4096
+#define DEDUPE_MAX_ENTRIES 65536
+
+typedef enum {
+    DEDUPE_OFF,
+    DEDUPE_USER,
+    DEDUPE_GLOBAL
+} dedupe_scope_t;
+
+void dedupe_set_scope(dedupe_scope_t scope);
+// Parses "off", "user" or "global". Returns -1 if 's' is none of them.
+int  dedupe_parse_scope(const char *s, dedupe_scope_t *scope);
+int  dedupe_enabled(void);
+
+// Records that the stored file 'path', whose stat is 'st', holds 'size'
+// bytes of contents with 'digest'.
+void dedupe_remember(const char *path, const uint8_t digest[SHA256_DIGEST_LEN], uint64_t size, const struct stat *st);
+// Drops the entries of the stored file 'path'; call with its write lock
+// held, when the file is replaced, renamed or deleted.
+void dedupe_forget(const char *path);
+// Finds a stored file with these contents that a user whose files live in
+// 'user_dir' may reuse. Returns 1 with its path and the stat it had when
+// indexed (for storage_clone to check) or 0 if there is none.
+int  dedupe_lookup(const char *user_dir, const uint8_t digest[SHA256_DIGEST_LEN], uint64_t size,
+                   char *path, size_t path_len, struct stat *st);
+// Counts the bytes an upload answered from the index did not transfer.
+void dedupe_note_saved(uint64_t size);
+
+// Prometheus lines with lookups, their hits and the bytes they saved.
+void dedupe_write_metrics(FILE *out);
+
+#endif // SERVER_DEDUPE_H
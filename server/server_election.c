@@ -0,0 +1,330 @@
+#include "server_election.h"
+#include "server_session.h"
+#include "server_utils.h"
+#include "server_metrics.h"
+#include "../common/log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+
+typedef struct {
+    char     id[64];
+    char     host[256];
+    int      port;
+    char     addr[REPL_NAME_MAX]; // "host:port"
+    uint64_t last_seen_ns; // Last heartbeat exchanged with it, 0 = never
+    uint32_t lsn;          // Replicated position it last reported
+} member_t;
+
+static pthread_mutex_t election_mutex = PTHREAD_MUTEX_INITIALIZER;
+static member_t members[ELECTION_MAX_MEMBERS];
+static int      member_count = 0;
+static int      self_index = -1;
+static int      leader_index = -1;
+static uint32_t current_term = 0;
+static int      enabled = 0;
+static uint64_t started_ns = 0;
+static uint64_t leaderless_since_ns = 0;
+static uint64_t leader_last_seen_ns = 0; // Last sign of life of the previous leader
+
+static void sleep_ms(int ms) {
+    struct timespec ts = { .tv_sec = ms / 1000, .tv_nsec = (long)(ms % 1000) * 1000000L };
+    nanosleep(&ts, NULL);
+}
+
+int election_load(const char *path, const char *self_id) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        LOG_ERROR("[Eleição] Não foi possível abrir '%s': %s", path, strerror(errno));
+        return -1;
+    }
+    char line[512];
+    int count = 0, self = -1;
+    while (fgets(line, sizeof(line), f)) {
+        char *hash = strchr(line, '#');
+        if (hash) *hash = '\0';
+        member_t m = { 0 };
+        if (sscanf(line, "%63s %255s %d", m.id, m.host, &m.port) != 3) continue;
+        int n = snprintf(m.addr, sizeof(m.addr), "%s:%d", m.host, m.port);
+        if (n < 0 || (size_t)n >= sizeof(m.addr)) {
+            LOG_ERROR("[Eleição] Endereço do membro '%s' longo demais em '%s'.", m.id, path);
+            fclose(f);
+            return -1;
+        }
+        if (count == ELECTION_MAX_MEMBERS) {
+            LOG_ERROR("[Eleição] '%s' lista mais de %d membros.", path, ELECTION_MAX_MEMBERS);
+            fclose(f);
+            return -1;
+        }
+        if (strcmp(m.id, self_id) == 0) self = count;
+        members[count++] = m;
+    }
+    fclose(f);
+    if (self < 0) {
+        LOG_ERROR("[Eleição] O nó '%s' não aparece em '%s'.", self_id, path);
+        return -1;
+    }
+
+    pthread_mutex_lock(&election_mutex);
+    member_count = count;
+    self_index = self;
+    enabled = 1;
+    pthread_mutex_unlock(&election_mutex);
+
+    for (int i = 0; i < count; i++) {
+        if (i == self) continue;
+        repl_add_backup(members[i].addr);
+    }
+    LOG_INFO("[Eleição] Grupo de %d membro(s) carregado de '%s'; este nó é '%s'.", count, path, self_id);
+    return 0;
+}
+
+int election_enabled(void) {
+    pthread_mutex_lock(&election_mutex);
+    int e = enabled;
+    pthread_mutex_unlock(&election_mutex);
+    return e;
+}
+
+static int find_member_locked(const char *id) {
+    for (int i = 0; i < member_count; i++) {
+        if (strcmp(members[i].id, id) == 0) return i;
+    }
+    return -1;
+}
+
+static int alive_locked(int i, uint64_t now) {
+    if (i == self_index) return 1;
+    return members[i].last_seen_ns != 0 && now - members[i].last_seen_ns < (uint64_t)ELECTION_TIMEOUT_MS * 1000000ull;
+}
+
+static uint32_t position_locked(int i) {
+    return i == self_index ? repl_position() : members[i].lsn;
+}
+
+// 1 if member a ranks above member b: more replicated data first, then id.
+static int better_locked(int a, int b) {
+    uint32_t la = position_locked(a), lb = position_locked(b);
+    if (la != lb) return la > lb;
+    return strcmp(members[a].id, members[b].id) > 0;
+}
+
+static void shutdown_session_fds(const UserSession_t *session, void *ctx) {
+    (void)ctx;
+    for (int i = 0; i < MAX_SESSIONS_PER_USER; i++) {
+        if (session->connection_fds[i] > 0) shutdown(session->connection_fds[i], SHUT_RDWR);
+    }
+}
+
+static void set_leader_locked(int idx) {
+    if (idx == leader_index) return;
+    int was_leader = (leader_index == self_index);
+    uint64_t now = metrics_now_ns();
+    leader_index = idx;
+
+    if (was_leader) {
+        repl_set_active(0);
+        // Clients reconnect and are redirected to the new leader
+        lock_sessions();
+        for_each_session_locked(shutdown_session_fds, NULL);
+        unlock_sessions();
+        LOG_WARN("[Eleição] Este nó deixou de ser líder (termo %u).", current_term);
+    }
+    if (idx < 0) {
+        leaderless_since_ns = now;
+        return;
+    }
+    uint64_t outage_ns = now - leader_last_seen_ns;
+    if (idx == self_index) {
+        repl_set_term(current_term);
+        repl_set_active(1);
+        LOG_INFO("[Eleição] Este nó é o líder no termo %u (%.1f s sem líder).", current_term,
+                 (double)outage_ns / 1e9);
+    } else {
+        LOG_INFO("[Eleição] Líder: '%s' (%s:%d), termo %u.", members[idx].id, members[idx].host,
+                 members[idx].port, current_term);
+    }
+}
+
+// Heartbeat payload: "<id> <term> <leader id or -> <lsn>"
+static void fill_heartbeat_locked(packet_t *pkt) {
+    pkt->type = PKT_HEARTBEAT;
+    pkt->seq_num = current_term;
+    snprintf(pkt->payload, MAX_PAYLOAD, "%s %u %s %u", members[self_index].id, current_term,
+             leader_index >= 0 ? members[leader_index].id : "-", repl_position());
+    pkt->payload_size = (uint32_t)strlen(pkt->payload) + 1;
+}
+
+static void observe_heartbeat(packet_t *pkt) {
+    pkt->payload[pkt->payload_size < MAX_PAYLOAD ? pkt->payload_size : MAX_PAYLOAD - 1] = '\0';
+    char id[64], leader_id[64];
+    unsigned int term, lsn;
+    if (sscanf(pkt->payload, "%63s %u %63s %u", id, &term, leader_id, &lsn) != 4) return;
+
+    pthread_mutex_lock(&election_mutex);
+    int from = find_member_locked(id);
+    if (from < 0 || from == self_index) {
+        pthread_mutex_unlock(&election_mutex);
+        return;
+    }
+    uint64_t now = metrics_now_ns();
+    members[from].last_seen_ns = now;
+    members[from].lsn = lsn;
+    // Follow a reported leader only if it is the sender or we hear from it
+    // ourselves: peers keep naming a crashed leader until they time out, and a
+    // restarted node must win an election rather than be handed the role.
+    int their_leader = find_member_locked(leader_id);
+    if (their_leader == self_index || (their_leader >= 0 && their_leader != from && !alive_locked(their_leader, now))) {
+        their_leader = -1;
+    }
+
+    if (term > current_term) {
+        current_term = term;
+        repl_set_term(term);
+        if (their_leader >= 0) set_leader_locked(their_leader);
+    } else if (term == current_term && their_leader >= 0 && their_leader != leader_index) {
+        if (leader_index < 0) {
+            set_leader_locked(their_leader);
+        } else if (leader_index == self_index && better_locked(their_leader, self_index)) {
+            // Two leaders in one term: the better one keeps the group
+            set_leader_locked(their_leader);
+        }
+    }
+    pthread_mutex_unlock(&election_mutex);
+}
+
+static void *ticker_thread(void *arg) {
+    (void)arg;
+    for (;;) {
+        sleep_ms(ELECTION_HEARTBEAT_MS);
+        uint64_t now = metrics_now_ns();
+        pthread_mutex_lock(&election_mutex);
+        if (leader_index >= 0 && leader_index != self_index && !alive_locked(leader_index, now)) {
+            LOG_WARN("[Eleição] Líder '%s' sem heartbeat há mais de %d ms.", members[leader_index].id, ELECTION_TIMEOUT_MS);
+            leader_last_seen_ns = members[leader_index].last_seen_ns;
+            set_leader_locked(-1);
+            pthread_mutex_unlock(&election_mutex);
+            continue; // leaderless_since_ns is newer than 'now'
+        }
+        // Right after startup, wait one timeout to learn about a running leader.
+        // After losing one, wait two heartbeat rounds so the positions the
+        // members report no longer include writes still in flight.
+        if (leader_index < 0 && now - started_ns >= (uint64_t)ELECTION_TIMEOUT_MS * 1000000ull &&
+            now - leaderless_since_ns >= 2ull * ELECTION_HEARTBEAT_MS * 1000000ull) {
+            int best = self_index;
+            for (int i = 0; i < member_count; i++) {
+                if (alive_locked(i, now) && better_locked(i, best)) best = i;
+            }
+            // If the best candidate stays silent (it may see a different set
+            // of members), stop waiting for it after two more timeouts.
+            int overdue = now - leaderless_since_ns >= 3ull * ELECTION_TIMEOUT_MS * 1000000ull;
+            if (best == self_index || overdue) {
+                current_term++;
+                set_leader_locked(self_index);
+            }
+        }
+        pthread_mutex_unlock(&election_mutex);
+    }
+    return NULL;
+}
+
+static void set_recv_timeout(int sock) {
+    struct timeval tv = { .tv_sec = ELECTION_TIMEOUT_MS / 1000, .tv_usec = (ELECTION_TIMEOUT_MS % 1000) * 1000 };
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+}
+
+// Keeps a heartbeat connection to one peer, reconnecting as needed.
+static void *peer_thread(void *arg) {
+    int idx = (int)(intptr_t)arg;
+    const char *addr = members[idx].addr;
+    for (;;) {
+        int sock = connect_to_addr(addr);
+        if (sock < 0) {
+            sleep_ms(ELECTION_HEARTBEAT_MS);
+            continue;
+        }
+        set_recv_timeout(sock);
+        for (;;) {
+            packet_t hb, reply;
+            pthread_mutex_lock(&election_mutex);
+            fill_heartbeat_locked(&hb);
+            pthread_mutex_unlock(&election_mutex);
+            if (send_packet(sock, &hb) != 0 || recv_packet(sock, &reply) != 0 || reply.type != PKT_HEARTBEAT) break;
+            observe_heartbeat(&reply);
+            sleep_ms(ELECTION_HEARTBEAT_MS);
+        }
+        close(sock);
+        sleep_ms(ELECTION_HEARTBEAT_MS);
+    }
+    return NULL;
+}
+
+void election_serve_peer(int conn_fd, const packet_t *first) {
+    set_recv_timeout(conn_fd);
+    packet_t pkt = *first;
+    do {
+        if (pkt.type != PKT_HEARTBEAT) break;
+        observe_heartbeat(&pkt);
+        packet_t reply;
+        pthread_mutex_lock(&election_mutex);
+        fill_heartbeat_locked(&reply);
+        pthread_mutex_unlock(&election_mutex);
+        if (send_packet(conn_fd, &reply) != 0) break;
+    } while (recv_packet(conn_fd, &pkt) == 0);
+}
+
+void election_start(void) {
+    pthread_mutex_lock(&election_mutex);
+    started_ns = leaderless_since_ns = leader_last_seen_ns = metrics_now_ns();
+    pthread_mutex_unlock(&election_mutex);
+
+    pthread_t tid;
+    for (int i = 0; i < member_count; i++) {
+        if (i == self_index) continue;
+        int err = pthread_create(&tid, NULL, peer_thread, (void *)(intptr_t)i);
+        if (err != 0) {
+            LOG_ERROR("[Eleição] pthread_create para '%s' falhou: %s", members[i].id, strerror(err));
+            continue;
+        }
+        pthread_detach(tid);
+    }
+    int err = pthread_create(&tid, NULL, ticker_thread, NULL);
+    if (err != 0) {
+        LOG_ERROR("[Eleição] pthread_create para o temporizador falhou: %s", strerror(err));
+        return;
+    }
+    pthread_detach(tid);
+}
+
+int election_is_leader(char *leader_addr, size_t len) {
+    pthread_mutex_lock(&election_mutex);
+    int mine = (leader_index == self_index);
+    if (!mine && leader_addr) {
+        if (leader_index >= 0) {
+            snprintf(leader_addr, len, "%s", members[leader_index].addr);
+        } else {
+            leader_addr[0] = '\0';
+        }
+    }
+    pthread_mutex_unlock(&election_mutex);
+    return mine;
+}
+
+void election_member_list(char *out, size_t len) {
+    size_t off = 0;
+    out[0] = '\0';
+    pthread_mutex_lock(&election_mutex);
+    for (int i = 0; i < member_count && off < len; i++) {
+        int n = snprintf(out + off, len - off, "%s%s", i ? "," : "", members[i].addr);
+        if (n < 0) break;
+        off += (size_t)n;
+    }
+    pthread_mutex_unlock(&election_mutex);
+}
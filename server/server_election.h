@@ -0,0 +1,47 @@
+#ifndef SERVER_ELECTION_H
+#define SERVER_ELECTION_H
+
+#include <stddef.h>
+#include "../common/packet.h"
+#include "server_replication.h"
+
+// Replica group with automatic failover. Every member is started with the
+// same group file (one "<id> <host> <port>" per line, as for the cluster) and
+// its own id. Members keep a connection to each other and exchange
+// PKT_HEARTBEAT every ELECTION_HEARTBEAT_MS; the answer carries the
+// receiver's view, so each side learns the other's term, leader and position.
+// The leader is the replication primary and ships to every other member;
+// followers redirect clients to it.
+//
+// Election is a sticky bully. A member that has not heard from a leader for
+// ELECTION_TIMEOUT_MS ranks the members it can reach by (replicated LSN, id).
+// If it ranks first it takes the next term and becomes leader; otherwise it
+// waits for the winner's heartbeat (and takes over itself if none comes). A
+// better member joining never displaces a live leader. Two leaders in the
+// same term (a healed partition) resolve in favour of the better one; the
+// other steps down and is resynced from it. There is no quorum, so a
+// two-member group still fails over, and writes taken by the losing side of a
+// partition are discarded when it heals.
+
+#define ELECTION_HEARTBEAT_MS 300
+#define ELECTION_TIMEOUT_MS   1500
+#define ELECTION_MAX_MEMBERS  (REPL_MAX_BACKUPS + 1)
+
+// Loads the group file and registers every other member as a replication
+// backup (call before repl_start). Returns -1 if the file cannot be read,
+// has too many members or does not list 'self_id'.
+int  election_load(const char *path, const char *self_id);
+void election_start(void);
+int  election_enabled(void);
+
+// Returns 1 if this node leads. Otherwise returns 0 and writes the leader's
+// "host:port" to 'leader_addr', or "" while no leader is known.
+int  election_is_leader(char *leader_addr, size_t len);
+// Comma-separated "host:port" of every member, sent to clients in the
+// handshake ACK so they can find the group again after a failover.
+void election_member_list(char *out, size_t len);
+
+// Serves a peer's heartbeat connection, whose first packet is 'first'.
+void election_serve_peer(int conn_fd, const packet_t *first);
+
+#endif // SERVER_ELECTION_H
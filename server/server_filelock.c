@@ -0,0 +1,143 @@
+#include "server_filelock.h"
+#include "../common/log.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+typedef struct version_entry {
+    char    *path;
+    uint64_t version; // Stamp of the last change applied to the file
+    struct version_entry *next;
+} version_entry_t;
+
+struct file_lock {
+    pthread_rwlock_t rwlock;
+    version_entry_t *versions; // Protected by rwlock held exclusive
+    int              version_count;
+};
+
+static struct file_lock stripes[FILE_LOCK_STRIPES];
+static pthread_once_t   stripes_once = PTHREAD_ONCE_INIT;
+
+// Running changes in stamp order, so the head is the oldest.
+static pthread_mutex_t stamp_mutex = PTHREAD_MUTEX_INITIALIZER;
+static file_stamp_t   *stamps_head = NULL;
+static file_stamp_t   *stamps_tail = NULL;
+static uint64_t        next_stamp = 0;
+
+static void init_stripes(void) {
+    for (int i = 0; i < FILE_LOCK_STRIPES; i++) {
+        pthread_rwlock_init(&stripes[i].rwlock, NULL);
+    }
+}
+
+static struct file_lock *stripe_of(const char *path) {
+    pthread_once(&stripes_once, init_stripes);
+    uint32_t h = 2166136261u; // FNV-1a
+    for (const unsigned char *c = (const unsigned char *)path; *c; c++) {
+        h ^= *c;
+        h *= 16777619u;
+    }
+    return &stripes[h % FILE_LOCK_STRIPES];
+}
+
+file_lock_t *file_lock_read(const char *path) {
+    struct file_lock *lock = stripe_of(path);
+    pthread_rwlock_rdlock(&lock->rwlock);
+    return lock;
+}
+
+file_lock_t *file_lock_write(const char *path) {
+    struct file_lock *lock = stripe_of(path);
+    pthread_rwlock_wrlock(&lock->rwlock);
+    return lock;
+}
+
+void file_lock_write_pair(const char *a, const char *b, file_lock_t **first, file_lock_t **second) {
+    struct file_lock *la = stripe_of(a), *lb = stripe_of(b);
+    if (la == lb) {
+        lb = NULL;
+    } else if (lb < la) {
+        struct file_lock *t = la;
+        la = lb;
+        lb = t;
+    }
+    pthread_rwlock_wrlock(&la->rwlock);
+    if (lb) pthread_rwlock_wrlock(&lb->rwlock);
+    *first = la;
+    *second = lb;
+}
+
+void file_unlock(file_lock_t *lock) {
+    if (lock) pthread_rwlock_unlock(&lock->rwlock);
+}
+
+void file_stamp_begin(file_stamp_t *stamp) {
+    pthread_mutex_lock(&stamp_mutex);
+    stamp->version = ++next_stamp;
+    stamp->next = NULL;
+    stamp->prev = stamps_tail;
+    if (stamps_tail) stamps_tail->next = stamp; else stamps_head = stamp;
+    stamps_tail = stamp;
+    pthread_mutex_unlock(&stamp_mutex);
+}
+
+void file_stamp_end(file_stamp_t *stamp) {
+    pthread_mutex_lock(&stamp_mutex);
+    if (stamp->prev) stamp->prev->next = stamp->next; else stamps_head = stamp->next;
+    if (stamp->next) stamp->next->prev = stamp->prev; else stamps_tail = stamp->prev;
+    stamp->prev = stamp->next = NULL;
+    pthread_mutex_unlock(&stamp_mutex);
+}
+
+// Drops the versions older than every running change: no claim can lose
+// to them any more.
+static void prune_locked(struct file_lock *lock) {
+    pthread_mutex_lock(&stamp_mutex);
+    uint64_t oldest = stamps_head ? stamps_head->version : next_stamp + 1;
+    pthread_mutex_unlock(&stamp_mutex);
+
+    for (version_entry_t **pp = &lock->versions; *pp;) {
+        version_entry_t *v = *pp;
+        if (v->version < oldest) {
+            *pp = v->next;
+            free(v->path);
+            free(v);
+            lock->version_count--;
+        } else {
+            pp = &v->next;
+        }
+    }
+}
+
+int file_version_newer(const char *path, const file_stamp_t *stamp) {
+    const version_entry_t *v = stripe_of(path)->versions;
+    while (v && strcmp(v->path, path) != 0) v = v->next;
+    return v && v->version > stamp->version;
+}
+
+int file_version_claim(const char *path, const file_stamp_t *stamp) {
+    struct file_lock *lock = stripe_of(path);
+    version_entry_t *v = lock->versions;
+    while (v && strcmp(v->path, path) != 0) v = v->next;
+    if (v) {
+        if (v->version > stamp->version) return 0;
+        v->version = stamp->version;
+        return 1;
+    }
+
+    if (lock->version_count >= FILE_VERSIONS_PRUNE_AT) prune_locked(lock);
+    v = calloc(1, sizeof(*v));
+    if (!v || !(v->path = strdup(path))) {
+        // Without the entry a slower, older change could still win; the
+        // file itself is consistent either way
+        LOG_WARN("Sem memória para a versão de '%s'.", path);
+        free(v);
+        return 1;
+    }
+    v->version = stamp->version;
+    v->next = lock->versions;
+    lock->versions = v;
+    lock->version_count++;
+    return 1;
+}
@@ -0,0 +1,53 @@
+#ifndef SERVER_FILELOCK_H
+#define SERVER_FILELOCK_H
+
+#include <stdint.h>
+
+// Per-file reader/writer locks and last-writer-wins versions.
+//
+// Locks are striped: a path hashes to one of FILE_LOCK_STRIPES rwlocks, so
+// operations on different files rarely share a lock and never wait on a
+// global one. Readers (opening a file for a download or a push) take it
+// shared; whatever replaces or removes a stored file takes it exclusive for
+// the rename or unlink only, never for the transfer.
+//
+// Every change is stamped when it starts (file_stamp_begin). When two
+// changes to the same file overlap, the one that started last wins: a change
+// whose stamp is older than the last one applied to its file is dropped
+// (file_version_claim returns 0), so a slow upload cannot overwrite a newer
+// upload or bring back a file deleted after it started.
+
+#define FILE_LOCK_STRIPES 256
+// Versions kept per stripe before the ones no running change can lose to
+// are pruned.
+#define FILE_VERSIONS_PRUNE_AT 32
+
+typedef struct file_lock file_lock_t;
+
+// A running change. Lives with the operation; file_stamp_end must follow.
+typedef struct file_stamp {
+    uint64_t version;
+    struct file_stamp *prev, *next; // In-flight changes, oldest first
+} file_stamp_t;
+
+// Lock 'path' shared or exclusive; hand the result to file_unlock.
+file_lock_t *file_lock_read(const char *path);
+file_lock_t *file_lock_write(const char *path);
+// Locks two paths exclusive for a change that touches both (a rename). The
+// stripes are taken in a fixed order so two such changes cannot deadlock;
+// when both paths share a stripe it is locked once and *second is NULL.
+void         file_lock_write_pair(const char *a, const char *b, file_lock_t **first, file_lock_t **second);
+void         file_unlock(file_lock_t *lock);
+
+void file_stamp_begin(file_stamp_t *stamp);
+void file_stamp_end(file_stamp_t *stamp);
+
+// Call with the write lock on 'path' held. Returns 1 and records the change
+// if no newer one was applied to 'path', 0 if the caller must drop it.
+int file_version_claim(const char *path, const file_stamp_t *stamp);
+// Call with the write lock on 'path' held. Returns 1 if a change newer than
+// 'stamp' was applied to 'path', without recording anything; lets a change to
+// several files check them all before claiming any.
+int file_version_newer(const char *path, const file_stamp_t *stamp);
+
+#endif // SERVER_FILELOCK_H
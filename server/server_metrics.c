@@ -0,0 +1,284 @@
+#include "server_metrics.h"
+#include "server_session.h"
+#include "server_replication.h"
+#include "server_push.h"
+#include "server_cache.h"
+#include "server_storage.h"
+#include "server_pack.h"
+#include "server_zfile.h"
+#include "server_dedupe.h"
+#include "../common/log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+// Histogram bucket upper bounds in nanoseconds (Prometheus "le" labels).
+// The last implicit bucket is +Inf.
+static const uint64_t bucket_bounds_ns[] = {
+    50000ull, 100000ull, 250000ull, 500000ull,
+    1000000ull, 2500000ull, 5000000ull, 10000000ull, 25000000ull, 50000000ull,
+    100000000ull, 250000000ull, 500000000ull,
+    1000000000ull, 2500000000ull, 5000000000ull, 10000000000ull
+};
+#define HISTOGRAM_BOUNDS (sizeof(bucket_bounds_ns) / sizeof(bucket_bounds_ns[0]))
+
+typedef struct {
+    _Atomic uint64_t buckets[HISTOGRAM_BOUNDS + 1]; // Non-cumulative; summed on export
+    _Atomic uint64_t sum_ns;
+    _Atomic uint64_t count;
+} histogram_t;
+
+typedef struct {
+    histogram_t      latency;
+    _Atomic uint64_t ok;
+    _Atomic uint64_t failed;
+} op_metrics_t;
+
+static op_metrics_t op_metrics[METRIC_OP_COUNT];
+static histogram_t  sessions_lock_wait;
+static _Atomic int64_t gauges[METRIC_GAUGE_COUNT];
+
+static const char *op_labels[METRIC_OP_COUNT] = {
+    "upload", "download", "delete", "list", "propagation", "handshake", "migration", "replication", "batch_upload", "rename"
+};
+
+static const char *gauge_names[METRIC_GAUGE_COUNT] = {
+    "sync_active_connections",
+    "sync_sessions_lock_waiters",
+    "sync_propagations_in_flight",
+    "sync_propagations_queued"
+};
+
+static const char *gauge_help[METRIC_GAUGE_COUNT] = {
+    "Client connections currently being served.",
+    "Threads currently blocked waiting for sessions_mutex.",
+    "Propagation transfers to other devices currently running.",
+    "Pushes waiting to be sent to devices, at most one per file and device."
+};
+
+uint64_t metrics_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void histogram_observe(histogram_t *h, uint64_t ns) {
+    size_t i = 0;
+    while (i < HISTOGRAM_BOUNDS && ns > bucket_bounds_ns[i]) i++;
+    atomic_fetch_add_explicit(&h->buckets[i], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->sum_ns, ns, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->count, 1, memory_order_relaxed);
+}
+
+void metrics_observe_op(metric_op_t op, uint64_t duration_ns, int success) {
+    if (op < 0 || op >= METRIC_OP_COUNT) return;
+    histogram_observe(&op_metrics[op].latency, duration_ns);
+    atomic_fetch_add_explicit(success ? &op_metrics[op].ok : &op_metrics[op].failed, 1, memory_order_relaxed);
+}
+
+void metrics_observe_request(packet_type_t type, uint64_t duration_ns, int success) {
+    switch (type) {
+        case PKT_UPLOAD_REQ:      metrics_observe_op(METRIC_OP_UPLOAD, duration_ns, success); break;
+        case PKT_DOWNLOAD_REQ:    metrics_observe_op(METRIC_OP_DOWNLOAD, duration_ns, success); break;
+        case PKT_DELETE_REQ:      metrics_observe_op(METRIC_OP_DELETE, duration_ns, success); break;
+        case PKT_LIST_SERVER_REQ: metrics_observe_op(METRIC_OP_LIST, duration_ns, success); break;
+        case PKT_BATCH_UPLOAD:    metrics_observe_op(METRIC_OP_BATCH_UPLOAD, duration_ns, success); break;
+        case PKT_RENAME_REQ:      metrics_observe_op(METRIC_OP_RENAME, duration_ns, success); break;
+        default: break;
+    }
+}
+
+void metrics_observe_sessions_lock_wait(uint64_t wait_ns) {
+    histogram_observe(&sessions_lock_wait, wait_ns);
+}
+
+void metrics_gauge_add(metric_gauge_t gauge, int64_t delta) {
+    if (gauge < 0 || gauge >= METRIC_GAUGE_COUNT) return;
+    atomic_fetch_add_explicit(&gauges[gauge], delta, memory_order_relaxed);
+}
+
+// ---------------------------------------------------------------------------
+// Prometheus text exposition
+// ---------------------------------------------------------------------------
+
+static void write_histogram(FILE *out, const char *name, const char *labels, histogram_t *h) {
+    uint64_t cumulative = 0;
+    const char *sep = labels[0] ? "," : "";
+    for (size_t i = 0; i < HISTOGRAM_BOUNDS; i++) {
+        cumulative += atomic_load_explicit(&h->buckets[i], memory_order_relaxed);
+        fprintf(out, "%s_bucket{%s%sle=\"%g\"} %llu\n", name, labels, sep,
+                (double)bucket_bounds_ns[i] / 1e9, (unsigned long long)cumulative);
+    }
+    cumulative += atomic_load_explicit(&h->buckets[HISTOGRAM_BOUNDS], memory_order_relaxed);
+    fprintf(out, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, labels, sep, (unsigned long long)cumulative);
+    double sum_s = (double)atomic_load_explicit(&h->sum_ns, memory_order_relaxed) / 1e9;
+    if (labels[0]) {
+        fprintf(out, "%s_sum{%s} %.9f\n", name, labels, sum_s);
+        fprintf(out, "%s_count{%s} %llu\n", name, labels, (unsigned long long)cumulative);
+    } else {
+        fprintf(out, "%s_sum %.9f\n", name, sum_s);
+        fprintf(out, "%s_count %llu\n", name, (unsigned long long)cumulative);
+    }
+}
+
+static void write_session_gauge(const UserSession_t *session, void *ctx) {
+    FILE *out = (FILE *)ctx;
+    fputs("sync_user_sessions{user=\"", out);
+    for (const char *c = session->username; *c; c++) {
+        if (*c == '"' || *c == '\\') fputc('\\', out);
+        if (*c == '\n') { fputs("\\n", out); continue; }
+        fputc(*c, out);
+    }
+    fprintf(out, "\"} %d\n", session->active_connections_count);
+}
+
+static void write_metrics(FILE *out) {
+    fputs("# HELP sync_ops_total Requests handled, by operation and result.\n"
+          "# TYPE sync_ops_total counter\n", out);
+    for (int op = 0; op < METRIC_OP_COUNT; op++) {
+        fprintf(out, "sync_ops_total{op=\"%s\",result=\"ok\"} %llu\n", op_labels[op],
+                (unsigned long long)atomic_load_explicit(&op_metrics[op].ok, memory_order_relaxed));
+        fprintf(out, "sync_ops_total{op=\"%s\",result=\"error\"} %llu\n", op_labels[op],
+                (unsigned long long)atomic_load_explicit(&op_metrics[op].failed, memory_order_relaxed));
+    }
+
+    fputs("# HELP sync_op_duration_seconds Time spent serving each operation.\n"
+          "# TYPE sync_op_duration_seconds histogram\n", out);
+    for (int op = 0; op < METRIC_OP_COUNT; op++) {
+        char labels[64];
+        snprintf(labels, sizeof(labels), "op=\"%s\"", op_labels[op]);
+        write_histogram(out, "sync_op_duration_seconds", labels, &op_metrics[op].latency);
+    }
+
+    fputs("# HELP sync_sessions_lock_wait_seconds Time spent waiting to acquire sessions_mutex.\n"
+          "# TYPE sync_sessions_lock_wait_seconds histogram\n", out);
+    write_histogram(out, "sync_sessions_lock_wait_seconds", "", &sessions_lock_wait);
+
+    packet_stats_t ps;
+    packet_get_stats(&ps);
+    fprintf(out, "# HELP sync_bytes_received_total Bytes read from client sockets.\n"
+                 "# TYPE sync_bytes_received_total counter\n"
+                 "sync_bytes_received_total %llu\n", (unsigned long long)ps.bytes_received);
+    fprintf(out, "# HELP sync_bytes_sent_total Bytes written to client sockets.\n"
+                 "# TYPE sync_bytes_sent_total counter\n"
+                 "sync_bytes_sent_total %llu\n", (unsigned long long)ps.bytes_sent);
+    fprintf(out, "# HELP sync_packets_received_total Packets read from client sockets.\n"
+                 "# TYPE sync_packets_received_total counter\n"
+                 "sync_packets_received_total %llu\n", (unsigned long long)ps.packets_received);
+    fprintf(out, "# HELP sync_packets_sent_total Packets written to client sockets.\n"
+                 "# TYPE sync_packets_sent_total counter\n"
+                 "sync_packets_sent_total %llu\n", (unsigned long long)ps.packets_sent);
+    fprintf(out, "# HELP sync_wire_compressed_packets_total Packets whose payload crossed the wire compressed.\n"
+                 "# TYPE sync_wire_compressed_packets_total counter\n"
+                 "sync_wire_compressed_packets_total{direction=\"sent\"} %llu\n"
+                 "sync_wire_compressed_packets_total{direction=\"received\"} %llu\n",
+            (unsigned long long)ps.compressed_sent, (unsigned long long)ps.compressed_received);
+    fprintf(out, "# HELP sync_wire_compression_saved_bytes_total Payload bytes compression kept off the wire.\n"
+                 "# TYPE sync_wire_compression_saved_bytes_total counter\n"
+                 "sync_wire_compression_saved_bytes_total{direction=\"sent\"} %llu\n"
+                 "sync_wire_compression_saved_bytes_total{direction=\"received\"} %llu\n",
+            (unsigned long long)ps.compress_saved_sent, (unsigned long long)ps.compress_saved_received);
+    fprintf(out, "# HELP sync_wire_compression_bypassed_total Payloads sent as is because they did not shrink.\n"
+                 "# TYPE sync_wire_compression_bypassed_total counter\n"
+                 "sync_wire_compression_bypassed_total %llu\n", (unsigned long long)ps.compress_bypassed);
+
+    for (int g = 0; g < METRIC_GAUGE_COUNT; g++) {
+        fprintf(out, "# HELP %s %s\n# TYPE %s gauge\n%s %lld\n", gauge_names[g], gauge_help[g],
+                gauge_names[g], gauge_names[g],
+                (long long)atomic_load_explicit(&gauges[g], memory_order_relaxed));
+    }
+
+    fputs("# HELP sync_user_sessions Active connections per user.\n"
+          "# TYPE sync_user_sessions gauge\n", out);
+    lock_sessions();
+    for_each_session_locked(write_session_gauge, out);
+    unlock_sessions();
+
+    push_write_metrics(out);
+    content_cache_write_metrics(out);
+    storage_write_metrics(out);
+    pack_write_metrics(out);
+    zfile_write_metrics(out);
+    dedupe_write_metrics(out);
+    repl_write_metrics(out);
+}
+
+// ---------------------------------------------------------------------------
+// Admin socket (minimal HTTP/1.0, one request per connection)
+// ---------------------------------------------------------------------------
+
+static void serve_admin_connection(int fd) {
+    char req[1024];
+    ssize_t n = read(fd, req, sizeof(req) - 1); // Request line/headers are not needed
+    (void)n;
+
+    char *body = NULL;
+    size_t body_len = 0;
+    FILE *out = open_memstream(&body, &body_len);
+    if (!out) return;
+    write_metrics(out);
+    fclose(out);
+
+    char header[256];
+    int header_len = snprintf(header, sizeof(header),
+                              "HTTP/1.0 200 OK\r\n"
+                              "Content-Type: text/plain; version=0.0.4\r\n"
+                              "Content-Length: %zu\r\n"
+                              "Connection: close\r\n\r\n", body_len);
+    if (write(fd, header, (size_t)header_len) == header_len) {
+        size_t off = 0;
+        while (off < body_len) {
+            ssize_t w = write(fd, body + off, body_len - off);
+            if (w <= 0) break;
+            off += (size_t)w;
+        }
+    }
+    free(body);
+}
+
+static void *admin_server_thread(void *arg) {
+    int listen_fd = (int)(intptr_t)arg;
+    while (1) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) continue;
+        serve_admin_connection(fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+int metrics_start_admin_server(int port) {
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_fd < 0) { LOG_ERROR("admin socket creation failed: %s", strerror(errno)); return -1; }
+
+    int optval = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK), // Local only
+        .sin_port = htons(port)
+    };
+    if (bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(listen_fd, 4) < 0) {
+        LOG_ERROR("admin bind/listen failed: %s", strerror(errno));
+        close(listen_fd);
+        return -1;
+    }
+
+    pthread_t tid;
+    int err = pthread_create(&tid, NULL, admin_server_thread, (void*)(intptr_t)listen_fd);
+    if (err != 0) {
+        LOG_ERROR("pthread_create for admin server failed: %s", strerror(err));
+        close(listen_fd);
+        return -1;
+    }
+    pthread_detach(tid);
+    return 0;
+}
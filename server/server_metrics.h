@@ -0,0 +1,46 @@
+#ifndef SERVER_METRICS_H
+#define SERVER_METRICS_H
+
+#include <stdint.h>
+#include "../common/packet.h"
+
+// Operations tracked with a counter and a latency histogram
+typedef enum {
+    METRIC_OP_UPLOAD,
+    METRIC_OP_DOWNLOAD,
+    METRIC_OP_DELETE,
+    METRIC_OP_LIST,
+    METRIC_OP_PROPAGATION,
+    METRIC_OP_HANDSHAKE,
+    METRIC_OP_MIGRATION,
+    METRIC_OP_REPLICATION, // Record appended on the primary -> ACKed by a backup
+    METRIC_OP_BATCH_UPLOAD,
+    METRIC_OP_RENAME,
+    METRIC_OP_COUNT
+} metric_op_t;
+
+// Gauges that go up and down
+typedef enum {
+    METRIC_GAUGE_ACTIVE_CONNECTIONS,
+    METRIC_GAUGE_SESSIONS_LOCK_WAITERS,
+    METRIC_GAUGE_PROPAGATIONS_IN_FLIGHT,
+    METRIC_GAUGE_PROPAGATIONS_QUEUED,
+    METRIC_GAUGE_COUNT
+} metric_gauge_t;
+
+// Monotonic clock in nanoseconds, used for all durations below.
+uint64_t metrics_now_ns(void);
+
+// All recording functions are lock-free (relaxed atomics) and safe to call
+// from any thread, including while holding sessions_mutex.
+void metrics_observe_op(metric_op_t op, uint64_t duration_ns, int success);
+// Maps a request packet type to its operation; other types are ignored.
+void metrics_observe_request(packet_type_t type, uint64_t duration_ns, int success);
+void metrics_observe_sessions_lock_wait(uint64_t wait_ns);
+void metrics_gauge_add(metric_gauge_t gauge, int64_t delta);
+
+// Starts a thread serving the metrics in Prometheus text format over HTTP on
+// 127.0.0.1:<port>. Returns 0 on success, -1 if the socket could not be set up.
+int metrics_start_admin_server(int port);
+
+#endif // SERVER_METRICS_H
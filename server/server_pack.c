@@ -0,0 +1,855 @@
+#include "server_pack.h"
+#include "server_storage.h"
+#include "../common/log.h"
+#include "../common/trace.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#define PACK_MAGIC            0x4b415031u // "1PAK" on disk
+#define PACK_FLAG_DELETED     1u
+#define PACK_REGISTRY_BUCKETS 1024
+#define PACK_INDEX_MIN        64
+#define PACK_NEGATIVE_MAX     65536 // Directories remembered as having no packfile
+
+// Records are written in host byte order: a packfile never leaves its server.
+typedef struct {
+    uint32_t magic;
+    uint32_t flags;
+    uint32_t name_len; // Without a terminator
+    uint32_t checksum; // FNV-1a of this header (checksum 0), the name and the contents
+    uint64_t size;     // Contents, after the name
+    int64_t  mtime_ns; // When the file was stored
+} pack_header_t;
+
+typedef struct pack_entry {
+    char    *name;
+    uint64_t offset; // Of the record's header
+    uint64_t size;
+    int64_t  mtime_ns;
+    struct pack_entry *next;
+} pack_entry_t;
+
+typedef struct pack {
+    char           *dir;
+    pthread_mutex_t mutex; // Everything down to entry_count
+    int             loaded;
+    int             fd;    // -1 until the directory has a packfile
+    uint64_t        end;   // Where the next record goes
+    uint64_t        live_bytes, dead_bytes;
+    pack_entry_t  **buckets;
+    size_t          bucket_count, entry_count;
+    int             refs;        // Protected by registry_mutex
+    int             in_registry; // Forgotten packs are freed by their last user
+    int             negative;    // Kept with no packfile; counted in negative_count
+    struct pack    *next;
+} pack_t;
+
+static size_t threshold = 0;
+
+static pthread_mutex_t registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pack_t         *registry[PACK_REGISTRY_BUCKETS];
+static size_t          negative_count = 0;
+
+// Until packing is enabled or a packfile turns up on disk, no directory can
+// have one, and every call returns without touching the filesystem.
+static atomic_int in_use = 0;
+
+static _Atomic int64_t  files_gauge, live_gauge, dead_gauge;
+static _Atomic uint64_t compactions_total, torn_total;
+
+void pack_set_threshold(size_t bytes) {
+    threshold = bytes;
+    if (bytes > 0) atomic_store(&in_use, 1);
+}
+
+void pack_note_found(void) {
+    atomic_store(&in_use, 1);
+}
+
+static int packs_possible(void) {
+    return atomic_load_explicit(&in_use, memory_order_relaxed);
+}
+
+size_t pack_threshold(void) {
+    return threshold;
+}
+
+int pack_is_internal_name(const char *name) {
+    return strcmp(name, PACK_NAME) == 0 || strcmp(name, PACK_COMPACT_NAME) == 0;
+}
+
+static uint32_t fnv1a(uint32_t h, const void *data, size_t len) {
+    const unsigned char *c = data;
+    for (size_t i = 0; i < len; i++) {
+        h ^= c[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// Checksum of a record laid out in memory as header, name, contents.
+static uint32_t record_checksum(const char *rec, size_t len) {
+    pack_header_t h;
+    memcpy(&h, rec, sizeof(h));
+    h.checksum = 0;
+    uint32_t sum = fnv1a(2166136261u, &h, sizeof(h));
+    return fnv1a(sum, rec + sizeof(h), len - sizeof(h));
+}
+
+static uint64_t record_len(size_t name_len, uint64_t size) {
+    return sizeof(pack_header_t) + name_len + size;
+}
+
+static int pread_full(int fd, void *buf, size_t len, uint64_t off) {
+    char *p = buf;
+    while (len > 0) {
+        ssize_t n = pread(fd, p, len, (off_t)off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            if (n == 0) errno = EIO;
+            return -1;
+        }
+        p += n;
+        len -= (size_t)n;
+        off += (uint64_t)n;
+    }
+    return 0;
+}
+
+static int pwrite_full(int fd, const void *buf, size_t len, uint64_t off) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = pwrite(fd, p, len, (off_t)off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= (size_t)n;
+        off += (uint64_t)n;
+    }
+    return 0;
+}
+
+// Splits "<dir>/<name>". Returns -1 if 'path' has no name.
+static int split_path(const char *path, char *dir, size_t dir_len, const char **name) {
+    const char *slash = strrchr(path, '/');
+    if (!slash || slash[1] == '\0' || (size_t)(slash - path) >= dir_len) {
+        errno = EINVAL;
+        return -1;
+    }
+    snprintf(dir, dir_len, "%.*s", (int)(slash - path), path);
+    *name = slash + 1;
+    return 0;
+}
+
+static void account(pack_t *p, int64_t files, int64_t live, int64_t dead) {
+    p->live_bytes += (uint64_t)live;
+    p->dead_bytes += (uint64_t)dead;
+    atomic_fetch_add_explicit(&files_gauge, files, memory_order_relaxed);
+    atomic_fetch_add_explicit(&live_gauge, live, memory_order_relaxed);
+    atomic_fetch_add_explicit(&dead_gauge, dead, memory_order_relaxed);
+}
+
+// ---------------------------------------------------------------------------
+// Offset index
+// ---------------------------------------------------------------------------
+
+static size_t bucket_of(const pack_t *p, const char *name) {
+    return fnv1a(2166136261u, name, strlen(name)) % p->bucket_count;
+}
+
+static pack_entry_t *index_find(const pack_t *p, const char *name) {
+    if (p->entry_count == 0) return NULL;
+    for (pack_entry_t *e = p->buckets[bucket_of(p, name)]; e; e = e->next) {
+        if (strcmp(e->name, name) == 0) return e;
+    }
+    return NULL;
+}
+
+static void index_grow(pack_t *p) {
+    size_t count = p->bucket_count ? p->bucket_count * 2 : PACK_INDEX_MIN;
+    pack_entry_t **buckets = calloc(count, sizeof(*buckets));
+    if (!buckets) return; // Longer chains, still correct
+    pack_entry_t **old = p->buckets;
+    size_t old_count = p->bucket_count;
+    p->buckets = buckets;
+    p->bucket_count = count;
+    for (size_t i = 0; i < old_count; i++) {
+        pack_entry_t *e = old[i];
+        while (e) {
+            pack_entry_t *next = e->next;
+            size_t b = bucket_of(p, e->name);
+            e->next = buckets[b];
+            buckets[b] = e;
+            e = next;
+        }
+    }
+    free(old);
+}
+
+// Adds or updates the entry for 'name'. Returns the entry's previous record
+// length (0 if it is new), or -1 without memory.
+static int64_t index_set(pack_t *p, const char *name, uint64_t offset, uint64_t size, int64_t mtime_ns) {
+    pack_entry_t *e = index_find(p, name);
+    int64_t previous = 0;
+    if (e) {
+        previous = (int64_t)record_len(strlen(e->name), e->size);
+    } else {
+        if (p->entry_count >= 2 * p->bucket_count) index_grow(p);
+        if (p->bucket_count == 0) return -1;
+        e = calloc(1, sizeof(*e));
+        if (!e || !(e->name = strdup(name))) {
+            free(e);
+            return -1;
+        }
+        size_t b = bucket_of(p, name);
+        e->next = p->buckets[b];
+        p->buckets[b] = e;
+        p->entry_count++;
+    }
+    e->offset = offset;
+    e->size = size;
+    e->mtime_ns = mtime_ns;
+    return previous;
+}
+
+static void index_remove(pack_t *p, const char *name) {
+    for (pack_entry_t **pp = &p->buckets[bucket_of(p, name)]; *pp; pp = &(*pp)->next) {
+        pack_entry_t *e = *pp;
+        if (strcmp(e->name, name) == 0) {
+            *pp = e->next;
+            free(e->name);
+            free(e);
+            p->entry_count--;
+            return;
+        }
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Loading
+// ---------------------------------------------------------------------------
+
+// Applies one record read from the log.
+static void replay_record(pack_t *p, const pack_header_t *h, const char *name, uint64_t offset) {
+    int64_t len = (int64_t)record_len(h->name_len, h->size);
+    pack_entry_t *old = index_find(p, name);
+    int64_t old_len = old ? (int64_t)record_len(strlen(old->name), old->size) : 0;
+    if (h->flags & PACK_FLAG_DELETED) {
+        if (old) {
+            index_remove(p, name);
+            account(p, -1, -old_len, old_len + len);
+        } else {
+            account(p, 0, 0, len);
+        }
+        return;
+    }
+    if (index_set(p, name, offset, h->size, h->mtime_ns) < 0) {
+        LOG_ERROR("Sem memória para o índice do packfile de '%s'.", p->dir);
+        account(p, 0, 0, len);
+        return;
+    }
+    account(p, old ? 0 : 1, len - old_len, old_len);
+}
+
+// A regular file stored under a packed one's name was renamed into place
+// after it was packed, and the crash came before its tombstone: the regular
+// file, in its shard (see storage_locate), is the newer one.
+static void drop_shadowed(pack_t *p) {
+    for (size_t b = 0; b < p->bucket_count; b++) {
+        for (pack_entry_t **pp = &p->buckets[b]; *pp;) {
+            pack_entry_t *e = *pp;
+            char path[PATH_MAX], disk_path[PATH_MAX];
+            struct stat st;
+            int n = snprintf(path, sizeof(path), "%s/%s", p->dir, e->name);
+            if (n < 0 || (size_t)n >= sizeof(path) || storage_locate(path, disk_path, sizeof(disk_path)) != 0 ||
+                stat(disk_path, &st) != 0 || !S_ISREG(st.st_mode)) {
+                pp = &e->next;
+                continue;
+            }
+            int64_t len = (int64_t)record_len(strlen(e->name), e->size);
+            *pp = e->next;
+            free(e->name);
+            free(e);
+            p->entry_count--;
+            account(p, -1, -len, len);
+        }
+    }
+}
+
+static void load_locked(pack_t *p) {
+    p->loaded = 1;
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/" PACK_NAME, p->dir);
+    int fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd < 0) {
+        if (errno != ENOENT) LOG_ERROR("Não foi possível abrir o packfile '%s': %s", path, strerror(errno));
+        return;
+    }
+    char compact_path[PATH_MAX];
+    snprintf(compact_path, sizeof(compact_path), "%s/" PACK_COMPACT_NAME, p->dir);
+    unlink(compact_path); // A compaction interrupted by a crash; the packfile is intact
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        LOG_ERROR("Não foi possível ler o packfile '%s': %s", path, strerror(errno));
+        close(fd);
+        return;
+    }
+    p->fd = fd;
+
+    trace_span_t load_span = trace_begin("storage.pack_load", TRACE_FLOW_NONE);
+    uint64_t file_size = (uint64_t)st.st_size, off = 0;
+    char *body = NULL;
+    size_t body_cap = 0;
+    while (off + sizeof(pack_header_t) <= file_size) {
+        pack_header_t h;
+        if (pread_full(fd, &h, sizeof(h), off) != 0 || h.magic != PACK_MAGIC ||
+            h.name_len == 0 || h.name_len > NAME_MAX || h.name_len > file_size - off - sizeof(h) ||
+            h.size > file_size - off - sizeof(h) - h.name_len) {
+            break;
+        }
+        size_t len = (size_t)record_len(h.name_len, h.size);
+        if (len > body_cap) {
+            char *grown = realloc(body, len);
+            if (!grown) break;
+            body = grown;
+            body_cap = len;
+        }
+        if (pread_full(fd, body, len, off) != 0 || record_checksum(body, len) != h.checksum) break;
+        char name[NAME_MAX + 1];
+        memcpy(name, body + sizeof(h), h.name_len);
+        name[h.name_len] = '\0';
+        replay_record(p, &h, name, off);
+        off += len;
+    }
+    free(body);
+    if (off < file_size) {
+        LOG_WARN("Packfile '%s': registro incompleto em %llu (falha anterior); descartando %llu bytes.",
+                 path, (unsigned long long)off, (unsigned long long)(file_size - off));
+        atomic_fetch_add_explicit(&torn_total, 1, memory_order_relaxed);
+        if (ftruncate(fd, (off_t)off) != 0) {
+            LOG_ERROR("Não foi possível truncar '%s': %s", path, strerror(errno));
+        }
+    }
+    p->end = off;
+    drop_shadowed(p);
+    trace_end(&load_span, p->dir);
+    LOG_DEBUG("Packfile '%s' carregado: %zu arquivo(s), %llu bytes.\n", path, p->entry_count, (unsigned long long)off);
+}
+
+// ---------------------------------------------------------------------------
+// Registry
+// ---------------------------------------------------------------------------
+
+// Returns the pack of 'dir', loaded and with its mutex held; hand it to
+// pack_release. NULL without memory.
+static size_t registry_bucket(const char *dir) {
+    return fnv1a(2166136261u, dir, strlen(dir)) % PACK_REGISTRY_BUCKETS;
+}
+
+static pack_t *pack_acquire(const char *dir) {
+    size_t b = registry_bucket(dir);
+    pthread_mutex_lock(&registry_mutex);
+    pack_t *p = registry[b];
+    while (p && strcmp(p->dir, dir) != 0) p = p->next;
+    if (!p) {
+        p = calloc(1, sizeof(*p));
+        if (!p || !(p->dir = strdup(dir))) {
+            free(p);
+            pthread_mutex_unlock(&registry_mutex);
+            return NULL;
+        }
+        p->fd = -1;
+        pthread_mutex_init(&p->mutex, NULL);
+        p->in_registry = 1;
+        p->next = registry[b];
+        registry[b] = p;
+    }
+    p->refs++;
+    pthread_mutex_unlock(&registry_mutex);
+
+    pthread_mutex_lock(&p->mutex);
+    if (!p->loaded) load_locked(p);
+    return p;
+}
+
+static void free_pack(pack_t *p) {
+    account(p, -(int64_t)p->entry_count, -(int64_t)p->live_bytes, -(int64_t)p->dead_bytes);
+    for (size_t i = 0; i < p->bucket_count; i++) {
+        pack_entry_t *e = p->buckets[i];
+        while (e) {
+            pack_entry_t *next = e->next;
+            free(e->name);
+            free(e);
+            e = next;
+        }
+    }
+    free(p->buckets);
+    if (p->fd >= 0) close(p->fd);
+    pthread_mutex_destroy(&p->mutex);
+    free(p->dir);
+    free(p);
+}
+
+static void pack_release(pack_t *p) {
+    pthread_mutex_unlock(&p->mutex);
+    pthread_mutex_lock(&registry_mutex);
+    int last = (--p->refs == 0);
+    // A directory without a packfile stays as a negative entry, so the next
+    // upload there does not look for one again; its packfile, if one is
+    // created, is created through this entry. Past PACK_NEGATIVE_MAX of them
+    // (listing a large tree visits every directory) they are not remembered.
+    int empty = (p->fd < 0 && p->entry_count == 0);
+    if (last && p->in_registry && empty && !p->negative) {
+        if (negative_count < PACK_NEGATIVE_MAX) {
+            p->negative = 1;
+            negative_count++;
+        } else {
+            pack_t **pp = &registry[registry_bucket(p->dir)];
+            while (*pp != p) pp = &(*pp)->next;
+            *pp = p->next;
+            p->in_registry = 0;
+        }
+    } else if (last && p->negative && !empty) {
+        p->negative = 0;
+        negative_count--;
+    }
+    int gone = (last && !p->in_registry);
+    pthread_mutex_unlock(&registry_mutex);
+    if (gone) free_pack(p);
+}
+
+void pack_forget_under(const char *prefix) {
+    size_t len = strlen(prefix);
+    pthread_mutex_lock(&registry_mutex);
+    for (int b = 0; b < PACK_REGISTRY_BUCKETS; b++) {
+        for (pack_t **pp = &registry[b]; *pp;) {
+            pack_t *p = *pp;
+            if (strncmp(p->dir, prefix, len) != 0 || (p->dir[len] != '\0' && p->dir[len] != '/')) {
+                pp = &p->next;
+                continue;
+            }
+            *pp = p->next;
+            p->in_registry = 0;
+            if (p->negative) {
+                p->negative = 0;
+                negative_count--;
+            }
+            if (p->refs == 0) free_pack(p);
+        }
+    }
+    pthread_mutex_unlock(&registry_mutex);
+}
+
+// ---------------------------------------------------------------------------
+// Changes
+// ---------------------------------------------------------------------------
+
+// Syncs 'fd' and the directory 'dir'. Returns 0 on success.
+static int sync_file_and_dir(int fd, const char *dir) {
+    if (fdatasync(fd) != 0) return -1;
+    int dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd < 0) return -1;
+    int rc = fsync(dir_fd);
+    close(dir_fd);
+    return rc;
+}
+
+// Rewrites the live records into a new packfile that replaces the old one.
+// The new file is synced before the rename whatever the durability policy:
+// the old one may hold records that were already durable.
+static void compact_locked(pack_t *p) {
+    char tmp_path[PATH_MAX], path[PATH_MAX];
+    snprintf(tmp_path, sizeof(tmp_path), "%s/" PACK_COMPACT_NAME, p->dir);
+    snprintf(path, sizeof(path), "%s/" PACK_NAME, p->dir);
+    trace_span_t compact_span = trace_begin("storage.pack_compact", TRACE_FLOW_NONE);
+    int fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    uint64_t *offsets = malloc((p->entry_count ? p->entry_count : 1) * sizeof(*offsets));
+    char *rec = NULL;
+    size_t rec_cap = 0, n = 0;
+    uint64_t off = 0;
+    int ok = (fd >= 0 && offsets != NULL);
+    for (size_t b = 0; ok && b < p->bucket_count; b++) {
+        for (pack_entry_t *e = p->buckets[b]; ok && e; e = e->next) {
+            size_t len = (size_t)record_len(strlen(e->name), e->size);
+            if (len > rec_cap) {
+                char *grown = realloc(rec, len);
+                if (!grown) {
+                    ok = 0;
+                    break;
+                }
+                rec = grown;
+                rec_cap = len;
+            }
+            ok = (pread_full(p->fd, rec, len, e->offset) == 0 && pwrite_full(fd, rec, len, off) == 0);
+            offsets[n++] = off;
+            off += len;
+        }
+    }
+    free(rec);
+    if (ok) ok = (fdatasync(fd) == 0 && rename(tmp_path, path) == 0 && sync_file_and_dir(fd, p->dir) == 0);
+    trace_end(&compact_span, p->dir);
+    if (!ok) {
+        LOG_ERROR("Falha ao compactar o packfile de '%s': %s", p->dir, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+            unlink(tmp_path);
+        }
+        free(offsets);
+        return;
+    }
+
+    n = 0;
+    for (size_t b = 0; b < p->bucket_count; b++) {
+        for (pack_entry_t *e = p->buckets[b]; e; e = e->next) e->offset = offsets[n++];
+    }
+    free(offsets);
+    LOG_DEBUG("Packfile de '%s' compactado: %llu -> %llu bytes.\n", p->dir,
+              (unsigned long long)p->end, (unsigned long long)off);
+    close(p->fd);
+    p->fd = fd;
+    p->end = off;
+    account(p, 0, (int64_t)off - (int64_t)p->live_bytes, -(int64_t)p->dead_bytes);
+    atomic_fetch_add_explicit(&compactions_total, 1, memory_order_relaxed);
+}
+
+// Writes a record built in memory at the end of the packfile, creating it if
+// needed. A partial write is cut off again so the log stays whole.
+static int append_locked(pack_t *p, char *rec, size_t len) {
+    pack_header_t h;
+    memcpy(&h, rec, sizeof(h));
+    h.checksum = record_checksum(rec, len);
+    memcpy(rec, &h, sizeof(h));
+    if (p->fd < 0) {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/" PACK_NAME, p->dir);
+        p->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (p->fd < 0) return -1;
+        p->end = 0;
+    }
+    if (pwrite_full(p->fd, rec, len, p->end) != 0) {
+        int saved = errno;
+        if (ftruncate(p->fd, (off_t)p->end) != 0) {
+            LOG_ERROR("Não foi possível desfazer a escrita parcial no packfile de '%s'.", p->dir);
+        }
+        errno = saved;
+        return -1;
+    }
+    return 0;
+}
+
+// A packfile whose last file went away holds nothing worth a rewrite: it is
+// removed, which also lets its directory go once that is empty too.
+static void maybe_compact_locked(pack_t *p) {
+    if (p->entry_count == 0 && p->fd >= 0) {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/" PACK_NAME, p->dir);
+        // Should the unlink not survive a crash, the tombstones must
+        if (fdatasync(p->fd) != 0 || unlink(path) != 0) return;
+        close(p->fd);
+        p->fd = -1;
+        p->end = 0;
+        account(p, 0, -(int64_t)p->live_bytes, -(int64_t)p->dead_bytes);
+        return;
+    }
+    if (p->dead_bytes >= PACK_COMPACT_MIN_BYTES && p->dead_bytes > p->live_bytes) compact_locked(p);
+}
+
+// Builds a record for 'name' with room for 'size' bytes of contents.
+static char *new_record(const char *name, uint64_t size, uint32_t flags, size_t *len) {
+    size_t name_len = strlen(name);
+    *len = (size_t)record_len(name_len, size);
+    char *rec = malloc(*len);
+    if (!rec) return NULL;
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    pack_header_t h = {
+        .magic = PACK_MAGIC,
+        .flags = flags,
+        .name_len = (uint32_t)name_len,
+        .size = size,
+        .mtime_ns = (int64_t)now.tv_sec * 1000000000LL + now.tv_nsec
+    };
+    memcpy(rec, &h, sizeof(h));
+    memcpy(rec + sizeof(h), name, name_len);
+    return rec;
+}
+
+// Appends 'rec', a record for 'name' with 'size' bytes of contents, to the
+// packfile of 'dir' and indexes it. Returns 0 or -1 (errno set).
+static int put_record(const char *dir, const char *name, char *rec, size_t len, uint64_t size) {
+    pack_t *p = pack_acquire(dir);
+    if (!p) {
+        errno = ENOMEM;
+        return -1;
+    }
+    int rc = append_locked(p, rec, len);
+    if (rc == 0) {
+        pack_header_t h;
+        memcpy(&h, rec, sizeof(h));
+        int64_t old_len = index_set(p, name, p->end, size, h.mtime_ns);
+        p->end += len;
+        if (old_len < 0) {
+            // Written but not indexed: dead until the next load replays it
+            account(p, 0, 0, (int64_t)len);
+            errno = ENOMEM;
+            rc = -1;
+        } else {
+            account(p, old_len ? 0 : 1, (int64_t)len - old_len, old_len);
+            maybe_compact_locked(p);
+        }
+    }
+    int saved = errno;
+    pack_release(p);
+    errno = saved;
+    return rc;
+}
+
+int pack_put(const char *path, int src_fd, uint64_t size) {
+    char dir[PATH_MAX];
+    const char *name;
+    if (split_path(path, dir, sizeof(dir), &name) != 0) return -1;
+    if (strlen(name) > NAME_MAX) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    size_t len;
+    char *rec = new_record(name, size, 0, &len);
+    if (!rec) return -1;
+    int rc = pread_full(src_fd, rec + (len - size), (size_t)size, 0) == 0 ? put_record(dir, name, rec, len, size) : -1;
+    int saved = errno;
+    free(rec);
+    errno = saved;
+    return rc;
+}
+
+int pack_delete(const char *path) {
+    if (!packs_possible()) return 0;
+    char dir[PATH_MAX];
+    const char *name;
+    if (split_path(path, dir, sizeof(dir), &name) != 0) return -1;
+    pack_t *p = pack_acquire(dir);
+    if (!p) {
+        errno = ENOMEM;
+        return -1;
+    }
+    int rc = 0;
+    pack_entry_t *e = index_find(p, name);
+    if (e) {
+        size_t len;
+        char *rec = new_record(name, 0, PACK_FLAG_DELETED, &len);
+        rc = (rec && append_locked(p, rec, len) == 0) ? 1 : -1;
+        free(rec);
+        if (rc == 1) {
+            int64_t old_len = (int64_t)record_len(strlen(e->name), e->size);
+            index_remove(p, name);
+            p->end += len;
+            account(p, -1, -old_len, old_len + (int64_t)len);
+            maybe_compact_locked(p);
+        }
+    }
+    int saved = errno;
+    pack_release(p);
+    errno = saved;
+    return rc;
+}
+
+// Moves the packed 'from' into the packfile of another directory. The two
+// packs are never held together: the contents are read out, appended
+// there, and only then tombstoned here. Same results as pack_rename.
+static int move_across(const char *from, const char *to_dir, const char *to_name) {
+    char *data;
+    size_t size;
+    if (pack_read(from, &data, &size) != 0) return errno == ENOENT ? 0 : -1;
+    size_t len;
+    char *rec = new_record(to_name, size, 0, &len);
+    int rc = -1;
+    if (rec) {
+        memcpy(rec + (len - size), data, size);
+        rc = put_record(to_dir, to_name, rec, len, size);
+    }
+    int saved = errno;
+    free(rec);
+    free(data);
+    if (rc != 0) {
+        errno = saved;
+        return -1;
+    }
+    if (pack_delete(from) < 0) {
+        LOG_ERROR("Tombstone de '%s' não gravado após movê-lo para o packfile de '%s'.", from, to_dir);
+        return -1;
+    }
+    return 1;
+}
+
+int pack_rename(const char *from, const char *to) {
+    if (!packs_possible()) return 0;
+    char dir[PATH_MAX], to_dir[PATH_MAX];
+    const char *name, *to_name;
+    if (split_path(from, dir, sizeof(dir), &name) != 0 || split_path(to, to_dir, sizeof(to_dir), &to_name) != 0) return -1;
+    if (strlen(to_name) > NAME_MAX) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    if (strcmp(dir, to_dir) != 0) return move_across(from, to_dir, to_name);
+    pack_t *p = pack_acquire(dir);
+    if (!p) {
+        errno = ENOMEM;
+        return -1;
+    }
+    int rc = 0;
+    pack_entry_t *e = index_find(p, name);
+    if (e) {
+        // The contents are copied under the new name, then the old one gets
+        // its tombstone: a crash in between leaves both names, never neither
+        size_t len, tomb_len;
+        char *rec = new_record(to_name, e->size, 0, &len);
+        char *tomb = new_record(name, 0, PACK_FLAG_DELETED, &tomb_len);
+        rc = -1;
+        if (rec && tomb && pread_full(p->fd, rec + (len - e->size), (size_t)e->size,
+                                      e->offset + sizeof(pack_header_t) + strlen(e->name)) == 0 &&
+            append_locked(p, rec, len) == 0) {
+            pack_header_t h;
+            memcpy(&h, rec, sizeof(h));
+            int64_t old_len = index_set(p, to_name, p->end, h.size, h.mtime_ns);
+            p->end += len;
+            if (old_len < 0) {
+                account(p, 0, 0, (int64_t)len);
+                errno = ENOMEM;
+            } else {
+                account(p, old_len ? 0 : 1, (int64_t)len - old_len, old_len);
+                e = index_find(p, name);
+                if (append_locked(p, tomb, tomb_len) == 0) {
+                    int64_t from_len = (int64_t)record_len(strlen(e->name), e->size);
+                    index_remove(p, name);
+                    p->end += tomb_len;
+                    account(p, -1, -from_len, from_len + (int64_t)tomb_len);
+                    rc = 1;
+                } else {
+                    LOG_ERROR("Tombstone de '%s' não gravado após renomeá-lo no packfile de '%s'.", name, dir);
+                }
+            }
+            maybe_compact_locked(p);
+        }
+        free(rec);
+        free(tomb);
+    }
+    int saved = errno;
+    pack_release(p);
+    errno = saved;
+    return rc;
+}
+
+int pack_contains(const char *path) {
+    if (!packs_possible()) return 0;
+    char dir[PATH_MAX];
+    const char *name;
+    if (split_path(path, dir, sizeof(dir), &name) != 0) return 0;
+    pack_t *p = pack_acquire(dir);
+    if (!p) return 0;
+    int found = (index_find(p, name) != NULL);
+    pack_release(p);
+    return found;
+}
+
+int pack_read(const char *path, char **data, size_t *size) {
+    if (!packs_possible()) {
+        errno = ENOENT;
+        return -1;
+    }
+    char dir[PATH_MAX];
+    const char *name;
+    if (split_path(path, dir, sizeof(dir), &name) != 0) return -1;
+    pack_t *p = pack_acquire(dir);
+    if (!p) {
+        errno = ENOMEM;
+        return -1;
+    }
+    int rc = -1;
+    pack_entry_t *e = index_find(p, name);
+    if (!e) {
+        errno = ENOENT;
+    } else if ((*data = malloc(e->size ? (size_t)e->size : 1)) != NULL) {
+        rc = pread_full(p->fd, *data, (size_t)e->size, e->offset + sizeof(pack_header_t) + strlen(e->name));
+        if (rc != 0) {
+            free(*data);
+            *data = NULL;
+        } else {
+            *size = (size_t)e->size;
+        }
+    }
+    int saved = errno;
+    pack_release(p);
+    errno = saved;
+    return rc;
+}
+
+int pack_sync(const char *dir) {
+    if (!packs_possible()) return 0;
+    pack_t *p = pack_acquire(dir);
+    if (!p) return -1;
+    int rc = (p->fd >= 0) ? fdatasync(p->fd) : 0;
+    pack_release(p);
+    return rc;
+}
+
+int pack_foreach(const char *dir, pack_visit_fn fn, void *arg) {
+    if (!packs_possible()) return 0;
+    pack_t *p = pack_acquire(dir);
+    if (!p) return 0;
+    // Copied out first: visitors read files, which takes this pack's mutex
+    size_t n = 0, count = p->entry_count;
+    char **names = calloc(count ? count : 1, sizeof(*names));
+    struct stat *stats = calloc(count ? count : 1, sizeof(*stats));
+    for (size_t b = 0; names && stats && b < p->bucket_count; b++) {
+        for (pack_entry_t *e = p->buckets[b]; e; e = e->next) {
+            if (!(names[n] = strdup(e->name))) continue;
+            memset(&stats[n], 0, sizeof(stats[n]));
+            stats[n].st_mode = S_IFREG | 0644;
+            stats[n].st_nlink = 1;
+            stats[n].st_size = (off_t)e->size;
+            stats[n].st_mtim.tv_sec = (time_t)(e->mtime_ns / 1000000000LL);
+            stats[n].st_mtim.tv_nsec = (long)(e->mtime_ns % 1000000000LL);
+            stats[n].st_atim = stats[n].st_ctim = stats[n].st_mtim;
+            n++;
+        }
+    }
+    pack_release(p);
+
+    int rc = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (rc == 0) rc = fn(names[i], &stats[i], arg);
+        free(names[i]);
+    }
+    free(names);
+    free(stats);
+    return rc;
+}
+
+void pack_write_metrics(FILE *out) {
+    fprintf(out, "# HELP sync_pack_files Files stored in packfiles.\n"
+                 "# TYPE sync_pack_files gauge\n"
+                 "sync_pack_files %lld\n"
+                 "# HELP sync_pack_bytes Bytes of the loaded packfiles, by whether their records are still live.\n"
+                 "# TYPE sync_pack_bytes gauge\n"
+                 "sync_pack_bytes{state=\"live\"} %lld\n"
+                 "sync_pack_bytes{state=\"dead\"} %lld\n"
+                 "# HELP sync_pack_compactions_total Packfiles rewritten to reclaim dead records.\n"
+                 "# TYPE sync_pack_compactions_total counter\n"
+                 "sync_pack_compactions_total %llu\n"
+                 "# HELP sync_pack_torn_total Packfiles found with an incomplete last record when loaded.\n"
+                 "# TYPE sync_pack_torn_total counter\n"
+                 "sync_pack_torn_total %llu\n",
+            (long long)atomic_load_explicit(&files_gauge, memory_order_relaxed),
+            (long long)atomic_load_explicit(&live_gauge, memory_order_relaxed),
+            (long long)atomic_load_explicit(&dead_gauge, memory_order_relaxed),
+            (unsigned long long)atomic_load_explicit(&compactions_total, memory_order_relaxed),
+            (unsigned long long)atomic_load_explicit(&torn_total, memory_order_relaxed));
+}
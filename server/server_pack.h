@@ -0,0 +1,74 @@
+#ifndef SERVER_PACK_H
+#define SERVER_PACK_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/stat.h>
+
+// Packfiles for small stored files (-k). With a threshold set, an upload of
+// at most that many bytes is appended to its directory's packfile (PACK_NAME,
+// hidden next to the regular files) instead of becoming a file of its own, so
+// a user with many tiny files costs one inode and one open descriptor rather
+// than one per file. Larger files stay regular files; a file lives in one
+// place or the other, never both.
+//
+// The packfile is a log of records, each a header, the name and the
+// contents; a newer record for a name replaces the older one and a deletion
+// appends a tombstone. The offset index is kept in memory and rebuilt from
+// the log the first time the directory is used, which also cuts off a record
+// torn by a crash (every record carries a checksum). Once more than half of
+// a packfile is dead records, it is compacted: the live records are copied
+// to a new file that replaces it.
+//
+// Packfiles are read whatever the threshold, so files packed by an earlier
+// run stay visible; storage_prepare_trees reports the ones it finds at
+// startup (pack_note_found), and with none found and packing off every call
+// below returns at once. Whether a directory has a packfile is remembered,
+// either way, so it is looked for once per directory. Every call below takes the full path of the stored file
+// ("<dir>/<name>"); the caller holds that file's lock from server_filelock.h,
+// shared for pack_read and exclusive for the changes.
+
+#define PACK_NAME              ".pack"
+#define PACK_COMPACT_NAME      ".pack.compact" // Compaction in progress
+#define PACK_COMPACT_MIN_BYTES (1024 * 1024)   // Dead bytes worth a compaction
+
+// Files of at most 'bytes' are packed (0, the default, packs nothing).
+void   pack_set_threshold(size_t bytes);
+size_t pack_threshold(void);
+// Records that a packfile exists on disk, found before any was used.
+void   pack_note_found(void);
+// Returns 1 for the packfile's own names, which listings and uploads skip.
+int    pack_is_internal_name(const char *name);
+
+// Appends the first 'size' bytes of 'src_fd' as the contents of 'path'.
+// Returns 0, or -1 (errno set) if nothing was stored.
+int  pack_put(const char *path, int src_fd, uint64_t size);
+// Drops 'path' from its packfile. Returns 1 if it was packed, 0 if not and
+// -1 (errno set) if the tombstone could not be written.
+int  pack_delete(const char *path);
+// Moves the packed contents of 'from' to 'to', replacing a packed 'to'; the
+// directory of 'to' must exist. Returns 1 if 'from' was packed, 0 if not and -1
+// (errno set) on error; if only the tombstone failed, both names are left.
+int  pack_rename(const char *from, const char *to);
+int  pack_contains(const char *path);
+// Copies the packed contents of 'path' into a malloc'ed buffer the caller
+// frees. Returns -1 with errno ENOENT if 'path' is not packed.
+int  pack_read(const char *path, char **data, size_t *size);
+// Flushes the packfile of directory 'dir' to disk. Returns 0 on success.
+int  pack_sync(const char *dir);
+
+// Calls 'fn' for every file packed in 'dir', with a stat carrying its size
+// and the time it was stored. Stops at, and returns, fn's first non-zero
+// result.
+typedef int (*pack_visit_fn)(const char *name, const struct stat *st, void *arg);
+int  pack_foreach(const char *dir, pack_visit_fn fn, void *arg);
+
+// Forgets the packfiles of every directory under 'prefix'; call after
+// removing the directories themselves.
+void pack_forget_under(const char *prefix);
+
+// Prometheus lines with the files and bytes held in packfiles.
+void pack_write_metrics(FILE *out);
+
+#endif // SERVER_PACK_H
@@ -0,0 +1,525 @@
+#include "server_push.h"
+#include "server_metrics.h"
+#include "server_cache.h"
+#include "server_storage.h"
+#include "server_utils.h"
+#include "../common/batch.h"
+#include "../common/log.h"
+#include "../common/trace.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#define CHUNK_SIZE MAX_PAYLOAD
+
+typedef struct push_entry {
+    char     *filename;
+    char     *from;     // Old name of a rename (filename is the new one), NULL otherwise
+    int       is_delete;
+    uint64_t  version;
+    uint32_t  trace_id; // Trace of the request that made the change
+    struct push_entry *next;
+} push_entry_t;
+
+// Pending pushes in the order their files first changed. The wakeup pipe
+// holds a byte while wake_pending is set, i.e. while the queue is not empty.
+struct push_queue {
+    pthread_mutex_t mutex;
+    push_entry_t   *head;
+    push_entry_t   *tail;
+    int             wake_pipe[2];
+    int             wake_pending;
+};
+
+static _Atomic uint64_t next_version = 0;
+static _Atomic uint64_t superseded_total = 0;
+static _Atomic uint64_t crossed_total = 0;
+static _Atomic uint64_t renamed_total = 0;
+static _Atomic uint64_t rename_fallback_total = 0;
+
+push_queue_t *push_queue_create(void) {
+    push_queue_t *queue = calloc(1, sizeof(*queue));
+    if (!queue) return NULL;
+    if (pipe(queue->wake_pipe) != 0) {
+        LOG_ERROR("pipe for push queue failed: %s", strerror(errno));
+        free(queue);
+        return NULL;
+    }
+    // Neither side may block: the writer holds the queue mutex and the
+    // reader empties the pipe until EAGAIN
+    for (int i = 0; i < 2; i++) {
+        fcntl(queue->wake_pipe[i], F_SETFL, fcntl(queue->wake_pipe[i], F_GETFL) | O_NONBLOCK);
+        fcntl(queue->wake_pipe[i], F_SETFD, FD_CLOEXEC);
+    }
+    pthread_mutex_init(&queue->mutex, NULL);
+    return queue;
+}
+
+static void free_entry(push_entry_t *e) {
+    free(e->filename);
+    free(e->from);
+    free(e);
+}
+
+void push_queue_destroy(push_queue_t *queue) {
+    if (!queue) return;
+    push_entry_t *e = queue->head;
+    while (e) {
+        push_entry_t *next = e->next;
+        metrics_gauge_add(METRIC_GAUGE_PROPAGATIONS_QUEUED, -1);
+        free_entry(e);
+        e = next;
+    }
+    close(queue->wake_pipe[0]);
+    close(queue->wake_pipe[1]);
+    pthread_mutex_destroy(&queue->mutex);
+    free(queue);
+}
+
+int push_queue_wake_fd(push_queue_t *queue) {
+    return queue->wake_pipe[0];
+}
+
+// Call with the queue mutex held, whenever the queue is not empty.
+static void wake_locked(push_queue_t *queue) {
+    if (queue->wake_pending) return;
+    queue->wake_pending = 1;
+    if (write(queue->wake_pipe[1], "", 1) != 1) {
+        LOG_WARN("Falha ao acordar a fila de push: %s", strerror(errno));
+    }
+}
+
+static push_entry_t *new_entry(const char *filename, const char *from, int is_delete, uint64_t version, uint32_t trace_id) {
+    push_entry_t *e = calloc(1, sizeof(*e));
+    if (!e || !(e->filename = strdup(filename)) || (from && !(e->from = strdup(from)))) {
+        LOG_ERROR("Sem memória para enfileirar o push de '%s'.", filename);
+        if (e) free_entry(e);
+        return NULL;
+    }
+    e->is_delete = is_delete;
+    e->version = version;
+    e->trace_id = trace_id;
+    return e;
+}
+
+static void append_locked(push_queue_t *queue, push_entry_t *e) {
+    if (queue->tail) queue->tail->next = e; else queue->head = e;
+    queue->tail = e;
+    metrics_gauge_add(METRIC_GAUGE_PROPAGATIONS_QUEUED, 1);
+    wake_locked(queue);
+}
+
+static int touches(const push_entry_t *e, const char *name) {
+    return strcmp(e->filename, name) == 0 || (e->from && strcmp(e->from, name) == 0);
+}
+
+static push_entry_t *find_locked(push_queue_t *queue, const char *name) {
+    push_entry_t *e = queue->head;
+    while (e && !touches(e, name)) e = e->next;
+    return e;
+}
+
+// A pending rename can only be sent as one while neither of its files
+// changed again. Once one does, the rename is split in place into a delete
+// of the old name, followed by an upload of the new one; the change then
+// supersedes whichever of the two it concerns.
+static void split_rename_locked(push_queue_t *queue, const char *name) {
+    push_entry_t *e = find_locked(queue, name);
+    if (!e || !e->from) return;
+    push_entry_t *upload = new_entry(e->filename, NULL, 0, e->version, e->trace_id);
+    free(e->filename);
+    e->filename = e->from;
+    e->from = NULL;
+    e->is_delete = 1;
+    if (upload) append_locked(queue, upload);
+}
+
+static void add_locked(push_queue_t *queue, const char *filename, int is_delete, uint64_t version, uint32_t trace_id) {
+    split_rename_locked(queue, filename);
+    push_entry_t *e = find_locked(queue, filename);
+    if (e) {
+        if (e->version < version) {
+            LOG_DEBUG("Push de '%s' (versão %llu) substituído pela versão %llu (%s).\n", filename,
+                      (unsigned long long)e->version, (unsigned long long)version, is_delete ? "deleção" : "upload");
+            e->is_delete = is_delete;
+            e->version = version;
+            e->trace_id = trace_id;
+            atomic_fetch_add_explicit(&superseded_total, 1, memory_order_relaxed);
+        }
+        return;
+    }
+    if ((e = new_entry(filename, NULL, is_delete, version, trace_id)) != NULL) append_locked(queue, e);
+}
+
+static void push_queue_add(push_queue_t *queue, const char *filename, int is_delete, uint64_t version, uint32_t trace_id) {
+    pthread_mutex_lock(&queue->mutex);
+    add_locked(queue, filename, is_delete, version, trace_id);
+    pthread_mutex_unlock(&queue->mutex);
+}
+
+// Queues a rename, or its delete and upload if a push of either file is
+// still pending: the device may not hold the old file as it is now.
+static void push_queue_add_rename(push_queue_t *queue, const char *from, const char *to, uint64_t version, uint32_t trace_id) {
+    pthread_mutex_lock(&queue->mutex);
+    push_entry_t *e;
+    if (find_locked(queue, from) || find_locked(queue, to)) {
+        add_locked(queue, from, 1, version, trace_id);
+        add_locked(queue, to, 0, version, trace_id);
+    } else if ((e = new_entry(to, from, 0, version, trace_id)) != NULL) {
+        append_locked(queue, e);
+    }
+    pthread_mutex_unlock(&queue->mutex);
+}
+
+// Puts a push popped by pop_run back at the head of the queue. A file that
+// changed again meanwhile already has a newer push queued and keeps only
+// that one; a rename either of whose files did is put back as its delete
+// and upload.
+static void putback_locked(push_queue_t *queue, const push_entry_t *old) {
+    if (old->from && (find_locked(queue, old->from) || find_locked(queue, old->filename))) {
+        push_entry_t upload = { .filename = old->filename, .version = old->version, .trace_id = old->trace_id };
+        push_entry_t del = { .filename = old->from, .is_delete = 1, .version = old->version, .trace_id = old->trace_id };
+        putback_locked(queue, &upload);
+        putback_locked(queue, &del);
+        return;
+    }
+    if (find_locked(queue, old->filename)) return;
+    push_entry_t *e = new_entry(old->filename, old->from, old->is_delete, old->version, old->trace_id);
+    if (!e) return;
+    e->next = queue->head;
+    queue->head = e;
+    if (!queue->tail) queue->tail = e;
+    metrics_gauge_add(METRIC_GAUGE_PROPAGATIONS_QUEUED, 1);
+}
+
+// Puts pushes popped by pop_run back at the head of the queue, in their
+// order; see putback_locked.
+static void push_queue_putback(push_queue_t *queue, push_entry_t **entries, int n) {
+    pthread_mutex_lock(&queue->mutex);
+    for (int i = n - 1; i >= 0; i--) putback_locked(queue, entries[i]);
+    if (queue->head) wake_locked(queue);
+    pthread_mutex_unlock(&queue->mutex);
+}
+
+void push_change(UserSession_t *session, const char *filename, int is_delete, int originating_conn_fd) {
+    if (!session || !filename || filename[0] == '\0') return;
+
+    lock_sessions();
+    // Taken under sessions_mutex so every queue sees versions in the same order
+    uint64_t version = atomic_fetch_add_explicit(&next_version, 1, memory_order_relaxed) + 1;
+    LOG_DEBUG("Propagando %s de '%s' (versão %llu) para outros dispositivos do usuário '%s'.\n",
+              is_delete ? "deleção" : "arquivo", filename, (unsigned long long)version, session->username);
+    for (int i = 0; i < MAX_SESSIONS_PER_USER; i++) {
+        int other_fd = session->connection_fds[i];
+        if (other_fd > 0 && other_fd != originating_conn_fd && session->push_queues[i]) {
+            push_queue_add(session->push_queues[i], filename, is_delete, version, trace_current());
+        }
+    }
+    unlock_sessions();
+}
+
+void push_rename(UserSession_t *session, const char *from, const char *to, int originating_conn_fd) {
+    if (!session || !from || !to || from[0] == '\0' || to[0] == '\0') return;
+
+    lock_sessions();
+    uint64_t version = atomic_fetch_add_explicit(&next_version, 1, memory_order_relaxed) + 1;
+    LOG_DEBUG("Propagando renomeação de '%s' para '%s' (versão %llu) para outros dispositivos do usuário '%s'.\n",
+              from, to, (unsigned long long)version, session->username);
+    for (int i = 0; i < MAX_SESSIONS_PER_USER; i++) {
+        int other_fd = session->connection_fds[i];
+        if (other_fd > 0 && other_fd != originating_conn_fd && session->push_queues[i]) {
+            push_queue_add_rename(session->push_queues[i], from, to, version, trace_current());
+        }
+    }
+    unlock_sessions();
+}
+
+// Waits for the reply to the packet numbered 'seq'. An ACK for another
+// sequence number is a late one for the end of the previous push (the
+// client ACKs that packet, the protocol does not require it) and is
+// skipped. Returns 0 on ACK, 1 on any other reply and -1 if the connection
+// failed. If 'crossed' is given, the reply to a push's first packet is
+// expected: a request from the device instead of an ACK or NACK is copied
+// there and PUSH_CROSSED returned (see push_queue_drain).
+static int wait_push_reply(int conn_fd, uint32_t seq, packet_t *crossed) {
+    packet_t a;
+    int rc;
+    while ((rc = recv_packet(conn_fd, &a)) == 0 && a.type == PKT_ACK && a.seq_num != seq) {
+    }
+    if (rc != 0) return rc;
+    if (a.type == PKT_ACK) return 0;
+    if (crossed && a.type != PKT_NACK) {
+        *crossed = a;
+        atomic_fetch_add_explicit(&crossed_total, 1, memory_order_relaxed);
+        return PUSH_CROSSED;
+    }
+    return 1;
+}
+
+// Sends 'p' and waits for its ACK; see wait_push_reply.
+static int send_push_packet(int conn_fd, packet_t *p, packet_t *crossed) {
+    trace_span_t rtt_span = trace_begin("server.ack_rtt", TRACE_FLOW_NONE);
+    int rc = -1;
+    if (send_packet(conn_fd, p) == 0) rc = wait_push_reply(conn_fd, p->seq_num, crossed);
+    trace_end(&rtt_span, NULL);
+    return rc;
+}
+
+// Returns 0 if the device took the push, 1 if it was skipped or refused,
+// PUSH_CROSSED if a request of the device crossed it (only the push's first
+// packet went out) and -1 if the connection failed.
+static int send_push(int conn_fd, const push_entry_t *e, const char *user_dir, packet_t *crossed) {
+    packet_t req_pkt = { .type = e->is_delete ? PKT_DELETE_REQ : PKT_UPLOAD_REQ, .seq_num = 1 };
+    snprintf(req_pkt.payload, MAX_PAYLOAD, "%s", e->filename);
+    req_pkt.payload_size = (uint32_t)strlen(req_pkt.payload) + 1;
+
+    char path[PATH_MAX];
+    if (path_join(path, sizeof(path), user_dir, e->filename) != 0) {
+        LOG_ERROR("Push de '%s' ignorado: caminho longo demais.\n", e->filename);
+        return 1;
+    }
+    if (e->from) {
+        // Sent even if the file changed again since: that change has a push
+        // of its own queued behind this one
+        packet_t ren_pkt = { .type = PKT_RENAME_REQ, .seq_num = 1 };
+        size_t from_len = strlen(e->from) + 1, to_len = strlen(e->filename) + 1;
+        memcpy(ren_pkt.payload, e->from, from_len);
+        memcpy(ren_pkt.payload + from_len, e->filename, to_len);
+        ren_pkt.payload_size = (uint32_t)(from_len + to_len);
+        LOG_DEBUG("  Enviando RENAME de '%s' para '%s' para fd=%d\n", e->from, e->filename, conn_fd);
+        int rc = send_push_packet(conn_fd, &ren_pkt, crossed);
+        if (rc != 1) {
+            if (rc == 0) atomic_fetch_add_explicit(&renamed_total, 1, memory_order_relaxed);
+            return rc;
+        }
+        // The device lacks the old file or could not rename it: it gets the
+        // new one whole
+        LOG_DEBUG("Cliente fd=%d recusou o RENAME de '%s'; enviando '%s' inteiro.\n", conn_fd, e->from, e->filename);
+        atomic_fetch_add_explicit(&rename_fallback_total, 1, memory_order_relaxed);
+    } else if (e->is_delete) {
+        // Uploaded again after the delete; that upload's push follows
+        if (storage_exists(path)) return 1;
+        LOG_DEBUG("  Enviando pedido de DELETE para '%s' para fd=%d\n", e->filename, conn_fd);
+        int rc = send_push_packet(conn_fd, &req_pkt, crossed);
+        if (rc != 0 && rc != PUSH_CROSSED) LOG_ERROR("Cliente fd=%d não confirmou DELETE_REQ para '%s'.\n", conn_fd, e->filename);
+        return rc;
+    }
+
+    // Read now rather than when the change was queued, so a file rewritten
+    // while its push waited goes out once, with its newest content
+    content_reader_t f;
+    if (content_open(&f, path) != 0) {
+        LOG_DEBUG("Push de '%s' ignorado: %s\n", e->filename, strerror(errno));
+        return 1;
+    }
+
+    LOG_DEBUG("  Enviando '%s' (versão %llu) para fd=%d\n", e->filename, (unsigned long long)e->version, conn_fd);
+    int rc = send_push_packet(conn_fd, &req_pkt, crossed);
+    if (rc == 0) {
+        uint32_t seq = 2;
+        packet_t data_pkt = { .type = PKT_UPLOAD_DATA };
+        size_t n_read;
+        while ((n_read = content_read(&f, data_pkt.payload, CHUNK_SIZE)) > 0) {
+            data_pkt.seq_num = seq++;
+            data_pkt.payload_size = (uint32_t)n_read;
+            if ((rc = send_push_packet(conn_fd, &data_pkt, NULL)) != 0) {
+                LOG_ERROR("Erro ao propagar chunk de '%s' para fd=%d. Interrompendo para este fd.\n", e->filename, conn_fd);
+                break;
+            }
+        }
+        if (rc == 0 && content_error(&f)) {
+            LOG_ERROR("Erro de leitura ao propagar '%s' para fd=%d.\n", e->filename, conn_fd);
+            rc = 1;
+        } else if (rc == 0) {
+            // Final 0-byte packet; see send_push_packet for its ACK
+            packet_t end_pkt = { .type = PKT_UPLOAD_DATA, .seq_num = seq, .payload_size = 0 };
+            rc = (send_packet(conn_fd, &end_pkt) == 0) ? 0 : -1;
+        }
+    } else if (rc != PUSH_CROSSED) {
+        LOG_ERROR("Cliente fd=%d não confirmou UPLOAD_REQ para propagação de '%s'.\n", conn_fd, e->filename);
+    }
+    content_close(&f);
+    return rc;
+}
+
+// Sends a single push, in the trace of the change that queued it.
+static int push_one(int conn_fd, const push_entry_t *e, const char *user_dir, packet_t *crossed) {
+    trace_set_current(e->trace_id);
+    trace_span_t push_span = trace_begin(e->from ? "server.propagate_rename" :
+                                         e->is_delete ? "server.propagate_delete" : "server.propagate_file", TRACE_FLOW_STEP);
+    uint64_t push_start = metrics_now_ns();
+    metrics_gauge_add(METRIC_GAUGE_PROPAGATIONS_IN_FLIGHT, 1);
+    int rc = send_push(conn_fd, e, user_dir, crossed);
+    metrics_gauge_add(METRIC_GAUGE_PROPAGATIONS_IN_FLIGHT, -1);
+    if (rc != PUSH_CROSSED) metrics_observe_op(METRIC_OP_PROPAGATION, metrics_now_ns() - push_start, rc == 0);
+    trace_end(&push_span, e->filename);
+    trace_set_current(0);
+    return rc;
+}
+
+// Sends the small files among 'run' (consecutive upload entries) as one
+// PKT_BATCH_UPLOAD. Entries whose file is gone are dropped, like in
+// send_push; those too large for a batch are left in 'rest' for the caller
+// to push one by one. Returns what send_push would.
+static int send_push_batch(int conn_fd, push_entry_t **run, int n, const char *user_dir,
+                           push_entry_t **rest, int *n_rest, packet_t *crossed) {
+    content_reader_t readers[BATCH_MAX_FILES];
+    long long sizes[BATCH_MAX_FILES];
+    int open_count = 0;
+    push_entry_t *batched[BATCH_MAX_FILES];
+    *n_rest = 0;
+    for (int i = 0; i < n; i++) {
+        char path[PATH_MAX];
+        if (path_join(path, sizeof(path), user_dir, run[i]->filename) != 0 ||
+            content_open(&readers[open_count], path) != 0) {
+            LOG_DEBUG("Push de '%s' ignorado: %s\n", run[i]->filename, strerror(errno));
+            continue;
+        }
+        long long size = content_size(&readers[open_count]);
+        if (size < 0 || size > BATCH_MAX_FILE_SIZE) {
+            content_close(&readers[open_count]);
+            rest[(*n_rest)++] = run[i];
+            continue;
+        }
+        sizes[open_count] = size;
+        batched[open_count++] = run[i];
+    }
+    if (open_count == 0) return 1;
+
+    packet_t req_pkt = { .type = PKT_BATCH_UPLOAD, .seq_num = 1 };
+    snprintf(req_pkt.payload, MAX_PAYLOAD, "%d", open_count);
+    req_pkt.payload_size = (uint32_t)strlen(req_pkt.payload) + 1;
+    LOG_DEBUG("  Enviando lote de %d arquivo(s) para fd=%d\n", open_count, conn_fd);
+    int rc = send_push_packet(conn_fd, &req_pkt, crossed);
+    if (rc == 0) {
+        // No ACKs until the end: the batch goes out as fast as the socket takes it
+        batch_writer_t w;
+        batch_writer_init(&w, conn_fd, 2);
+        char buf[CHUNK_SIZE];
+        for (int i = 0; i < open_count && rc == 0; i++) {
+            if (batch_add_file(&w, batched[i]->filename, (uint64_t)sizes[i]) != 0) {
+                rc = -1;
+                break;
+            }
+            long long left = sizes[i];
+            size_t n_read;
+            while (left > 0 && (n_read = content_read(&readers[i], buf, sizeof(buf))) > 0) {
+                if ((long long)n_read > left) n_read = (size_t)left;
+                if (batch_write(&w, buf, n_read) != 0) {
+                    rc = -1;
+                    break;
+                }
+                left -= (long long)n_read;
+            }
+            if (rc != 0) break; // The socket failed: nothing more gets through
+            if (left > 0) {
+                // The entry's size is already on the wire; keep the stream whole
+                LOG_ERROR("Erro de leitura ao propagar '%s' para fd=%d.\n", batched[i]->filename, conn_fd);
+                memset(buf, 0, sizeof(buf));
+                while (left > 0 && rc == 0) {
+                    size_t pad = left < (long long)sizeof(buf) ? (size_t)left : sizeof(buf);
+                    if (batch_write(&w, buf, pad) != 0) rc = -1;
+                    left -= (long long)pad;
+                }
+            }
+        }
+        uint32_t end_seq;
+        if (rc == 0 && batch_finish(&w, &end_seq) != 0) rc = -1;
+        if (rc == 0) rc = wait_push_reply(conn_fd, end_seq, NULL);
+    } else if (rc != PUSH_CROSSED) {
+        LOG_ERROR("Cliente fd=%d não confirmou o lote de propagações.\n", conn_fd);
+    }
+    for (int i = 0; i < open_count; i++) content_close(&readers[i]);
+    return rc;
+}
+
+static int is_upload(const push_entry_t *e) {
+    return !e->is_delete && !e->from;
+}
+
+// Pops the head of the queue and, if it is an upload, up to max - 1 uploads
+// right behind it. Returns how many entries went to 'run'.
+static int pop_run(push_queue_t *queue, push_entry_t **run, int max) {
+    pthread_mutex_lock(&queue->mutex);
+    int n = 0;
+    while (n < max && queue->head && (n == 0 || is_upload(queue->head))) {
+        run[n] = queue->head;
+        queue->head = run[n]->next;
+        if (!is_upload(run[n++])) break;
+    }
+    if (!queue->head) {
+        queue->tail = NULL;
+        if (queue->wake_pending) {
+            char buf[64];
+            while (read(queue->wake_pipe[0], buf, sizeof(buf)) > 0) {
+            }
+            queue->wake_pending = 0;
+        }
+    }
+    pthread_mutex_unlock(&queue->mutex);
+    metrics_gauge_add(METRIC_GAUGE_PROPAGATIONS_QUEUED, -n);
+    return n;
+}
+
+int push_queue_drain(push_queue_t *queue, int conn_fd, const char *user_dir, packet_t *crossed) {
+    push_entry_t *run[BATCH_MAX_FILES], *rest[BATCH_MAX_FILES];
+    int n;
+    while ((n = pop_run(queue, run, BATCH_MAX_FILES)) > 0) {
+        int n_single = n, rc = 0;
+        push_entry_t **single = run;
+        if (n > 1) {
+            // Several files changed at once (a checkout, an unpacked
+            // archive): their pushes share one exchange
+            trace_set_current(run[0]->trace_id);
+            trace_span_t push_span = trace_begin("server.propagate_batch", TRACE_FLOW_STEP);
+            uint64_t push_start = metrics_now_ns();
+            metrics_gauge_add(METRIC_GAUGE_PROPAGATIONS_IN_FLIGHT, 1);
+            rc = send_push_batch(conn_fd, run, n, user_dir, rest, &n_single, crossed);
+            metrics_gauge_add(METRIC_GAUGE_PROPAGATIONS_IN_FLIGHT, -1);
+            uint64_t elapsed = metrics_now_ns() - push_start;
+            trace_end(&push_span, NULL);
+            trace_set_current(0);
+            if (rc == PUSH_CROSSED) {
+                n_single = n; // All of the run is still to be sent
+            } else {
+                for (int i = 0; i < n - n_single; i++) metrics_observe_op(METRIC_OP_PROPAGATION, elapsed, rc == 0);
+                single = rest;
+            }
+        }
+        int sent = 0;
+        while (sent < n_single && rc >= 0 && rc != PUSH_CROSSED) {
+            rc = push_one(conn_fd, single[sent], user_dir, crossed);
+            if (rc != PUSH_CROSSED) sent++;
+        }
+        if (rc == PUSH_CROSSED) {
+            LOG_DEBUG("Push para fd=%d cruzou com um pedido do cliente; %d push(es) reenfileirado(s).\n",
+                      conn_fd, n_single - sent);
+            push_queue_putback(queue, single + sent, n_single - sent);
+        }
+        for (int i = 0; i < n; i++) free_entry(run[i]);
+        if (rc < 0 || rc == PUSH_CROSSED) return rc;
+    }
+    return 0;
+}
+
+void push_write_metrics(FILE *out) {
+    fprintf(out, "# HELP sync_propagations_superseded_total Pushes replaced by a newer change to the same file before being sent.\n"
+                 "# TYPE sync_propagations_superseded_total counter\n"
+                 "sync_propagations_superseded_total %llu\n",
+            (unsigned long long)atomic_load_explicit(&superseded_total, memory_order_relaxed));
+    fprintf(out, "# HELP sync_propagations_crossed_total Pushes withdrawn because a request of the device crossed them; they are sent again.\n"
+                 "# TYPE sync_propagations_crossed_total counter\n"
+                 "sync_propagations_crossed_total %llu\n",
+            (unsigned long long)atomic_load_explicit(&crossed_total, memory_order_relaxed));
+    fprintf(out, "# HELP sync_propagations_renames_total Renames pushed as such, by whether the device applied them or needed the whole file.\n"
+                 "# TYPE sync_propagations_renames_total counter\n"
+                 "sync_propagations_renames_total{result=\"renamed\"} %llu\n"
+                 "sync_propagations_renames_total{result=\"fallback\"} %llu\n",
+            (unsigned long long)atomic_load_explicit(&renamed_total, memory_order_relaxed),
+            (unsigned long long)atomic_load_explicit(&rename_fallback_total, memory_order_relaxed));
+}
@@ -0,0 +1,53 @@
+#ifndef SERVER_PUSH_H
+#define SERVER_PUSH_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "../common/packet.h"
+#include "server_session.h"
+
+// Propagation of a user's changes to their other connected devices. Every
+// device connection owns a push queue holding at most one pending push per
+// file, and only the connection's handler thread writes pushes to its socket
+// (so it is also the only thread reading the ACKs). A change gets a version
+// from a server-wide counter when it is queued. A newer change to a file that
+// still has a push pending replaces it in place: an upload supersedes an
+// older upload, and a delete cancels it. The file is read when the push is
+// sent, so a device receives at most the newest state of a hot file instead
+// of every intermediate version.
+
+typedef struct push_queue push_queue_t;
+
+// Returns NULL if the queue or its wakeup pipe cannot be created.
+push_queue_t *push_queue_create(void);
+void push_queue_destroy(push_queue_t *queue);
+// Descriptor that becomes readable while pushes are pending; the handler
+// polls it together with the connection's socket.
+int  push_queue_wake_fd(push_queue_t *queue);
+
+// Queues 'filename' (uploaded, or deleted if 'is_delete') on every device of
+// 'session' except 'originating_conn_fd'. Takes sessions_mutex.
+void push_change(UserSession_t *session, const char *filename, int is_delete, int originating_conn_fd);
+// Queues the rename of 'from' to 'to' the same way. The device is asked to
+// rename its own copy (PKT_RENAME_REQ) and is sent the file only if it
+// refuses; a push still pending for either name turns the rename back into
+// a delete and an upload.
+void push_rename(UserSession_t *session, const char *from, const char *to, int originating_conn_fd);
+
+// Sends every pending push of 'queue' over 'conn_fd', reading uploaded files
+// from 'user_dir'. Call only from the thread that serves 'conn_fd'. Returns
+// 0 once the queue is empty and -1 if the connection failed.
+//
+// A device may send a request just as a push starts, so each side reads the
+// other's request where it expects a reply. The device wins: it drops the
+// push request, and push_queue_drain returns PUSH_CROSSED with the device's
+// request in *crossed for the caller to serve. The pushes not sent yet stay
+// queued and go out on the next drain.
+#define PUSH_CROSSED 2
+int  push_queue_drain(push_queue_t *queue, int conn_fd, const char *user_dir, packet_t *crossed);
+
+// Prometheus lines with the number of pushes superseded before being sent
+// and of pushes withdrawn because they crossed a request.
+void push_write_metrics(FILE *out);
+
+#endif // SERVER_PUSH_H
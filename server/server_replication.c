@@ -0,0 +1,798 @@
+#define _XOPEN_SOURCE 700 // nftw
+#include "server_replication.h"
+#include "server_utils.h"
+#include "server_metrics.h"
+#include "server_cache.h"
+#include "server_storage.h"
+#include "server_pack.h"
+#include "../common/log.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <limits.h>
+#include <dirent.h>
+#include <ftw.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+
+#define CHUNK_SIZE      MAX_PAYLOAD
+#define REPL_RETRY_S    1
+#define REPL_STATE_FILE ".replication" // "<epoch> <applied lsn>" in a backup's storage dir
+
+typedef struct {
+    uint32_t lsn;
+    char     op;        // 'U' upload, 'D' delete, 'R' rename
+    uint64_t logged_ns; // For the log -> backup ACK latency metric
+    char     username[REPL_NAME_MAX];
+    char     filename[REPL_PATH_MAX];
+    char     target[REPL_PATH_MAX]; // New name of a rename, "" otherwise
+} repl_record_t;
+
+typedef struct {
+    char      addr[REPL_NAME_MAX];
+    int       sock;
+    int       connected;    // Sync-mode writers wait for this backup
+    int       broken;       // Set by the ACK reader when the stream fails
+    uint32_t  next_lsn;     // Next record to send
+    uint32_t  acked_lsn;    // Highest record the backup applied
+    uint32_t  stream_start; // First LSN streamed on this connection
+    pthread_t ack_reader;
+} repl_backup_t;
+
+// Everything below is protected by repl_mutex; repl_cond is signalled when a
+// record is appended, an ACK arrives or a stream breaks.
+static pthread_mutex_t repl_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  repl_cond;
+static repl_record_t   repl_log[REPL_LOG_CAPACITY]; // Slot = lsn % capacity
+static uint32_t        head_lsn = 0;
+static uint64_t        repl_epoch = 0;
+static uint64_t        prev_epoch = 0;   // Lineage this node held before becoming primary
+static uint32_t        log_floor = 0;    // Backups may resume from this LSN or later
+static uint32_t        repl_term = 0;    // Election term; stale primaries are refused
+static repl_mode_t     repl_mode = REPL_MODE_ASYNC;
+static repl_backup_t   backups[REPL_MAX_BACKUPS];
+static int             backup_count = 0;
+static int             initialized = 0;
+static int             active = 0;       // This node is the primary and ships records
+static unsigned int    read_staleness_ms = REPL_READ_STALENESS_MS;
+static int             reader_next = 0;  // Rotation for repl_pick_reader
+
+// Backup side: one stream at a time owns the storage directory
+static pthread_mutex_t backup_mutex = PTHREAD_MUTEX_INITIALIZER;
+static _Atomic int     backup_streams = 0;
+static _Atomic uint32_t backup_applied = 0;
+static _Atomic int     backup_conn_fd = -1; // Stream being applied, -1 if none
+static _Atomic uint64_t backup_fresh_ns = 0; // When the applied copy last matched the primary's head
+static _Atomic int     backup_fed = 0;       // A primary has streamed to this process
+
+static void load_state(uint64_t *epoch, uint32_t *lsn);
+static void save_state(uint64_t epoch, uint32_t lsn);
+
+int repl_add_backup(const char *addr) {
+    if (backup_count == REPL_MAX_BACKUPS) return -1;
+    repl_backup_t *b = &backups[backup_count++];
+    snprintf(b->addr, sizeof(b->addr), "%s", addr);
+    b->sock = -1;
+    return 0;
+}
+
+void repl_set_mode(repl_mode_t mode) {
+    repl_mode = mode;
+}
+
+int repl_enabled(void) {
+    pthread_mutex_lock(&repl_mutex);
+    int e = active;
+    pthread_mutex_unlock(&repl_mutex);
+    return e;
+}
+
+static uint32_t repl_append(char op, const char *username, const char *filename, const char *target) {
+    pthread_mutex_lock(&repl_mutex);
+    if (!active) {
+        pthread_mutex_unlock(&repl_mutex);
+        return 0;
+    }
+    if (strlen(username) >= REPL_NAME_MAX || strlen(filename) >= REPL_PATH_MAX || strlen(target) >= REPL_PATH_MAX) {
+        pthread_mutex_unlock(&repl_mutex);
+        LOG_ERROR("[Replicação] Nome longo demais para replicar: '%s/%s'.", username, filename);
+        return REPL_LSN_UNLOGGED;
+    }
+    uint32_t lsn = ++head_lsn;
+    repl_record_t *rec = &repl_log[lsn % REPL_LOG_CAPACITY];
+    rec->lsn = lsn;
+    rec->op = op;
+    rec->logged_ns = metrics_now_ns();
+    snprintf(rec->username, sizeof(rec->username), "%s", username);
+    snprintf(rec->filename, sizeof(rec->filename), "%s", filename);
+    snprintf(rec->target, sizeof(rec->target), "%s", target);
+    pthread_cond_broadcast(&repl_cond);
+    pthread_mutex_unlock(&repl_mutex);
+    return lsn;
+}
+
+uint32_t repl_log_upload(const char *username, const char *filename) {
+    return repl_append('U', username, filename, "");
+}
+
+uint32_t repl_log_delete(const char *username, const char *filename) {
+    return repl_append('D', username, filename, "");
+}
+
+uint32_t repl_log_rename(const char *username, const char *from, const char *to) {
+    return repl_append('R', username, from, to);
+}
+
+int repl_wait_durable(uint32_t lsn) {
+    if (lsn == 0 || repl_mode != REPL_MODE_SYNC) return 0;
+    if (lsn == REPL_LSN_UNLOGGED) return -1;
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += REPL_SYNC_TIMEOUT_MS / 1000;
+    deadline.tv_nsec += (long)(REPL_SYNC_TIMEOUT_MS % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&repl_mutex);
+    for (;;) {
+        int pending = 0;
+        for (int i = 0; i < backup_count; i++) {
+            if (backups[i].connected && backups[i].acked_lsn < lsn) pending = 1;
+        }
+        if (!pending) break;
+        if (pthread_cond_timedwait(&repl_cond, &repl_mutex, &deadline) == ETIMEDOUT) {
+            LOG_WARN("[Replicação] LSN %u não confirmada pelos backups em %d ms; seguindo sem eles.",
+                     lsn, REPL_SYNC_TIMEOUT_MS);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&repl_mutex);
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// Primary: shipping
+// ---------------------------------------------------------------------------
+
+// Sends one record and, for uploads, the file as it is on disk right now.
+// Records are not ACKed one by one; see ack_reader_thread.
+static int send_record(int sock, const repl_record_t *rec, uint32_t lsn) {
+    char op = rec->op;
+    content_reader_t f; // Every backup ships the same bytes, so they come from the cache
+    int has_data = 0;
+    if (op == 'U') {
+        char dir[PATH_MAX], path[PATH_MAX];
+        user_sync_dir(rec->username, dir, sizeof(dir));
+        has_data = (path_join(path, sizeof(path), dir, rec->filename) == 0 && content_open(&f, path) == 0);
+        if (!has_data) op = 'N'; // Deleted since; the delete record that follows covers it
+    } else if (op == 'D') {
+        // Records of overlapping changes to a file may be logged out of
+        // order; like uploads, deletes ship the file's current state
+        char dir[PATH_MAX], path[PATH_MAX];
+        user_sync_dir(rec->username, dir, sizeof(dir));
+        if (path_join(path, sizeof(path), dir, rec->filename) == 0 && storage_exists(path)) {
+            op = 'N'; // Uploaded again since; its record covers it
+        }
+    }
+    // A rename ships as one: the backup renames its own copy. Later changes
+    // to either name have records of their own that follow it.
+
+
+    packet_t p = { .type = PKT_REPL_RECORD, .seq_num = lsn };
+    size_t ulen = strlen(rec->username) + 1, flen = strlen(rec->filename) + 1;
+    size_t tlen = op == 'R' ? strlen(rec->target) + 1 : 0;
+    p.payload[0] = op;
+    memcpy(p.payload + 1, rec->username, ulen);
+    memcpy(p.payload + 1 + ulen, rec->filename, flen);
+    memcpy(p.payload + 1 + ulen + flen, rec->target, tlen);
+    p.payload_size = (uint32_t)(1 + ulen + flen + tlen);
+    int rc = send_packet(sock, &p);
+
+    if (has_data) {
+        packet_t dp = { .type = PKT_REPL_DATA };
+        size_t n_read;
+        while (rc == 0 && (n_read = content_read(&f, dp.payload, CHUNK_SIZE)) > 0) {
+            dp.payload_size = (uint32_t)n_read;
+            rc = send_packet(sock, &dp);
+        }
+        content_close(&f);
+        if (rc == 0) {
+            dp.payload_size = 0;
+            rc = send_packet(sock, &dp);
+        }
+    }
+    return rc;
+}
+
+typedef struct {
+    int           sock;
+    repl_record_t rec;
+    int           files;
+    int           failed;
+} snapshot_ctx_t;
+
+static int snapshot_file(const char *name, const struct stat *st, void *arg) {
+    (void)st;
+    snapshot_ctx_t *ctx = arg;
+    snprintf(ctx->rec.filename, sizeof(ctx->rec.filename), "%s", name);
+    ctx->files++;
+    ctx->failed = (send_record(ctx->sock, &ctx->rec, 0) != 0);
+    return ctx->failed;
+}
+
+// Streams every stored file. Records logged while this runs are shipped
+// afterwards and simply rewrite what the snapshot already carried.
+static int send_snapshot(int sock, uint32_t base_lsn, const char *addr) {
+    packet_t p = { .type = PKT_REPL_SNAPSHOT, .seq_num = base_lsn };
+    snprintf(p.payload, MAX_PAYLOAD, "begin");
+    p.payload_size = (uint32_t)strlen(p.payload) + 1;
+    if (send_packet(sock, &p) != 0) return -1;
+
+    snapshot_ctx_t ctx = { .sock = sock, .rec = { .op = 'U' } };
+    DIR *d = opendir(storage_base_dir());
+    if (d) {
+        struct dirent *ue;
+        while (!ctx.failed && (ue = readdir(d)) != NULL) {
+            if (ue->d_name[0] == '.') continue;
+            snprintf(ctx.rec.username, sizeof(ctx.rec.username), "%s", ue->d_name);
+            char dir[PATH_MAX];
+            user_sync_dir(ctx.rec.username, dir, sizeof(dir));
+            storage_list_tree(dir, snapshot_file, &ctx);
+        }
+        closedir(d);
+    }
+    int rc = ctx.failed ? -1 : 0, files = ctx.files;
+
+    if (rc == 0) {
+        snprintf(p.payload, MAX_PAYLOAD, "end");
+        p.payload_size = (uint32_t)strlen(p.payload) + 1;
+        rc = send_packet(sock, &p);
+    }
+    if (rc == 0) {
+        LOG_INFO("[Replicação] Snapshot enviado para %s: %d arquivo(s), base na LSN %u.", addr, files, base_lsn);
+    }
+    return rc;
+}
+
+// ACKs carry the highest LSN the backup applied; they arrive once per burst.
+static void *ack_reader_thread(void *arg) {
+    repl_backup_t *b = (repl_backup_t *)arg;
+    packet_t ack;
+    while (recv_packet(b->sock, &ack) == 0) {
+        if (ack.type != PKT_ACK) continue;
+        uint64_t now = metrics_now_ns();
+        pthread_mutex_lock(&repl_mutex);
+        if (ack.seq_num > b->acked_lsn) {
+            uint32_t from = b->acked_lsn + 1;
+            if (from < b->stream_start) from = b->stream_start;
+            for (uint32_t lsn = from; lsn <= ack.seq_num && lsn <= head_lsn; lsn++) {
+                if (head_lsn - lsn >= REPL_LOG_CAPACITY) continue; // Slot reused already
+                metrics_observe_op(METRIC_OP_REPLICATION, now - repl_log[lsn % REPL_LOG_CAPACITY].logged_ns, 1);
+            }
+            b->acked_lsn = ack.seq_num;
+            pthread_cond_broadcast(&repl_cond);
+        }
+        pthread_mutex_unlock(&repl_mutex);
+    }
+    pthread_mutex_lock(&repl_mutex);
+    b->broken = 1;
+    pthread_cond_broadcast(&repl_cond);
+    pthread_mutex_unlock(&repl_mutex);
+    return NULL;
+}
+
+// Runs one connection to a backup until it breaks.
+static void ship_stream(repl_backup_t *b, int sock) {
+    packet_t hello = { .type = PKT_REPL_HELLO, .seq_num = 1 };
+    pthread_mutex_lock(&repl_mutex);
+    snprintf(hello.payload, MAX_PAYLOAD, "%llu %u", (unsigned long long)repl_epoch, repl_term);
+    pthread_mutex_unlock(&repl_mutex);
+    hello.payload_size = (uint32_t)strlen(hello.payload) + 1;
+    packet_t resp;
+    if (send_packet(sock, &hello) != 0 || recv_packet(sock, &resp) != 0 || resp.type != PKT_ACK) {
+        LOG_WARN("[Replicação] %s recusou o handshake de replicação.", b->addr);
+        return;
+    }
+    resp.payload[resp.payload_size < MAX_PAYLOAD ? resp.payload_size : MAX_PAYLOAD - 1] = '\0';
+    unsigned long long their_epoch = 0;
+    unsigned int their_lsn = 0;
+    sscanf(resp.payload, "%llu %u", &their_epoch, &their_lsn);
+
+    pthread_mutex_lock(&repl_mutex);
+    uint32_t head = head_lsn;
+    // Resume when the backup holds a prefix of what this log can still send:
+    // a position in this run that is still in the ring, or exactly the state
+    // this node had when it was promoted.
+    int resume = (their_epoch == repl_epoch && their_lsn >= log_floor && their_lsn <= head &&
+                  head - their_lsn < REPL_LOG_CAPACITY) ||
+                 (prev_epoch != 0 && their_epoch == prev_epoch && their_lsn == log_floor);
+    pthread_mutex_unlock(&repl_mutex);
+
+    uint32_t start = resume ? their_lsn : head;
+    if (!resume && send_snapshot(sock, head, b->addr) != 0) return;
+
+    pthread_mutex_lock(&repl_mutex);
+    b->sock = sock;
+    b->broken = 0;
+    b->next_lsn = start + 1;
+    b->stream_start = start + 1;
+    b->acked_lsn = resume ? their_lsn : 0; // A snapshot counts once the backup ACKs its base
+    b->connected = 1;
+    pthread_mutex_unlock(&repl_mutex);
+    LOG_INFO("[Replicação] Backup %s conectado; enviando a partir da LSN %u.", b->addr, start + 1);
+
+    int err = pthread_create(&b->ack_reader, NULL, ack_reader_thread, b);
+    if (err != 0) {
+        LOG_ERROR("[Replicação] pthread_create para leitor de ACKs falhou: %s", strerror(err));
+        pthread_mutex_lock(&repl_mutex);
+        b->connected = 0;
+        b->sock = -1;
+        pthread_cond_broadcast(&repl_cond);
+        pthread_mutex_unlock(&repl_mutex);
+        return;
+    }
+
+    repl_record_t batch[REPL_BATCH];
+    uint64_t keepalive_due = 0;
+    for (;;) {
+        // The keepalive goes out on schedule whether or not records are
+        // flowing, so a backup under steady load still learns it is current.
+        int rc = 0;
+        pthread_mutex_lock(&repl_mutex);
+        while (active && !b->broken && metrics_now_ns() < keepalive_due &&
+               (b->next_lsn > head_lsn || b->next_lsn - b->acked_lsn > REPL_WINDOW)) {
+            struct timespec deadline = { .tv_sec = (time_t)(keepalive_due / 1000000000ull),
+                                         .tv_nsec = (long)(keepalive_due % 1000000000ull) };
+            pthread_cond_timedwait(&repl_cond, &repl_mutex, &deadline);
+        }
+        if (!active || b->broken) {
+            pthread_mutex_unlock(&repl_mutex);
+            break;
+        }
+        if (metrics_now_ns() >= keepalive_due) {
+            packet_t ka = { .type = PKT_REPL_KEEPALIVE, .seq_num = head_lsn };
+            pthread_mutex_unlock(&repl_mutex);
+            if (send_packet(sock, &ka) != 0) break;
+            keepalive_due = metrics_now_ns() + (uint64_t)REPL_KEEPALIVE_MS * 1000000ull;
+            continue;
+        }
+        if (head_lsn - b->next_lsn >= REPL_LOG_CAPACITY) {
+            pthread_mutex_unlock(&repl_mutex);
+            LOG_WARN("[Replicação] Backup %s ficou para trás do log; um novo snapshot será enviado.", b->addr);
+            break;
+        }
+        uint32_t first = b->next_lsn;
+        int n = 0;
+        while (n < REPL_BATCH && first + n <= head_lsn && first + n - b->acked_lsn <= REPL_WINDOW) {
+            batch[n] = repl_log[(first + n) % REPL_LOG_CAPACITY];
+            n++;
+        }
+        pthread_mutex_unlock(&repl_mutex);
+
+        for (int i = 0; i < n && rc == 0; i++) {
+            rc = send_record(sock, &batch[i], first + (uint32_t)i);
+        }
+        if (rc != 0) break;
+        pthread_mutex_lock(&repl_mutex);
+        b->next_lsn = first + (uint32_t)n;
+        pthread_mutex_unlock(&repl_mutex);
+    }
+
+    shutdown(sock, SHUT_RDWR);
+    pthread_join(b->ack_reader, NULL);
+    pthread_mutex_lock(&repl_mutex);
+    b->connected = 0;
+    b->sock = -1;
+    uint32_t acked = b->acked_lsn;
+    pthread_cond_broadcast(&repl_cond);
+    pthread_mutex_unlock(&repl_mutex);
+    LOG_WARN("[Replicação] Conexão com o backup %s encerrada (confirmado até a LSN %u).", b->addr, acked);
+}
+
+static void *shipper_thread(void *arg) {
+    repl_backup_t *b = (repl_backup_t *)arg;
+    int warned = 0;
+    for (;;) {
+        pthread_mutex_lock(&repl_mutex);
+        while (!active) pthread_cond_wait(&repl_cond, &repl_mutex);
+        pthread_mutex_unlock(&repl_mutex);
+
+        int sock = connect_to_addr(b->addr);
+        if (sock < 0) {
+            if (!warned) {
+                LOG_WARN("[Replicação] Backup %s indisponível; nova tentativa a cada %d s.", b->addr, REPL_RETRY_S);
+                warned = 1;
+            }
+            sleep(REPL_RETRY_S);
+            continue;
+        }
+        warned = 0;
+        ship_stream(b, sock);
+        close(sock);
+        sleep(REPL_RETRY_S);
+    }
+    return NULL;
+}
+
+void repl_start(void) {
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC); // Timed waits in repl_wait_durable
+    pthread_cond_init(&repl_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    uint64_t epoch;
+    uint32_t lsn;
+    load_state(&epoch, &lsn);
+    atomic_store(&backup_applied, lsn);
+
+    pthread_mutex_lock(&repl_mutex);
+    initialized = 1;
+    pthread_mutex_unlock(&repl_mutex);
+
+    for (int i = 0; i < backup_count; i++) {
+        pthread_t tid;
+        int err = pthread_create(&tid, NULL, shipper_thread, &backups[i]);
+        if (err != 0) {
+            LOG_ERROR("[Replicação] pthread_create para %s falhou: %s", backups[i].addr, strerror(err));
+            continue;
+        }
+        pthread_detach(tid);
+    }
+}
+
+void repl_set_active(int on) {
+    pthread_mutex_lock(&repl_mutex);
+    if (!initialized || on == active) {
+        pthread_mutex_unlock(&repl_mutex);
+        return;
+    }
+    if (on) {
+        // Continue the numbering of the copy this node holds, under a fresh
+        // epoch. The state file is invalidated while this node is primary: if
+        // it crashes, its storage may be ahead of anything a backup has.
+        uint64_t epoch;
+        uint32_t lsn;
+        load_state(&epoch, &lsn);
+        prev_epoch = epoch;
+        log_floor = lsn > head_lsn ? lsn : head_lsn;
+        head_lsn = log_floor;
+        save_state(0, 0);
+        int fd = atomic_load(&backup_conn_fd);
+        if (fd >= 0) shutdown(fd, SHUT_RDWR); // Whoever fed us is no longer the primary
+
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        repl_epoch = ((uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec) ^ ((uint64_t)getpid() << 32);
+        if (repl_epoch == 0) repl_epoch = 1; // 0 means "no state" on backups
+        active = 1;
+        LOG_INFO("[Replicação] Primário: modo %s, %d backup(s), época %llu, a partir da LSN %u.",
+                 repl_mode == REPL_MODE_SYNC ? "síncrono" : "assíncrono", backup_count,
+                 (unsigned long long)repl_epoch, head_lsn);
+    } else {
+        // The storage now matches (epoch, head) exactly; with nothing written
+        // since the promotion it still matches the lineage it inherited.
+        active = 0;
+        if (head_lsn == log_floor && prev_epoch != 0) {
+            save_state(prev_epoch, log_floor);
+        } else {
+            save_state(repl_epoch, head_lsn);
+        }
+        atomic_store(&backup_applied, head_lsn);
+        LOG_INFO("[Replicação] Deixando de ser primário na LSN %u.", head_lsn);
+    }
+    pthread_cond_broadcast(&repl_cond);
+    pthread_mutex_unlock(&repl_mutex);
+}
+
+void repl_set_term(uint32_t term) {
+    pthread_mutex_lock(&repl_mutex);
+    if (term > repl_term) repl_term = term;
+    pthread_mutex_unlock(&repl_mutex);
+}
+
+uint32_t repl_position(void) {
+    pthread_mutex_lock(&repl_mutex);
+    uint32_t lsn = active ? head_lsn : atomic_load(&backup_applied);
+    pthread_mutex_unlock(&repl_mutex);
+    return lsn;
+}
+
+void repl_set_read_staleness(unsigned int ms) {
+    read_staleness_ms = ms;
+}
+
+int repl_pick_reader(char *addr, size_t len) {
+    if (read_staleness_ms == 0) return -1;
+    pthread_mutex_lock(&repl_mutex);
+    int found = -1;
+    for (int n = 0; active && n < backup_count && found < 0; n++) {
+        int i = (reader_next + n) % backup_count;
+        // Lagging backups would refuse the session anyway
+        if (backups[i].connected && head_lsn - backups[i].acked_lsn <= REPL_BATCH) found = i;
+    }
+    if (found >= 0) {
+        reader_next = (found + 1) % backup_count;
+        snprintf(addr, len, "%s", backups[found].addr);
+    }
+    pthread_mutex_unlock(&repl_mutex);
+    return found >= 0 ? 0 : -1;
+}
+
+int repl_reads_fresh(void) {
+    if (read_staleness_ms == 0) return 0;
+    pthread_mutex_lock(&repl_mutex);
+    // A group member that does not lead, or a former backup, must be fed
+    int needs_stream = !active && (backup_count > 0 || atomic_load(&backup_fed));
+    pthread_mutex_unlock(&repl_mutex);
+    if (!needs_stream) return 1;
+    uint64_t fresh = atomic_load(&backup_fresh_ns);
+    return fresh != 0 && metrics_now_ns() - fresh <= (uint64_t)read_staleness_ms * 1000000ull;
+}
+
+void repl_write_metrics(FILE *out) {
+    pthread_mutex_lock(&repl_mutex);
+    if (!active) {
+        pthread_mutex_unlock(&repl_mutex);
+        return;
+    }
+    fprintf(out, "# HELP sync_replication_head_lsn Last LSN appended to the replication log.\n"
+                 "# TYPE sync_replication_head_lsn gauge\n"
+                 "sync_replication_head_lsn %u\n", head_lsn);
+    fputs("# HELP sync_replication_acked_lsn Highest LSN each backup acknowledged.\n"
+          "# TYPE sync_replication_acked_lsn gauge\n", out);
+    for (int i = 0; i < backup_count; i++) {
+        fprintf(out, "sync_replication_acked_lsn{backup=\"%s\"} %u\n", backups[i].addr, backups[i].acked_lsn);
+    }
+    fputs("# HELP sync_replication_backup_connected Whether each backup is currently streaming.\n"
+          "# TYPE sync_replication_backup_connected gauge\n", out);
+    for (int i = 0; i < backup_count; i++) {
+        fprintf(out, "sync_replication_backup_connected{backup=\"%s\"} %d\n", backups[i].addr, backups[i].connected);
+    }
+    pthread_mutex_unlock(&repl_mutex);
+}
+
+// ---------------------------------------------------------------------------
+// Backup: applying
+// ---------------------------------------------------------------------------
+
+int repl_is_backup(void) {
+    return atomic_load(&backup_streams) > 0;
+}
+
+static void load_state(uint64_t *epoch, uint32_t *lsn) {
+    char path[PATH_MAX];
+    unsigned long long e = 0;
+    unsigned int l = 0;
+    FILE *f = path_join(path, sizeof(path), storage_base_dir(), REPL_STATE_FILE) == 0 ? fopen(path, "r") : NULL;
+    if (f) {
+        if (fscanf(f, "%llu %u", &e, &l) != 2) e = l = 0;
+        fclose(f);
+    }
+    *epoch = e;
+    *lsn = l;
+}
+
+static void save_state(uint64_t epoch, uint32_t lsn) {
+    char path[PATH_MAX], tmp[PATH_MAX];
+    int n = -1;
+    if (path_join(path, sizeof(path), storage_base_dir(), REPL_STATE_FILE) == 0) {
+        n = snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    }
+    if (n < 0 || (size_t)n >= sizeof(tmp)) {
+        LOG_ERROR("[Replicação] Caminho do estado longo demais em '%s'.", storage_base_dir());
+        return;
+    }
+    FILE *f = fopen(tmp, "w");
+    if (!f) {
+        LOG_ERROR("[Replicação] Não foi possível gravar '%s': %s", tmp, strerror(errno));
+        return;
+    }
+    fprintf(f, "%llu %u\n", (unsigned long long)epoch, lsn);
+    if (fclose(f) != 0 || rename(tmp, path) != 0) {
+        LOG_ERROR("[Replicação] Não foi possível gravar '%s': %s", path, strerror(errno));
+    }
+}
+
+static int remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+    (void)st; (void)flag; (void)ftw;
+    return remove(path);
+}
+
+// Drops every user directory; the snapshot that follows rebuilds them.
+static void wipe_storage(void) {
+    DIR *d = opendir(storage_base_dir());
+    if (!d) return;
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL) {
+        if (e->d_name[0] == '.') continue;
+        char path[PATH_MAX];
+        if (path_join(path, sizeof(path), storage_base_dir(), e->d_name) != 0) {
+            LOG_ERROR("[Replicação] Caminho longo demais para '%s'; não removido.", e->d_name);
+            continue;
+        }
+        nftw(path, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    }
+    closedir(d);
+    pack_forget_under(storage_base_dir());
+}
+
+static int valid_user(const char *s) {
+    return s[0] != '\0' && strcmp(s, ".") != 0 && strcmp(s, "..") != 0 && strchr(s, '/') == NULL &&
+           !storage_is_internal_name(s);
+}
+
+// Receives the file as a staged upload (see server_storage.h), so a reader
+// never sees a half-applied file and the durability policy applies here too.
+// Local write errors are logged and the stream goes on; -1 means the stream
+// itself broke.
+static int apply_upload(int fd, const char *username, const char *filename) {
+    char dir[PATH_MAX], path[PATH_MAX];
+    user_sync_dir(username, dir, sizeof(dir));
+    mkdir_p(dir, 0755);
+
+    staged_file_t staged;
+    int ok = (path_join(path, sizeof(path), dir, filename) == 0 && storage_stage_begin(&staged, path, 0) == 0);
+    packet_t dp;
+    for (;;) {
+        if (recv_packet(fd, &dp) != 0 || dp.type != PKT_REPL_DATA) {
+            if (ok) storage_stage_abort(&staged);
+            return -1;
+        }
+        if (dp.payload_size == 0) break;
+        if (ok) storage_stage_write(&staged, dp.payload, dp.payload_size);
+    }
+    if (ok) ok = (storage_stage_commit(&staged) == 0);
+    if (!ok) {
+        LOG_ERROR("[Replicação] Falha ao aplicar '%s/%s': %s", username, filename, strerror(errno));
+    }
+    return 0;
+}
+
+void repl_serve_backup(int conn_fd, const packet_t *hello) {
+    char hello_str[64];
+    size_t len = hello->payload_size < sizeof(hello_str) ? hello->payload_size : sizeof(hello_str) - 1;
+    memcpy(hello_str, hello->payload, len);
+    hello_str[len] = '\0';
+    unsigned long long primary_epoch = 0;
+    unsigned int primary_term = 0;
+    sscanf(hello_str, "%llu %u", &primary_epoch, &primary_term);
+
+    pthread_mutex_lock(&repl_mutex);
+    uint32_t local_term = repl_term;
+    int stale = (primary_term < local_term) || active;
+    pthread_mutex_unlock(&repl_mutex);
+    if (stale) {
+        LOG_WARN("[Replicação] Recusando stream do termo %u (fd=%d): este nó está no termo %u ou é primário.",
+                 primary_term, conn_fd, local_term);
+        packet_t nack = { .type = PKT_NACK, .seq_num = hello->seq_num };
+        send_packet(conn_fd, &nack);
+        return;
+    }
+
+    if (pthread_mutex_trylock(&backup_mutex) != 0) {
+        LOG_WARN("[Replicação] Já existe um primário replicando para este servidor; recusando fd=%d.", conn_fd);
+        packet_t nack = { .type = PKT_NACK, .seq_num = hello->seq_num };
+        send_packet(conn_fd, &nack);
+        return;
+    }
+    atomic_fetch_add(&backup_streams, 1);
+    atomic_store(&backup_conn_fd, conn_fd);
+
+    uint64_t epoch;
+    uint32_t applied;
+    mkdir_p(storage_base_dir(), 0755);
+    load_state(&epoch, &applied);
+    packet_t ack = { .type = PKT_ACK, .seq_num = hello->seq_num };
+    snprintf(ack.payload, MAX_PAYLOAD, "%llu %u", (unsigned long long)epoch, applied);
+    ack.payload_size = (uint32_t)strlen(ack.payload) + 1;
+    LOG_INFO("[Replicação] Recebendo replicação da época %llu (fd=%d); estado local: época %llu, LSN %u.",
+             (unsigned long long)primary_epoch, conn_fd, (unsigned long long)epoch, applied);
+
+    int dirty = 0, in_snapshot = 0; // dirty: 'applied' moved since the last ACK
+    uint32_t fresh_lsn = 0;          // Primary head from a keepalive not applied yet
+    uint64_t fresh_at_ns = 0;        // ... and when that keepalive arrived
+    atomic_store(&backup_fresh_ns, 0);
+    atomic_store(&backup_fed, 1);
+    packet_t p;
+    int ok = (send_packet(conn_fd, &ack) == 0);
+    while (ok && recv_packet(conn_fd, &p) == 0) {
+        if (p.type == PKT_REPL_RECORD) {
+            if (p.payload_size < 5 || p.payload_size > MAX_PAYLOAD) break;
+            p.payload[p.payload_size - 1] = '\0';
+            char op = p.payload[0];
+            const char *username = p.payload + 1;
+            size_t ulen = strlen(username);
+            if (1 + ulen + 1 >= p.payload_size) break;
+            const char *filename = username + ulen + 1;
+            size_t flen = strlen(filename);
+            const char *target = NULL;
+            if (op == 'R') {
+                if (1 + ulen + 1 + flen + 1 >= p.payload_size) break;
+                target = filename + flen + 1;
+            }
+            if (!valid_user(username) || !storage_valid_name(filename) || (target && !storage_valid_name(target))) {
+                LOG_ERROR("[Replicação] Registro com nome inválido; encerrando o stream.");
+                break;
+            }
+            if (op == 'U') {
+                if (apply_upload(conn_fd, username, filename) != 0) break;
+            } else if (op == 'D') {
+                char dir[PATH_MAX], path[PATH_MAX];
+                user_sync_dir(username, dir, sizeof(dir));
+                if ((path_join(path, sizeof(path), dir, filename) != 0 || storage_remove(path) < 0) && errno != ENOENT) {
+                    LOG_ERROR("[Replicação] Falha ao remover '%s/%s': %s", username, filename, strerror(errno));
+                }
+            } else if (op == 'R') {
+                char dir[PATH_MAX], from[PATH_MAX], to[PATH_MAX];
+                user_sync_dir(username, dir, sizeof(dir));
+                if (path_join(from, sizeof(from), dir, filename) != 0 || path_join(to, sizeof(to), dir, target) != 0 ||
+                    storage_rename(from, to) < 0) {
+                    LOG_ERROR("[Replicação] Falha ao renomear '%s/%s' para '%s': %s", username, filename, target,
+                              strerror(errno));
+                }
+            }
+            if (p.seq_num != 0) {
+                applied = p.seq_num;
+                dirty = 1;
+            }
+        } else if (p.type == PKT_REPL_SNAPSHOT) {
+            if (strncmp(p.payload, "begin", 5) == 0) {
+                // Until "end" arrives the local copy is incomplete: forget the
+                // position so an interrupted snapshot is restarted, not resumed.
+                save_state(0, 0);
+                atomic_store(&backup_applied, 0);
+                wipe_storage();
+                in_snapshot = 1;
+                LOG_INFO("[Replicação] Recebendo snapshot (base na LSN %u).", p.seq_num);
+            } else {
+                applied = p.seq_num;
+                in_snapshot = 0;
+                dirty = 1;
+                LOG_INFO("[Replicação] Snapshot aplicado até a LSN %u.", applied);
+            }
+        } else if (p.type == PKT_REPL_KEEPALIVE) {
+            if (!in_snapshot && fresh_lsn == 0) {
+                fresh_lsn = p.seq_num;
+                fresh_at_ns = metrics_now_ns();
+            }
+        } else {
+            LOG_ERROR("[Replicação] Pacote inesperado (%d) no stream de replicação.", p.type);
+            break;
+        }
+        if (fresh_lsn != 0 && !in_snapshot && applied >= fresh_lsn) {
+            atomic_store(&backup_fresh_ns, fresh_at_ns);
+            fresh_lsn = 0;
+        }
+
+        // One ACK per burst: only when nothing else is waiting on the socket
+        if (dirty && !in_snapshot) {
+            struct pollfd pfd = { .fd = conn_fd, .events = POLLIN };
+            if (poll(&pfd, 1, 0) == 0) {
+                save_state(primary_epoch, applied);
+                atomic_store(&backup_applied, applied);
+                packet_t progress = { .type = PKT_ACK, .seq_num = applied };
+                ok = (send_packet(conn_fd, &progress) == 0);
+                dirty = 0;
+            }
+        }
+    }
+
+    // The primary's EOF also wakes poll(), so the last burst may be unsaved
+    if (dirty && !in_snapshot) {
+        save_state(primary_epoch, applied);
+        atomic_store(&backup_applied, applied);
+    }
+    LOG_INFO("[Replicação] Stream de replicação encerrado (fd=%d, LSN aplicada: %u).", conn_fd, applied);
+    atomic_store(&backup_fresh_ns, 0);
+    atomic_store(&backup_conn_fd, -1);
+    atomic_fetch_sub(&backup_streams, 1);
+    pthread_mutex_unlock(&backup_mutex);
+}
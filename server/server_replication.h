@@ -0,0 +1,94 @@
+#ifndef SERVER_REPLICATION_H
+#define SERVER_REPLICATION_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "../common/packet.h"
+#include "server_storage.h" // For STORAGE_NAME_MAX
+
+// Primary-backup replication. The primary appends every completed upload and
+// delete to an in-memory log; a record means "make <user>/<file> look like it
+// does here now", so replaying one twice is harmless. One shipper thread per
+// backup streams the records over a PKT_REPL_HELLO connection without
+// waiting between them (up to REPL_WINDOW unacknowledged), and the backup
+// ACKs the highest LSN it has applied each time its socket runs dry, so a
+// burst of records costs a single ACK. A backup that fell out of the log, or
+// that was fed by an earlier run of the primary (different epoch), first gets
+// a full snapshot of the storage directory.
+//
+// Durability modes:
+//   async  client requests never wait for backups (default)
+//   sync   after an upload is stored, or before a delete is ACKed, the request
+//          thread waits until every connected backup has the record (at most
+//          REPL_SYNC_TIMEOUT_MS). Chunks are never delayed: the wait happens
+//          once per operation.
+//
+// Any server accepts a replication stream; while it is being fed it refuses
+// client handshakes so the copies cannot diverge. A primary stepping down
+// (failover, or a clean shutdown) records its (epoch, LSN) so that backups
+// holding exactly that state resume instead of taking a snapshot when it or
+// another node becomes primary.
+//
+// Read offload: backups also serve read-only sessions (listing and
+// downloads) while their copy is at most the read staleness bound behind the
+// primary. The shipper sends PKT_REPL_KEEPALIVE with the primary's head
+// every REPL_KEEPALIVE_MS, even when it has nothing else to send; once the
+// backup has applied up to that head it knows its copy is current as of the
+// moment the keepalive arrived.
+
+#define REPL_MAX_BACKUPS     4
+#define REPL_LOG_CAPACITY    4096 // Records kept for backups that reconnect
+#define REPL_WINDOW          256  // Unacknowledged records in flight per backup
+#define REPL_BATCH           32   // Records taken from the log per wakeup
+#define REPL_SYNC_TIMEOUT_MS 2000
+#define REPL_NAME_MAX        256  // User names and peer addresses
+#define REPL_PATH_MAX        (STORAGE_NAME_MAX + 1) // File names, which may be paths
+#define REPL_KEEPALIVE_MS    200
+#define REPL_READ_STALENESS_MS 1000 // Default bound for serving reads on a backup
+
+typedef enum {
+    REPL_MODE_ASYNC,
+    REPL_MODE_SYNC
+} repl_mode_t;
+
+// Primary side. Backups are added before repl_start(), which starts their
+// shippers idle; they stream only while this node is active (the primary).
+int  repl_add_backup(const char *addr); // "host:port"; returns -1 if the table is full
+void repl_set_mode(repl_mode_t mode);
+void repl_start(void);
+void repl_set_active(int on);
+int  repl_enabled(void);
+// Election term sent in PKT_REPL_HELLO; backups refuse lower terms.
+void repl_set_term(uint32_t term);
+// Last LSN this node holds: the log head on a primary, the applied one on a backup.
+uint32_t repl_position(void);
+
+// Appends a record and wakes the shippers. Returns its LSN, 0 if replication
+// is off, or REPL_LSN_UNLOGGED if the names do not fit a record.
+#define REPL_LSN_UNLOGGED UINT32_MAX
+uint32_t repl_log_upload(const char *username, const char *filename);
+uint32_t repl_log_delete(const char *username, const char *filename);
+uint32_t repl_log_rename(const char *username, const char *from, const char *to);
+// In sync mode, blocks until every connected backup acknowledged 'lsn'.
+// Returns 0, or -1 in sync mode for REPL_LSN_UNLOGGED: the change never
+// reaches the backups, so the request must not be confirmed.
+int  repl_wait_durable(uint32_t lsn);
+
+// Maximum staleness, in ms, of the copy a backup reads from (0 disables read offload).
+void repl_set_read_staleness(unsigned int ms);
+// Primary: writes the "host:port" of a connected, caught-up backup for a
+// client's reads to 'addr', rotating between backups. Returns -1 if none.
+int  repl_pick_reader(char *addr, size_t len);
+// Returns 1 if reads served here are within the staleness bound: always on the
+// primary or an unreplicated server, and on a backup while its stream is fresh.
+int  repl_reads_fresh(void);
+
+// Prometheus lines with the log head and each backup's acknowledged LSN.
+void repl_write_metrics(FILE *out);
+
+// Backup side: serves a stream that started with 'hello' until it breaks.
+void repl_serve_backup(int conn_fd, const packet_t *hello);
+// Returns 1 while at least one primary is streaming to this server.
+int  repl_is_backup(void);
+
+#endif // SERVER_REPLICATION_H
@@ -1,98 +1,261 @@
 #include "server_request_handler.h"
 #include "server_utils.h" // For mkdir_p, send_and_wait_ack_server
+#include "server_metrics.h"
+#include "server_replication.h"
+#include "server_push.h"
+#include "server_cache.h"
+#include "server_storage.h"
+#include "server_dedupe.h"
+#include "../common/batch.h"
+#include "../common/log.h"
+#include "../common/trace.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <unistd.h>     // For remove, close
 #include <sys/stat.h>   // For stat
-#include <dirent.h>     // For opendir, readdir, closedir
+#include <sys/socket.h> // For shutdown
 
 #define CHUNK_SIZE MAX_PAYLOAD
 
 
-// Helper function to propagate a file to other connected devices of the same user
-void propagate_file_to_other_devices(UserSession_t *user_session, const char *base_filename, const char *full_file_path_on_server, int originating_conn_fd) {
-    if (!user_session || !base_filename || !full_file_path_on_server) return;
+static const char *request_span_name(packet_type_t type) {
+    switch (type) {
+        case PKT_UPLOAD_REQ:      return "server.upload";
+        case PKT_DOWNLOAD_REQ:    return "server.download";
+        case PKT_DELETE_REQ:      return "server.delete";
+        case PKT_LIST_SERVER_REQ: return "server.list";
+        case PKT_BATCH_UPLOAD:    return "server.batch_upload";
+        case PKT_RENAME_REQ:      return "server.rename";
+        default:                  return "server.other";
+    }
+}
+
+typedef struct {
+    char     buf[CHUNK_SIZE];
+    size_t   offset;
+    int      stream;  // Full packets go out as the tree is walked
+    int      fd;
+    uint32_t seq_num;
+} list_ctx_t;
+
+static int list_flush(list_ctx_t *ctx) {
+    packet_t list_res = { .type = PKT_LIST_SERVER_RES, .seq_num = ctx->seq_num, .payload_size = (uint32_t)ctx->offset };
+    memcpy(list_res.payload, ctx->buf, ctx->offset);
+    ctx->offset = 0;
+    return send_packet(ctx->fd, &list_res);
+}
 
-    FILE *f_to_propagate = fopen(full_file_path_on_server, "rb");
-    if (!f_to_propagate) {
-        perror("propagate_file: fopen failed");
-        return;
+static int list_entry(const char *name, const struct stat *st, void *arg) {
+    list_ctx_t *ctx = arg;
+    char line[STORAGE_NAME_MAX + 128];
+    int n = snprintf(line, sizeof(line), "%s\t%ld bytes\tmtime:%ld\tatime:%ld\tctime:%ld\n",
+                     name, (long)st->st_size,
+                     (long)st->st_mtime, (long)st->st_atime, (long)st->st_ctime);
+    if (n < 0 || (size_t)n >= sizeof(line)) return 0;
+    if (ctx->offset + (size_t)n > CHUNK_SIZE) {
+        if (!ctx->stream) { // A single packet is all an old client reads
+            LOG_WARN("Aviso: Buffer de list_server cheio. Lista pode estar truncada.\n");
+            return 1;
+        }
+        if (list_flush(ctx) != 0) return 1;
     }
+    memcpy(ctx->buf + ctx->offset, line, (size_t)n);
+    ctx->offset += (size_t)n;
+    return 0;
+}
 
-    printf("Propagando arquivo '%s' para outros dispositivos do usuário '%s'.\n", base_filename, user_session->username);
-
-    lock_sessions(); // Lock before iterating connection_fds
-    for (int i = 0; i < MAX_SESSIONS_PER_USER; i++) {
-        int other_fd = user_session->connection_fds[i];
-        if (other_fd > 0 && other_fd != originating_conn_fd) { // If connection active and not the source
-            printf("  Enviando '%s' para fd=%d\n", base_filename, other_fd);
-            
-            packet_t req_pkt = { .type = PKT_UPLOAD_REQ, .seq_num = 1 }; // Server initiates "upload" to other client
-            strncpy(req_pkt.payload, base_filename, MAX_PAYLOAD -1);
-            req_pkt.payload[MAX_PAYLOAD-1] = '\0';
-            req_pkt.payload_size = (uint32_t)strlen(base_filename) + 1;
-
-            if (send_and_wait_ack_server(other_fd, &req_pkt) == 0) {
-                rewind(f_to_propagate); // Rewind file for each client
-                uint32_t seq = 2;
-                char buf[CHUNK_SIZE];
-                size_t n_read;
-                while ((n_read = fread(buf, 1, CHUNK_SIZE, f_to_propagate)) > 0) {
-                    packet_t data_pkt = { .type = PKT_UPLOAD_DATA, .seq_num = seq++, .payload_size = (uint32_t)n_read };
-                    memcpy(data_pkt.payload, buf, n_read);
-                    if (send_and_wait_ack_server(other_fd, &data_pkt) != 0) {
-                        fprintf(stderr, "Erro ao propagar chunk de '%s' para fd=%d. Interrompendo para este fd.\n", base_filename, other_fd);
-                        break; 
-                    }
-                }
-                if (ferror(f_to_propagate)) {
-                     fprintf(stderr, "Erro de leitura ao propagar '%s' para fd=%d.\n", base_filename, other_fd);
-                } else {
-                    // Send final 0-byte packet
-                    packet_t end_pkt = { .type = PKT_UPLOAD_DATA, .seq_num = seq, .payload_size = 0 };
-                    send_packet(other_fd, &end_pkt); // Client doesn't ACK this one, just closes file
-                    printf("  Propagação de '%s' para fd=%d concluída (ou erro no envio final).\n", base_filename, other_fd);
-                }
-            } else {
-                fprintf(stderr, "Cliente fd=%d não confirmou UPLOAD_REQ para propagação de '%s'.\n", other_fd, base_filename);
+// Files under a directory that a request deletes or renames as a whole.
+typedef struct {
+    char   **names;
+    size_t   count, cap;
+} tree_files_t;
+
+static int collect_file(const char *name, const struct stat *st, void *arg) {
+    (void)st;
+    tree_files_t *t = arg;
+    if (t->count == t->cap) {
+        size_t cap = t->cap ? t->cap * 2 : 64;
+        char **grown = realloc(t->names, cap * sizeof(*grown));
+        if (!grown) return 1;
+        t->names = grown;
+        t->cap = cap;
+    }
+    return (t->names[t->count] = strdup(name)) ? (t->count++, 0) : 1;
+}
+
+static void tree_files_free(tree_files_t *t) {
+    for (size_t i = 0; i < t->count; i++) free(t->names[i]);
+    free(t->names);
+    memset(t, 0, sizeof(*t));
+}
+
+// Deletes (to == NULL) or renames to 'to' every file under the directory
+// 'dir', one by one as the single-file requests do, then removes the
+// directories left empty. 'changed' gets the names, relative to 'dir', of
+// the files changed here, for the pushes. Returns 1 if every file was
+// handled (changed, or already superseded by a newer change).
+static int apply_to_tree(const UserSession_t *session, const char *base, const char *dir, const char *to, tree_files_t *changed) {
+    char dir_path[PATH_MAX];
+    if (path_join(dir_path, sizeof(dir_path), base, dir) != 0) return 0;
+    tree_files_t files = { 0 };
+    if (storage_list_tree(dir_path, collect_file, &files) != 0) {
+        tree_files_free(&files);
+        return 0;
+    }
+    int all = 1;
+    uint32_t lsn = 0;
+    for (size_t i = 0; i < files.count; i++) {
+        char old_name[PATH_MAX], new_name[PATH_MAX], old_path[PATH_MAX], new_path[PATH_MAX];
+        if (path_join(old_name, sizeof(old_name), dir, files.names[i]) != 0 ||
+            path_join(old_path, sizeof(old_path), base, old_name) != 0) {
+            all = 0;
+            continue;
+        }
+        int rc;
+        if (to) {
+            if (path_join(new_name, sizeof(new_name), to, files.names[i]) != 0 || !storage_valid_name(new_name) ||
+                path_join(new_path, sizeof(new_path), base, new_name) != 0) {
+                all = 0;
+                continue;
             }
+            rc = storage_rename(old_path, new_path);
+        } else {
+            rc = storage_remove(old_path);
+        }
+        if (rc == 0) {
+            content_cache_invalidate(old_path);
+            if (to) content_cache_invalidate(new_path);
+            uint32_t rec = to ? repl_log_rename(session->username, old_name, new_name) : repl_log_delete(session->username, old_name);
+            if (rec == REPL_LSN_UNLOGGED) {
+                if (repl_wait_durable(rec) != 0) all = 0; // Sync mode: not confirmed
+            } else if (rec) {
+                lsn = rec;
+            }
+            collect_file(files.names[i], NULL, changed);
+        } else if (rc != STORAGE_SUPERSEDED && errno != ENOENT) { // Gone meanwhile is as good as done
+            LOG_ERROR("Falha em '%s' ao %s o diretório '%s': %s", old_name, to ? "renomear" : "remover", dir, strerror(errno));
+            all = 0;
         }
     }
-    unlock_sessions();
-    fclose(f_to_propagate);
+    tree_files_free(&files);
+    repl_wait_durable(lsn); // Records are applied in order: the last covers them all
+    storage_remove_empty_dirs(dir_path);
+    storage_prune_parents(dir_path, base);
+    return all;
 }
 
-// Helper function to propagate delete to other connected devices
-void propagate_delete_to_other_devices(UserSession_t *user_session, const char *base_filename, int originating_conn_fd) {
-    if (!user_session || !base_filename) return;
-
-    printf("Propagando deleção do arquivo '%s' para outros dispositivos do usuário '%s'.\n", base_filename, user_session->username);
-
-    lock_sessions();
-    for (int i = 0; i < MAX_SESSIONS_PER_USER; i++) {
-        int other_fd = user_session->connection_fds[i];
-        if (other_fd > 0 && other_fd != originating_conn_fd) {
-            printf("  Enviando pedido de DELETE para '%s' para fd=%d\n", base_filename, other_fd);
-            
-            packet_t del_pkt = { .type = PKT_DELETE_REQ, .seq_num = 1 };
-            strncpy(del_pkt.payload, base_filename, MAX_PAYLOAD -1);
-            del_pkt.payload[MAX_PAYLOAD-1] = '\0';
-            del_pkt.payload_size = (uint32_t)strlen(base_filename) + 1;
-
-            // Client is expected to ACK this delete request.
-            if (send_and_wait_ack_server(other_fd, &del_pkt) != 0) {
-                fprintf(stderr, "Cliente fd=%d não confirmou DELETE_REQ para '%s'.\n", other_fd, base_filename);
-            } else {
-                 printf("  Cliente fd=%d confirmou DELETE_REQ para '%s'.\n", other_fd, base_filename);
+static int is_directory(const char *path) {
+    struct stat st;
+    return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+// Receives a PKT_BATCH_UPLOAD (see common/batch.h). The files are staged as
+// they arrive and committed together, so the batch costs one shared sync;
+// each stored file is then replicated and pushed like a single upload.
+// Returns 1 if any file was stored.
+static int receive_batch(int client_conn_fd, const packet_t *pkt, UserSession_t *user_session, const char *user_storage_base_dir) {
+    staged_file_t *staged = calloc(BATCH_MAX_FILES, sizeof(*staged));
+    if (!staged) {
+        packet_t nack_resp = { .type = PKT_NACK, .seq_num = pkt->seq_num };
+        send_packet(client_conn_fd, &nack_resp);
+        return 0;
+    }
+    packet_t ack_resp = { .type = PKT_ACK, .seq_num = pkt->seq_num };
+    send_packet(client_conn_fd, &ack_resp);
+
+    batch_reader_t reader;
+    batch_reader_init(&reader, client_conn_fd);
+    char names[BATCH_MAX_FILES][STORAGE_NAME_MAX + 1];
+    int count = 0, rc;
+    char name[STORAGE_NAME_MAX + 1];
+    uint64_t size;
+    while ((rc = batch_next_file(&reader, name, sizeof(name), &size)) == 1) {
+        if (count == BATCH_MAX_FILES || size > BATCH_MAX_FILE_SIZE || !storage_valid_name(name)) {
+            LOG_ERROR("Lote de '%s' com arquivo inválido ('%s'); descartando-o.\n", user_session->username, name);
+            continue; // batch_next_file skips its contents
+        }
+        char path[PATH_MAX];
+        if (path_join(path, sizeof(path), user_storage_base_dir, name) != 0 ||
+            storage_stage_begin(&staged[count], path, size) != 0) {
+            LOG_ERROR("Falha ao preparar '%s' do lote: %s", name, strerror(errno));
+            continue;
+        }
+        char buf[MAX_PAYLOAD];
+        long n;
+        while ((n = batch_read(&reader, buf, sizeof(buf))) > 0) {
+            storage_stage_write(&staged[count], buf, (size_t)n);
+        }
+        if (n < 0) {
+            rc = -1;
+            count++;
+            break;
+        }
+        snprintf(names[count], sizeof(names[count]), "%s", name);
+        count++;
+    }
+
+    int results[BATCH_MAX_FILES];
+    int stored = 0;
+    if (rc == 0) {
+        trace_span_t commit_span = trace_begin("storage.commit", TRACE_FLOW_NONE);
+        storage_stage_commit_all(staged, count, results);
+        trace_end(&commit_span, NULL);
+        for (int i = 0; i < count; i++) stored += (results[i] == 0 || results[i] == STORAGE_SUPERSEDED);
+    } else {
+        for (int i = 0; i < count; i++) storage_stage_abort(&staged[i]);
+        // Malformed or cut short: where the client's next request starts is
+        // unknown, and a client still waiting for the reply holds its socket
+        // lock. Closing the connection fails its read; it reconnects.
+        LOG_ERROR("Lote de '%s' interrompido ou malformado; encerrando a conexão fd=%d.\n", user_session->username, client_conn_fd);
+        shutdown(client_conn_fd, SHUT_RDWR);
+    }
+
+    if (rc == 0) {
+        // In sync mode the reply means the backups hold the files too
+        uint32_t last_lsn = 0;
+        int durable = 1;
+        for (int i = 0; i < count; i++) {
+            if (results[i] != 0) continue;
+            content_cache_invalidate(staged[i].final_path);
+            uint32_t lsn = repl_log_upload(user_session->username, names[i]);
+            if (lsn == REPL_LSN_UNLOGGED) {
+                if (repl_wait_durable(lsn) != 0) durable = 0;
+            } else if (lsn) {
+                last_lsn = lsn;
             }
         }
+        repl_wait_durable(last_lsn);
+
+        packet_t reply = { .type = durable && (stored > 0 || count == 0) ? PKT_ACK : PKT_NACK, .seq_num = batch_end_seq(&reader) };
+        snprintf(reply.payload, MAX_PAYLOAD, "%d", stored);
+        reply.payload_size = (uint32_t)strlen(reply.payload) + 1;
+        send_packet(client_conn_fd, &reply);
+        LOG_DEBUG("[*] Lote de %d arquivo(s) de '%s': %d gravado(s).\n", count, user_session->username, stored);
+
+        for (int i = 0; i < count; i++) {
+            if (results[i] == 0) push_change(user_session, names[i], 0, client_conn_fd);
+        }
     }
-    unlock_sessions();
+    free(staged);
+    return stored > 0;
 }
 
-
 void handle_received_packet(int client_conn_fd, packet_t *pkt, UserSession_t *user_session, const char *user_storage_base_dir) {
+    // Everything this request sends carries the client's trace id, and so do
+    // the pushes it queues for the user's other devices
+    trace_set_current(pkt->trace_id);
+    trace_span_t req_span = trace_begin(request_span_name(pkt->type), TRACE_FLOW_STEP);
+    uint64_t op_start = metrics_now_ns();
+    int op_ok = 0;
+    // Changes are queued for the other devices after the request is accounted
+    // for; their handler threads send them (see server_push.h).
+    int propagate_upload = 0, propagate_delete = 0, propagate_rename = 0;
+    char new_name[MAX_PAYLOAD + 1] = ""; // Of a rename, right after the old name in the payload
+    int tree_op = 0; // The request named a directory: it applied to the files under it
+    tree_files_t tree_changed = { 0 };
+
     char filename_from_payload[MAX_PAYLOAD + 1];
     if (pkt->payload_size > 0 && pkt->payload_size <= MAX_PAYLOAD) {
         memcpy(filename_from_payload, pkt->payload, pkt->payload_size);
@@ -112,26 +275,76 @@ void handle_received_packet(int client_conn_fd, packet_t *pkt, UserSession_t *us
 
 
     char full_path_on_server[PATH_MAX];
-    if (filename_from_payload[0] != '\0') { // Only construct if filename is present
-        snprintf(full_path_on_server, sizeof(full_path_on_server), "%s/%s", user_storage_base_dir, filename_from_payload);
-    } else {
+    // Staging and packfile names belong to the server, and names must stay
+    // inside the user's tree; requests for anything else are refused, as are
+    // names too long to fit
+    if (!storage_valid_name(filename_from_payload) ||
+        path_join(full_path_on_server, sizeof(full_path_on_server), user_storage_base_dir, filename_from_payload) != 0) {
         full_path_on_server[0] = '\0'; // No filename, no path
     }
 
 
     switch (pkt->type) {
         case PKT_UPLOAD_REQ: {
-            printf("[*] Upload Req: '%s' from user '%s' (fd=%d)\n", filename_from_payload, user_session->username, client_conn_fd);
+            LOG_DEBUG("[*] Upload Req: '%s' from user '%s' (fd=%d)\n", filename_from_payload, user_session->username, client_conn_fd);
             if (full_path_on_server[0] == '\0') {
-                fprintf(stderr, "Erro: Nome de arquivo inválido ou ausente para PKT_UPLOAD_REQ.\n");
+                LOG_ERROR("Erro: Nome de arquivo inválido ou ausente para PKT_UPLOAD_REQ.\n");
                 packet_t nack_resp = { .type = PKT_NACK, .seq_num = pkt->seq_num, .payload_size = 0 };
                 send_packet(client_conn_fd, &nack_resp);
                 break;
             }
 
-            FILE *f_upload = fopen(full_path_on_server, "wb");
-            if (!f_upload) {
-                perror("fopen for upload failed");
+            // An optional "<size>\0" after the name is the length the client
+            // is about to send, used to preallocate the staging file, and an
+            // optional "<sha256 hex>\0" after it the digest of the contents
+            uint64_t declared_size = 0;
+            int has_digest = 0;
+            uint8_t digest[SHA256_DIGEST_LEN];
+            size_t name_len = strnlen(pkt->payload, pkt->payload_size < MAX_PAYLOAD ? pkt->payload_size : MAX_PAYLOAD);
+            if (name_len + 1 < pkt->payload_size && pkt->payload_size <= MAX_PAYLOAD) {
+                char size_str[24];
+                size_t size_len = pkt->payload_size - name_len - 1;
+                if (size_len >= sizeof(size_str)) size_len = sizeof(size_str) - 1;
+                memcpy(size_str, pkt->payload + name_len + 1, size_len);
+                size_str[size_len] = '\0';
+                declared_size = strtoull(size_str, NULL, 10);
+                size_t hex_at = name_len + 1 + strnlen(pkt->payload + name_len + 1, pkt->payload_size - name_len - 1) + 1;
+                has_digest = hex_at + SHA256_HEX_LEN <= pkt->payload_size &&
+                             sha256_from_hex(pkt->payload + hex_at, digest) == 0;
+            }
+
+            // Contents the server already holds are stored without their bytes
+            char same_path[PATH_MAX];
+            struct stat same_st;
+            if (has_digest && declared_size >= UPLOAD_HASH_MIN_SIZE &&
+                dedupe_lookup(user_storage_base_dir, digest, declared_size, same_path, sizeof(same_path), &same_st)) {
+                int clone_rc = strcmp(same_path, full_path_on_server) == 0 ? STORAGE_SUPERSEDED // Unchanged
+                             : storage_clone(same_path, &same_st, full_path_on_server, digest, declared_size);
+                if (clone_rc == 0 || clone_rc == STORAGE_SUPERSEDED) {
+                    LOG_DEBUG("[*] Upload de '%s' atendido com o conteúdo de '%s'.\n", filename_from_payload, same_path);
+                    dedupe_note_saved(declared_size);
+                    int durable = 1;
+                    if (clone_rc == 0) {
+                        content_cache_invalidate(full_path_on_server);
+                        durable = (repl_wait_durable(repl_log_upload(user_session->username, filename_from_payload)) == 0);
+                    }
+                    packet_t dedupe_ack = { .type = PKT_NACK, .seq_num = pkt->seq_num, .payload_size = 0 };
+                    if (durable) {
+                        dedupe_ack.type = PKT_ACK;
+                        dedupe_ack.payload_size = sizeof(UPLOAD_DEDUPE_REPLY);
+                        memcpy(dedupe_ack.payload, UPLOAD_DEDUPE_REPLY, sizeof(UPLOAD_DEDUPE_REPLY));
+                    }
+                    send_packet(client_conn_fd, &dedupe_ack);
+                    op_ok = durable;
+                    propagate_upload = (clone_rc == 0);
+                    break;
+                }
+                LOG_WARN("Falha ao reaproveitar '%s' para '%s' (%s); recebendo o conteúdo.", same_path, filename_from_payload, strerror(errno));
+            }
+
+            staged_file_t staged;
+            if (storage_stage_begin(&staged, full_path_on_server, declared_size) != 0) {
+                LOG_ERROR("Falha ao preparar upload de '%s': %s", filename_from_payload, strerror(errno));
                 packet_t nack_resp = { .type = PKT_NACK, .seq_num = pkt->seq_num, .payload_size = 0 };
                 send_packet(client_conn_fd, &nack_resp);
                 break;
@@ -140,41 +353,56 @@ void handle_received_packet(int client_conn_fd, packet_t *pkt, UserSession_t *us
             packet_t ack_resp = { .type = PKT_ACK, .seq_num = pkt->seq_num, .payload_size = 0 };
             send_packet(client_conn_fd, &ack_resp); // ACK the UPLOAD_REQ
 
+            // Chunks are ACKed as they arrive; the 0-byte end packet is not
+            int complete = 0;
             packet_t data_pkt;
             while (recv_packet(client_conn_fd, &data_pkt) == 0 && data_pkt.type == PKT_UPLOAD_DATA) {
                 if (data_pkt.payload_size == 0) { // End of transfer from this client
-                    packet_t final_ack = { .type = PKT_ACK, .seq_num = data_pkt.seq_num, .payload_size = 0 };
-                    // Original client doesn't wait for this ACK based on its logic, but sending it is fine.
-                    // Or, per client logic, no ACK for 0-byte packet.
-                    // However, the client's send_and_wait_ack_client IS used for data chunks,
-                    // so the server MUST ACK data chunks. The 0-byte end packet is sent without send_and_wait_ack.
-                    // The loop condition `pkt.payload_size > 0` in original server.c meant it didn't ACK the 0-byte one.
-                    // Let's stick to server not ACKing the 0-byte one as it exits loop.
+                    complete = 1;
                     break; 
                 }
-                fwrite(data_pkt.payload, 1, data_pkt.payload_size, f_upload);
+                trace_span_t write_span = trace_begin("storage.write", TRACE_FLOW_NONE);
+                storage_stage_write(&staged, data_pkt.payload, data_pkt.payload_size);
+                trace_end(&write_span, NULL);
                 packet_t chunk_ack = { .type = PKT_ACK, .seq_num = data_pkt.seq_num, .payload_size = 0 };
                 send_packet(client_conn_fd, &chunk_ack);
             }
-            fclose(f_upload);
-            printf("[*] Upload completed for: '%s'\n", filename_from_payload);
+            // Only a complete upload replaces the stored file
+            int commit_rc = -1;
+            if (complete) {
+                trace_span_t commit_span = trace_begin("storage.commit", TRACE_FLOW_NONE);
+                commit_rc = storage_stage_commit(&staged);
+                trace_end(&commit_span, filename_from_payload);
+            } else {
+                storage_stage_abort(&staged);
+            }
+            // A superseded upload succeeded as far as the client is concerned;
+            // the newer change already replicates and propagates itself
+            op_ok = (commit_rc == 0 || commit_rc == STORAGE_SUPERSEDED);
+            if (commit_rc == 0) content_cache_invalidate(full_path_on_server); // Frees the old version's entry right away
+            LOG_DEBUG("[*] Upload completed for: '%s'\n", filename_from_payload);
+            // The end packet gets no reply, so an unreplicated upload can only
+            // count as failed
+            if (commit_rc == 0 && repl_wait_durable(repl_log_upload(user_session->username, filename_from_payload)) != 0) {
+                op_ok = 0;
+            }
 
-            // Propagate to other devices
-            propagate_file_to_other_devices(user_session, filename_from_payload, full_path_on_server, client_conn_fd);
+            // Propagate to other devices (after the switch)
+            propagate_upload = (commit_rc == 0);
             break;
         }
         case PKT_DOWNLOAD_REQ: {
-            printf("[*] Download Req: '%s' for user '%s' (fd=%d)\n", filename_from_payload, user_session->username, client_conn_fd);
+            LOG_DEBUG("[*] Download Req: '%s' for user '%s' (fd=%d)\n", filename_from_payload, user_session->username, client_conn_fd);
              if (full_path_on_server[0] == '\0') {
-                fprintf(stderr, "Erro: Nome de arquivo inválido ou ausente para PKT_DOWNLOAD_REQ.\n");
+                LOG_ERROR("Erro: Nome de arquivo inválido ou ausente para PKT_DOWNLOAD_REQ.\n");
                 packet_t nack_resp = { .type = PKT_NACK, .seq_num = pkt->seq_num, .payload_size = 0 };
                 send_packet(client_conn_fd, &nack_resp);
                 break;
             }
 
-            FILE *f_download = fopen(full_path_on_server, "rb");
-            if (!f_download) {
-                perror("fopen for download failed");
+            content_reader_t f_download;
+            if (content_open(&f_download, full_path_on_server) != 0) {
+                LOG_ERROR("fopen for download failed: %s", strerror(errno));
                 packet_t nack_resp = { .type = PKT_NACK, .seq_num = pkt->seq_num, .payload_size = 0 };
                 // snprintf(nack_resp.payload, MAX_PAYLOAD, "File not found or access denied.");
                 // nack_resp.payload_size = strlen(nack_resp.payload) + 1;
@@ -186,38 +414,37 @@ void handle_received_packet(int client_conn_fd, packet_t *pkt, UserSession_t *us
             send_packet(client_conn_fd, &ack_resp); // ACK the DOWNLOAD_REQ
 
             uint32_t seq = 1; // Sequence for data packets
-            char buf[CHUNK_SIZE];
             size_t n_read;
             packet_t file_data_pkt;
 
-            while ((n_read = fread(buf, 1, CHUNK_SIZE, f_download)) > 0) {
+            while ((n_read = content_read(&f_download, file_data_pkt.payload, CHUNK_SIZE)) > 0) {
                 file_data_pkt.type = PKT_DOWNLOAD_DATA;
                 file_data_pkt.seq_num = seq++;
                 file_data_pkt.payload_size = (uint32_t)n_read;
-                memcpy(file_data_pkt.payload, buf, n_read);
                 if (send_and_wait_ack_server(client_conn_fd, &file_data_pkt) != 0) {
-                    fprintf(stderr, "Erro: Cliente não confirmou recebimento de chunk para '%s'.\n", filename_from_payload);
+                    LOG_ERROR("Erro: Cliente não confirmou recebimento de chunk para '%s'.\n", filename_from_payload);
                     break; // Stop sending if client doesn't ACK
                 }
             }
-            fclose(f_download);
+            int read_error = content_error(&f_download);
+            content_close(&f_download);
 
-            if (ferror(f_download)){
-                 fprintf(stderr, "Erro de leitura durante download de '%s'.\n", filename_from_payload);
+            if (read_error) {
+                 LOG_ERROR("Erro de leitura durante download de '%s'.\n", filename_from_payload);
             } else {
                  // Send final 0-byte packet to indicate end of transfer
                 file_data_pkt.type = PKT_DOWNLOAD_DATA;
                 file_data_pkt.seq_num = seq;
                 file_data_pkt.payload_size = 0;
-                send_packet(client_conn_fd, &file_data_pkt); // Client expects this, doesn't ACK it
-                printf("[*] Download data sent for: '%s'\n", filename_from_payload);
+                op_ok = (send_packet(client_conn_fd, &file_data_pkt) == 0); // Client expects this, doesn't ACK it
+                LOG_DEBUG("[*] Download data sent for: '%s'\n", filename_from_payload);
             }
             break;
         }
         case PKT_DELETE_REQ: {
-            printf("[*] Delete Req: '%s' for user '%s' (fd=%d)\n", filename_from_payload, user_session->username, client_conn_fd);
+            LOG_DEBUG("[*] Delete Req: '%s' for user '%s' (fd=%d)\n", filename_from_payload, user_session->username, client_conn_fd);
             if (full_path_on_server[0] == '\0') {
-                fprintf(stderr, "Erro: Nome de arquivo inválido ou ausente para PKT_DELETE_REQ.\n");
+                LOG_ERROR("Erro: Nome de arquivo inválido ou ausente para PKT_DELETE_REQ.\n");
                 packet_t nack_resp = { .type = PKT_NACK, .seq_num = pkt->seq_num, .payload_size = 0 };
                 send_packet(client_conn_fd, &nack_resp); // Envia NACK para o cliente que requisitou
                 break;
@@ -227,81 +454,159 @@ void handle_received_packet(int client_conn_fd, packet_t *pkt, UserSession_t *us
             resp_pkt_to_originating_client.seq_num = pkt->seq_num;
             resp_pkt_to_originating_client.payload_size = 0;
 
-            if (remove(full_path_on_server) == 0) {
-                printf("Arquivo '%s' removido do servidor.\n", full_path_on_server);
+            if (is_directory(full_path_on_server)) {
+                // A directory goes with every file under it
+                trace_span_t remove_span = trace_begin("storage.remove", TRACE_FLOW_NONE);
+                op_ok = apply_to_tree(user_session, user_storage_base_dir, filename_from_payload, NULL, &tree_changed);
+                trace_end(&remove_span, filename_from_payload);
+                resp_pkt_to_originating_client.type = op_ok ? PKT_ACK : PKT_NACK;
+                send_packet(client_conn_fd, &resp_pkt_to_originating_client);
+                propagate_delete = 1;
+                tree_op = 1;
+                break;
+            }
+            trace_span_t remove_span = trace_begin("storage.remove", TRACE_FLOW_NONE);
+            int remove_rc = storage_remove(full_path_on_server);
+            trace_end(&remove_span, filename_from_payload);
+            if (remove_rc == STORAGE_SUPERSEDED) {
+                // An upload that started later already replaced the file
+                LOG_DEBUG("Deleção de '%s' superada por um upload mais recente.\n", full_path_on_server);
                 resp_pkt_to_originating_client.type = PKT_ACK;
+                send_packet(client_conn_fd, &resp_pkt_to_originating_client);
+                op_ok = 1;
+            } else if (remove_rc == 0) {
+                content_cache_invalidate(full_path_on_server);
+                storage_prune_parents(full_path_on_server, user_storage_base_dir); // Directories only exist through files
+                LOG_DEBUG("Arquivo '%s' removido do servidor.\n", full_path_on_server);
+                // In sync mode the ACK means the backups dropped the file too
+                int durable = (repl_wait_durable(repl_log_delete(user_session->username, filename_from_payload)) == 0);
+                resp_pkt_to_originating_client.type = durable ? PKT_ACK : PKT_NACK;
                 
                 // Envia o ACK para o cliente solicitante ANTES de propagar
                 send_packet(client_conn_fd, &resp_pkt_to_originating_client);
-                printf("[*] ACK enviado para fd=%d para PKT_DELETE_REQ de '%s'.\n", client_conn_fd, filename_from_payload);
+                LOG_DEBUG("[*] ACK enviado para fd=%d para PKT_DELETE_REQ de '%s'.\n", client_conn_fd, filename_from_payload);
 
-                // Agora, tenta propagar a deleção para outros dispositivos.
+                // Agora, tenta propagar a deleção para outros dispositivos (após o switch).
                 // A falha aqui não afetará a resposta já enviada ao cliente original.
-                propagate_delete_to_other_devices(user_session, filename_from_payload, client_conn_fd);
+                op_ok = durable;
+                propagate_delete = 1;
 
             } else {
-                perror("remove failed on server for PKT_DELETE_REQ");
+                LOG_ERROR("remove failed on server for PKT_DELETE_REQ: %s", strerror(errno));
                 resp_pkt_to_originating_client.type = PKT_NACK;
                 // Envia o NACK para o cliente solicitante
                 send_packet(client_conn_fd, &resp_pkt_to_originating_client);
-                printf("[*] NACK enviado para fd=%d para PKT_DELETE_REQ de '%s'.\n", client_conn_fd, filename_from_payload);
+                LOG_DEBUG("[*] NACK enviado para fd=%d para PKT_DELETE_REQ de '%s'.\n", client_conn_fd, filename_from_payload);
             }
             // Não há mais send_packet aqui, já foi feito acima.
             break;
         }        
         case PKT_LIST_SERVER_REQ: {
-            printf("[*] List Server Req from user '%s' (fd=%d)\n", user_session->username, client_conn_fd);
-            DIR *d = opendir(user_storage_base_dir);
-            if (!d) {
-                perror("opendir for list_server failed");
+            LOG_DEBUG("[*] List Server Req from user '%s' (fd=%d)\n", user_session->username, client_conn_fd);
+            // Clients that ask for a stream get the whole tree over as many
+            // packets as it takes, ended by an empty one; older clients read
+            // a single packet
+            list_ctx_t list = { .offset = 0, .fd = client_conn_fd, .seq_num = pkt->seq_num,
+                                .stream = strcmp(filename_from_payload, LIST_STREAM_REQUEST) == 0 };
+            if (storage_list_tree(user_storage_base_dir, list_entry, &list) < 0) {
+                LOG_ERROR("opendir for list_server failed: %s", strerror(errno));
                 packet_t nack_res = { .type = PKT_NACK, .seq_num = pkt->seq_num, .payload_size = 0 };
                 send_packet(client_conn_fd, &nack_res);
                 break;
             }
-
-            char list_buf[CHUNK_SIZE]; // Can be larger if needed, or send in multiple packets
-            size_t offset = 0;
-            struct dirent *entry;
-            struct stat st;
-
-            while ((entry = readdir(d)) != NULL) {
-                if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-                    continue;
-                }
-                char entry_full_path[PATH_MAX];
-                snprintf(entry_full_path, sizeof(entry_full_path), "%s/%s", user_storage_base_dir, entry->d_name);
-                if (stat(entry_full_path, &st) < 0) {
-                    perror("stat for list_server entry failed");
-                    continue;
-                }
-                // Append entry info to list_buf
-                offset += snprintf(list_buf + offset, CHUNK_SIZE - offset,
-                                   "%s\t%ld bytes\tmtime:%ld\tatime:%ld\tctime:%ld\n",
-                                   entry->d_name, (long)st.st_size,
-                                   (long)st.st_mtime, (long)st.st_atime, (long)st.st_ctime);
-                if (offset >= CHUNK_SIZE - 200) { // Heuristic: leave some space for one more small entry + null
-                    // Buffer full, send what we have or implement multi-packet response
-                    fprintf(stderr, "Aviso: Buffer de list_server cheio. Lista pode estar truncada.\n");
-                    break;
-                }
-            }
-            closedir(d);
-
-            packet_t list_res = { .type = PKT_LIST_SERVER_RES, .seq_num = pkt->seq_num, .payload_size = (uint32_t)offset };
-            if (offset > 0) {
-                memcpy(list_res.payload, list_buf, offset);
-            }
-            send_packet(client_conn_fd, &list_res);
-            printf("[*] List Server Res sent (size %u).\n", offset);
+            size_t offset = list.offset;
+            op_ok = (list_flush(&list) == 0);
+            if (op_ok && list.stream && offset > 0) op_ok = (list_flush(&list) == 0);
+            LOG_DEBUG("[*] List Server Res sent (size %zu).\n", offset);
             break;
         }
+        case PKT_ACK: // Clients ACK the end packet of a push; nothing waits for it
+            LOG_DEBUG("[*] ACK tardio (seq %u) de fd=%d ignorado.\n", pkt->seq_num, client_conn_fd);
+            break;
         case PKT_SYNC_EVENT: // This packet type is defined but not used with specific logic
-            printf("[*] PKT_SYNC_EVENT recebido de fd=%d, ignorando.\n", client_conn_fd);
+            LOG_DEBUG("[*] PKT_SYNC_EVENT recebido de fd=%d, ignorando.\n", client_conn_fd);
             // No action needed as per original code. Could be used for heartbeats or explicit sync triggers.
             break;
+        case PKT_BATCH_UPLOAD:
+            op_ok = receive_batch(client_conn_fd, pkt, user_session, user_storage_base_dir);
+            break;
+        case PKT_RENAME_REQ: {
+            size_t old_len = strnlen(pkt->payload, pkt->payload_size <= MAX_PAYLOAD ? pkt->payload_size : 0);
+            if (old_len + 1 < pkt->payload_size && pkt->payload_size <= MAX_PAYLOAD) {
+                size_t new_len = strnlen(pkt->payload + old_len + 1, pkt->payload_size - old_len - 1);
+                memcpy(new_name, pkt->payload + old_len + 1, new_len);
+                new_name[new_len] = '\0';
+            }
+            LOG_DEBUG("[*] Rename Req: '%s' -> '%s' for user '%s' (fd=%d)\n", filename_from_payload, new_name, user_session->username, client_conn_fd);
+            packet_t resp = { .type = PKT_NACK, .seq_num = pkt->seq_num, .payload_size = 0 };
+            size_t old_name_len = strlen(filename_from_payload);
+            char new_path[PATH_MAX];
+            if (full_path_on_server[0] == '\0' || !storage_valid_name(new_name) ||
+                (strncmp(new_name, filename_from_payload, old_name_len) == 0 && new_name[old_name_len] == '/') ||
+                path_join(new_path, sizeof(new_path), user_storage_base_dir, new_name) != 0) {
+                LOG_ERROR("Erro: Nomes inválidos ou ausentes para PKT_RENAME_REQ.\n");
+                send_packet(client_conn_fd, &resp);
+                break;
+            }
+            if (is_directory(full_path_on_server)) {
+                // Every file under the directory moves under the new name
+                op_ok = apply_to_tree(user_session, user_storage_base_dir, filename_from_payload, new_name, &tree_changed);
+                resp.type = op_ok ? PKT_ACK : PKT_NACK;
+                send_packet(client_conn_fd, &resp);
+                propagate_rename = 1;
+                tree_op = 1;
+                break;
+            }
+
+            int rename_rc = strcmp(filename_from_payload, new_name) == 0 ? STORAGE_SUPERSEDED
+                                                                          : storage_rename(full_path_on_server, new_path);
+            if (rename_rc == 0) {
+                content_cache_invalidate(full_path_on_server);
+                content_cache_invalidate(new_path);
+                storage_prune_parents(full_path_on_server, user_storage_base_dir);
+                LOG_DEBUG("Arquivo '%s' renomeado para '%s' no servidor.\n", filename_from_payload, new_name);
+                int durable = (repl_wait_durable(repl_log_rename(user_session->username, filename_from_payload, new_name)) == 0);
+                resp.type = durable ? PKT_ACK : PKT_NACK;
+                propagate_rename = 1;
+            } else if (rename_rc == STORAGE_SUPERSEDED || (errno == ENOENT && storage_exists(new_path))) {
+                // A newer change won, or this device is echoing a rename it
+                // was pushed: the server already holds the result
+                resp.type = PKT_ACK;
+            } else {
+                // The client falls back to uploading the file under its new name
+                LOG_DEBUG("Renomeação de '%s' recusada: %s\n", filename_from_payload, strerror(errno));
+            }
+            op_ok = (resp.type == PKT_ACK);
+            send_packet(client_conn_fd, &resp);
+            break;
+        }
         default:
-            fprintf(stderr, "Tipo de pacote desconhecido (%d) recebido de fd=%d.\n", pkt->type, client_conn_fd);
+            LOG_ERROR("Tipo de pacote desconhecido (%d) recebido de fd=%d.\n", pkt->type, client_conn_fd);
             // Optionally send a NACK or error response
             break;
     }
+
+    metrics_observe_request(pkt->type, metrics_now_ns() - op_start, op_ok);
+    trace_end(&req_span, filename_from_payload);
+
+    if (tree_op) {
+        // Per file, as the other devices may hold any subset of the tree
+        for (size_t i = 0; i < tree_changed.count; i++) {
+            // apply_to_tree changed only names that fit, so these do too
+            char old_name[PATH_MAX], to_name[PATH_MAX];
+            if (path_join(old_name, sizeof(old_name), filename_from_payload, tree_changed.names[i]) != 0) continue;
+            if (propagate_rename) {
+                if (path_join(to_name, sizeof(to_name), new_name, tree_changed.names[i]) != 0) continue;
+                push_rename(user_session, old_name, to_name, client_conn_fd);
+            } else {
+                push_change(user_session, old_name, 1, client_conn_fd);
+            }
+        }
+        tree_files_free(&tree_changed);
+    } else if (propagate_upload || propagate_delete) {
+        push_change(user_session, filename_from_payload, propagate_delete, client_conn_fd);
+    } else if (propagate_rename) {
+        push_rename(user_session, filename_from_payload, new_name, client_conn_fd);
+    }
+    trace_set_current(0);
 }
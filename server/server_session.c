@@ -1,7 +1,12 @@
 #include "server_session.h"
+#include "server_metrics.h"
+#include "../common/log.h"
+#include "../common/trace.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
 
 static UserSession_t *sessions_head = NULL;
 static pthread_mutex_t sessions_mutex;
@@ -11,7 +16,18 @@ void init_session_management(void) {
 }
 
 void lock_sessions(void) {
+    if (pthread_mutex_trylock(&sessions_mutex) == 0) {
+        metrics_observe_sessions_lock_wait(0);
+        return;
+    }
+    // Contended: record how long we wait so lock pressure shows up in the metrics
+    trace_span_t wait_span = trace_begin("sessions_lock_wait", TRACE_FLOW_NONE);
+    uint64_t wait_start = metrics_now_ns();
+    metrics_gauge_add(METRIC_GAUGE_SESSIONS_LOCK_WAITERS, 1);
     pthread_mutex_lock(&sessions_mutex);
+    metrics_gauge_add(METRIC_GAUGE_SESSIONS_LOCK_WAITERS, -1);
+    metrics_observe_sessions_lock_wait(metrics_now_ns() - wait_start);
+    trace_end(&wait_span, NULL);
 }
 
 void unlock_sessions(void) {
@@ -25,6 +41,11 @@ UserSession_t* find_session_by_username_locked(const char* username) {
     return NULL;
 }
 
+void for_each_session_locked(void (*fn)(const UserSession_t *session, void *ctx), void *ctx) {
+    for (UserSession_t *u = sessions_head; u; u = u->next) {
+        fn(u, ctx);
+    }
+}
 
 UserSession_t *get_or_create_user_session_locked(const char *username) {
     UserSession_t *session = find_session_by_username_locked(username);
@@ -35,7 +56,7 @@ UserSession_t *get_or_create_user_session_locked(const char *username) {
     // Create new session
     session = (UserSession_t*) calloc(1, sizeof(UserSession_t));
     if (!session) {
-        perror("calloc for UserSession_t failed");
+        LOG_ERROR("calloc for UserSession_t failed: %s", strerror(errno));
         return NULL; // Critical error
     }
     strncpy(session->username, username, MAX_USER_LEN - 1);
@@ -49,7 +70,7 @@ UserSession_t *get_or_create_user_session_locked(const char *username) {
     return session;
 }
 
-int add_connection_to_session_locked(UserSession_t *session, int conn_fd) {
+int add_connection_to_session_locked(UserSession_t *session, int conn_fd, struct push_queue *queue) {
     if (!session) return -1;
 
     if (session->active_connections_count >= MAX_SESSIONS_PER_USER) {
@@ -59,6 +80,7 @@ int add_connection_to_session_locked(UserSession_t *session, int conn_fd) {
     for (int i = 0; i < MAX_SESSIONS_PER_USER; i++) {
         if (session->connection_fds[i] == 0) { // Find an empty slot
             session->connection_fds[i] = conn_fd;
+            session->push_queues[i] = queue;
             session->active_connections_count++;
             return 0; // Success
         }
@@ -66,12 +88,26 @@ int add_connection_to_session_locked(UserSession_t *session, int conn_fd) {
     return -1; // Should not happen if count is correct, but as a safeguard
 }
 
+int disconnect_user_locked(const char *username) {
+    UserSession_t *session = find_session_by_username_locked(username);
+    if (!session) return 0;
+    int count = 0;
+    for (int i = 0; i < MAX_SESSIONS_PER_USER; i++) {
+        if (session->connection_fds[i] > 0) {
+            shutdown(session->connection_fds[i], SHUT_RDWR);
+            count++;
+        }
+    }
+    return count;
+}
+
 void remove_connection_from_session_locked(UserSession_t *session, int conn_fd) {
     if (!session) return;
 
     for (int i = 0; i < MAX_SESSIONS_PER_USER; i++) {
         if (session->connection_fds[i] == conn_fd) {
             session->connection_fds[i] = 0; // Mark slot as free
+            session->push_queues[i] = NULL;
             session->active_connections_count--;
             break;
         }
@@ -7,10 +7,13 @@
 #define MAX_USER_LEN  MAX_PAYLOAD // Or a smaller reasonable value like 256
 #define MAX_SESSIONS_PER_USER 2   // Specified in problem statement
 
+struct push_queue;
+
 typedef struct UserSession {
     char username[MAX_USER_LEN];
     int  active_connections_count;
     int  connection_fds[MAX_SESSIONS_PER_USER];
+    struct push_queue *push_queues[MAX_SESSIONS_PER_USER]; // Pushes pending for each connection (server_push.h)
     struct UserSession *next;
 } UserSession_t;
 
@@ -21,10 +24,10 @@ void init_session_management(void);
 // Locks mutex. Caller must unlock.
 UserSession_t *get_or_create_user_session_locked(const char *username);
 
-// Adds a connection to a user's session.
+// Adds a connection, with the queue its pushes go through, to a user's session.
 // Assumes session_mutex is already locked.
 // Returns 0 on success, -1 if session is full.
-int add_connection_to_session_locked(UserSession_t *session, int conn_fd);
+int add_connection_to_session_locked(UserSession_t *session, int conn_fd, struct push_queue *queue);
 
 // Removes a connection from a user's session.
 // Assumes session_mutex is already locked.
@@ -37,5 +40,13 @@ void unlock_sessions(void);
 // Helper to find a session by username (does not lock/unlock itself)
 UserSession_t* find_session_by_username_locked(const char* username);
 
+// Shuts down every connection of 'username' (its handler threads then clean
+// up as for a lost client). Assumes session_mutex is already locked.
+// Returns the number of connections shut down.
+int disconnect_user_locked(const char *username);
+
+// Calls fn for every known session. Assumes session_mutex is already locked.
+void for_each_session_locked(void (*fn)(const UserSession_t *session, void *ctx), void *ctx);
+
 
 #endif // SERVER_SESSION_H
@@ -0,0 +1,949 @@
+#define _GNU_SOURCE // fallocate, syncfs
+#include "server_storage.h"
+#include "server_pack.h"
+#include "server_zfile.h"
+#include "server_dedupe.h"
+#include "server_utils.h"
+#include "../common/log.h"
+#include "../common/trace.h"
+#include "../common/packet.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h> // FICLONE
+
+static storage_sync_t sync_policy = STORAGE_SYNC_NONE;
+
+// Group commit: a ticket is taken after the caller's writes are done; a
+// sync that starts after ticket N was taken covers every ticket up to N.
+static pthread_mutex_t group_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  group_cond = PTHREAD_COND_INITIALIZER;
+static uint64_t        group_requested = 0;
+static uint64_t        group_completed = 0;
+static int             group_running = 0;
+static uint64_t        group_failures = 0; // Syncs that returned an error
+
+static _Atomic uint64_t commits_total, fsyncs_total, syncfs_total, superseded_total, renames_total;
+static _Atomic uint64_t clones_reflink_total, clones_hardlink_total;
+
+void storage_set_sync_policy(storage_sync_t policy) {
+    sync_policy = policy;
+}
+
+int storage_parse_sync_policy(const char *s, storage_sync_t *policy) {
+    if (strcmp(s, "none") == 0) *policy = STORAGE_SYNC_NONE;
+    else if (strcmp(s, "file") == 0) *policy = STORAGE_SYNC_FILE;
+    else if (strcmp(s, "group") == 0) *policy = STORAGE_SYNC_GROUP;
+    else return -1;
+    return 0;
+}
+
+int storage_is_staging_name(const char *name) {
+    return strncmp(name, STORAGE_STAGING_PREFIX, strlen(STORAGE_STAGING_PREFIX)) == 0;
+}
+
+int storage_is_shard_name(const char *name) {
+    return strncmp(name, STORAGE_SHARD_PREFIX, strlen(STORAGE_SHARD_PREFIX)) == 0;
+}
+
+int storage_is_internal_name(const char *name) {
+    return storage_is_staging_name(name) || storage_is_shard_name(name) || pack_is_internal_name(name);
+}
+
+// FNV-1a of the file's own name: a directory's files spread evenly over its
+// shards, and a file keeps its shard when it moves to another directory.
+static unsigned shard_of(const char *name) {
+    uint32_t h = 2166136261u;
+    while (*name) h = (h ^ (unsigned char)*name++) * 16777619u;
+    return h % STORAGE_SHARD_COUNT;
+}
+
+int storage_locate(const char *path, char *out, size_t len) {
+    const char *slash = strrchr(path, '/');
+    const char *name = slash ? slash + 1 : path;
+    int n = snprintf(out, len, "%.*s%s" STORAGE_SHARD_PREFIX "%02x/%s", slash ? (int)(slash - path) : 0, path,
+                     slash ? "/" : "", shard_of(name), name);
+    if (n < 0 || (size_t)n >= len) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    return 0;
+}
+
+int storage_valid_name(const char *name) {
+    size_t len = strlen(name);
+    if (len == 0 || len > STORAGE_NAME_MAX) return 0;
+    char component[NAME_MAX + 1];
+    for (const char *p = name; ; ) {
+        const char *slash = strchr(p, '/');
+        size_t n = slash ? (size_t)(slash - p) : strlen(p);
+        if (n == 0 || n > NAME_MAX) return 0;
+        memcpy(component, p, n);
+        component[n] = '\0';
+        if (strcmp(component, ".") == 0 || strcmp(component, "..") == 0 || storage_is_internal_name(component)) return 0;
+        if (!slash) return 1;
+        p = slash + 1;
+    }
+}
+
+static int fsync_counted(int fd) {
+    trace_span_t sync_span = trace_begin("storage.fsync", TRACE_FLOW_NONE);
+    int rc = fsync(fd);
+    trace_end(&sync_span, NULL);
+    atomic_fetch_add_explicit(&fsyncs_total, 1, memory_order_relaxed);
+    return rc;
+}
+
+static int pack_sync_counted(const char *dir) {
+    trace_span_t sync_span = trace_begin("storage.fsync", TRACE_FLOW_NONE);
+    int rc = pack_sync(dir);
+    trace_end(&sync_span, NULL);
+    atomic_fetch_add_explicit(&fsyncs_total, 1, memory_order_relaxed);
+    return rc;
+}
+
+// Waits until a syncfs() of fd's filesystem that started after this call
+// has completed. Returns 1 if it succeeded and covered the caller's writes,
+// 0 if any sync failed meanwhile: the caller then fsyncs its files on its
+// own instead of guessing whether the failure was the one covering them.
+static int group_sync(int fd) {
+    pthread_mutex_lock(&group_mutex);
+    uint64_t ticket = ++group_requested;
+    uint64_t failures_before = group_failures;
+    while (group_completed < ticket) {
+        if (group_running) {
+            pthread_cond_wait(&group_cond, &group_mutex);
+            continue;
+        }
+        group_running = 1;
+        uint64_t covers = group_requested;
+        pthread_mutex_unlock(&group_mutex);
+
+        trace_span_t sync_span = trace_begin("storage.syncfs", TRACE_FLOW_NONE);
+        int err = (syncfs(fd) == 0) ? 0 : errno;
+        trace_end(&sync_span, NULL);
+        atomic_fetch_add_explicit(&syncfs_total, 1, memory_order_relaxed);
+
+        pthread_mutex_lock(&group_mutex);
+        group_completed = covers;
+        if (err != 0) {
+            group_failures++;
+            LOG_ERROR("syncfs falhou: %s", strerror(err));
+        }
+        group_running = 0;
+        pthread_cond_broadcast(&group_cond);
+    }
+    int covered = (group_failures == failures_before);
+    pthread_mutex_unlock(&group_mutex);
+    return covered;
+}
+
+// Writes "<dir of path>" to 'dir'.
+static void parent_dir(const char *path, char *dir, size_t len) {
+    const char *slash = strrchr(path, '/');
+    if (!slash) {
+        snprintf(dir, len, ".");
+    } else {
+        snprintf(dir, len, "%.*s", (int)(slash - path), path);
+    }
+}
+
+// Creates the directory 'path' lives in. Returns 0 or -1 (errno set).
+static int mkdir_parent(const char *path) {
+    char dir[PATH_MAX];
+    parent_dir(path, dir, sizeof(dir));
+    return mkdir_p(dir, 0755);
+}
+
+// Length of the root of the user's tree 'path' is in ("<base>/<user>/sync_dir",
+// see user_sync_dir), or 0 if it is in none.
+static size_t tree_root_len(const char *path) {
+    const char *base = storage_base_dir();
+    size_t n = strlen(base);
+    if (strncmp(path, base, n) != 0 || path[n] != '/') return 0;
+    const char *user_end = strchr(path + n + 1, '/');
+    if (!user_end || strncmp(user_end, "/sync_dir/", 10) != 0) return 0;
+    return (size_t)(user_end + 9 - path);
+}
+
+// Creates the directories leading to 'disk_path', a stored file's place in
+// its shard. Since a file and a directory of the same name no longer meet
+// in one directory, each level is created under the write lock of its name
+// and refused (ENOTDIR) while a file is stored under that name; a file is
+// only committed under its lock with no directory of its name (see
+// dir_in_the_way), so the two never coexist. Returns 0 or -1 (errno set).
+static int make_tree_dirs(const char *disk_path) {
+    size_t root = tree_root_len(disk_path);
+    if (root == 0) return mkdir_parent(disk_path);
+    char dir[PATH_MAX];
+    memcpy(dir, disk_path, root);
+    dir[root] = '\0';
+    if (mkdir_p(dir, 0755) != 0) return -1;
+    snprintf(dir, sizeof(dir), "%s", disk_path); // storage_locate made it fit
+    for (char *slash = strchr(dir + root + 1, '/'); slash; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        file_lock_t *lock = file_lock_write(dir);
+        int rc = 0;
+        if (storage_exists(dir)) {
+            errno = ENOTDIR;
+            rc = -1;
+        } else if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+            rc = -1;
+        }
+        file_unlock(lock);
+        *slash = '/';
+        if (rc != 0) return -1;
+    }
+    return 0;
+}
+
+// Call with the write lock on the stored file 'path' held, before putting a
+// file there. Returns 1 (errno EISDIR) if a directory with files under it
+// has its name; one left with none is removed.
+static int dir_in_the_way(const char *path) {
+    struct stat st;
+    if (lstat(path, &st) != 0 || !S_ISDIR(st.st_mode)) return 0;
+    storage_remove_empty_dirs(path);
+    if (lstat(path, &st) != 0) return 0;
+    errno = EISDIR;
+    return 1;
+}
+
+static int same_parent(const char *a, const char *b) {
+    const char *sa = strrchr(a, '/'), *sb = strrchr(b, '/');
+    size_t la = sa ? (size_t)(sa - a) : 0, lb = sb ? (size_t)(sb - b) : 0;
+    return la == lb && strncmp(a, b, la) == 0;
+}
+
+int storage_stage_begin(staged_file_t *sf, const char *final_path, uint64_t declared_size) {
+    memset(sf, 0, sizeof(*sf));
+    sf->fd = -1;
+    char dir[PATH_MAX];
+    snprintf(sf->final_path, sizeof(sf->final_path), "%s", final_path);
+    if (storage_locate(final_path, sf->disk_path, sizeof(sf->disk_path)) != 0) return -1;
+    parent_dir(sf->disk_path, dir, sizeof(dir));
+    int stage_len = snprintf(sf->stage_path, sizeof(sf->stage_path), "%s/" STORAGE_STAGING_PREFIX "XXXXXX", dir);
+    if (stage_len < 0 || (size_t)stage_len >= sizeof(sf->stage_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    trace_span_t open_span = trace_begin("storage.stage_open", TRACE_FLOW_NONE);
+    sf->fd = mkostemp(sf->stage_path, O_CLOEXEC);
+    // First file of a new directory or shard. The staging file keeps the
+    // directories from being pruned; one pruned before it was created is
+    // created again
+    for (int tries = 0; sf->fd < 0 && errno == ENOENT && tries < 3 && make_tree_dirs(sf->disk_path) == 0; tries++) {
+        memcpy(sf->stage_path + stage_len - 6, "XXXXXX", 6); // The template again
+        sf->fd = mkostemp(sf->stage_path, O_CLOEXEC);
+    }
+    trace_end(&open_span, NULL);
+    if (sf->fd < 0) return -1;
+    fchmod(sf->fd, 0644); // mkstemp creates 0600; keep what fopen() used to give
+    file_stamp_begin(&sf->stamp);
+
+    // Reserving the blocks up front gives the filesystem one contiguous
+    // extent to fill and fails early when the disk is full. Filesystems
+    // without fallocate just grow the file as it is written, and small files
+    // are not worth the extra call.
+    if (declared_size >= STORAGE_PREALLOC_MIN) {
+        if (fallocate(sf->fd, 0, 0, (off_t)declared_size) == 0) {
+            sf->declared = declared_size;
+        } else if (errno == ENOSPC) {
+            storage_stage_abort(sf);
+            errno = ENOSPC;
+            return -1;
+        }
+    }
+    if (dedupe_enabled() && declared_size >= UPLOAD_HASH_MIN_SIZE) {
+        sf->hashing = 1;
+        sha256_init(&sf->hash);
+    }
+    return 0;
+}
+
+void storage_stage_write(staged_file_t *sf, const void *buf, size_t len) {
+    const char *p = buf;
+    if (sf->hashing && !sf->failed) sha256_update(&sf->hash, buf, len);
+    while (!sf->failed && len > 0) {
+        ssize_t n = pwrite(sf->fd, p, len, (off_t)sf->written);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            LOG_ERROR("Erro ao gravar '%s': %s", sf->stage_path, strerror(errno));
+            sf->failed = 1;
+            break;
+        }
+        p += n;
+        len -= (size_t)n;
+        sf->written += (uint64_t)n;
+    }
+}
+
+void storage_stage_abort(staged_file_t *sf) {
+    if (sf->fd >= 0) {
+        close(sf->fd);
+        unlink(sf->stage_path);
+        sf->fd = -1;
+        file_stamp_end(&sf->stamp);
+    }
+}
+
+// Renames one staged file into place under its write lock. Returns 0,
+// STORAGE_SUPERSEDED or -1; the staging file is gone unless it returned 0.
+static int rename_into_place(staged_file_t *sf) {
+    trace_span_t rename_span = trace_begin("storage.rename", TRACE_FLOW_NONE);
+    file_lock_t *lock = file_lock_write(sf->final_path);
+    int claimed = file_version_claim(sf->final_path, &sf->stamp);
+    int rc = !claimed ? 0 : dir_in_the_way(sf->final_path) ? -1 : rename(sf->stage_path, sf->disk_path);
+    int rename_errno = errno;
+    if (claimed && rc == 0) dedupe_forget(sf->final_path); // The new contents are indexed once committed
+    // A file that outgrew the packing threshold leaves its packed copy behind
+    if (claimed && rc == 0 && pack_delete(sf->final_path) < 0) {
+        LOG_ERROR("Erro ao remover '%s' do packfile: %s", sf->final_path, strerror(errno));
+    }
+    file_unlock(lock);
+    trace_end(&rename_span, NULL);
+    if (!claimed) {
+        LOG_DEBUG("Upload de '%s' descartado: uma alteração mais recente já foi aplicada.\n", sf->final_path);
+        atomic_fetch_add_explicit(&superseded_total, 1, memory_order_relaxed);
+        storage_stage_abort(sf);
+        return STORAGE_SUPERSEDED;
+    }
+    if (rc != 0) {
+        LOG_ERROR("Erro ao mover '%s' para '%s': %s", sf->stage_path, sf->final_path, strerror(rename_errno));
+        storage_stage_abort(sf);
+        return -1;
+    }
+    return 0;
+}
+
+// Copies one small staged file into its directory's packfile under its write
+// lock, in place of rename_into_place, with the same results. A regular file
+// it replaces is unlinked only once the packed copy is as durable as the
+// policy asks, so a crash in between keeps one version or the other. The
+// staging file is gone unless it returned 0.
+static int pack_into_place(staged_file_t *sf) {
+    trace_span_t pack_span = trace_begin("storage.pack", TRACE_FLOW_NONE);
+    file_lock_t *lock = file_lock_write(sf->final_path);
+    int claimed = file_version_claim(sf->final_path, &sf->stamp);
+    int rc = !claimed ? 0 : dir_in_the_way(sf->final_path) ? -1 : pack_put(sf->final_path, sf->fd, sf->written);
+    int pack_errno = errno;
+    if (claimed && rc == 0 && access(sf->disk_path, F_OK) == 0) {
+        dedupe_forget(sf->final_path);
+        char dir[PATH_MAX];
+        parent_dir(sf->final_path, dir, sizeof(dir));
+        if ((sync_policy != STORAGE_SYNC_NONE && pack_sync_counted(dir) != 0) || unlink(sf->disk_path) != 0) {
+            pack_errno = errno;
+            pack_delete(sf->final_path); // The regular file stays the stored one
+            rc = -1;
+        }
+    }
+    file_unlock(lock);
+    trace_end(&pack_span, NULL);
+    if (!claimed) {
+        LOG_DEBUG("Upload de '%s' descartado: uma alteração mais recente já foi aplicada.\n", sf->final_path);
+        atomic_fetch_add_explicit(&superseded_total, 1, memory_order_relaxed);
+        storage_stage_abort(sf);
+        return STORAGE_SUPERSEDED;
+    }
+    if (rc != 0) {
+        LOG_ERROR("Erro ao gravar '%s' no packfile: %s", sf->final_path, strerror(pack_errno));
+        storage_stage_abort(sf);
+        return -1;
+    }
+    unlink(sf->stage_path);
+    sf->packed = 1;
+    return 0;
+}
+
+// Rewrites a staged upload block-compressed (see server_zfile.h) when that
+// is enabled and pays off, or whenever its contents would otherwise read
+// back as a compressed file. Returns 0 with the staging file in its final
+// form, or -1 if the rewrite failed.
+static int compress_stage(staged_file_t *sf) {
+    int force = zfile_probe(sf->fd, NULL);
+    if (!force && (!zfile_enabled() || sf->written < ZFILE_MIN_SIZE)) return 0;
+    char dir[PATH_MAX], tmp_path[PATH_MAX];
+    parent_dir(sf->stage_path, dir, sizeof(dir));
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s/" STORAGE_STAGING_PREFIX "XXXXXX", dir) >= (int)sizeof(tmp_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    trace_span_t compress_span = trace_begin("storage.compress", TRACE_FLOW_NONE);
+    int fd = mkostemp(tmp_path, O_CLOEXEC);
+    int rc = fd >= 0 ? zfile_encode(sf->fd, sf->written, fd, force) : -1;
+    trace_end(&compress_span, NULL);
+    if (rc != 1) { // Stays plain, or the rewrite failed
+        int saved = errno;
+        if (fd >= 0) {
+            close(fd);
+            unlink(tmp_path);
+        }
+        errno = saved;
+        return rc == 0 ? 0 : -1;
+    }
+    if (fchmod(fd, 0644 | ZFILE_MODE_MARK) != 0) {
+        int saved = errno;
+        close(fd);
+        unlink(tmp_path);
+        errno = saved;
+        return -1;
+    }
+    close(sf->fd);
+    unlink(sf->stage_path);
+    sf->fd = fd;
+    memcpy(sf->stage_path, tmp_path, sizeof(tmp_path));
+    return 0;
+}
+
+// Syncs the directory 'path' lives in. Returns 0 on success.
+static int sync_parent_dir(const char *path) {
+    char dir[PATH_MAX];
+    parent_dir(path, dir, sizeof(dir));
+    int dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd < 0) return -1;
+    int rc = 0;
+    if (sync_policy == STORAGE_SYNC_FILE || !group_sync(dir_fd)) rc = fsync_counted(dir_fd);
+    close(dir_fd);
+    return rc;
+}
+
+int storage_stage_commit(staged_file_t *sf) {
+    int result;
+    storage_stage_commit_all(sf, 1, &result);
+    return result;
+}
+
+// Adds a committed upload that was hashed to the deduplication index, with
+// the stat of what now sits at its path.
+static void index_contents(staged_file_t *sf) {
+    struct stat st;
+    if (!sf->hashing || sf->packed || fstat(sf->fd, &st) != 0) return;
+    uint8_t digest[SHA256_DIGEST_LEN];
+    sha256_final(&sf->hash, digest);
+    dedupe_remember(sf->final_path, digest, sf->written, &st);
+}
+
+static int packable(const staged_file_t *sf) {
+    return pack_threshold() > 0 && sf->written <= pack_threshold();
+}
+
+// The directory entry that makes a committed file durable: its shard's, or
+// for a packed file the packfile's in the directory itself.
+static const char *entry_path(const staged_file_t *sf) {
+    return sf->packed ? sf->final_path : sf->disk_path;
+}
+
+void storage_stage_commit_all(staged_file_t *sf, int n, int *results) {
+    int pending = 0, first_pending = -1, renamed = 0;
+    for (int i = 0; i < n; i++) {
+        results[i] = -1;
+        if (sf[i].fd < 0) continue;
+        // The client may send less than it declared
+        if (!sf[i].failed && sf[i].declared > sf[i].written && ftruncate(sf[i].fd, (off_t)sf[i].written) != 0) {
+            LOG_ERROR("Erro ao ajustar o tamanho de '%s': %s", sf[i].stage_path, strerror(errno));
+            sf[i].failed = 1;
+        }
+        if (!sf[i].failed && !packable(&sf[i]) && compress_stage(&sf[i]) != 0) {
+            LOG_ERROR("Erro ao comprimir '%s': %s", sf[i].stage_path, strerror(errno));
+            sf[i].failed = 1;
+        }
+        // A file bound for the packfile is only copied from; the packfile is synced instead
+        if (!sf[i].failed && sync_policy == STORAGE_SYNC_FILE && !packable(&sf[i]) && fsync_counted(sf[i].fd) != 0) {
+            sf[i].failed = 1;
+        }
+        if (sf[i].failed) {
+            storage_stage_abort(&sf[i]);
+        } else {
+            pending++;
+            renamed += !packable(&sf[i]);
+            if (first_pending < 0) first_pending = i;
+        }
+    }
+    if (pending == 0) return;
+
+    // One shared flush covers every file of the batch that gets renamed
+    if (sync_policy == STORAGE_SYNC_GROUP && renamed > 0 && !group_sync(sf[first_pending].fd)) {
+        for (int i = first_pending; i < n; i++) {
+            if (sf[i].fd >= 0 && !packable(&sf[i]) && fsync_counted(sf[i].fd) != 0) storage_stage_abort(&sf[i]);
+        }
+    }
+
+    for (int i = first_pending; i < n; i++) {
+        if (sf[i].fd < 0) continue;
+        results[i] = packable(&sf[i]) ? pack_into_place(&sf[i]) : rename_into_place(&sf[i]);
+        if (results[i] != 0) continue;
+        index_contents(&sf[i]);
+        close(sf[i].fd); // In place either way; only its durability is in doubt
+        sf[i].fd = -1;
+        file_stamp_end(&sf[i].stamp);
+        atomic_fetch_add_explicit(&commits_total, 1, memory_order_relaxed);
+    }
+
+    // The renames are only durable once their directories are, and packed
+    // files once their packfile is: each directory and packfile is synced
+    // once, and a single group sync covers all of them
+    if (sync_policy == STORAGE_SYNC_NONE) return;
+    for (int i = first_pending; i < n; i++) {
+        if (results[i] != 0) continue;
+        int seen = 0, packed = 0;
+        for (int j = first_pending; j < i && !seen; j++) {
+            seen = (results[j] == 0) && (sync_policy == STORAGE_SYNC_GROUP || same_parent(entry_path(&sf[i]), entry_path(&sf[j])));
+        }
+        if (seen) continue;
+        if (sync_parent_dir(entry_path(&sf[i])) != 0) {
+            LOG_ERROR("Erro ao sincronizar o diretório de '%s': %s", sf[i].final_path, strerror(errno));
+        }
+        for (int j = i; j < n && !packed && sync_policy == STORAGE_SYNC_FILE; j++) {
+            packed = (results[j] == 0) && sf[j].packed && same_parent(sf[i].final_path, sf[j].final_path);
+        }
+        if (packed) {
+            char dir[PATH_MAX];
+            parent_dir(sf[i].final_path, dir, sizeof(dir));
+            if (pack_sync_counted(dir) != 0) LOG_ERROR("Erro ao sincronizar o packfile de '%s': %s", dir, strerror(errno));
+        }
+    }
+}
+
+int storage_remove(const char *path) {
+    char disk_path[PATH_MAX];
+    if (storage_locate(path, disk_path, sizeof(disk_path)) != 0) return -1;
+    file_stamp_t stamp;
+    file_stamp_begin(&stamp);
+    file_lock_t *lock = file_lock_write(path);
+    int claimed = file_version_claim(path, &stamp);
+    int rc = claimed ? unlink(disk_path) : 0;
+    int saved = errno;
+    if (claimed && rc == 0) dedupe_forget(path);
+    if (claimed && rc != 0 && saved == ENOENT) {
+        int unpacked = pack_delete(path);
+        if (unpacked > 0) rc = 0;
+        else if (unpacked < 0) saved = errno;
+    }
+    file_unlock(lock);
+    file_stamp_end(&stamp);
+    if (!claimed) {
+        atomic_fetch_add_explicit(&superseded_total, 1, memory_order_relaxed);
+        return STORAGE_SUPERSEDED;
+    }
+    errno = saved;
+    return rc;
+}
+
+// Renames 'disk_path' to a new staging name next to it, written to 'out'.
+// Returns 1, 0 if there is no such file, or -1 (errno set).
+static int move_aside(const char *disk_path, char *out, size_t len) {
+    if (access(disk_path, F_OK) != 0) return errno == ENOENT ? 0 : -1;
+    char dir[PATH_MAX];
+    parent_dir(disk_path, dir, sizeof(dir));
+    int n = snprintf(out, len, "%s/" STORAGE_STAGING_PREFIX "XXXXXX", dir);
+    if (n < 0 || (size_t)n >= len) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    int fd = mkostemp(out, O_CLOEXEC);
+    if (fd < 0) return -1;
+    close(fd);
+    if (rename(disk_path, out) != 0) {
+        int saved = errno;
+        unlink(out);
+        errno = saved;
+        return saved == ENOENT ? 0 : -1;
+    }
+    return 1;
+}
+
+int storage_rename(const char *from, const char *to) {
+    char from_disk[PATH_MAX], to_disk[PATH_MAX];
+    if (storage_locate(from, from_disk, sizeof(from_disk)) != 0 || storage_locate(to, to_disk, sizeof(to_disk)) != 0) return -1;
+    // Into a new directory or shard: created before the files are locked,
+    // as each level takes its own lock
+    char to_shard[PATH_MAX];
+    parent_dir(to_disk, to_shard, sizeof(to_shard));
+    if (access(to_shard, F_OK) != 0 && make_tree_dirs(to_disk) != 0) return -1;
+    file_stamp_t stamp;
+    file_stamp_begin(&stamp);
+    file_lock_t *first, *second;
+    file_lock_write_pair(from, to, &first, &second);
+    // Both files take the rename's version, or neither does
+    int claimed = !file_version_newer(from, &stamp) && !file_version_newer(to, &stamp);
+    int rc = -1, saved = ENOENT, packed = 0;
+    int regular = (access(from_disk, F_OK) == 0);
+    int stored = claimed && (regular || pack_contains(from));
+    if (stored && dir_in_the_way(to)) {
+        saved = EISDIR;
+    } else if (stored) {
+        file_version_claim(from, &stamp);
+        file_version_claim(to, &stamp);
+        trace_span_t rename_span = trace_begin("storage.rename", TRACE_FLOW_NONE);
+        if (regular) {
+            rc = rename(from_disk, to_disk);
+            saved = (rc != 0 && errno == ENOENT) ? EAGAIN : errno; // The new directory was pruned meanwhile
+            if (rc == 0) {
+                dedupe_forget(from);
+                dedupe_forget(to);
+            }
+            // A file lives in one place: a packed 'to' is the replaced version
+            if (rc == 0 && pack_delete(to) < 0) LOG_ERROR("Erro ao remover '%s' do packfile: %s", to, strerror(errno));
+        } else {
+            // The file being replaced is moved aside, and removed only once
+            // the packed copy took its name; a failed pack_rename puts it
+            // back. After a crash in between it is a staging file, which
+            // startup removes: the state from before the rename, less the
+            // file it was replacing
+            char aside[PATH_MAX];
+            int aside_rc = move_aside(to_disk, aside, sizeof(aside));
+            if (aside_rc < 0) {
+                saved = errno;
+            } else {
+                int moved = pack_rename(from, to);
+                saved = moved < 0 ? errno : ENOENT;
+                rc = moved > 0 ? 0 : -1;
+                packed = 1;
+                if (rc == 0) {
+                    dedupe_forget(to);
+                    if (aside_rc > 0) unlink(aside);
+                } else if (aside_rc > 0 && rename(aside, to_disk) != 0) {
+                    LOG_ERROR("Erro ao restaurar '%s' após falha na renomeação: %s", to, strerror(errno));
+                }
+            }
+        }
+        trace_end(&rename_span, NULL);
+        char dir[PATH_MAX], from_dir[PATH_MAX];
+        parent_dir(to, dir, sizeof(dir));
+        parent_dir(from, from_dir, sizeof(from_dir));
+        // Across directories both of them (or both packfiles) changed
+        if (rc == 0 && sync_policy != STORAGE_SYNC_NONE &&
+            ((packed ? pack_sync_counted(dir) : sync_parent_dir(to_disk)) != 0 ||
+             (!same_parent(from_disk, to_disk) && (packed ? pack_sync_counted(from_dir) : sync_parent_dir(from_disk)) != 0))) {
+            LOG_WARN("Renomeação de '%s' aplicada, mas não sincronizada: %s", to, strerror(errno));
+        }
+    }
+    file_unlock(second);
+    file_unlock(first);
+    file_stamp_end(&stamp);
+    if (!claimed) {
+        atomic_fetch_add_explicit(&superseded_total, 1, memory_order_relaxed);
+        return STORAGE_SUPERSEDED;
+    }
+    if (rc == 0) atomic_fetch_add_explicit(&renames_total, 1, memory_order_relaxed);
+    errno = saved;
+    return rc;
+}
+
+// Makes the staging file of 'sf' a copy of 'src_fd': a reflink where the
+// filesystem has them, otherwise a hard link to 'src', which must be the
+// file open at 'src_fd'. Returns 0 or -1 (errno set).
+static int clone_into_stage(staged_file_t *sf, const char *src, int src_fd, const struct stat *src_st) {
+    if (ioctl(sf->fd, FICLONE, src_fd) == 0) {
+        fchmod(sf->fd, src_st->st_mode & 07777); // A compressed source's mark
+        atomic_fetch_add_explicit(&clones_reflink_total, 1, memory_order_relaxed);
+        return 0;
+    }
+    close(sf->fd);
+    sf->fd = -1;
+    unlink(sf->stage_path);
+    if (link(src, sf->stage_path) != 0) return -1;
+    sf->fd = open(sf->stage_path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (sf->fd < 0 || fstat(sf->fd, &st) != 0 || st.st_ino != src_st->st_ino || st.st_dev != src_st->st_dev) {
+        // 'src' was replaced after it was opened
+        if (sf->fd >= 0) close(sf->fd);
+        sf->fd = -1;
+        unlink(sf->stage_path);
+        errno = ESTALE;
+        return -1;
+    }
+    atomic_fetch_add_explicit(&clones_hardlink_total, 1, memory_order_relaxed);
+    return 0;
+}
+
+int storage_clone(const char *src, const struct stat *src_st, const char *final_path,
+                  const uint8_t digest[SHA256_DIGEST_LEN], uint64_t size) {
+    char src_disk[PATH_MAX];
+    staged_file_t sf;
+    if (storage_locate(src, src_disk, sizeof(src_disk)) != 0 || storage_stage_begin(&sf, final_path, 0) != 0) return -1;
+    trace_span_t clone_span = trace_begin("storage.clone", TRACE_FLOW_NONE);
+    int src_fd = open(src_disk, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    int ok = src_fd >= 0 && fstat(src_fd, &st) == 0 && st.st_dev == src_st->st_dev &&
+             st.st_ino == src_st->st_ino && st.st_size == src_st->st_size;
+    if (src_fd >= 0 && !ok) errno = ESTALE;
+    // The copy is taken as is: a compressed source stays compressed
+    if (ok && clone_into_stage(&sf, src_disk, src_fd, &st) != 0) ok = 0;
+    int saved = errno;
+    if (src_fd >= 0) close(src_fd);
+    trace_end(&clone_span, NULL);
+    if (ok && sync_policy != STORAGE_SYNC_NONE && (sync_policy == STORAGE_SYNC_FILE || !group_sync(sf.fd))) {
+        ok = fsync_counted(sf.fd) == 0;
+        saved = errno;
+    }
+    if (!ok) {
+        if (sf.fd >= 0) {
+            storage_stage_abort(&sf);
+        } else {
+            file_stamp_end(&sf.stamp);
+        }
+        errno = saved;
+        return -1;
+    }
+
+    int rc = rename_into_place(&sf);
+    if (rc != 0) return rc;
+    // A hard link renamed over another link to the same inode leaves both
+    // names in place
+    struct stat left, placed;
+    if (lstat(sf.stage_path, &left) == 0 && fstat(sf.fd, &placed) == 0 && left.st_ino == placed.st_ino) {
+        unlink(sf.stage_path);
+    }
+    if (sync_policy != STORAGE_SYNC_NONE && sync_parent_dir(sf.disk_path) != 0) {
+        LOG_ERROR("Erro ao sincronizar o diretório de '%s': %s", final_path, strerror(errno));
+    }
+    if (fstat(sf.fd, &placed) == 0) dedupe_remember(final_path, digest, size, &placed);
+    close(sf.fd);
+    file_stamp_end(&sf.stamp);
+    atomic_fetch_add_explicit(&commits_total, 1, memory_order_relaxed);
+    return 0;
+}
+
+int storage_exists(const char *path) {
+    char disk_path[PATH_MAX];
+    return (storage_locate(path, disk_path, sizeof(disk_path)) == 0 && access(disk_path, F_OK) == 0) || pack_contains(path);
+}
+
+// Names of a directory's subdirectories, collected so the directory can be
+// closed before they are visited: a deep tree then holds one descriptor.
+typedef struct {
+    char  **names;
+    size_t  count, cap;
+} name_list_t;
+
+static void name_list_add(name_list_t *l, const char *name) {
+    if (l->count == l->cap) {
+        size_t cap = l->cap ? l->cap * 2 : 16;
+        char **grown = realloc(l->names, cap * sizeof(*grown));
+        if (!grown) return;
+        l->names = grown;
+        l->cap = cap;
+    }
+    if ((l->names[l->count] = strdup(name)) != NULL) l->count++;
+}
+
+static void name_list_free(name_list_t *l) {
+    for (size_t i = 0; i < l->count; i++) free(l->names[i]);
+    free(l->names);
+}
+
+static int is_subdir(DIR *d, const struct dirent *de) {
+    if (de->d_type != DT_UNKNOWN) return de->d_type == DT_DIR;
+    struct stat st;
+    return fstatat(dirfd(d), de->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode);
+}
+
+typedef struct {
+    storage_visit_fn fn;
+    void            *arg;
+    const char      *rel; // Of the directory being listed, "" for the root
+} tree_ctx_t;
+
+// Writes "<rel>/<name>", or just the name at the root. Returns -1 if it is
+// longer than a stored name may be.
+static int join_rel(const char *rel, const char *name, char *out, size_t len) {
+    int n = rel[0] ? snprintf(out, len, "%s/%s", rel, name) : snprintf(out, len, "%s", name);
+    return (n < 0 || (size_t)n >= len || n > STORAGE_NAME_MAX) ? -1 : 0;
+}
+
+static int visit_packed(const char *name, const struct stat *st, void *arg) {
+    tree_ctx_t *ctx = arg;
+    char rel[PATH_MAX];
+    if (join_rel(ctx->rel, name, rel, sizeof(rel)) != 0) return 0;
+    return ctx->fn(rel, st, ctx->arg);
+}
+
+// Visits the files of one shard of the directory 'rel', by their logical names.
+static int list_shard(const char *dir, const char *shard, const char *rel, storage_visit_fn fn, void *arg) {
+    char shard_dir[PATH_MAX];
+    if (path_join(shard_dir, sizeof(shard_dir), dir, shard) != 0) return 0; // Too deep to hold any stored file
+    DIR *d = opendir(shard_dir);
+    if (!d) return 0; // Emptied and removed meanwhile
+    struct dirent *de;
+    int rc = 0;
+    while (rc == 0 && (de = readdir(d)) != NULL) {
+        char name[PATH_MAX];
+        struct stat st;
+        if (de->d_name[0] == '.' && (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0 || storage_is_internal_name(de->d_name))) {
+            continue;
+        }
+        if (join_rel(rel, de->d_name, name, sizeof(name)) != 0) continue;
+        if (fstatat(dirfd(d), de->d_name, &st, 0) != 0 || !S_ISREG(st.st_mode)) continue;
+        if (st.st_mode & ZFILE_MODE_MARK) { // Report its contents, not its blocks
+            int fd = openat(dirfd(d), de->d_name, O_RDONLY | O_CLOEXEC);
+            uint64_t raw_size;
+            if (fd >= 0 && zfile_probe(fd, &raw_size)) st.st_size = (off_t)raw_size;
+            if (fd >= 0) close(fd);
+        }
+        rc = fn(name, &st, arg);
+    }
+    closedir(d);
+    return rc;
+}
+
+static int list_tree_dir(const char *root, const char *rel, storage_visit_fn fn, void *arg) {
+    char dir[PATH_MAX];
+    int n = rel[0] ? snprintf(dir, sizeof(dir), "%s/%s", root, rel) : snprintf(dir, sizeof(dir), "%s", root);
+    if (n < 0 || (size_t)n >= sizeof(dir)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    DIR *d = opendir(dir);
+    if (!d) return -1;
+    // A directory holds its shards, its packfile and its subdirectories
+    name_list_t subdirs = { 0 }, shards = { 0 };
+    struct dirent *de;
+    int rc = 0;
+    while ((de = readdir(d)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0 || !is_subdir(d, de)) continue;
+        if (storage_is_shard_name(de->d_name)) {
+            name_list_add(&shards, de->d_name);
+            continue;
+        }
+        char name[PATH_MAX];
+        if (storage_is_internal_name(de->d_name) || join_rel(rel, de->d_name, name, sizeof(name)) != 0) continue;
+        name_list_add(&subdirs, name);
+    }
+    closedir(d);
+    for (size_t i = 0; rc == 0 && i < shards.count; i++) rc = list_shard(dir, shards.names[i], rel, fn, arg);
+    name_list_free(&shards);
+    tree_ctx_t ctx = { .fn = fn, .arg = arg, .rel = rel };
+    if (rc == 0) rc = pack_foreach(dir, visit_packed, &ctx);
+    for (size_t i = 0; rc == 0 && i < subdirs.count; i++) {
+        int sub = list_tree_dir(root, subdirs.names[i], fn, arg);
+        if (sub > 0) rc = sub; // A subdirectory removed meanwhile is just skipped
+    }
+    name_list_free(&subdirs);
+    return rc;
+}
+
+int storage_list_tree(const char *root, storage_visit_fn fn, void *arg) {
+    return list_tree_dir(root, "", fn, arg);
+}
+
+void storage_remove_empty_dirs(const char *dir) {
+    DIR *d = opendir(dir);
+    if (!d) return;
+    name_list_t subdirs = { 0 };
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL) {
+        if (strcmp(de->d_name, ".") != 0 && strcmp(de->d_name, "..") != 0 && is_subdir(d, de)) {
+            name_list_add(&subdirs, de->d_name);
+        }
+    }
+    closedir(d);
+    for (size_t i = 0; i < subdirs.count; i++) {
+        char path[PATH_MAX];
+        if (snprintf(path, sizeof(path), "%s/%s", dir, subdirs.names[i]) < (int)sizeof(path)) storage_remove_empty_dirs(path);
+    }
+    name_list_free(&subdirs);
+    rmdir(dir); // Fails, as it should, while anything is left
+}
+
+void storage_prune_parents(const char *path, const char *root) {
+    char dir[PATH_MAX];
+    if (storage_locate(path, dir, sizeof(dir)) != 0) return;
+    size_t root_len = strlen(root);
+    char *slash;
+    while ((slash = strrchr(dir, '/')) != NULL && (size_t)(slash - dir) > root_len) {
+        *slash = '\0';
+        if (rmdir(dir) != 0 && errno != ENOENT) break; // A directory has no shard of its own
+    }
+}
+
+// Unlinks the staging files in the tree under 'dir' and moves the files
+// found outside a shard into theirs. Counts both.
+static void prepare_tree(const char *dir, int *removed, int *moved) {
+    DIR *d = opendir(dir);
+    if (!d) return;
+    name_list_t subdirs = { 0 }, unsharded = { 0 };
+    struct dirent *de;
+    int in_shard = storage_is_shard_name(strrchr(dir, '/') ? strrchr(dir, '/') + 1 : dir);
+    while ((de = readdir(d)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+        if (is_subdir(d, de)) {
+            name_list_add(&subdirs, de->d_name);
+        } else if (storage_is_staging_name(de->d_name)) {
+            if (unlinkat(dirfd(d), de->d_name, 0) == 0) (*removed)++;
+        } else if (strcmp(de->d_name, PACK_NAME) == 0) {
+            pack_note_found();
+        } else if (!in_shard && !storage_is_internal_name(de->d_name)) {
+            name_list_add(&unsharded, de->d_name);
+        }
+    }
+    closedir(d);
+    for (size_t i = 0; i < unsharded.count; i++) {
+        char path[PATH_MAX], disk_path[PATH_MAX];
+        if (snprintf(path, sizeof(path), "%s/%s", dir, unsharded.names[i]) >= (int)sizeof(path) ||
+            storage_locate(path, disk_path, sizeof(disk_path)) != 0) {
+            continue;
+        }
+        if (rename(path, disk_path) != 0 && (errno != ENOENT || mkdir_parent(disk_path) != 0 || rename(path, disk_path) != 0)) {
+            LOG_ERROR("Erro ao mover '%s' para '%s': %s", path, disk_path, strerror(errno));
+        } else {
+            (*moved)++;
+        }
+    }
+    name_list_free(&unsharded);
+    for (size_t i = 0; i < subdirs.count; i++) {
+        char path[PATH_MAX];
+        if (snprintf(path, sizeof(path), "%s/%s", dir, subdirs.names[i]) < (int)sizeof(path)) prepare_tree(path, removed, moved);
+    }
+    name_list_free(&subdirs);
+}
+
+void storage_prepare_trees(void) {
+    DIR *d = opendir(storage_base_dir());
+    if (!d) return;
+    struct dirent *ue;
+    int removed = 0, moved = 0;
+    while ((ue = readdir(d)) != NULL) {
+        if (ue->d_name[0] == '.') continue;
+        char dir[PATH_MAX];
+        user_sync_dir(ue->d_name, dir, sizeof(dir));
+        prepare_tree(dir, &removed, &moved);
+    }
+    closedir(d);
+    if (removed > 0) LOG_INFO("%d upload(s) incompleto(s) de uma execução anterior removido(s).", removed);
+    if (moved > 0) LOG_INFO("%d arquivo(s) movido(s) para os diretórios de shard.", moved);
+}
+
+void storage_write_metrics(FILE *out) {
+    fprintf(out, "# HELP sync_storage_commits_total Uploads renamed into place.\n"
+                 "# TYPE sync_storage_commits_total counter\n"
+                 "sync_storage_commits_total %llu\n"
+                 "# HELP sync_storage_syncs_total Flushes issued to make uploads durable, by system call.\n"
+                 "# TYPE sync_storage_syncs_total counter\n"
+                 "sync_storage_syncs_total{call=\"fsync\"} %llu\n"
+                 "sync_storage_syncs_total{call=\"syncfs\"} %llu\n"
+                 "# HELP sync_storage_renames_total Stored files renamed in place.\n"
+                 "# TYPE sync_storage_renames_total counter\n"
+                 "sync_storage_renames_total %llu\n"
+                 "# HELP sync_storage_clones_total Uploads stored from a file with the same contents, by how the copy was made.\n"
+                 "# TYPE sync_storage_clones_total counter\n"
+                 "sync_storage_clones_total{method=\"reflink\"} %llu\n"
+                 "sync_storage_clones_total{method=\"hardlink\"} %llu\n"
+                 "# HELP sync_storage_superseded_total Uploads, deletes and renames dropped because a change that started later reached the file first.\n"
+                 "# TYPE sync_storage_superseded_total counter\n"
+                 "sync_storage_superseded_total %llu\n",
+            (unsigned long long)atomic_load_explicit(&commits_total, memory_order_relaxed),
+            (unsigned long long)atomic_load_explicit(&fsyncs_total, memory_order_relaxed),
+            (unsigned long long)atomic_load_explicit(&syncfs_total, memory_order_relaxed),
+            (unsigned long long)atomic_load_explicit(&renames_total, memory_order_relaxed),
+            (unsigned long long)atomic_load_explicit(&clones_reflink_total, memory_order_relaxed),
+            (unsigned long long)atomic_load_explicit(&clones_hardlink_total, memory_order_relaxed),
+            (unsigned long long)atomic_load_explicit(&superseded_total, memory_order_relaxed));
+}
@@ -0,0 +1,167 @@
+#ifndef SERVER_STORAGE_H
+#define SERVER_STORAGE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <limits.h>
+#include <stddef.h>
+#include <sys/stat.h>
+#include "server_filelock.h"
+#include "../common/sha256.h"
+
+// Staged writes of stored files. An upload is written to a hidden staging
+// file next to its destination (STORAGE_STAGING_PREFIX plus a random
+// suffix), preallocated from the size the client declared, and renamed over
+// the destination once complete, so readers see either the old file or the
+// new one and an aborted upload leaves nothing behind. The rename happens
+// under the file's write lock and only if no change that started later
+// already reached the file (see server_filelock.h).
+//
+// Durability policies (-D):
+//   none   no fsync; a crash may lose recent uploads (default)
+//   file   each upload fsyncs its data before the rename and the directory
+//          after it
+//   group  uploads wait for a shared syncfs() instead: whoever finds no sync
+//          running starts one that covers every upload that finished writing
+//          before it, so concurrent uploads share the cost of a flush
+//
+// A stored file is named by its path relative to the user's directory, so
+// clients can sync whole trees: directories are created on the way as files
+// need them and exist only to hold files; an empty one is never listed.
+// A name cannot be both: an upload or rename is refused while one of the
+// name's leading components is a stored file (ENOTDIR) or while files are
+// stored under a directory with the name itself (EISDIR), as no client
+// could create both.
+//
+// On disk the files of a directory are spread over STORAGE_SHARD_COUNT
+// shard subdirectories by a hash of their name ("a/b/c.txt" is stored as
+// "a/b/.shard-3f/c.txt", see storage_locate), so a directory of millions
+// of files is not one directory the filesystem has to search and lock as a
+// whole. The fan-out is fixed: it divides a directory's entries by
+// STORAGE_SHARD_COUNT, it does not make lookups independent of their number
+// (10M files still leave some 39k per shard, and the filesystem's own
+// directory index does the rest), and a directory of a few files pays one
+// extra level all the same. Logical names are what every caller and the file
+// locks work with; only this module and the readers of stored files (the
+// content cache, dedupe) translate them. Staging files live in the
+// destination's shard, so the final rename stays within one directory.
+//
+// With packing enabled (-k, see server_pack.h) a small upload is copied from
+// its staging file into the directory's packfile instead of being renamed,
+// under the same lock and version check; 'file' then syncs the packfile
+// rather than the staging file. The functions below that read a directory
+// or test for a file see packed files like regular ones.
+//
+// With compression at rest (-z, see server_zfile.h) a larger upload is
+// rewritten block-compressed into a second staging file before it is synced
+// and renamed; listings report the size of its contents.
+//
+// With deduplication on (-H, see server_dedupe.h) uploads of at least
+// UPLOAD_HASH_MIN_SIZE bytes are hashed as they are staged and indexed once
+// renamed into place, and storage_clone makes a new stored file out of an
+// indexed one. Since stored files are only ever replaced or removed whole,
+// never written in place, the clone may share the source's blocks (a
+// reflink) or even its inode (a hard link).
+
+#define STORAGE_STAGING_PREFIX ".upload-"
+#define STORAGE_SUPERSEDED     1 // Returned when a newer change to the file won
+#define STORAGE_PREALLOC_MIN   (64 * 1024) // Smaller uploads are not preallocated
+#define STORAGE_NAME_MAX       1024 // Longest path of a stored file within its user's tree
+#define STORAGE_SHARD_PREFIX   ".shard-"
+#define STORAGE_SHARD_COUNT    256 // Shards per directory, named by two hex digits
+
+typedef enum {
+    STORAGE_SYNC_NONE,
+    STORAGE_SYNC_FILE,
+    STORAGE_SYNC_GROUP
+} storage_sync_t;
+
+typedef struct {
+    int      fd;
+    int      failed;   // A write failed; commit discards the file
+    uint64_t written;
+    uint64_t declared; // Size preallocated from the request (0 = unknown)
+    int      packed;   // Committed into the packfile rather than renamed
+    int      hashing;  // Contents are hashed for the deduplication index
+    sha256_ctx_t hash;
+    file_stamp_t stamp;
+    char     final_path[PATH_MAX];
+    char     disk_path[PATH_MAX];  // Where final_path lives on disk
+    char     stage_path[PATH_MAX];
+} staged_file_t;
+
+void storage_set_sync_policy(storage_sync_t policy);
+// Parses "none", "file" or "group". Returns -1 if 's' is none of them.
+int  storage_parse_sync_policy(const char *s, storage_sync_t *policy);
+
+// Creates the staging file for 'final_path' and the directories it needs.
+// Returns -1 (errno set) on error.
+int  storage_stage_begin(staged_file_t *sf, const char *final_path, uint64_t declared_size);
+// Appends to the staging file; a failure is remembered for the commit.
+void storage_stage_write(staged_file_t *sf, const void *buf, size_t len);
+// Makes the file durable as the policy asks and renames it into place.
+// Returns 0, STORAGE_SUPERSEDED or -1 if anything failed; the staging file
+// is gone in every case.
+int  storage_stage_commit(staged_file_t *sf);
+// Commits 'n' files at once, sharing the syncs the policy asks for; each
+// file's outcome, as storage_stage_commit returns it, goes to results[i].
+// Entries already aborted (fd < 0) get -1.
+void storage_stage_commit_all(staged_file_t *sf, int n, int *results);
+void storage_stage_abort(staged_file_t *sf);
+// Deletes a stored file under the same ordering. Returns 0, STORAGE_SUPERSEDED
+// or -1 (errno set).
+int  storage_remove(const char *path);
+// Renames a stored file, replacing whatever 'to' held and creating the
+// directories 'to' needs, under both files' write locks; the rename is
+// dropped if a newer change reached either of them. Returns 0, STORAGE_SUPERSEDED or -1 (errno set,
+// ENOENT if 'from' is not stored).
+int  storage_rename(const char *from, const char *to);
+// Stores at 'final_path' the contents of the stored file 'src', which must
+// still be the file 'src_st' describes, without copying its data when the
+// filesystem allows, and indexes it under 'digest'. Returns 0,
+// STORAGE_SUPERSEDED or -1 (errno set) if it could not; the contents must
+// then be uploaded.
+int  storage_clone(const char *src, const struct stat *src_st, const char *final_path,
+                   const uint8_t digest[SHA256_DIGEST_LEN], uint64_t size);
+// Returns 1 if a file is stored at 'path', packed or not.
+int  storage_exists(const char *path);
+
+// Calls 'fn' for every file stored in the tree under 'root' with its path
+// relative to 'root' ("dir/sub/name"), skipping staging and packfile names.
+// Within each directory the files in its shards come first, then packed
+// ones, then the subdirectories. Stops at, and returns, fn's first non-zero result; -1
+// (errno set) if 'root' cannot be read.
+typedef int (*storage_visit_fn)(const char *name, const struct stat *st, void *arg);
+int  storage_list_tree(const char *root, storage_visit_fn fn, void *arg);
+// Removes 'dir' and the directories under it that hold nothing, deepest
+// first; directories with files (or a packfile) stay.
+void storage_remove_empty_dirs(const char *dir);
+// Removes the directories leading to 'path' that are left empty, up to
+// 'root' (kept), a prefix of 'path'; for after a file is removed or moved.
+void storage_prune_parents(const char *path, const char *root);
+
+// Writes to 'out' the on-disk path of the stored file 'path' (its shard).
+// Returns 0, or -1 (ENAMETOOLONG) if it does not fit in 'len' bytes.
+int  storage_locate(const char *path, char *out, size_t len);
+
+// Returns 1 for names of staging files.
+int  storage_is_staging_name(const char *name);
+// Returns 1 for names of shard directories.
+int  storage_is_shard_name(const char *name);
+// Returns 1 for names no client file may take: staging, shard and packfile
+// names.
+int  storage_is_internal_name(const char *name);
+// Returns 1 if 'name' may name a stored file: a relative path of at most
+// STORAGE_NAME_MAX bytes whose components are neither empty, "." or ".."
+// nor internal names.
+int  storage_valid_name(const char *name);
+// Run at startup: removes staging files left by a crash from every user's
+// tree and moves files stored outside the shards, as earlier versions did,
+// into them.
+void storage_prepare_trees(void);
+
+// Prometheus lines with commits, the syncs they cost, clones and superseded
+// changes.
+void storage_write_metrics(FILE *out);
+
+#endif // SERVER_STORAGE_H
@@ -1,39 +1,50 @@
 #include "server_utils.h"
+#include "../common/trace.h"
 #include <stdio.h>  // For snprintf, perror
 #include <string.h> // For strlen
 #include <stdlib.h> // For exit (if needed, though not directly used here)
 #include <sys/stat.h> // For mkdir
 #include <unistd.h> // For access (optional, for checking before mkdir)
 #include <errno.h>  // Added for errno and EEXIST
+#include <limits.h>
+#include <netdb.h>
+#include <sys/socket.h>
 
+static char storage_dir[PATH_MAX] = "storage";
 
-void mkdir_p(const char *path, mode_t mode) {
-    char tmp[512];
-    snprintf(tmp, sizeof(tmp), "%s", path);
-    size_t len = strlen(tmp);
-    if (len == 0) return;
 
-    // Remove trailing slash if any
-    if (tmp[len - 1] == '/') {
-        tmp[len - 1] = '\0';
+int mkdir_p(const char *path, mode_t mode) {
+    char tmp[PATH_MAX];
+    size_t len = strlen(path);
+    if (len == 0 || len >= sizeof(tmp)) {
+        errno = len ? ENAMETOOLONG : ENOENT;
+        return -1;
     }
+    memcpy(tmp, path, len + 1);
+    while (len > 1 && tmp[len - 1] == '/') tmp[--len] = '\0';
 
-    for (char *p = tmp + 1; *p; p++) {
-        if (*p == '/') {
-            *p = '\0';
-            if (mkdir(tmp, mode) != 0 && errno != EEXIST) { // Check for EEXIST
-                //perror("mkdir_p: mkdir error (intermediate)");
-                // Optionally, handle error more gracefully
-            }
-            *p = '/';
-        }
+    // Usually the tree is already there and one mkdir says so. Otherwise
+    // walk up to the deepest ancestor that exists, cutting the path at each
+    // slash, then create the missing levels on the way back down.
+    char *end = tmp + len, *cut = end;
+    while (mkdir(tmp, mode) != 0) {
+        if (errno == EEXIST) break;
+        if (errno != ENOENT) return -1;
+        char *slash = strrchr(tmp, '/');
+        if (!slash || slash == tmp) return -1;
+        *slash = '\0';
+        cut = slash;
     }
-    if (mkdir(tmp, mode) != 0 && errno != EEXIST) { // Check for EEXIST
-        //perror("mkdir_p: mkdir error (final)");
+    while (cut < end) {
+        *cut = '/';
+        cut += strlen(cut); // The next cut, or the end
+        if (mkdir(tmp, mode) != 0 && errno != EEXIST) return -1;
     }
+    return 0;
 }
 
 int send_and_wait_ack_server(int s, packet_t *p) {
+    trace_span_t rtt_span = trace_begin("server.ack_rtt", TRACE_FLOW_NONE);
     if (send_packet(s, p) != 0) {
         // perror("send_packet failed in send_and_wait_ack_server");
         return -1;
@@ -43,5 +54,44 @@ int send_and_wait_ack_server(int s, packet_t *p) {
         // perror("recv_packet failed in send_and_wait_ack_server");
         return -1;
     }
+    trace_end(&rtt_span, NULL);
     return (a.type == PKT_ACK) ? 0 : -1;
 }
+
+void set_storage_base_dir(const char *dir) {
+    snprintf(storage_dir, sizeof(storage_dir), "%s", dir);
+}
+
+const char *storage_base_dir(void) {
+    return storage_dir;
+}
+
+void user_sync_dir(const char *username, char *out, size_t out_len) {
+    snprintf(out, out_len, "%s/%s/sync_dir", storage_dir, username);
+}
+
+int path_join(char *out, size_t out_len, const char *dir, const char *name) {
+    int n = snprintf(out, out_len, "%s/%s", dir, name);
+    if (n < 0 || (size_t)n >= out_len) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    return 0;
+}
+
+int connect_to_addr(const char *addr) {
+    char host[256], port[16];
+    if (parse_host_port(addr, host, sizeof(host), port, sizeof(port)) != 0) return -1;
+    struct addrinfo hints = { .ai_family = AF_INET, .ai_socktype = SOCK_STREAM }, *res, *p;
+    if (getaddrinfo(host, port, &hints, &res) != 0) return -1;
+    int sock = -1;
+    for (p = res; p; p = p->ai_next) {
+        if ((sock = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0) continue;
+        if (connect(sock, p->ai_addr, p->ai_addrlen) == 0) break;
+        close(sock);
+        sock = -1;
+    }
+    freeaddrinfo(res);
+    if (sock >= 0) packet_set_nodelay(sock);
+    return sock;
+}
@@ -1,14 +1,30 @@
 #ifndef SERVER_UTILS_H
 #define SERVER_UTILS_H
 
+#include <stddef.h>
 #include <sys/stat.h> // For mode_t
 #include "../common/packet.h" // For packet_t
 
-// mkdir -p equivalent
-void mkdir_p(const char *path, mode_t mode);
+// mkdir -p equivalent. Costs a single mkdir when 'path' already exists.
+// Returns 0, or -1 (errno set) if a level could not be created.
+int  mkdir_p(const char *path, mode_t mode);
 
 // Server-specific send and wait for ACK
 int send_and_wait_ack_server(int s, packet_t *p);
 
+// Root directory holding every user's data ("storage" unless set with -s).
+void set_storage_base_dir(const char *dir);
+const char *storage_base_dir(void);
+// Writes "<storage>/<username>/sync_dir" to 'out'.
+void user_sync_dir(const char *username, char *out, size_t out_len);
+
+// Writes "<dir>/<name>" to 'out'. Returns 0, or -1 (ENAMETOOLONG) if it
+// does not fit in 'out_len' bytes.
+int  path_join(char *out, size_t out_len, const char *dir, const char *name);
+
+// Opens a TCP connection to a peer server given as "host:port". Returns the
+// socket or -1.
+int connect_to_addr(const char *addr);
+
 
 #endif // SERVER_UTILS_H
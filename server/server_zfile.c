@@ -0,0 +1,267 @@
+#include "server_zfile.h"
+#include "../common/lz.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+
+#define ZFILE_MAGIC     0x315a4653u // "SFZ1" on disk
+#define ZFILE_BLOCK_RAW 0x80000000u // Index flag: the block is stored uncompressed
+
+// Host byte order, like the packfiles: stored files never leave the server
+// in this form (every reader decodes them).
+typedef struct {
+    uint32_t magic;
+    uint32_t block_size;
+    uint64_t raw_size;
+    uint64_t index_offset; // Just past the last block; the index runs to the end of the file
+    uint32_t block_count;
+    uint32_t checksum;     // FNV-1a of this header with checksum 0
+} zfile_header_t;
+
+struct zfile_reader {
+    int       fd;
+    zfile_header_t h;
+    uint64_t *offsets;   // Where each block starts
+    uint32_t *lengths;   // Index entries: stored length, maybe with ZFILE_BLOCK_RAW
+    int64_t   cur;       // Block held in 'block', -1 for none
+    size_t    cur_len;
+    char     *block;
+    char     *comp;
+};
+
+static int enabled = 0;
+
+static _Atomic uint64_t compressed_total, plain_total, raw_bytes_total, stored_bytes_total, blocks_decoded_total;
+
+void zfile_set_enabled(int on) {
+    enabled = on;
+}
+
+int zfile_enabled(void) {
+    return enabled;
+}
+
+static uint32_t header_checksum(const zfile_header_t *h) {
+    zfile_header_t copy = *h;
+    copy.checksum = 0;
+    uint32_t sum = 2166136261u;
+    const unsigned char *c = (const unsigned char *)&copy;
+    for (size_t i = 0; i < sizeof(copy); i++) {
+        sum ^= c[i];
+        sum *= 16777619u;
+    }
+    return sum;
+}
+
+static int pread_full(int fd, void *buf, size_t len, uint64_t off) {
+    char *p = buf;
+    while (len > 0) {
+        ssize_t n = pread(fd, p, len, (off_t)off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            if (n == 0) errno = EIO;
+            return -1;
+        }
+        p += n;
+        len -= (size_t)n;
+        off += (uint64_t)n;
+    }
+    return 0;
+}
+
+static int pwrite_full(int fd, const void *buf, size_t len, uint64_t off) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = pwrite(fd, p, len, (off_t)off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= (size_t)n;
+        off += (uint64_t)n;
+    }
+    return 0;
+}
+
+// Reads and checks the header against the file's length.
+static int read_header(int fd, zfile_header_t *h) {
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || (uint64_t)st.st_size < sizeof(*h)) return 0;
+    if (pread_full(fd, h, sizeof(*h), 0) != 0 || h->magic != ZFILE_MAGIC) return 0;
+    if (h->block_size == 0 || h->block_size > LZ_MAX_INPUT || header_checksum(h) != h->checksum) return 0;
+    uint64_t blocks = h->raw_size / h->block_size + (h->raw_size % h->block_size != 0);
+    return blocks == h->block_count && h->index_offset >= sizeof(*h) && h->index_offset <= (uint64_t)st.st_size &&
+           (uint64_t)st.st_size - h->index_offset == (uint64_t)h->block_count * sizeof(uint32_t);
+}
+
+int zfile_probe(int fd, uint64_t *raw_size) {
+    zfile_header_t h;
+    if (!read_header(fd, &h)) return 0;
+    if (raw_size) *raw_size = h.raw_size;
+    return 1;
+}
+
+int zfile_encode(int src_fd, uint64_t size, int dst_fd, int force) {
+    if (!force && size < ZFILE_MIN_SIZE) return 0;
+    uint64_t count = size / ZFILE_BLOCK_SIZE + (size % ZFILE_BLOCK_SIZE != 0);
+    uint32_t *index = malloc(count > 0 ? count * sizeof(uint32_t) : 1);
+    char *raw = malloc(ZFILE_BLOCK_SIZE), *comp = malloc(ZFILE_BLOCK_SIZE);
+    int rc = -1;
+    if (!index || !raw || !comp) {
+        errno = ENOMEM;
+        goto out;
+    }
+
+    uint64_t off = sizeof(zfile_header_t);
+    for (uint64_t b = 0; b < count; b++) {
+        size_t n = (size_t)(size - b * ZFILE_BLOCK_SIZE < ZFILE_BLOCK_SIZE ? size - b * ZFILE_BLOCK_SIZE : ZFILE_BLOCK_SIZE);
+        if (pread_full(src_fd, raw, n, b * ZFILE_BLOCK_SIZE) != 0) goto out;
+        size_t c = lz_compress(raw, n, comp, n - 1);
+        // The first block tells media and archives apart from text
+        if (b == 0 && !force && (c == 0 || c > n - n / ZFILE_MIN_GAIN)) {
+            rc = 0;
+            goto out;
+        }
+        if (c > 0) {
+            if (pwrite_full(dst_fd, comp, c, off) != 0) goto out;
+            index[b] = (uint32_t)c;
+            off += c;
+        } else {
+            if (pwrite_full(dst_fd, raw, n, off) != 0) goto out;
+            index[b] = (uint32_t)n | ZFILE_BLOCK_RAW;
+            off += n;
+        }
+    }
+    uint64_t total = off + count * sizeof(uint32_t);
+    if (!force && total > size - size / ZFILE_MIN_GAIN) { // The rest of the file undid the first block's promise
+        rc = 0;
+        goto out;
+    }
+
+    zfile_header_t h = {
+        .magic = ZFILE_MAGIC, .block_size = ZFILE_BLOCK_SIZE, .raw_size = size,
+        .index_offset = off, .block_count = (uint32_t)count
+    };
+    h.checksum = header_checksum(&h);
+    if (pwrite_full(dst_fd, index, (size_t)(count * sizeof(uint32_t)), off) != 0 ||
+        pwrite_full(dst_fd, &h, sizeof(h), 0) != 0) {
+        goto out;
+    }
+    atomic_fetch_add_explicit(&raw_bytes_total, size, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stored_bytes_total, total, memory_order_relaxed);
+    rc = 1;
+out:
+    if (rc == 0) atomic_fetch_add_explicit(&plain_total, 1, memory_order_relaxed);
+    if (rc == 1) atomic_fetch_add_explicit(&compressed_total, 1, memory_order_relaxed);
+    free(index);
+    free(raw);
+    free(comp);
+    return rc;
+}
+
+zfile_reader_t *zfile_open(int fd) {
+    zfile_reader_t *z = calloc(1, sizeof(*z));
+    if (!z) return NULL;
+    z->fd = fd;
+    z->cur = -1;
+    if (!read_header(fd, &z->h)) {
+        free(z);
+        errno = EINVAL;
+        return NULL;
+    }
+    uint32_t count = z->h.block_count;
+    z->lengths = malloc(count > 0 ? count * sizeof(uint32_t) : 1);
+    z->offsets = malloc(count > 0 ? count * sizeof(uint64_t) : 1);
+    z->block = malloc(z->h.block_size);
+    z->comp = malloc(z->h.block_size);
+    int ok = z->lengths && z->offsets && z->block && z->comp &&
+             pread_full(fd, z->lengths, count * sizeof(uint32_t), z->h.index_offset) == 0;
+    uint64_t off = sizeof(zfile_header_t);
+    for (uint32_t b = 0; ok && b < count; b++) {
+        uint32_t len = z->lengths[b] & ~ZFILE_BLOCK_RAW;
+        ok = len > 0 && len <= z->h.block_size;
+        z->offsets[b] = off;
+        off += len;
+    }
+    if (!ok || off != z->h.index_offset) {
+        zfile_close(z);
+        errno = EINVAL;
+        return NULL;
+    }
+    return z;
+}
+
+uint64_t zfile_size(const zfile_reader_t *z) {
+    return z->h.raw_size;
+}
+
+// Makes block 'b' the decoded one. Returns 0 or -1.
+static int load_block(zfile_reader_t *z, uint64_t b) {
+    if (z->cur == (int64_t)b) return 0;
+    z->cur = -1;
+    uint64_t start = b * z->h.block_size;
+    size_t want = (size_t)(z->h.raw_size - start < z->h.block_size ? z->h.raw_size - start : z->h.block_size);
+    uint32_t entry = z->lengths[b];
+    size_t stored = entry & ~ZFILE_BLOCK_RAW;
+    if (entry & ZFILE_BLOCK_RAW) {
+        if (stored != want || pread_full(z->fd, z->block, stored, z->offsets[b]) != 0) return -1;
+    } else {
+        if (pread_full(z->fd, z->comp, stored, z->offsets[b]) != 0) return -1;
+        long n = lz_decompress(z->comp, stored, z->block, z->h.block_size);
+        if (n != (long)want) {
+            errno = EIO;
+            return -1;
+        }
+    }
+    z->cur = (int64_t)b;
+    z->cur_len = want;
+    atomic_fetch_add_explicit(&blocks_decoded_total, 1, memory_order_relaxed);
+    return 0;
+}
+
+long zfile_pread(zfile_reader_t *z, void *buf, size_t len, uint64_t offset) {
+    char *out = buf;
+    size_t done = 0;
+    while (done < len && offset < z->h.raw_size) {
+        uint64_t b = offset / z->h.block_size;
+        if (load_block(z, b) != 0) return -1;
+        size_t in_block = (size_t)(offset - b * z->h.block_size);
+        size_t n = z->cur_len - in_block;
+        if (n > len - done) n = len - done;
+        memcpy(out + done, z->block + in_block, n);
+        done += n;
+        offset += n;
+    }
+    return (long)done;
+}
+
+void zfile_close(zfile_reader_t *z) {
+    if (!z) return;
+    free(z->lengths);
+    free(z->offsets);
+    free(z->block);
+    free(z->comp);
+    free(z);
+}
+
+void zfile_write_metrics(FILE *out) {
+    fprintf(out, "# HELP sync_zfile_files_total Committed files checked for compression at rest, by how they were stored.\n"
+                 "# TYPE sync_zfile_files_total counter\n"
+                 "sync_zfile_files_total{result=\"compressed\"} %llu\n"
+                 "sync_zfile_files_total{result=\"plain\"} %llu\n"
+                 "# HELP sync_zfile_bytes_total Contents of the files stored compressed, before and after.\n"
+                 "# TYPE sync_zfile_bytes_total counter\n"
+                 "sync_zfile_bytes_total{kind=\"raw\"} %llu\n"
+                 "sync_zfile_bytes_total{kind=\"stored\"} %llu\n"
+                 "# HELP sync_zfile_blocks_decoded_total Blocks of compressed files decoded by reads.\n"
+                 "# TYPE sync_zfile_blocks_decoded_total counter\n"
+                 "sync_zfile_blocks_decoded_total %llu\n",
+            (unsigned long long)atomic_load_explicit(&compressed_total, memory_order_relaxed),
+            (unsigned long long)atomic_load_explicit(&plain_total, memory_order_relaxed),
+            (unsigned long long)atomic_load_explicit(&raw_bytes_total, memory_order_relaxed),
+            (unsigned long long)atomic_load_explicit(&stored_bytes_total, memory_order_relaxed),
+            (unsigned long long)atomic_load_explicit(&blocks_decoded_total, memory_order_relaxed));
+}
@@ -0,0 +1,62 @@
+#ifndef SERVER_ZFILE_H
+#define SERVER_ZFILE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+// Block-compressed stored files (-z). With compression on, a committed
+// upload is rewritten as a header, its contents cut into ZFILE_BLOCK_SIZE
+// blocks each compressed on its own with the codec in common/lz.h, and an
+// index with every block's stored length. Any offset can then be read by
+// decoding only the block that holds it. A block that does not shrink is
+// stored as is, and a file whose first block does not shrink by at least
+// 1/ZFILE_MIN_GAIN (already compressed media) is left a plain file, as are
+// files under ZFILE_MIN_SIZE.
+//
+// A stored file is compressed if it parses as one: the header must match
+// the file's length and its index. Reads recognize compressed files whatever
+// the setting, so files written by an earlier run stay readable; an upload
+// that happens to parse as a compressed file is always stored compressed,
+// so what it reads back as is what was sent. Compressed files also carry
+// ZFILE_MODE_MARK, so that listings, which only stat the files, open just
+// those for the size of their contents.
+
+#define ZFILE_BLOCK_SIZE (32 * 1024) // Within the codec's LZ_MAX_INPUT
+#define ZFILE_MIN_SIZE   4096
+#define ZFILE_MIN_GAIN   8
+#define ZFILE_MODE_MARK  S_ISVTX // Unused on regular files
+
+void zfile_set_enabled(int enabled);
+int  zfile_enabled(void);
+
+// Returns 1 if the file open at 'fd' is block-compressed, with its
+// contents' size in *raw_size when not NULL.
+int  zfile_probe(int fd, uint64_t *raw_size);
+
+// Writes the first 'size' bytes of 'src_fd' block-compressed to 'dst_fd'.
+// Returns 1 if it did, 0 if the contents are not worth compressing (only
+// checked when 'force' is 0; 'dst_fd' is then left in an unspecified state)
+// and -1 (errno set) on an I/O error.
+int  zfile_encode(int src_fd, uint64_t size, int dst_fd, int force);
+
+// Random-access reader over a block-compressed file. It does not own the
+// descriptor, which must stay open until zfile_close.
+typedef struct zfile_reader zfile_reader_t;
+
+// Returns NULL (errno set) if 'fd' is not a valid compressed file.
+zfile_reader_t *zfile_open(int fd);
+uint64_t zfile_size(const zfile_reader_t *z);
+// Reads up to 'len' bytes of contents starting at 'offset', decoding only
+// the blocks involved (the last one stays decoded for the next call).
+// Returns the number of bytes read, 0 at the end and -1 on a corrupt block
+// or an I/O error.
+long zfile_pread(zfile_reader_t *z, void *buf, size_t len, uint64_t offset);
+void zfile_close(zfile_reader_t *z);
+
+// Prometheus lines with files encoded or left plain and the bytes saved.
+void zfile_write_metrics(FILE *out);
+
+#endif // SERVER_ZFILE_H
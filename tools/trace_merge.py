@@ -0,0 +1,25 @@
+#!/usr/bin/env python3
+"""Merge the per-process trace files written with SYNC_TRACE=<prefix> into a
+single Chrome/Perfetto trace, so an edit on one device can be followed through
+the server and into the other device.
+
+Usage: tools/trace_merge.py out.json /tmp/sync.*.json
+"""
+import json
+import sys
+
+
+def main():
+    if len(sys.argv) < 3:
+        sys.exit(__doc__.strip().splitlines()[-1])
+    events = []
+    for path in sys.argv[2:]:
+        with open(path) as f:
+            events.extend(json.load(f)["traceEvents"])
+    with open(sys.argv[1], "w") as out:
+        json.dump({"traceEvents": events, "displayTimeUnit": "ms"}, out)
+    print(f"{len(events)} eventos de {len(sys.argv) - 2} arquivo(s) gravados em {sys.argv[1]}")
+
+
+if __name__ == "__main__":
+    main()